@@ -54,14 +54,19 @@
 #include <VBox/vmm/pdmdev.h>
 #include <VBox/AssertGuest.h>
 #include <VBox/version.h>
+#include <iprt/asm-math.h>
 #include <iprt/assert.h>
+#include <iprt/circbuf.h>
 #include <iprt/mem.h>
+#include <iprt/path.h>
+#include <iprt/string.h>
 
 #include "opl3.h"
+#include "oplfast.h"
 
-#ifndef IN_RING3
-#error "R3-only driver"
-#endif
+#ifdef IN_RING3
+#include "oplcapture.h"
+#include "pcmresampler.h"
 
 #if RT_OPSYS == RT_OPSYS_LINUX
 #include "pcmalsa.h"
@@ -70,6 +75,7 @@ typedef PCMOutAlsa PCMOutBackend;
 #include "pcmwin.h"
 typedef PCMOutWin PCMOutBackend;
 #endif
+#endif /* IN_RING3 */
 
 /*********************************************************************************************************************************
 *   Defined Constants And Macros                                                                                                 *
@@ -79,7 +85,11 @@ typedef PCMOutWin PCMOutBackend;
 
 #define ADLIB_DEFAULT_OUT_DEVICE    "default"
 #define ADLIB_DEFAULT_SAMPLE_RATE   49716 /* Hz */
+#define ADLIB_DEFAULT_CORE          "nuked"
+#define ADLIB_DEFAULT_IRQ           -1 /* disabled */
+#define ADLIB_DEFAULT_PAN           "center"
 #define ADLIB_NUM_CHANNELS          2 /* as we are actually supporting OPL3 */
+#define ADLIB_NUM_CHANNELS_OPL2     1 /* OPL2 is mono */
 
 enum {
     ADLIB_PORT_ADDR = 0,
@@ -90,96 +100,1043 @@ enum {
 };
 
 /** The saved state version. */
-#define ADLIB_SAVED_STATE_VERSION     1
+#define ADLIB_SAVED_STATE_VERSION     3
+/** The saved state version before there could be more than one chip. */
+#define ADLIB_SAVED_STATE_VERSION_SINGLE_CHIP 2
+/** The saved state version before the OPL timers were TM timers. */
+#define ADLIB_SAVED_STATE_VERSION_VIRT_EXPIRE 1
+
+/** Maximum number of OPL chips per device, each on its own ports (e.g. dual OPL2 boards). */
+#define ADLIB_MAX_CHIPS               4
 
 /** Maximum number of sound samples render in one batch by render thread. */
 #define ADLIB_RENDER_BLOCK_TIME       5 /* in millisec */
 
-/** The render thread will shutdown if this time passes since the last OPL register write. */
-#define ADLIB_RENDER_SUSPEND_TIMEOUT  5000 /* in millisec */
+/** Number of register writes that can be queued for the render thread. */
+#define ADLIB_EVENT_QUEUE_SIZE        4096
+
+/** Number of register writes the render thread remembers, to replay them after rolling back. */
+#define ADLIB_RENDER_HISTORY_SIZE     4096 /* must be a power of 2 */
+
+/** Number of chip checkpoints the render thread keeps, one per block; must cover the PCM buffer. */
+#define ADLIB_RENDER_CHECKPOINTS      32
+
+/** How far the rendered audio may drift from the virtual clock before resyncing, rather than resampling. */
+#define ADLIB_RENDER_MAX_DRIFT        20 /* in millisec */
+
+/** How long the resampler takes to absorb a difference between the virtual and host audio clocks. */
+#define ADLIB_RENDER_SETTLE_TIME      10000 /* in millisec */
+
+/** The render thread will park once the chip has been silent for this long. */
+#define ADLIB_RENDER_SUSPEND_TIMEOUT  1000 /* in millisec */
 
 #define OPL2_NUM_IO_PORTS       2
 #define OPL3_NUM_IO_PORTS       4
 
+#define OPL_NUM_REGS            0x200 /* two banks */
+
 #define OPL_TIMER1_PERIOD       80    /* microseconds */
 #define OPL_TIMER2_PERIOD       320
 
+/** Status register bits. */
+#define OPL_STATUS_IRQ          RT_BIT(7) /* either timer has expired */
+#define OPL_STATUS_TIMER1       RT_BIT(6)
+#define OPL_STATUS_TIMER2       RT_BIT(5)
+
 enum {
     OPL_REG_WAVEFORM_ENABLE = 0x01,
     OPL_REG_TIMER1          = 0x02,
     OPL_REG_TIMER2          = 0x03,
     OPL_REG_TIMER_CTRL      = 0x04,
-    OPL_REG_FM_MODE         = 0x08
+    OPL_REG_FM_MODE         = 0x08,
+    OPL_REG_KEY_ON_FIRST    = 0xB0,
+    OPL_REG_KEY_ON_LAST     = 0xB8,
+    OPL_REG_RHYTHM          = 0xBD,
+    OPL_REG_4OP_ENABLE      = 0x104,
+    OPL_REG_OPL3_ENABLE     = 0x105
 };
 
-/** Device configuration & state. */
-typedef struct {
-    /* Device configuration. */
-    /** Whether to emulate an OPL3. */
-    bool                   fOPL3;
+/** An OPL emulation core. Only the chip itself is emulated; timers and status are handled here. */
+typedef struct ADLIBCORE {
+    /** Name used for the "Core" config key. */
+    const char *pszName;
+    /** Size of the chip state, which must be copyable to take checkpoints. */
+    size_t      cbChip;
+    DECLCALLBACKMEMBER(void, pfnReset, (void *pvChip, uint32_t uSampleRate));
+    DECLCALLBACKMEMBER(void, pfnWriteReg, (void *pvChip, uint16_t reg, uint8_t value));
+    DECLCALLBACKMEMBER(void, pfnGenerateStream, (void *pvChip, int16_t *buf, uint32_t frames));
+    /** Whether the chip will output silence until the next register write. */
+    DECLCALLBACKMEMBER(bool, pfnIsSilent, (void *pvChip));
+} ADLIBCORE;
+typedef const ADLIBCORE *PCADLIBCORE;
+
+/** A register write queued for the render thread. */
+typedef struct ADLIBEVENT {
+    /** Virtual clock timestamp of the write. */
+    uint64_t tmVirt;
+    uint16_t reg;
+    uint8_t  value;
+} ADLIBEVENT;
+
+/** Where the output of a chip goes in the mixed stream, when there is more than one. */
+typedef enum ADLIBPAN {
+    ADLIBPAN_CENTER = 0,
+    ADLIBPAN_LEFT,
+    ADLIBPAN_RIGHT
+} ADLIBPAN;
+
+#ifdef IN_RING3
+/** A copy of the chips state taken by the render thread before rendering a block. */
+typedef struct ADLIBCHECKPOINT {
+    /** Virtual time at which the first frame of the block plays. */
+    uint64_t tmVirt;
+    /** Number of frames written to the PCM device before the block. */
+    uint64_t iFrame;
+    /** Number of frames rendered by the chips before the block. */
+    uint64_t iSrcFrame;
+    /** Resampler state before the block. */
+    PCMResampler::State resampler;
+    /** Sequence number of the first register write not yet applied to each chip. */
+    uint64_t aiEvent[ADLIB_MAX_CHIPS];
+    /** State of each chip, ADLIBRENDER::cbChipStride bytes apart. */
+    uint8_t  abChip[1];
+} ADLIBCHECKPOINT;
+typedef ADLIBCHECKPOINT *PADLIBCHECKPOINT;
+
+/** Render thread state for one chip. */
+typedef struct ADLIBRENDERCHIP {
+    /** Sequence number of the next register write taken from the queue. */
+    uint64_t         iEventNext;
+    /** Sequence number of the first register write not yet applied to the chip. */
+    uint64_t         iEventApplied;
+    /** Frames rendered by this chip before mixing, when there is more than one. */
+    int16_t         *pi16Buf;
+    /** Register writes taken from the queue, indexed by sequence number. */
+    ADLIBEVENT       aHistory[ADLIB_RENDER_HISTORY_SIZE];
+} ADLIBRENDERCHIP;
+typedef ADLIBRENDERCHIP *PADLIBRENDERCHIP;
+
+typedef struct ADLIBRENDER *PADLIBRENDER;
+
+/** A thread rendering blocks for some of the chips, in parallel with the render thread. */
+typedef struct ADLIBWORKER {
+    PPDMDEVINS       pDevIns;
+    PADLIBRENDER     pRender;
+    /** Index of the worker; chips are dealt to the render thread and then each worker in turn. */
+    unsigned         iWorker;
+    RTTHREAD         hThread;
+    /** Signaled by the render thread when there is a block to render. */
+    RTSEMEVENT       hEvtGo;
+} ADLIBWORKER;
+typedef ADLIBWORKER *PADLIBWORKER;
+
+/** State private to the render thread. */
+typedef struct ADLIBRENDER {
+    /** Whether rendering ahead of the virtual clock, rolling back when a write arrives late. */
+    bool             fAhead;
+    /** Number of frames written to the PCM device. */
+    uint64_t         iFrame;
+    /** Number of frames rendered by the chips, at the virtual clock rate. */
+    uint64_t         iSrcFrame;
+    /** Virtual time of chip frame iSrcFrameBase; the chips timeline is locked to the virtual clock. */
+    uint64_t         tmBase;
+    uint64_t         iSrcFrameBase;
+    /** Whether to place the next block where it is expected, rather than right after the previous one. */
+    bool             fResync;
+    /** Converts the chips output to the PCM device clock. */
+    PCMResampler     resampler;
+    /** Copies of ADLIBSTATER3::cResets and ADLIBSTATER3::cFlushes, to notice changes. */
+    uint32_t         cResets, cFlushes;
+    /** PCM device underruns, as last reported. */
+    uint32_t         cXruns;
+    /** Whether the last block rendered was resynced to the virtual clock after drifting off it. */
+    bool             fResynced;
+    /** Checkpoints ring, oldest first. */
+    unsigned         iCheckpointFirst, cCheckpoints;
+    size_t           cbCheckpoint, cbChipStride;
+    uint8_t         *pbCheckpoints;
+
+    /** Block being rendered, shared with the workers. */
+    int16_t         *pi16Block;
+    uint32_t         cBlockFrames;
+    uint64_t         tmBlockStart, tmBlockEnd;
+
+    /** Worker pool, one thread per chip beyond the first. */
+    unsigned         cWorkers;
+    ADLIBWORKER      aWorkers[ADLIB_MAX_CHIPS - 1];
+    /** Number of workers still rendering the current block. */
+    uint32_t volatile cWorkersBusy;
+    /** Signaled by the last worker to finish the current block. */
+    RTSEMEVENT       hEvtWorkersDone;
+    /** Tells the workers to exit. */
+    bool volatile    fWorkersExit;
+
+    ADLIBRENDERCHIP  aChips[ADLIB_MAX_CHIPS];
+} ADLIBRENDER;
+#endif /* IN_RING3 */
+
+/** Configuration & state of one OPL chip, shared between ring-0 and ring-3. */
+typedef struct ADLIBCHIP {
+    /* Chip configuration. */
     /** Base port. */
     RTIOPORT               uPort;
     /** Base port for mirror (e.g. SB16 compatibility). May be 0. */
     RTIOPORT               uMirrorPort;
+    /** Where the chip output goes when mixing several chips. */
+    ADLIBPAN               enmPan;
+
+    /* Runtime state. */
+    /** Current selected register index */
+    uint16_t               oplReg;
+
+    /** Last value written to each chip register, used by the register filter. */
+    uint8_t                abRegShadow[OPL_NUM_REGS];
+    /** Bitmap of the abRegShadow entries which are known to match the chip. */
+    uint64_t               bmRegShadowValid[OPL_NUM_REGS / 64];
+
+    /** OPL timer status */
+    uint8_t                timer1Value,  timer2Value;
+    bool                   timer1Enable, timer2Enable;
+    TMTIMERHANDLE          hTimer1,      hTimer2;
+    /** Status register as the guest reads it, updated when the timers expire or are reset. */
+    uint8_t volatile       timerStatus;
+
+    IOMIOPORTHANDLE        hIoPorts;
+    IOMIOPORTHANDLE        hMirrorPorts;
+} ADLIBCHIP;
+typedef ADLIBCHIP *PADLIBCHIP;
+
+/**
+ * Device configuration & state, shared between ring-0 and ring-3.
+ * Ring-0 serves status reads and address latches from here; everything else is in ADLIBSTATER3.
+ */
+typedef struct ADLIBSTATE {
+    /* Device configuration. */
+    /** Whether to emulate an OPL3. */
+    bool                   fOPL3;
+    /** Number of chips, each on its own ports. */
+    uint8_t                cChips;
+    /** IRQ raised when an OPL timer expires. May be -1 to disable. */
+    int8_t                 uIrq;
     /** Sample rate for PCM output. */
     uint16_t               uSampleRate;
+    /** Whether to drop register writes that would not change the chip state. */
+    bool                   fRegisterFilter;
+    /** Whether to render ahead of time and roll back on register writes, for lower latency. */
+    bool                   fRenderAhead;
+
+    /* Runtime state. */
+    /** Makes whoever holds it the event queues consumer and owner of the chips,
+     *  normally the render thread, or the main thread on reset or when a queue is full. */
+    PDMCRITSECT            critSect;
+    /** The chips, cChips of them in use. */
+    ADLIBCHIP              aChips[ADLIB_MAX_CHIPS];
+
+    /** Number of register writes dropped by the register filter. */
+    STAMCOUNTER            StatRegWritesFiltered;
+    /** Number of times the event queue was found full and had to be flushed by the main thread. */
+    STAMCOUNTER            StatEventQueueFull;
+    /** Number of times the render thread rolled back to re-render already written audio. */
+    STAMCOUNTER            StatRenderRollbacks;
+    /** Number of register writes that arrived too late to be rendered at their time. */
+    STAMCOUNTER            StatRenderLateWrites;
+    /** Number of PCM output underruns. */
+    STAMCOUNTER            StatPcmUnderruns;
+    /** Time from PCM output underruns until the output was back at its target latency, in nanoseconds. */
+    STAMCOUNTER            StatPcmRecoveryTime;
+} ADLIBSTATE;
+typedef ADLIBSTATE *PADLIBSTATE;
+
+#ifdef IN_RING3
+/** Ring-3 state of one OPL chip. */
+typedef struct ADLIBCHIPR3 {
+    /** Register writes from the I/O port handlers (producer) to the render thread (consumer).
+     *  The handlers are serialized by the device critical section, so there is a single producer. */
+    PRTCIRCBUF             pEventQueue;
+    /** Chip state of the selected core. */
+    union {
+        opl3_chip          nuked;
+        oplf_chip          fast;
+    } opl;
+} ADLIBCHIPR3;
+typedef ADLIBCHIPR3 *PADLIBCHIPR3;
+
+/** Device state for ring-3. */
+typedef struct ADLIBSTATER3 {
+    /* Device configuration. */
     /** Device for PCM output. */
-    R3PTRTYPE(char *)      pszOutDevice;
+    char                  *pszOutDevice;
+    /** Emulation core in use. */
+    PCADLIBCORE            pCore;
 
     /* Runtime state. */
+    /** Register write capture, if a capture file is configured. */
+    OPLCapture             capture;
     /** Audio output device */
     PCMOutBackend          pcmOut;
     /** Thread that connects to PCM out, renders and pushes audio data. */
     RTTHREAD               hRenderThread;
+    /** Event the render thread parks on while the chips are silent. */
+    RTSEMEVENT             hEvtRender;
+    /** Render thread state while it runs (protected by critSect), for direct writes to apply what it took from the queues first. */
+    PADLIBRENDER           pRender;
     /** Buffer for the rendering thread to use, size defined by ADLIB_RENDER_BLOCK_TIME. */
-    R3PTRTYPE(uint8_t *)   pbRenderBuf;
-    /** Flag to signal render thread to shut down. */
+    uint8_t               *pbRenderBuf;
+    /** Flag to signal render thread to terminate. */
     bool volatile          fShutdown;
-    /** Flag from render thread indicated it has shutdown (e.g. due to error or timeout). */
+    /** Flag to ask the render thread to park now, e.g. when the VM is suspended. */
+    bool volatile          fIdle;
+    /** Whether the render thread is parked (or about to), and needs hEvtRender to be signalled to render. */
     bool volatile          fStopped;
-    /** (System clock) timestamp of last OPL chip access. */
-    uint64_t               tmLastWrite;
 
-    /** To protect access to opl3_chip from the render thread and main thread. */
-    PDMCRITSECT            critSect;
-    /** Handle to nuked. */
-    opl3_chip              opl;
+    /** Number of times the main thread reset the chips, or wrote to one directly (protected by critSect). */
+    uint32_t               cResets, cFlushes;
+    /** The ring-3 side of each chip in ADLIBSTATE::aChips. */
+    ADLIBCHIPR3            aChips[ADLIB_MAX_CHIPS];
+} ADLIBSTATER3;
+typedef ADLIBSTATER3 *PADLIBSTATER3;
+#else
+/** Device state for ring-0, which only needs the shared state. */
+typedef struct ADLIBSTATER0 {
+    uint8_t                bDummy;
+} ADLIBSTATER0;
+typedef ADLIBSTATER0 *PADLIBSTATER0;
+#endif
 
-    /** Current selected register index */
-    uint16_t               oplReg;
+/** The device state for the current context. */
+typedef CTX_SUFF(ADLIBSTATE) ADLIBSTATECC;
+/** Pointer to the device state for the current context. */
+typedef CTX_SUFF(PADLIBSTATE) PADLIBSTATECC;
 
-    /** OPL timer status */
-    uint8_t                timer1Value,  timer2Value;
-    uint64_t               timer1Expire, timer2Expire; /* (virtual clock) timestamps */
-    bool                   timer1Enable, timer2Enable;
+#ifndef VBOX_DEVICE_STRUCT_TESTCASE
+
+# ifdef IN_RING3
+
+static DECLCALLBACK(void) adlibNukedReset(void *pvChip, uint32_t uSampleRate)
+{
+    OPL3_Reset((opl3_chip *)pvChip, uSampleRate);
+}
+
+static DECLCALLBACK(void) adlibNukedWriteReg(void *pvChip, uint16_t reg, uint8_t value)
+{
+    OPL3_WriteReg((opl3_chip *)pvChip, reg, value);
+}
+
+static DECLCALLBACK(void) adlibNukedGenerateStream(void *pvChip, int16_t *buf, uint32_t frames)
+{
+    OPL3_GenerateStream((opl3_chip *)pvChip, buf, frames);
+}
+
+static DECLCALLBACK(bool) adlibNukedIsSilent(void *pvChip)
+{
+    return OPL3_IsSilent((opl3_chip *)pvChip);
+}
+
+static DECLCALLBACK(void) adlibFastReset(void *pvChip, uint32_t uSampleRate)
+{
+    OPLF_Reset((oplf_chip *)pvChip, uSampleRate);
+}
+
+static DECLCALLBACK(void) adlibFastWriteReg(void *pvChip, uint16_t reg, uint8_t value)
+{
+    OPLF_WriteReg((oplf_chip *)pvChip, reg, value);
+}
+
+static DECLCALLBACK(void) adlibFastGenerateStream(void *pvChip, int16_t *buf, uint32_t frames)
+{
+    OPLF_GenerateStream((oplf_chip *)pvChip, buf, frames);
+}
+
+static DECLCALLBACK(bool) adlibFastIsSilent(void *pvChip)
+{
+    return OPLF_IsSilent((oplf_chip *)pvChip);
+}
+
+/** Emulation cores selectable with the "Core" config key. */
+static const ADLIBCORE g_aAdlibCores[] =
+{
+    /* Nuked OPL3: cycle accurate. */
+    { "nuked", sizeof(opl3_chip), adlibNukedReset, adlibNukedWriteReg, adlibNukedGenerateStream, adlibNukedIsSilent },
+    /* Table driven: approximate, but much cheaper. */
+    { "fast",  sizeof(oplf_chip), adlibFastReset,  adlibFastWriteReg,  adlibFastGenerateStream,  adlibFastIsSilent },
+};
+
+static PCADLIBCORE adlibFindCore(const char *pszName)
+{
+    for (unsigned i = 0; i < RT_ELEMENTS(g_aAdlibCores); i++) {
+        if (RTStrICmp(g_aAdlibCores[i].pszName, pszName) == 0) {
+            return &g_aAdlibCores[i];
+        }
+    }
+    return NULL;
+}
+
+static inline uint64_t adlibCalculateFramesFromMilli(PADLIBSTATE pThis, uint64_t milli)
+{
+    uint64_t rate = pThis->uSampleRate;
+    return (rate * milli) / 1000;
+}
+
+static inline size_t adlibCalculateBytesFromFrames(PADLIBSTATE pThis, uint64_t frames)
+{
+    NOREF(pThis);
+    return frames * sizeof(uint16_t) * ADLIB_NUM_CHANNELS;
+}
+
+static inline unsigned int adlibOutputChannels(PADLIBSTATE pThis)
+{
+    // Several OPL2 chips are mixed in stereo, e.g. dual OPL2 boards put one on each side.
+    return pThis->fOPL3 || pThis->cChips > 1 ? ADLIB_NUM_CHANNELS : ADLIB_NUM_CHANNELS_OPL2;
+}
+
+/** Folds the stereo frames rendered by the emulator into mono frames, in place. */
+static void adlibFoldToMono(int16_t *buf, uint64_t frames)
+{
+    // Without OPL3 mode both outputs carry the same channels, so just keep the left one.
+    for (uint64_t i = 0; i < frames; i++) {
+        buf[i] = buf[i * 2];
+    }
+}
+
+/** Raises the IRQ while any chip has an expired timer, lowers it otherwise. */
+static void adlibUpdateIrq(PPDMDEVINS pDevIns)
+{
+    PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+
+    if (pThis->uIrq >= 0) {
+        bool raise = false;
+        for (unsigned i = 0; i < pThis->cChips; i++) {
+            raise |= RT_BOOL(pThis->aChips[i].timerStatus & OPL_STATUS_IRQ);
+        }
+        Log7Func(("irq=%RTbool\n", raise));
+        PDMDevHlpISASetIrqNoWait(pDevIns, pThis->uIrq, raise ? PDM_IRQ_LEVEL_HIGH : PDM_IRQ_LEVEL_LOW);
+    }
+}
+
+/**
+ * Sets the timer expired flags in the status register, raising or lowering the IRQ to match.
+ *
+ * @param   pDevIns     The device instance.
+ * @param   pChip       The chip the timers belong to.
+ * @param   flags       OPL_STATUS_TIMER1 and/or OPL_STATUS_TIMER2.
+ */
+static void adlibSetTimerStatus(PPDMDEVINS pDevIns, PADLIBCHIP pChip, uint8_t flags)
+{
+    uint8_t status = flags ? flags | OPL_STATUS_IRQ : 0;
+
+    if (status == pChip->timerStatus) {
+        return;
+    }
+
+    ASMAtomicWriteU8(&pChip->timerStatus, status);
+    adlibUpdateIrq(pDevIns);
+}
+
+/**
+ * Starts an OPL timer, which will expire once its counter overflows.
+ *
+ * @param   pDevIns     The device instance.
+ * @param   pChip       The chip the timer belongs to.
+ * @param   hTimer      TM timer backing the OPL timer.
+ * @param   flag        Status flag of the OPL timer.
+ * @param   value       Initial counter value.
+ * @param   period      Counter increment period, in microseconds.
+ */
+static void adlibStartTimer(PPDMDEVINS pDevIns, PADLIBCHIP pChip, TMTIMERHANDLE hTimer, uint8_t flag,
+                            uint8_t value, uint64_t period)
+{
+    uint64_t delay_usec = (0x100 - value) * period;
+
+    adlibSetTimerStatus(pDevIns, pChip, pChip->timerStatus & ~flag & (OPL_STATUS_TIMER1 | OPL_STATUS_TIMER2));
+
+    if (delay_usec < 100) {
+        // short delay: Likely just checking for OPL presence; fire timer now.
+        PDMDevHlpTimerStop(pDevIns, hTimer);
+        adlibSetTimerStatus(pDevIns, pChip, (pChip->timerStatus & (OPL_STATUS_TIMER1 | OPL_STATUS_TIMER2)) | flag);
+    } else {
+        PDMDevHlpTimerSetMicro(pDevIns, hTimer, delay_usec);
+    }
+}
+
+/**
+ * Stops an OPL timer and clears its expired flag.
+ */
+static void adlibStopTimer(PPDMDEVINS pDevIns, PADLIBCHIP pChip, TMTIMERHANDLE hTimer, uint8_t flag)
+{
+    PDMDevHlpTimerStop(pDevIns, hTimer);
+    adlibSetTimerStatus(pDevIns, pChip, pChip->timerStatus & ~flag & (OPL_STATUS_TIMER1 | OPL_STATUS_TIMER2));
+}
+
+/**
+ * @callback_method_impl{FNTMTIMERDEV, Called when an OPL timer overflows;
+ *                       pvUser is the chip index shifted left by 8 plus the timer status flag.}
+ */
+static DECLCALLBACK(void) adlibR3TimerExpired(PPDMDEVINS pDevIns, TMTIMERHANDLE hTimer, void *pvUser)
+{
+    PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+    PADLIBCHIP pChip = &pThis->aChips[(uintptr_t)pvUser >> 8];
+    uint8_t flag = (uint8_t)(uintptr_t)pvUser;
+    RT_NOREF(hTimer);
+
+    Log5Func(("chip=%u flag=0x%x\n", (unsigned)((uintptr_t)pvUser >> 8), flag));
+
+    adlibSetTimerStatus(pDevIns, pChip, (pChip->timerStatus & (OPL_STATUS_TIMER1 | OPL_STATUS_TIMER2)) | flag);
+}
+
+/**
+ * Applies all queued register writes to a chip right away, in order: first those the render thread
+ * already took from the queue but did not apply yet, then those still in the queue.
+ * The caller must hold critSect.
+ */
+static void adlibFlushEvents(PADLIBSTATER3 pThisCC, PADLIBCHIPR3 pChipR3)
+{
+    ADLIBEVENT *pEvent;
+    size_t cbEvent;
+
+    PADLIBRENDER pRender = pThisCC->pRender;
+    if (pRender) {
+        PADLIBRENDERCHIP pRenderChip = &pRender->aChips[pChipR3 - &pThisCC->aChips[0]];
+        while (pRenderChip->iEventApplied < pRenderChip->iEventNext) {
+            pEvent = &pRenderChip->aHistory[pRenderChip->iEventApplied % ADLIB_RENDER_HISTORY_SIZE];
+            pThisCC->pCore->pfnWriteReg(&pChipR3->opl, pEvent->reg, pEvent->value);
+            pRenderChip->iEventApplied++;
+        }
+    }
+
+    for (;;) {
+        RTCircBufAcquireReadBlock(pChipR3->pEventQueue, sizeof(*pEvent), (void **)&pEvent, &cbEvent);
+        if (cbEvent < sizeof(*pEvent)) {
+            RTCircBufReleaseReadBlock(pChipR3->pEventQueue, 0);
+            break;
+        }
+        pThisCC->pCore->pfnWriteReg(&pChipR3->opl, pEvent->reg, pEvent->value);
+        RTCircBufReleaseReadBlock(pChipR3->pEventQueue, sizeof(*pEvent));
+    }
+}
+
+/** Whether any chip has register writes waiting in its queue. */
+static bool adlibHasQueuedEvents(PADLIBSTATE pThis, PADLIBSTATER3 pThisCC)
+{
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        if (RTCircBufUsed(pThisCC->aChips[i].pEventQueue) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint64_t adlibFramesToTicks(PPDMDEVINS pDevIns, PADLIBSTATE pThis, uint64_t frames)
+{
+    return ASMMultU64ByU32DivByU32(frames, (uint32_t)PDMDevHlpTMTimeVirtGetFreq(pDevIns), pThis->uSampleRate);
+}
+
+static inline PADLIBCHECKPOINT adlibRenderCheckpoint(PADLIBRENDER pRender, unsigned i)
+{
+    const unsigned iSlot = (pRender->iCheckpointFirst + i) % ADLIB_RENDER_CHECKPOINTS;
+    return (PADLIBCHECKPOINT)(pRender->pbCheckpoints + iSlot * pRender->cbCheckpoint);
+}
+
+static void adlibRenderDropOldestCheckpoint(PADLIBRENDER pRender)
+{
+    pRender->iCheckpointFirst = (pRender->iCheckpointFirst + 1) % ADLIB_RENDER_CHECKPOINTS;
+    pRender->cCheckpoints--;
+}
+
+static void adlibRenderSaveCheckpoint(PADLIBSTATE pThis, PADLIBSTATER3 pThisCC, PADLIBRENDER pRender, uint64_t tmVirt)
+{
+    if (pRender->cCheckpoints == ADLIB_RENDER_CHECKPOINTS) {
+        adlibRenderDropOldestCheckpoint(pRender);
+    }
+
+    PADLIBCHECKPOINT pCheckpoint = adlibRenderCheckpoint(pRender, pRender->cCheckpoints++);
+    pCheckpoint->tmVirt = tmVirt;
+    pCheckpoint->iFrame = pRender->iFrame;
+    pCheckpoint->iSrcFrame = pRender->iSrcFrame;
+    pRender->resampler.saveState(&pCheckpoint->resampler);
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        pCheckpoint->aiEvent[i] = pRender->aChips[i].iEventApplied;
+        memcpy(pCheckpoint->abChip + i * pRender->cbChipStride, &pThisCC->aChips[i].opl, pThisCC->pCore->cbChip);
+    }
+}
+
+/**
+ * Moves register writes from the lock-free queues into the render thread history.
+ * Old checkpoints are dropped when their writes would no longer fit in it.
+ */
+static void adlibRenderTakeEvents(PADLIBSTATE pThis, PADLIBSTATER3 pThisCC, PADLIBRENDER pRender)
+{
+    ADLIBEVENT *pEvent;
+    size_t cbEvent;
+
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        PADLIBCHIPR3 pChipR3 = &pThisCC->aChips[i];
+        PADLIBRENDERCHIP pRenderChip = &pRender->aChips[i];
+
+        for (;;) {
+            const uint64_t iEventOldest = pRender->cCheckpoints ? adlibRenderCheckpoint(pRender, 0)->aiEvent[i]
+                                                                : pRenderChip->iEventApplied;
+            if (pRenderChip->iEventNext - iEventOldest >= ADLIB_RENDER_HISTORY_SIZE) {
+                if (!pRender->cCheckpoints) {
+                    break; // History full of pending writes, leave the rest in the queue
+                }
+                adlibRenderDropOldestCheckpoint(pRender);
+                continue;
+            }
+
+            RTCircBufAcquireReadBlock(pChipR3->pEventQueue, sizeof(*pEvent), (void **)&pEvent, &cbEvent);
+            if (cbEvent < sizeof(*pEvent)) {
+                RTCircBufReleaseReadBlock(pChipR3->pEventQueue, 0);
+                break;
+            }
+            pRenderChip->aHistory[pRenderChip->iEventNext++ % ADLIB_RENDER_HISTORY_SIZE] = *pEvent;
+            RTCircBufReleaseReadBlock(pChipR3->pEventQueue, sizeof(*pEvent));
+        }
+    }
+}
+
+/**
+ * Rolls the chips and the PCM device back to the latest checkpoint before tmVirt,
+ * or the oldest one that can still be rewound if the write came too late for that.
+ *
+ * @returns true if rolled back.
+ */
+static bool adlibRenderRollback(PADLIBSTATE pThis, PADLIBSTATER3 pThisCC, PADLIBRENDER pRender, uint64_t tmVirt)
+{
+    const ssize_t cRewindable = pThisCC->pcmOut.rewindable();
+    if (cRewindable <= 0) {
+        return false;
+    }
+
+    PADLIBCHECKPOINT pTarget = NULL;
+    unsigned iTarget = 0;
+    for (unsigned i = 0; i < pRender->cCheckpoints; i++) {
+        PADLIBCHECKPOINT pCheckpoint = adlibRenderCheckpoint(pRender, i);
+        if (pRender->iFrame - pCheckpoint->iFrame > (uint64_t)cRewindable) {
+            continue; // Already (being) played
+        }
+        if (!pTarget || pCheckpoint->tmVirt <= tmVirt) {
+            pTarget = pCheckpoint;
+            iTarget = i;
+        }
+    }
+    if (!pTarget || pTarget->iFrame == pRender->iFrame) {
+        return false;
+    }
+
+    int rc = pThisCC->pcmOut.rewind(pRender->iFrame - pTarget->iFrame);
+    if (RT_FAILURE(rc)) {
+        return false;
+    }
+
+    Log9(("rolling back %llu frames\n", pRender->iFrame - pTarget->iFrame));
+    STAM_REL_COUNTER_INC(&pThis->StatRenderRollbacks);
+
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        memcpy(&pThisCC->aChips[i].opl, pTarget->abChip + i * pRender->cbChipStride, pThisCC->pCore->cbChip);
+        pRender->aChips[i].iEventApplied = pTarget->aiEvent[i];
+    }
+    pRender->iFrame = pTarget->iFrame;
+    pRender->iSrcFrame = pTarget->iSrcFrame;
+    pRender->resampler.loadState(&pTarget->resampler);
+    // The block will be rendered again, taking a new checkpoint
+    pRender->cCheckpoints = iTarget;
+
+    return true;
+}
+
+/**
+ * Renders a block of frames for one chip, covering the virtual time between tmStart and tmEnd,
+ * applying each pending register write at the frame matching its timestamp.
+ * Writes timestamped at or after tmEnd are left pending for the next block.
+ */
+static void adlibRenderBlock(PADLIBSTATER3 pThisCC, PADLIBCHIPR3 pChipR3, PADLIBRENDERCHIP pRenderChip,
+                             int16_t *buf, uint32_t frames, uint64_t tmStart, uint64_t tmEnd)
+{
+    const uint64_t tmSpan = RT_MAX(tmEnd - tmStart, 1);
+    uint32_t offFrame = 0;
+
+    while (pRenderChip->iEventApplied < pRenderChip->iEventNext) {
+        const ADLIBEVENT *pEvent = &pRenderChip->aHistory[pRenderChip->iEventApplied % ADLIB_RENDER_HISTORY_SIZE];
+        if (pEvent->tmVirt >= tmEnd) {
+            break;
+        }
+
+        uint32_t offEvent = 0;
+        if (pEvent->tmVirt > tmStart) {
+            offEvent = (uint32_t)(((pEvent->tmVirt - tmStart) * frames) / tmSpan);
+        }
+        if (offEvent > offFrame) {
+            pThisCC->pCore->pfnGenerateStream(&pChipR3->opl, buf + offFrame * 2, offEvent - offFrame);
+            offFrame = offEvent;
+        }
+
+        Log9(("applying 0x%x = 0x%x at frame %u\n", pEvent->reg, pEvent->value, offFrame));
+        pThisCC->pCore->pfnWriteReg(&pChipR3->opl, pEvent->reg, pEvent->value);
+        pRenderChip->iEventApplied++;
+    }
+
+    if (offFrame < frames) {
+        pThisCC->pCore->pfnGenerateStream(&pChipR3->opl, buf + offFrame * 2, frames - offFrame);
+    }
+}
+
+/**
+ * Renders the current block for the chips dealt to a worker.
+ * The render thread itself is worker -1, and gets the first chip.
+ */
+static void adlibRenderWorkerChips(PADLIBSTATE pThis, PADLIBSTATER3 pThisCC, PADLIBRENDER pRender, int iWorker)
+{
+    for (unsigned i = iWorker + 1; i < pThis->cChips; i += pRender->cWorkers + 1) {
+        PADLIBRENDERCHIP pRenderChip = &pRender->aChips[i];
+        int16_t *buf = pThis->cChips > 1 ? pRenderChip->pi16Buf : pRender->pi16Block;
+        adlibRenderBlock(pThisCC, &pThisCC->aChips[i], pRenderChip, buf, pRender->cBlockFrames,
+                         pRender->tmBlockStart, pRender->tmBlockEnd);
+    }
+}
+
+/**
+ * Worker threads wait for the render thread to hand them a block, and render it for their chips.
+ * They act on behalf of the render thread, which holds critSect until all of them are done.
+ *
+ * @callback_method_impl{FNRTTHREAD}
+ */
+static DECLCALLBACK(int) adlibRenderWorker(RTTHREAD ThreadSelf, void *pvUser)
+{
+    RT_NOREF(ThreadSelf);
+    PADLIBWORKER pWorker = (PADLIBWORKER)pvUser;
+    PADLIBSTATE pThis = PDMDEVINS_2_DATA(pWorker->pDevIns, PADLIBSTATE);
+    PADLIBSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pWorker->pDevIns, PADLIBSTATER3);
+    PADLIBRENDER pRender = pWorker->pRender;
+
+    for (;;) {
+        int rc = RTSemEventWait(pWorker->hEvtGo, RT_INDEFINITE_WAIT);
+        if (rc == VERR_INTERRUPTED) {
+            continue;
+        }
+        AssertLogRelRCBreak(rc);
+        if (ASMAtomicReadBool(&pRender->fWorkersExit)) {
+            break;
+        }
+
+        adlibRenderWorkerChips(pThis, pThisCC, pRender, pWorker->iWorker);
+
+        if (ASMAtomicDecU32(&pRender->cWorkersBusy) == 0) {
+            RTSemEventSignal(pRender->hEvtWorkersDone);
+        }
+    }
+
+    return VINF_SUCCESS;
+}
+
+/** Stops and destroys the worker pool. */
+static void adlibRenderDestroyWorkers(PADLIBRENDER pRender)
+{
+    ASMAtomicWriteBool(&pRender->fWorkersExit, true);
+    for (unsigned i = 0; i < pRender->cWorkers; i++) {
+        PADLIBWORKER pWorker = &pRender->aWorkers[i];
+        RTSemEventSignal(pWorker->hEvtGo);
+        int rc = RTThreadWait(pWorker->hThread, 30000, NULL);
+        AssertLogRelRC(rc);
+        RTSemEventDestroy(pWorker->hEvtGo);
+    }
+    pRender->cWorkers = 0;
+    if (pRender->hEvtWorkersDone != NIL_RTSEMEVENT) {
+        RTSemEventDestroy(pRender->hEvtWorkersDone);
+        pRender->hEvtWorkersDone = NIL_RTSEMEVENT;
+    }
+}
+
+/**
+ * Starts one worker thread per chip beyond the first.
+ * If that fails, the render thread just renders all chips itself.
+ */
+static void adlibRenderCreateWorkers(PPDMDEVINS pDevIns, PADLIBSTATE pThis, PADLIBRENDER pRender)
+{
+    pRender->cWorkers = 0;
+    pRender->fWorkersExit = false;
+    pRender->hEvtWorkersDone = NIL_RTSEMEVENT;
+
+    if (pThis->cChips <= 1) {
+        return;
+    }
+
+    int rc = RTSemEventCreate(&pRender->hEvtWorkersDone);
+    AssertLogRelRCReturnVoid(rc);
+
+    for (unsigned i = 0; i < pThis->cChips - 1u; i++) {
+        PADLIBWORKER pWorker = &pRender->aWorkers[i];
+        pWorker->pDevIns = pDevIns;
+        pWorker->pRender = pRender;
+        pWorker->iWorker = i;
+
+        rc = RTSemEventCreate(&pWorker->hEvtGo);
+        AssertLogRelRCBreak(rc);
+        rc = RTThreadCreateF(&pWorker->hThread, adlibRenderWorker, pWorker, 0,
+                             RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE,
+                             "adlib%u_work%u", pDevIns->iInstance, i);
+        if (RT_FAILURE(rc)) {
+            RTSemEventDestroy(pWorker->hEvtGo);
+            AssertLogRelRCBreak(rc);
+        }
+        pRender->cWorkers++;
+    }
+
+    if (RT_FAILURE(rc)) {
+        adlibRenderDestroyWorkers(pRender);
+    }
+}
+
+/** Mixes the blocks rendered by each chip into buf, placing each one as configured. */
+static void adlibRenderMixChips(PADLIBSTATE pThis, PADLIBRENDER pRender, int16_t *buf, uint32_t frames)
+{
+    for (uint32_t f = 0; f < frames; f++) {
+        int32_t left = 0, right = 0;
+        for (unsigned i = 0; i < pThis->cChips; i++) {
+            const int16_t *src = pRender->aChips[i].pi16Buf + f * 2;
+            switch (pThis->aChips[i].enmPan) {
+                case ADLIBPAN_LEFT:
+                    left += src[0];
+                    break;
+                case ADLIBPAN_RIGHT:
+                    right += src[1];
+                    break;
+                default:
+                    left += src[0];
+                    right += src[1];
+                    break;
+            }
+        }
+        buf[f * 2]     = RT_CLAMP(left,  INT16_MIN, INT16_MAX);
+        buf[f * 2 + 1] = RT_CLAMP(right, INT16_MIN, INT16_MAX);
+    }
+}
+
+/**
+ * Renders the block covering tmStart to tmEnd for all chips, into buf.
+ * Chips are rendered in parallel by the worker pool, then mixed.
+ */
+static void adlibRenderChips(PADLIBSTATE pThis, PADLIBSTATER3 pThisCC, PADLIBRENDER pRender, int16_t *buf,
+                             uint32_t frames, uint64_t tmStart, uint64_t tmEnd)
+{
+    pRender->pi16Block = buf;
+    pRender->cBlockFrames = frames;
+    pRender->tmBlockStart = tmStart;
+    pRender->tmBlockEnd = tmEnd;
+
+    if (pRender->cWorkers) {
+        ASMAtomicWriteU32(&pRender->cWorkersBusy, pRender->cWorkers);
+        for (unsigned i = 0; i < pRender->cWorkers; i++) {
+            RTSemEventSignal(pRender->aWorkers[i].hEvtGo);
+        }
+    }
+
+    adlibRenderWorkerChips(pThis, pThisCC, pRender, -1);
+
+    while (ASMAtomicReadU32(&pRender->cWorkersBusy) > 0) {
+        RTSemEventWait(pRender->hEvtWorkersDone, RT_INDEFINITE_WAIT);
+    }
+
+    if (pThis->cChips > 1) {
+        adlibRenderMixChips(pThis, pRender, buf, frames);
+    }
+}
+
+/**
+ * Renders the next block of frames output frames into buf. The caller must hold critSect.
+ *
+ * The chips render exactly as many frames as virtual time passes, so that their timeline
+ * matches the guest's one, and the frames are resampled to the PCM device clock.
+ * The resampling ratio is adapted to keep the blocks where they are expected:
+ * When rendering ahead, blocks are placed at the virtual time they will be played at,
+ * i.e. now plus the PCM device delay. A write timestamped before what was already
+ * rendered rolls the chips back to a checkpoint and rewinds the PCM device, so it is
+ * heard at its time instead of after the whole PCM buffer.
+ * Otherwise, each block ends about now, so writes are heard with the spacing the guest
+ * made them, one block later.
+ * Larger jumps of the virtual clock (e.g. when the VM is starved of CPU time) are resynced
+ * to rather than resampled.
+ */
+static void adlibRenderNextBlock(PPDMDEVINS pDevIns, PADLIBSTATE pThis, PADLIBSTATER3 pThisCC, PADLIBRENDER pRender,
+                                 int16_t *buf, uint32_t frames)
+{
+    if (pRender->cResets != pThisCC->cResets) {
+        // Chips were reset, forget everything from before
+        pRender->cResets = pThisCC->cResets;
+        pRender->cCheckpoints = 0;
+        for (unsigned i = 0; i < pThis->cChips; i++) {
+            pRender->aChips[i].iEventApplied = pRender->aChips[i].iEventNext;
+        }
+    }
+    if (pRender->cFlushes != pThisCC->cFlushes) {
+        // A chip was written directly (after applying the pending writes), which checkpoints do not know about
+        pRender->cFlushes = pThisCC->cFlushes;
+        pRender->cCheckpoints = 0;
+    }
+
+    adlibRenderTakeEvents(pThis, pThisCC, pRender);
+
+    const uint64_t tmNow = PDMDevHlpTMTimeVirtGet(pDevIns);
+    const uint64_t tmFreq = PDMDevHlpTMTimeVirtGetFreq(pDevIns);
+
+    uint64_t tmStart = pRender->tmBase + adlibFramesToTicks(pDevIns, pThis, pRender->iSrcFrame - pRender->iSrcFrameBase);
+
+    if (pRender->fAhead && !pRender->fResync) {
+        uint64_t tmFirstPending = UINT64_MAX;
+        for (unsigned i = 0; i < pThis->cChips; i++) {
+            PADLIBRENDERCHIP pRenderChip = &pRender->aChips[i];
+            if (pRenderChip->iEventApplied < pRenderChip->iEventNext) {
+                const ADLIBEVENT *pEvent = &pRenderChip->aHistory[pRenderChip->iEventApplied % ADLIB_RENDER_HISTORY_SIZE];
+                tmFirstPending = RT_MIN(tmFirstPending, pEvent->tmVirt);
+            }
+        }
+        if (tmFirstPending < tmStart) {
+            if (adlibRenderRollback(pThis, pThisCC, pRender, tmFirstPending)) {
+                tmStart = pRender->tmBase + adlibFramesToTicks(pDevIns, pThis, pRender->iSrcFrame - pRender->iSrcFrameBase);
+            }
+            if (tmFirstPending < tmStart) {
+                STAM_REL_COUNTER_INC(&pThis->StatRenderLateWrites);
+            }
+        }
+    }
+
+    // Where this block should start to keep the rendered position locked to the virtual clock
+    uint64_t tmExpected = tmStart;
+    if (pRender->fAhead) {
+        const ssize_t cDelay = pThisCC->pcmOut.delay();
+        if (cDelay >= 0) {
+            tmExpected = tmNow + adlibFramesToTicks(pDevIns, pThis, cDelay);
+        }
+    } else {
+        tmExpected = tmNow - RT_MIN(tmNow, adlibFramesToTicks(pDevIns, pThis, frames));
+    }
+
+    const uint64_t tmMaxDrift = tmFreq / 1000 * ADLIB_RENDER_MAX_DRIFT;
+    pRender->fResynced = tmStart > tmExpected + tmMaxDrift || tmStart + tmMaxDrift < tmExpected;
+    if (pRender->fResync || pRender->fResynced) {
+        Log9(("resyncing render position by %lld ticks\n", (int64_t)(tmExpected - tmStart)));
+        pRender->tmBase = tmStart = tmExpected;
+        pRender->iSrcFrameBase = pRender->iSrcFrame;
+        pRender->cCheckpoints = 0;
+        pRender->fResync = false;
+        pRender->resampler.reset();
+    }
+
+    adlibRenderSaveCheckpoint(pThis, pThisCC, pRender, tmStart);
+
+    // Position error in chip frames; positive when the virtual clock runs faster than the PCM device one
+    pRender->resampler.adapt((double)(int64_t)(tmExpected - tmStart) * pThis->uSampleRate / tmFreq, frames);
+
+    const uint32_t cSrcFrames = (uint32_t)pRender->resampler.inputFrames(frames);
+    int16_t *pi16Src = pRender->resampler.inputBuffer();
+    const uint64_t tmEnd = pRender->tmBase + adlibFramesToTicks(pDevIns, pThis, pRender->iSrcFrame + cSrcFrames - pRender->iSrcFrameBase);
+    adlibRenderChips(pThis, pThisCC, pRender, pi16Src, cSrcFrames, tmStart, tmEnd);
+    pRender->iSrcFrame += cSrcFrames;
+
+    pRender->resampler.process(cSrcFrames, buf, frames);
+}
+
+/** Whether all chips are silent and have no register writes pending. The caller must hold critSect. */
+static bool adlibRenderIsSilent(PADLIBSTATE pThis, PADLIBSTATER3 pThisCC, PADLIBRENDER pRender)
+{
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        if (pRender->aChips[i].iEventApplied != pRender->aChips[i].iEventNext
+            || !pThisCC->pCore->pfnIsSilent(&pThisCC->aChips[i].opl)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reports the PCM output underruns since the last call, which lost whatever was queued,
+ * so the checkpoints no longer match what can be rewound.
+ * Once the output is realigned after them, also reports how long that took: until the frames
+ * queued are back at the target latency, or the render position has been resynced to the virtual clock.
+ */
+static void adlibRenderCheckXruns(PPDMDEVINS pDevIns, PADLIBSTATE pThis, PADLIBSTATER3 pThisCC, PADLIBRENDER pRender)
+{
+    const uint32_t cXruns = pThisCC->pcmOut.xruns();
+    const bool fNewXruns = cXruns != pRender->cXruns;
+    if (fNewXruns) {
+        STAM_REL_COUNTER_ADD(&pThis->StatPcmUnderruns, cXruns - pRender->cXruns);
+        pRender->cXruns = cXruns;
+        pRender->cCheckpoints = 0;
+    }
+
+    // A block resynced before the write that underran does not realign the output
+    if (!pThisCC->pcmOut.xrunTime() || fNewXruns || (!pRender->fResynced && !pThisCC->pcmOut.atTargetLatency())) {
+        return;
+    }
+
+    const uint64_t cNsRecovery = pThisCC->pcmOut.realigned();
+    STAM_REL_COUNTER_ADD(&pThis->StatPcmRecoveryTime, cNsRecovery);
+    LogRelMax(10, ("adlib%d: PCM output underrun, back to target latency in %RU64 ms\n", pDevIns->iInstance,
+                   cNsRecovery / RT_NS_1MS));
+}
+
+/**
+ * Renders blocks and pushes them to the started PCM output device, until asked to shutdown
+ * or idle, or the chip has been silent for ADLIB_RENDER_SUSPEND_TIMEOUT.
+ */
+static int adlibRenderUntilSilent(PPDMDEVINS pDevIns, PADLIBSTATE pThis, PADLIBSTATER3 pThisCC, PADLIBRENDER pRender)
+{
+    PCMOutBackend *pPcmOut = &pThisCC->pcmOut;
+    int16_t *buf = (int16_t*) pThisCC->pbRenderBuf;
+    uint64_t buf_frames = adlibCalculateFramesFromMilli(pThis, ADLIB_RENDER_BLOCK_TIME);
+    const unsigned int channels = adlibOutputChannels(pThis);
+    uint64_t msSilentSince = 0;
+
+    while (!ASMAtomicReadBool(&pThisCC->fShutdown) && !ASMAtomicReadBool(&pThisCC->fIdle)) {
+        Log9(("rendering %lld frames\n", buf_frames));
+
+        int rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
+        PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
+        adlibRenderNextBlock(pDevIns, pThis, pThisCC, pRender, buf, buf_frames);
+        const bool fSilent = adlibRenderIsSilent(pThis, pThisCC, pRender);
+        PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
 
-    IOMIOPORTHANDLE        hIoPorts;
-    IOMIOPORTHANDLE        hMirrorPorts;
-} ADLIBSTATE;
-typedef ADLIBSTATE *PADLIBSTATE;
+        if (channels == ADLIB_NUM_CHANNELS_OPL2) {
+            adlibFoldToMono(buf, buf_frames);
+        }
 
-#ifndef VBOX_DEVICE_STRUCT_TESTCASE
+        Log9(("writing %lld frames\n", buf_frames));
 
-static inline uint64_t adlibCalculateFramesFromMilli(PADLIBSTATE pThis, uint64_t milli)
-{
-    uint64_t rate = pThis->uSampleRate;
-    return (rate * milli) / 1000;
-}
+        ssize_t written_frames = pPcmOut->write(buf, buf_frames);
+        if (written_frames < 0) {
+            AssertLogRelMsgFailedReturn(("adlib: render thread write err=%Rrc\n", written_frames), written_frames);
+        }
+        pRender->iFrame += written_frames;
+        adlibRenderCheckXruns(pDevIns, pThis, pThisCC, pRender);
+
+        if (!fSilent) {
+            msSilentSince = 0;
+        } else if (!msSilentSince) {
+            msSilentSince = RTTimeSystemMilliTS();
+        } else if (RTTimeSystemMilliTS() - msSilentSince >= ADLIB_RENDER_SUSPEND_TIMEOUT) {
+            Log(("adlib: Chip is silent, parking render thread\n"));
+            break;
+        }
 
-static inline size_t adlibCalculateBytesFromFrames(PADLIBSTATE pThis, uint64_t frames)
-{
-    NOREF(pThis);
-    return frames * sizeof(uint16_t) * ADLIB_NUM_CHANNELS;
+        RTThreadYield();
+    }
+
+    return VINF_SUCCESS;
 }
 
-static uint64_t adlibCalculateTimerExpire(PPDMDEVINS pDevIns, uint8_t value, uint64_t period)
+/**
+ * Goes idle after a period of rendering, unless asked to idle now by pfnSuspend.
+ * A register write queued meanwhile may have seen us still running and not woken us;
+ * if so, and nobody has claimed the wake up since, keep going instead.
+ *
+ * @returns true if the thread should park, false to keep rendering.
+ */
+static bool adlibRenderThreadGoIdle(PADLIBSTATE pThis, PADLIBSTATER3 pThisCC)
 {
-    uint64_t delay_usec = (0x100 - value) * period;
-    if (delay_usec < 100)  delay_usec = 0; // short delay: Likely just checking for OPL presence; fire timer now.
-    uint64_t freq = PDMDevHlpTMTimeVirtGetFreq(pDevIns);
-    uint64_t delay_ticks = (delay_usec * freq) / 1000000UL /*1usec in hz*/;
-    uint64_t now_ticks = PDMDevHlpTMTimeVirtGet(pDevIns);
-    return now_ticks + delay_ticks;
+    const bool fIdleNow = ASMAtomicXchgBool(&pThisCC->fIdle, false);
+    ASMAtomicWriteBool(&pThisCC->fStopped, true);
+    return fIdleNow
+        || !adlibHasQueuedEvents(pThis, pThisCC)
+        || !ASMAtomicCmpXchgBool(&pThisCC->fStopped, false, true);
 }
 
 /**
@@ -188,6 +1145,10 @@ static uint64_t adlibCalculateTimerExpire(PPDMDEVINS pDevIns, uint8_t value, uin
  * We rely on the PCM output device's blocking writes behavior to avoid running continously.
  * A small block size (ADLIB_RENDER_BLOCK_TIME) is also used to give the main thread some
  * opportunities to run.
+ * The thread is created along with the device and lives as long as it does. Once the chips
+ * go silent it stops the PCM output, keeping it open, and parks on hEvtRender until the next
+ * register write, so that waking up costs neither a thread creation nor a PCM open.
+ * With several chips, the blocks are rendered in parallel by a worker pool and mixed.
  *
  * @callback_method_impl{FNRTTHREAD}
  */
@@ -196,138 +1157,204 @@ static DECLCALLBACK(int) adlibRenderThread(RTTHREAD ThreadSelf, void *pvUser)
     RT_NOREF(ThreadSelf);
     PPDMDEVINS pDevIns = (PPDMDEVINS)pvUser;
     PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
-    PCMOutBackend *pPcmOut = &pThis->pcmOut;
+    PADLIBSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
+    PCMOutBackend *pPcmOut = &pThisCC->pcmOut;
+
+    Log(("adlib: Starting render thread with buf_frames=%lld\n",
+         adlibCalculateFramesFromMilli(pThis, ADLIB_RENDER_BLOCK_TIME)));
+
+    PADLIBRENDER pRender = (PADLIBRENDER) RTMemAllocZ(sizeof(*pRender));
+    AssertLogRelReturn(pRender, VERR_NO_MEMORY);
+    pRender->cbChipStride = RT_ALIGN_Z(pThisCC->pCore->cbChip, 8);
+    pRender->cbCheckpoint = RT_ALIGN_Z(RT_UOFFSETOF(ADLIBCHECKPOINT, abChip) + pRender->cbChipStride * pThis->cChips, 8);
+    pRender->pbCheckpoints = (uint8_t *) RTMemAlloc(pRender->cbCheckpoint * ADLIB_RENDER_CHECKPOINTS);
+
+    const uint64_t buf_frames = adlibCalculateFramesFromMilli(pThis, ADLIB_RENDER_BLOCK_TIME);
+    int rc = pRender->resampler.init(ADLIB_NUM_CHANNELS, buf_frames,
+                                     adlibCalculateFramesFromMilli(pThis, ADLIB_RENDER_SETTLE_TIME));
+
+    // Each chip gets its own block buffer to be mixed from, unless there is just one.
+    const size_t src_frames = pRender->resampler.maxInputFrames();
+    int16_t *pi16ChipBufs = NULL;
+    if (pThis->cChips > 1) {
+        pi16ChipBufs = (int16_t *) RTMemAlloc(adlibCalculateBytesFromFrames(pThis, src_frames) * pThis->cChips);
+        for (unsigned i = 0; pi16ChipBufs && i < pThis->cChips; i++) {
+            pRender->aChips[i].pi16Buf = pi16ChipBufs + i * src_frames * ADLIB_NUM_CHANNELS;
+        }
+    }
 
-    // Compute the max number of frames we can store on our temporary buffer.
-    int16_t *buf = (int16_t*) pThis->pbRenderBuf;
-    uint64_t buf_frames = adlibCalculateFramesFromMilli(pThis, ADLIB_RENDER_BLOCK_TIME);
+    if (RT_FAILURE(rc) || !pRender->pbCheckpoints || (pThis->cChips > 1 && !pi16ChipBufs)) {
+        RTMemFree(pi16ChipBufs);
+        pRender->resampler.destroy();
+        RTMemFree(pRender->pbCheckpoints);
+        RTMemFree(pRender);
+        AssertLogRelFailedReturn(VERR_NO_MEMORY);
+    }
 
-    Log(("adlib: Starting render thread with buf_frames=%lld\n", buf_frames));
+    adlibRenderCreateWorkers(pDevIns, pThis, pRender);
 
-    int rc = pPcmOut->open(pThis->pszOutDevice, pThis->uSampleRate, ADLIB_NUM_CHANNELS);
-    AssertLogRelRCReturn(rc, rc);
+    rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
+    PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
+    pThisCC->pRender = pRender;
+    PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
 
-    while (!ASMAtomicReadBool(&pThis->fShutdown)
-           && ASMAtomicReadU64(&pThis->tmLastWrite) + ADLIB_RENDER_SUSPEND_TIMEOUT >= RTTimeSystemMilliTS()) {
-        Log9(("rendering %lld frames\n", buf_frames));
+    const unsigned int channels = adlibOutputChannels(pThis);
+    bool fOpen = false;
 
-        rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
-        PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
-        OPL3_GenerateStream(&pThis->opl, buf, buf_frames);
-        PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
+    while (!ASMAtomicReadBool(&pThisCC->fShutdown)) {
+        // Park until a register write claims the wake up
+        rc = RTSemEventWait(pThisCC->hEvtRender, RT_INDEFINITE_WAIT);
+        if (rc == VERR_INTERRUPTED) {
+            continue;
+        }
+        AssertLogRelRCBreak(rc);
+        ASMAtomicWriteBool(&pThisCC->fIdle, false);
+
+        bool fPark = false;
+        while (!fPark && !ASMAtomicReadBool(&pThisCC->fShutdown)) {
+            // The PCM output is opened once and kept open; only reopened after an error.
+            if (!fOpen) {
+                rc = pPcmOut->open(pThisCC->pszOutDevice, pThis->uSampleRate, channels);
+                fOpen = RT_SUCCESS(rc);
+            }
+            if (fOpen) {
+                rc = pPcmOut->start();
+            }
+            if (RT_FAILURE(rc)) {
+                // Retried on the next wake up, as it will likely fail again now
+                LogRelMax(10, ("adlib%d: cannot start PCM output (%Rrc)\n", pDevIns->iInstance, rc));
+                ASMAtomicWriteBool(&pThisCC->fStopped, true);
+                fPark = true;
+                continue;
+            }
 
-        Log9(("writing %lld frames\n", buf_frames));
+            rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
+            PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
+            pRender->fAhead = pThis->fRenderAhead;
+            pRender->cResets = pThisCC->cResets;
+            pRender->cFlushes = pThisCC->cFlushes;
+            pRender->cCheckpoints = 0;
+            pRender->iFrame = 0;
+            pRender->fResync = true;
+            PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
 
-        ssize_t written_frames = pPcmOut->write(buf, buf_frames);
-        if (written_frames < 0) {
-            rc = written_frames;
-            AssertLogRelMsgFailedBreak(("adlib: render thread write err=%Rrc\n", written_frames));
+            rc = adlibRenderUntilSilent(pDevIns, pThis, pThisCC, pRender);
+
+            // Plays whatever is still buffered, but keeps the device open for the next wake up
+            int rcStop = RT_SUCCESS(rc) ? pPcmOut->stop() : rc;
+            if (RT_FAILURE(rcStop)) {
+                pPcmOut->close();
+                fOpen = false;
+            }
+
+            fPark = adlibRenderThreadGoIdle(pThis, pThisCC);
         }
+    }
 
-        RTThreadYield();
+    if (fOpen) {
+        int rcClose = pPcmOut->close();
+        AssertLogRelRC(rcClose);
     }
 
-    int rcClose = pPcmOut->close();
-    AssertLogRelRC(rcClose);
-    if (RT_SUCCESS(rc)) rc = rcClose;
+    int rcLock = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
+    PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rcLock);
+    pThisCC->pRender = NULL;
+    PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
+
+    adlibRenderDestroyWorkers(pRender);
+    RTMemFree(pi16ChipBufs);
+    pRender->resampler.destroy();
+    RTMemFree(pRender->pbCheckpoints);
+    RTMemFree(pRender);
 
     Log(("adlib: Stopping render thread with rc=%Rrc\n", rc));
 
-    ASMAtomicWriteBool(&pThis->fStopped, true);
+    return VINF_SUCCESS;
+}
+
+/** Creates the render thread, initially parked. */
+static int adlibCreateRenderThread(PPDMDEVINS pDevIns)
+{
+    PADLIBSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
+
+    pThisCC->fShutdown = false;
+    pThisCC->fIdle = false;
+    pThisCC->fStopped = true;
+
+    int rc = RTSemEventCreate(&pThisCC->hEvtRender);
+    AssertRCReturn(rc, rc);
+
+    Log3(("Creating render thread\n"));
+
+    rc = RTThreadCreateF(&pThisCC->hRenderThread, adlibRenderThread, pDevIns, 0,
+                         RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE,
+                         "adlib%u_render", pDevIns->iInstance);
+    AssertRCReturn(rc, rc);
 
     return VINF_SUCCESS;
 }
 
-/** Waits for the render thread to finish and reaps it. */
-static int adlibReapRenderThread(PPDMDEVINS pDevIns, RTMSINTERVAL millies = 100)
+/** Terminates the render thread and waits for it. */
+static int adlibDestroyRenderThread(PPDMDEVINS pDevIns)
 {
-    PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+    PADLIBSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
 
-    if (pThis->hRenderThread != NIL_RTTHREAD) {
-        int rc = RTThreadWait(pThis->hRenderThread, millies, NULL);
+    if (pThisCC->hRenderThread != NIL_RTTHREAD) {
+        ASMAtomicWriteBool(&pThisCC->fShutdown, true);
+        RTSemEventSignal(pThisCC->hEvtRender);
+
+        int rc = RTThreadWait(pThisCC->hRenderThread, 30000, NULL);
         if (RT_SUCCESS(rc)) {
-            pThis->hRenderThread = NIL_RTTHREAD;
+            pThisCC->hRenderThread = NIL_RTTHREAD;
         } else {
             LogWarn(("adlib%d: render thread did not terminate (%Rrc)\n", pDevIns->iInstance, rc));
             AssertRCReturn(rc, rc);
         }
     }
 
+    if (pThisCC->hEvtRender != NIL_RTSEMEVENT) {
+        RTSemEventDestroy(pThisCC->hEvtRender);
+        pThisCC->hEvtRender = NIL_RTSEMEVENT;
+    }
+
     return VINF_SUCCESS;
 }
 
-/** Raises signal for render thread to stop; potentially waits for it. */
-static int adlibStopRenderThread(PPDMDEVINS pDevIns, bool wait = false)
+/** Asks the render thread to stop the PCM output and park now, rather than once the chips are silent. */
+static void adlibIdleRenderThread(PPDMDEVINS pDevIns)
 {
-    PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
-
-    if (pThis->hRenderThread == NIL_RTTHREAD) {
-        // Already stopped & reaped
-        return VINF_SUCCESS;
-    }
-
-    // Raise the flag for the thread
-    ASMAtomicWriteBool(&pThis->fShutdown, true);
+    PADLIBSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
 
-    if (wait) {
-        int rc = adlibReapRenderThread(pDevIns, 30000);
-        AssertRCReturn(rc, rc);
+    if (!ASMAtomicReadBool(&pThisCC->fStopped)) {
+        ASMAtomicWriteBool(&pThisCC->fIdle, true);
     }
-
-    return VINF_SUCCESS;
 }
 
 static void adlibWakeRenderThread(PPDMDEVINS pDevIns)
 {
-    PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
-
-    ASMAtomicWriteU64(&pThis->tmLastWrite, RTTimeSystemMilliTS());
-
-    // Reap any existing render thread if it had stopped
-    if (ASMAtomicReadBool(&pThis->fStopped)) {
-        int rc = adlibReapRenderThread(pDevIns);
-        AssertLogRelRCReturnVoid(rc);
-    } else if (ASMAtomicReadBool(&pThis->fShutdown)
-               && pThis->hRenderThread != NIL_RTTHREAD) {
-        AssertLogRelMsgFailedReturnVoid(("can't wake render thread -- it's shutting down!\n"));
-    }
-
-    // If there is no existing render thread, start a new one
-    if (pThis->hRenderThread == NIL_RTTHREAD) {
-        pThis->fShutdown = false;
-        pThis->fStopped = false;
+    PADLIBSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
 
-        Log3(("Creating render thread\n"));
-
-        int rc = RTThreadCreateF(&pThis->hRenderThread, adlibRenderThread, pDevIns, 0,
-                                 RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE,
-                                 "adlib%u_render", pDevIns->iInstance);
-        AssertLogRelRCReturnVoid(rc);
+    // Unpark the render thread if it was parked, claiming its wake up
+    if (ASMAtomicCmpXchgBool(&pThisCC->fStopped, false, true)) {
+        Log3(("Waking render thread\n"));
+        int rc = RTSemEventSignal(pThisCC->hEvtRender);
+        AssertLogRelRC(rc);
     }
 }
 
-static uint8_t adlibReadStatus(PPDMDEVINS pDevIns)
+# endif /* IN_RING3 */
+
+static uint8_t adlibReadStatus(PPDMDEVINS pDevIns, PADLIBCHIP pChip)
 {
     PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
-    uint8_t status = 0;
 
     /* The status byte has the following structure:
        Bit 7 - set if either timer has expired.
            6 - set if timer 1 has expired.
-           5 - set if timer 2 has expired. */
-
-    uint64_t tmNow = PDMDevHlpTMTimeVirtGet(pDevIns);
+           5 - set if timer 2 has expired.
+       The timer callbacks keep it up to date, so polling it is cheap. */
+    uint8_t status = ASMAtomicReadU8(&pChip->timerStatus);
 
-    Log5Func(("tmNow=%llu timer1=%llu timer2=%llu\n", tmNow,
-              pThis->timer1Enable ? pThis->timer1Expire : 0,
-              pThis->timer2Enable ? pThis->timer2Expire : 0));
-
-    if (pThis->timer1Enable && tmNow > pThis->timer1Expire) {
-        status |= RT_BIT(7) | RT_BIT(6);
-    }
-    if (pThis->timer2Enable && tmNow > pThis->timer2Expire) {
-        status |= RT_BIT(7) | RT_BIT(5);
-    }
     if (!pThis->fOPL3) {
         // OPL2 seems to have this as special signature.
         status |= 0x6;
@@ -338,15 +1365,96 @@ static uint8_t adlibReadStatus(PPDMDEVINS pDevIns)
     return status;
 }
 
-static void adlibWriteRegister(PPDMDEVINS pDevIns, uint16_t reg, uint8_t value)
+# ifdef IN_RING3
+
+static void adlibInvalidateRegShadow(PADLIBCHIP pChip)
+{
+    RT_ZERO(pChip->bmRegShadowValid);
+}
+
+/**
+ * Checks whether a register write would leave the chip unchanged, and can be dropped.
+ * Otherwise records the value in the register shadow.
+ */
+static bool adlibFilterRegister(PADLIBSTATE pThis, PADLIBCHIP pChip, uint16_t reg, uint8_t value)
+{
+    const uint8_t regm = reg & 0xff;
+
+    if (!pThis->fRegisterFilter) {
+        return false;
+    }
+
+    // Key-on bits act on edges inside the chip, so these are always let through
+    const bool fKeyOn = (regm >= OPL_REG_KEY_ON_FIRST && regm <= OPL_REG_KEY_ON_LAST) || regm == OPL_REG_RHYTHM;
+
+    if (!fKeyOn && ASMBitTest(pChip->bmRegShadowValid, reg) && pChip->abRegShadow[reg] == value) {
+        STAM_REL_COUNTER_INC(&pThis->StatRegWritesFiltered);
+        return true;
+    }
+
+    // These change how the chip interprets other registers (e.g. channel outputs, key scaling),
+    // so rewriting those with the same value is meaningful again afterwards.
+    switch (reg) {
+        case OPL_REG_FM_MODE:
+        case OPL_REG_4OP_ENABLE:
+        case OPL_REG_OPL3_ENABLE:
+            adlibInvalidateRegShadow(pChip);
+            break;
+        case OPL_REG_RHYTHM:
+            if ((pChip->abRegShadow[reg] ^ value) & RT_BIT(5)) {
+                adlibInvalidateRegShadow(pChip);
+            }
+            break;
+    }
+
+    pChip->abRegShadow[reg] = value;
+    ASMBitSet(pChip->bmRegShadowValid, reg);
+
+    return false;
+}
+
+/** Queues a register write for the render thread, without taking critSect unless the queue is full. */
+static void adlibQueueRegister(PPDMDEVINS pDevIns, PADLIBCHIP pChip, uint16_t reg, uint8_t value)
 {
     PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+    PADLIBSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
+    PADLIBCHIPR3 pChipR3 = &pThisCC->aChips[pChip - &pThis->aChips[0]];
+    ADLIBEVENT *pEvent;
+    size_t cbEvent;
+
+    RTCircBufAcquireWriteBlock(pChipR3->pEventQueue, sizeof(*pEvent), (void **)&pEvent, &cbEvent);
+    if (cbEvent >= sizeof(*pEvent)) {
+        pEvent->tmVirt = PDMDevHlpTMTimeVirtGet(pDevIns);
+        pEvent->reg = reg;
+        pEvent->value = value;
+        RTCircBufReleaseWriteBlock(pChipR3->pEventQueue, sizeof(*pEvent));
+        return;
+    }
+    RTCircBufReleaseWriteBlock(pChipR3->pEventQueue, 0);
 
-    // Any write to a register causes the render thread to be waken up
-    adlibWakeRenderThread(pDevIns);
+    // The render thread is not keeping up (or not running yet), so apply everything now.
+    STAM_REL_COUNTER_INC(&pThis->StatEventQueueFull);
+
+    int rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
+    PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
+    adlibFlushEvents(pThisCC, pChipR3);
+    pThisCC->pCore->pfnWriteReg(&pChipR3->opl, reg, value);
+    pThisCC->cFlushes++;
+    PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
+}
+
+static void adlibWriteRegister(PPDMDEVINS pDevIns, PADLIBCHIP pChip, uint16_t reg, uint8_t value)
+{
+    PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+    PADLIBSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
 
     Log3Func(("0x%x = 0x%x\n", reg, value));
 
+    if (pThisCC->capture.isOpen()) {
+        // Everything the guest writes, timers included, before any filtering.
+        pThisCC->capture.write(PDMDevHlpTMTimeVirtGet(pDevIns), pChip - &pThis->aChips[0], reg, value);
+    }
+
     switch (reg)
     {
         case OPL_REG_TIMER1:
@@ -356,9 +1464,9 @@ static void adlibWriteRegister(PPDMDEVINS pDevIns, uint16_t reg, uint8_t value)
                (INT 08) and set bits 7 and 6 in its status byte.  The
                value for this timer is incremented every eighty (80)
                microseconds. */
-            pThis->timer1Value = value;
-            if (pThis->timer1Enable) {
-                pThis->timer1Expire = adlibCalculateTimerExpire(pDevIns, pThis->timer1Value, OPL_TIMER1_PERIOD);
+            pChip->timer1Value = value;
+            if (pChip->timer1Enable) {
+                adlibStartTimer(pDevIns, pChip, pChip->hTimer1, OPL_STATUS_TIMER1, pChip->timer1Value, OPL_TIMER1_PERIOD);
             }
             break;
 
@@ -369,9 +1477,9 @@ static void adlibWriteRegister(PPDMDEVINS pDevIns, uint16_t reg, uint8_t value)
                (INT 08) and set bits 7 and 5 in its status byte.  The
                value for this timer is incremented every three hundred
                twenty (320) microseconds. */
-            pThis->timer2Value = value;
-            if (pThis->timer2Enable) {
-                pThis->timer2Expire = adlibCalculateTimerExpire(pDevIns, pThis->timer2Value, OPL_TIMER2_PERIOD);
+            pChip->timer2Value = value;
+            if (pChip->timer2Enable) {
+                adlibStartTimer(pDevIns, pChip, pChip->hTimer2, OPL_STATUS_TIMER2, pChip->timer2Value, OPL_TIMER2_PERIOD);
             }
             break;
 
@@ -388,47 +1496,61 @@ static void adlibWriteRegister(PPDMDEVINS pDevIns, uint16_t reg, uint8_t value)
                        When set, the value from byte 02 is loaded into
                        Timer 1, and incrementation begins.  */
             if (value & RT_BIT(7)) {
-                pThis->timer1Enable = false;
-                pThis->timer2Enable = false;
+                pChip->timer1Enable = false;
+                pChip->timer2Enable = false;
+                adlibStopTimer(pDevIns, pChip, pChip->hTimer1, OPL_STATUS_TIMER1);
+                adlibStopTimer(pDevIns, pChip, pChip->hTimer2, OPL_STATUS_TIMER2);
             } else {
                 if (!(value & RT_BIT(6))) {
-                    pThis->timer1Enable = value & RT_BIT(0);
-                    if (pThis->timer1Enable) {
-                        pThis->timer1Expire = adlibCalculateTimerExpire(pDevIns, pThis->timer1Value, OPL_TIMER1_PERIOD);
+                    pChip->timer1Enable = value & RT_BIT(0);
+                    if (pChip->timer1Enable) {
+                        adlibStartTimer(pDevIns, pChip, pChip->hTimer1, OPL_STATUS_TIMER1, pChip->timer1Value, OPL_TIMER1_PERIOD);
+                    } else {
+                        adlibStopTimer(pDevIns, pChip, pChip->hTimer1, OPL_STATUS_TIMER1);
                     }
                 }
                 if (!(value & RT_BIT(5))) {
-                    pThis->timer2Enable = value & RT_BIT(1);
-                    if (pThis->timer2Enable) {
-                        pThis->timer2Expire = adlibCalculateTimerExpire(pDevIns, pThis->timer2Value, OPL_TIMER2_PERIOD);
+                    pChip->timer2Enable = value & RT_BIT(1);
+                    if (pChip->timer2Enable) {
+                        adlibStartTimer(pDevIns, pChip, pChip->hTimer2, OPL_STATUS_TIMER2, pChip->timer2Value, OPL_TIMER2_PERIOD);
+                    } else {
+                        adlibStopTimer(pDevIns, pChip, pChip->hTimer2, OPL_STATUS_TIMER2);
                     }
                 }
             }
             break;
 
         default:
-            int rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
-            PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
-            OPL3_WriteRegBuffered(&pThis->opl, reg, value);
-            PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
+            if (adlibFilterRegister(pThis, pChip, reg, value)) {
+                break;
+            }
+
+            adlibQueueRegister(pDevIns, pChip, reg, value);
+            // Wake the render thread after queueing, so it sees the write if it is just going idle
+            adlibWakeRenderThread(pDevIns);
             break;
     }
 }
 
+# endif /* IN_RING3 */
+
 /**
- * @callback_method_impl{FNIOMIOPORTNEWIN}
+ * @callback_method_impl{FNIOMIOPORTNEWIN, pvUser is the chip index.}
+ *
+ * Only the status register can be read, so this is served entirely from the shared state in any context.
  */
 static DECLCALLBACK(VBOXSTRICTRC) adlibIoPortRead(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT offPort, uint32_t *pu32, unsigned cb)
 {
-    RT_NOREF(pvUser);
     if (cb == 1)
     {
+        PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+        PADLIBCHIP pChip = &pThis->aChips[(uintptr_t)pvUser];
         uint32_t uValue;
 
         switch (offPort)
         {
             case ADLIB_PORT_STATUS:
-                uValue = adlibReadStatus(pDevIns);
+                uValue = adlibReadStatus(pDevIns, pChip);
                 break;
             default:
                 ASSERT_GUEST_MSG_FAILED(("invalid port %#x\n", offPort));
@@ -446,14 +1568,17 @@ static DECLCALLBACK(VBOXSTRICTRC) adlibIoPortRead(PPDMDEVINS pDevIns, void *pvUs
 }
 
 /**
- * @callback_method_impl{FNIOMIOPORTNEWOUT}
+ * @callback_method_impl{FNIOMIOPORTNEWOUT, pvUser is the chip index.}
+ *
+ * Address writes only latch the register index and are handled in any context;
+ * data writes need the emulator, so they are deferred to ring-3.
  */
 static DECLCALLBACK(VBOXSTRICTRC) adlibIoPortWrite(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT offPort, uint32_t u32, unsigned cb)
 {
-    RT_NOREF(pvUser);
     if (cb == 1)
     {
         PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+        PADLIBCHIP pChip = &pThis->aChips[(uintptr_t)pvUser];
         Log7Func(("write port %u: %#04x\n", offPort, u32));
 
         uint8_t val = u32;
@@ -461,15 +1586,19 @@ static DECLCALLBACK(VBOXSTRICTRC) adlibIoPortWrite(PPDMDEVINS pDevIns, void *pvU
         switch (offPort)
         {
             case ADLIB_PORT_ADDR:
-                pThis->oplReg = val;
+                pChip->oplReg = val;
                 break;
             case ADLIB_PORT_ADDR2:
-                pThis->oplReg = val | 0x100;
+                pChip->oplReg = val | 0x100;
                 break;
             case ADLIB_PORT_DATA:
             case ADLIB_PORT_DATA2:
-                adlibWriteRegister(pDevIns, pThis->oplReg, val);
+#ifdef IN_RING3
+                adlibWriteRegister(pDevIns, pChip, pChip->oplReg, val);
                 break;
+#else
+                return VINF_IOM_R3_IOPORT_WRITE;
+#endif
 
             default:
                 ASSERT_GUEST_MSG_FAILED(("invalid port %#x\n", offPort));
@@ -491,23 +1620,80 @@ static DECLCALLBACK(int) adlibR3SaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
     PADLIBSTATE     pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
     PCPDMDEVHLPR3   pHlp  = pDevIns->pHlpR3;
 
-    // Don't care if the configuration changes after resume, so not saving it
+    // Don't care if the configuration changes after resume, so not saving it,
+    // other than the number of chips the state below is for.
+    pHlp->pfnSSMPutU8    (pSSM, pThis->cChips);
 
     // However save as much of the current state as possible
-    pHlp->pfnSSMPutU16   (pSSM, pThis->oplReg);
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        PADLIBCHIP pChip = &pThis->aChips[i];
 
-    // TODO: We should save a copy of all current registers
+        pHlp->pfnSSMPutU16   (pSSM, pChip->oplReg);
 
-    pHlp->pfnSSMPutU8    (pSSM, pThis->timer1Value);
-    pHlp->pfnSSMPutU8    (pSSM, pThis->timer2Value);
-    pHlp->pfnSSMPutU64   (pSSM, pThis->timer1Expire);
-    pHlp->pfnSSMPutU64   (pSSM, pThis->timer2Expire);
-    pHlp->pfnSSMPutBool  (pSSM, pThis->timer1Enable);
-    pHlp->pfnSSMPutBool  (pSSM, pThis->timer2Enable);
+        // TODO: We should save a copy of all current registers
+
+        pHlp->pfnSSMPutU8    (pSSM, pChip->timer1Value);
+        pHlp->pfnSSMPutU8    (pSSM, pChip->timer2Value);
+        pHlp->pfnSSMPutBool  (pSSM, pChip->timer1Enable);
+        pHlp->pfnSSMPutBool  (pSSM, pChip->timer2Enable);
+        pHlp->pfnSSMPutU8    (pSSM, pChip->timerStatus);
+        PDMDevHlpTimerSave(pDevIns, pChip->hTimer1, pSSM);
+        PDMDevHlpTimerSave(pDevIns, pChip->hTimer2, pSSM);
+    }
 
 	return 0;
 }
 
+/** Loads the saved state of one chip. */
+static int adlibR3LoadChip(PPDMDEVINS pDevIns, PADLIBCHIP pChip, PSSMHANDLE pSSM, uint32_t uVersion)
+{
+    PCPDMDEVHLPR3   pHlp  = pDevIns->pHlpR3;
+
+    pHlp->pfnSSMGetU16   (pSSM, &pChip->oplReg);
+
+    pHlp->pfnSSMGetU8    (pSSM, &pChip->timer1Value);
+    pHlp->pfnSSMGetU8    (pSSM, &pChip->timer2Value);
+
+    uint8_t status = 0;
+    if (uVersion == ADLIB_SAVED_STATE_VERSION_VIRT_EXPIRE) {
+        // Older states only have the virtual clock time each timer expires at; re-arm the TM timers from it.
+        uint64_t timer1Expire, timer2Expire;
+        pHlp->pfnSSMGetU64   (pSSM, &timer1Expire);
+        pHlp->pfnSSMGetU64   (pSSM, &timer2Expire);
+        pHlp->pfnSSMGetBool  (pSSM, &pChip->timer1Enable);
+        pHlp->pfnSSMGetBool  (pSSM, &pChip->timer2Enable);
+
+        uint64_t tmNow = PDMDevHlpTMTimeVirtGet(pDevIns);
+        PDMDevHlpTimerStop(pDevIns, pChip->hTimer1);
+        PDMDevHlpTimerStop(pDevIns, pChip->hTimer2);
+        if (pChip->timer1Enable) {
+            if (tmNow > timer1Expire)
+                status |= OPL_STATUS_TIMER1;
+            else
+                PDMDevHlpTimerSet(pDevIns, pChip->hTimer1, timer1Expire);
+        }
+        if (pChip->timer2Enable) {
+            if (tmNow > timer2Expire)
+                status |= OPL_STATUS_TIMER2;
+            else
+                PDMDevHlpTimerSet(pDevIns, pChip->hTimer2, timer2Expire);
+        }
+    } else {
+        pHlp->pfnSSMGetBool  (pSSM, &pChip->timer1Enable);
+        pHlp->pfnSSMGetBool  (pSSM, &pChip->timer2Enable);
+        pHlp->pfnSSMGetU8    (pSSM, &status);
+        int rc = PDMDevHlpTimerLoad(pDevIns, pChip->hTimer1, pSSM);
+        AssertRCReturn(rc, rc);
+        rc = PDMDevHlpTimerLoad(pDevIns, pChip->hTimer2, pSSM);
+        AssertRCReturn(rc, rc);
+    }
+
+    status &= OPL_STATUS_TIMER1 | OPL_STATUS_TIMER2;
+    pChip->timerStatus = status ? status | OPL_STATUS_IRQ : 0;
+
+    return VINF_SUCCESS;
+}
+
 /**
  * @callback_method_impl{FNSSMDEVLOADEXEC}
  */
@@ -519,19 +1705,26 @@ static DECLCALLBACK(int) adlibR3LoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, ui
     Assert(uPass == SSM_PASS_FINAL);
     NOREF(uPass);
 
-    pHlp->pfnSSMGetU16   (pSSM, &pThis->oplReg);
+    if (uVersion > ADLIB_SAVED_STATE_VERSION)
+        return VERR_SSM_UNSUPPORTED_DATA_UNIT_VERSION;
 
-    pHlp->pfnSSMGetU8    (pSSM, &pThis->timer1Value);
-    pHlp->pfnSSMGetU8    (pSSM, &pThis->timer2Value);
-    pHlp->pfnSSMGetU64   (pSSM, &pThis->timer1Expire);
-    pHlp->pfnSSMGetU64   (pSSM, &pThis->timer2Expire);
-    pHlp->pfnSSMGetBool  (pSSM, &pThis->timer1Enable);
-    pHlp->pfnSSMGetBool  (pSSM, &pThis->timer2Enable);
+    // Older states have a single chip; any extra configured chips just keep their reset state.
+    uint8_t cChips = 1;
+    if (uVersion > ADLIB_SAVED_STATE_VERSION_SINGLE_CHIP) {
+        int rc = pHlp->pfnSSMGetU8(pSSM, &cChips);
+        AssertRCReturn(rc, rc);
+        if (cChips > pThis->cChips)
+            return pHlp->pfnSSMSetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch - saved chips=%u; configured chips=%u"),
+                                           cChips, pThis->cChips);
+    }
 
-    pThis->tmLastWrite = RTTimeSystemMilliTS();
+    for (unsigned i = 0; i < cChips; i++) {
+        int rc = adlibR3LoadChip(pDevIns, &pThis->aChips[i], pSSM, uVersion);
+        AssertRCReturn(rc, rc);
+    }
 
-    if (uVersion > ADLIB_SAVED_STATE_VERSION)
-        return VERR_SSM_UNSUPPORTED_DATA_UNIT_VERSION;
+    // The IRQ line is not part of our saved state.
+    adlibUpdateIrq(pDevIns);
 
     return 0;
 }
@@ -545,19 +1738,30 @@ static DECLCALLBACK(int) adlibR3LoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, ui
 static DECLCALLBACK(void) adlibR3Reset(PPDMDEVINS pDevIns)
 {
     PADLIBSTATE   pThis   = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+    PADLIBSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
     
     int rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
     PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
-    OPL3_Reset(&pThis->opl, pThis->uSampleRate);
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        // Writes still queued from before the reset are dropped.
+        RTCircBufReset(pThisCC->aChips[i].pEventQueue);
+        pThisCC->pCore->pfnReset(&pThisCC->aChips[i].opl, pThis->uSampleRate);
+    }
+    pThisCC->cResets++;
     PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
 
-	pThis->oplReg = 0;
-    pThis->timer1Enable = false;
-    pThis->timer1Expire = 0;
-    pThis->timer1Value = 0;
-    pThis->timer2Enable = false;
-    pThis->timer2Expire = 0;
-    pThis->timer2Value = 0;
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        PADLIBCHIP pChip = &pThis->aChips[i];
+
+        pChip->oplReg = 0;
+        adlibInvalidateRegShadow(pChip);
+        pChip->timer1Enable = false;
+        pChip->timer1Value = 0;
+        pChip->timer2Enable = false;
+        pChip->timer2Value = 0;
+        adlibStopTimer(pDevIns, pChip, pChip->hTimer1, OPL_STATUS_TIMER1);
+        adlibStopTimer(pDevIns, pChip, pChip->hTimer2, OPL_STATUS_TIMER2);
+    }
 }
 
 /**
@@ -565,7 +1769,7 @@ static DECLCALLBACK(void) adlibR3Reset(PPDMDEVINS pDevIns)
  */
 static DECLCALLBACK(void) adlibR3Suspend(PPDMDEVINS pDevIns)
 {
-    adlibStopRenderThread(pDevIns);
+    adlibIdleRenderThread(pDevIns);
 }
 
 /**
@@ -573,7 +1777,52 @@ static DECLCALLBACK(void) adlibR3Suspend(PPDMDEVINS pDevIns)
  */
 static DECLCALLBACK(void) adlibR3PowerOff(PPDMDEVINS pDevIns)
 {
-    adlibStopRenderThread(pDevIns);
+    adlibIdleRenderThread(pDevIns);
+}
+
+/**
+ * Reads the configuration of one chip: its ports, and where it goes in the mix.
+ *
+ * @param   pDevIns     The device instance.
+ * @param   pCfg        Configuration node of the chip.
+ * @param   pChip       The chip.
+ * @param   iChip       Index of the chip; only the first one has a default port.
+ */
+static int adlibR3QueryChipConfig(PPDMDEVINS pDevIns, PCFGMNODE pCfg, PADLIBCHIP pChip, unsigned iChip)
+{
+    PCPDMDEVHLPR3   pHlp    = pDevIns->pHlpR3;
+    int             rc;
+
+    if (iChip == 0) {
+        rc = pHlp->pfnCFGMQueryPortDef(pCfg, "Port", &pChip->uPort, ADLIB_DEFAULT_IO_BASE);
+    } else {
+        rc = pHlp->pfnCFGMQueryPort(pCfg, "Port", &pChip->uPort);
+    }
+    if (RT_FAILURE(rc))
+        return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS, N_("Failed to query \"Port\" of chip %u from the config"), iChip);
+
+    rc = pHlp->pfnCFGMQueryPortDef(pCfg, "MirrorPort", &pChip->uMirrorPort, 0);
+    if (RT_FAILURE(rc))
+        return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS, N_("Failed to query \"MirrorPort\" of chip %u from the config"), iChip);
+
+    char szPan[16];
+    rc = pHlp->pfnCFGMQueryStringDef(pCfg, "Pan", szPan, sizeof(szPan), ADLIB_DEFAULT_PAN);
+    if (RT_FAILURE(rc))
+        return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS, N_("Failed to query \"Pan\" of chip %u from the config"), iChip);
+
+    if (RTStrICmp(szPan, "center") == 0) {
+        pChip->enmPan = ADLIBPAN_CENTER;
+    } else if (RTStrICmp(szPan, "left") == 0) {
+        pChip->enmPan = ADLIBPAN_LEFT;
+    } else if (RTStrICmp(szPan, "right") == 0) {
+        pChip->enmPan = ADLIBPAN_RIGHT;
+    } else {
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Invalid \"Pan\" value \"%s\" for chip %u, must be \"center\", \"left\" or \"right\""),
+                                   szPan, iChip);
+    }
+
+    return VINF_SUCCESS;
 }
 
 /**
@@ -583,6 +1832,7 @@ static DECLCALLBACK(int) adlibR3Construct(PPDMDEVINS pDevIns, int iInstance, PCF
 {
     PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
     PADLIBSTATE     pThis   = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+    PADLIBSTATER3   pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
     PCPDMDEVHLPR3   pHlp    = pDevIns->pHlpR3;
     int             rc;
 
@@ -591,21 +1841,42 @@ static DECLCALLBACK(int) adlibR3Construct(PPDMDEVINS pDevIns, int iInstance, PCF
     /*
      * Validate and read the configuration.
      */
-    PDMDEV_VALIDATE_CONFIG_RETURN(pDevIns, "OPL3|Port|MirrorPort|OutDevice|SampleRate", "");
+    PDMDEV_VALIDATE_CONFIG_RETURN(pDevIns, "OPL3|Port|MirrorPort|Pan|IRQ|OutDevice|SampleRate|Core|RegisterFilter|RenderAhead"
+                                           "|CaptureFile", "Chip*");
 
     rc = pHlp->pfnCFGMQueryBoolDef(pCfg, "OPL3", &pThis->fOPL3, true);
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"OPL3\" from the config"));
 
-    rc = pHlp->pfnCFGMQueryPortDef(pCfg, "Port", &pThis->uPort, ADLIB_DEFAULT_IO_BASE);
+    // The first chip is configured at the top level, any others in Chip1, Chip2... nodes.
+    rc = adlibR3QueryChipConfig(pDevIns, pCfg, &pThis->aChips[0], 0);
     if (RT_FAILURE(rc))
-        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"Port\" from the config"));
+        return rc;
+    pThis->cChips = 1;
+
+    for (unsigned i = 1; i < ADLIB_MAX_CHIPS; i++) {
+        char szNode[16];
+        RTStrPrintf(szNode, sizeof(szNode), "Chip%u", i);
+        PCFGMNODE pChipCfg = pHlp->pfnCFGMGetChild(pCfg, szNode);
+        if (!pChipCfg) {
+            break;
+        }
+
+        rc = pHlp->pfnCFGMValidateConfig(pChipCfg, "/", "Port|MirrorPort|Pan", "", pDevIns->pReg->szName, iInstance);
+        if (RT_FAILURE(rc))
+            return rc;
 
-    rc = pHlp->pfnCFGMQueryPortDef(pCfg, "MirrorPort", &pThis->uMirrorPort, 0);
+        rc = adlibR3QueryChipConfig(pDevIns, pChipCfg, &pThis->aChips[i], i);
+        if (RT_FAILURE(rc))
+            return rc;
+        pThis->cChips++;
+    }
+
+    rc = pHlp->pfnCFGMQueryS8Def(pCfg, "IRQ", &pThis->uIrq, ADLIB_DEFAULT_IRQ);
     if (RT_FAILURE(rc))
-        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"MirrorPort\" from the config"));
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"IRQ\" from the config"));
 
-    rc = pHlp->pfnCFGMQueryStringAllocDef(pCfg, "OutDevice", &pThis->pszOutDevice, ADLIB_DEFAULT_OUT_DEVICE);
+    rc = pHlp->pfnCFGMQueryStringAllocDef(pCfg, "OutDevice", &pThisCC->pszOutDevice, ADLIB_DEFAULT_OUT_DEVICE);
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"OutDevice\" from the config"));
 
@@ -613,18 +1884,81 @@ static DECLCALLBACK(int) adlibR3Construct(PPDMDEVINS pDevIns, int iInstance, PCF
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"SampleRate\" from the config"));
 
-    // Prepare the render thread, but not create it yet.
-    pThis->fShutdown = false;
-    pThis->fStopped = false;
-    pThis->hRenderThread = NIL_RTTHREAD;
-    pThis->tmLastWrite = 0;
+    char szCore[16];
+    rc = pHlp->pfnCFGMQueryStringDef(pCfg, "Core", szCore, sizeof(szCore), ADLIB_DEFAULT_CORE);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"Core\" from the config"));
+
+    pThisCC->pCore = adlibFindCore(szCore);
+    if (!pThisCC->pCore)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Invalid \"Core\" value \"%s\", must be \"nuked\" or \"fast\""), szCore);
+
+    rc = pHlp->pfnCFGMQueryBoolDef(pCfg, "RegisterFilter", &pThis->fRegisterFilter, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"RegisterFilter\" from the config"));
+
+    rc = pHlp->pfnCFGMQueryBoolDef(pCfg, "RenderAhead", &pThis->fRenderAhead, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"RenderAhead\" from the config"));
+
+    char *pszCaptureFile = NULL;
+    rc = pHlp->pfnCFGMQueryStringAllocDef(pCfg, "CaptureFile", &pszCaptureFile, NULL);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"CaptureFile\" from the config"));
+
+    if (pszCaptureFile && *pszCaptureFile) {
+        // DOSBox captures by extension, anything else is VGM.
+        const char *pszSuffix = RTPathSuffix(pszCaptureFile);
+        OPLCapture::Format enmFormat = pszSuffix && RTStrICmp(pszSuffix, ".dro") == 0 ? OPLCapture::FORMAT_DRO
+                                                                                       : OPLCapture::FORMAT_VGM;
+        rc = pThisCC->capture.open(pszCaptureFile, enmFormat, pThis->fOPL3, pThis->cChips, PDMDevHlpTMTimeVirtGetFreq(pDevIns));
+        if (RT_FAILURE(rc)) {
+            rc = PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS, N_("Failed to open capture file \"%s\""), pszCaptureFile);
+            PDMDevHlpMMHeapFree(pDevIns, pszCaptureFile);
+            return rc;
+        }
+        LogRel(("adlib#%i: Capturing register writes to %s\n", iInstance, pszCaptureFile));
+    }
+    if (pszCaptureFile) {
+        PDMDevHlpMMHeapFree(pDevIns, pszCaptureFile);
+    }
+
+    pThisCC->hRenderThread = NIL_RTTHREAD;
+    pThisCC->hEvtRender = NIL_RTSEMEVENT;
     rc = PDMDevHlpCritSectInit(pDevIns, &pThis->critSect, RT_SRC_POS, "adlib#%d", iInstance);
     AssertRCReturn(rc, rc);
 
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        rc = RTCircBufCreate(&pThisCC->aChips[i].pEventQueue, ADLIB_EVENT_QUEUE_SIZE * sizeof(ADLIBEVENT));
+        AssertRCReturn(rc, rc);
+    }
+
     // Initialize now the buffer that will be used by the render thread.
     size_t renderBlockSize = adlibCalculateBytesFromFrames(pThis, adlibCalculateFramesFromMilli(pThis, ADLIB_RENDER_BLOCK_TIME));
-    pThis->pbRenderBuf = (uint8_t *) PDMDevHlpMMHeapAlloc(pDevIns, renderBlockSize);
-    AssertReturn(pThis->pbRenderBuf, VERR_NO_MEMORY);
+    pThisCC->pbRenderBuf = (uint8_t *) PDMDevHlpMMHeapAlloc(pDevIns, renderBlockSize);
+    AssertReturn(pThisCC->pbRenderBuf, VERR_NO_MEMORY);
+
+    // Create the OPL timers; they run under the device lock, like the port handlers which program them.
+    static const char * const s_apszTimerNames[ADLIB_MAX_CHIPS][2] =
+    {
+        { "Adlib Timer 1",        "Adlib Timer 2" },
+        { "Adlib Chip 1 Timer 1", "Adlib Chip 1 Timer 2" },
+        { "Adlib Chip 2 Timer 1", "Adlib Chip 2 Timer 2" },
+        { "Adlib Chip 3 Timer 1", "Adlib Chip 3 Timer 2" },
+    };
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        PADLIBCHIP pChip = &pThis->aChips[i];
+        rc = PDMDevHlpTimerCreate(pDevIns, TMCLOCK_VIRTUAL, adlibR3TimerExpired, (void *)(uintptr_t)(i << 8 | OPL_STATUS_TIMER1),
+                                  TMTIMER_FLAGS_DEFAULT_CRIT_SECT | TMTIMER_FLAGS_NO_RING0, s_apszTimerNames[i][0],
+                                  &pChip->hTimer1);
+        AssertRCReturn(rc, rc);
+        rc = PDMDevHlpTimerCreate(pDevIns, TMCLOCK_VIRTUAL, adlibR3TimerExpired, (void *)(uintptr_t)(i << 8 | OPL_STATUS_TIMER2),
+                                  TMTIMER_FLAGS_DEFAULT_CRIT_SECT | TMTIMER_FLAGS_NO_RING0, s_apszTimerNames[i][1],
+                                  &pChip->hTimer2);
+        AssertRCReturn(rc, rc);
+        pChip->timerStatus = 0;
+    }
 
     // Initialize the device state.
     adlibR3Reset(pDevIns);
@@ -639,25 +1973,59 @@ static DECLCALLBACK(int) adlibR3Construct(PPDMDEVINS pDevIns, int iInstance, PCF
         { NULL }
     };
     const unsigned int numPorts = pThis->fOPL3 ? OPL3_NUM_IO_PORTS : OPL2_NUM_IO_PORTS;
-    rc = PDMDevHlpIoPortCreateAndMap(pDevIns, pThis->uPort, numPorts, adlibIoPortWrite, adlibIoPortRead,
-                                     "Adlib", s_aDescs, &pThis->hIoPorts);
-    AssertRCReturn(rc, rc);
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        PADLIBCHIP pChip = &pThis->aChips[i];
 
-    if (pThis->uMirrorPort) {
-        rc = PDMDevHlpIoPortCreateAndMap(pDevIns, pThis->uMirrorPort, numPorts, adlibIoPortWrite, adlibIoPortRead,
-                                         "AdlibMirror", s_aDescs, &pThis->hMirrorPorts);
+        // The handlers get the chip index as pvUser.
+        rc = PDMDevHlpIoPortCreateExAndMap(pDevIns, pChip->uPort, numPorts, 0 /*fFlags*/, adlibIoPortWrite, adlibIoPortRead,
+                                           NULL, NULL, (void *)(uintptr_t)i, "Adlib", s_aDescs, &pChip->hIoPorts);
         AssertRCReturn(rc, rc);
-    } else {
-        pThis->hMirrorPorts = 0;
+
+        if (pChip->uMirrorPort) {
+            rc = PDMDevHlpIoPortCreateExAndMap(pDevIns, pChip->uMirrorPort, numPorts, 0 /*fFlags*/, adlibIoPortWrite,
+                                               adlibIoPortRead, NULL, NULL, (void *)(uintptr_t)i, "AdlibMirror", s_aDescs,
+                                               &pChip->hMirrorPorts);
+            AssertRCReturn(rc, rc);
+        } else {
+            pChip->hMirrorPorts = NIL_IOMIOPORTHANDLE;
+        }
     }
 
+    PDMDevHlpSTAMRegister(pDevIns, &pThis->StatRegWritesFiltered, STAMTYPE_COUNTER, "RegWritesFiltered",
+                          STAMUNIT_OCCURENCES, "Register writes dropped as they would not change the chip state");
+    PDMDevHlpSTAMRegister(pDevIns, &pThis->StatEventQueueFull, STAMTYPE_COUNTER, "EventQueueFull",
+                          STAMUNIT_OCCURENCES, "Register writes applied immediately as the render thread was behind");
+    PDMDevHlpSTAMRegister(pDevIns, &pThis->StatRenderRollbacks, STAMTYPE_COUNTER, "RenderRollbacks",
+                          STAMUNIT_OCCURENCES, "Times already written audio was rendered again to apply a register write");
+    PDMDevHlpSTAMRegister(pDevIns, &pThis->StatRenderLateWrites, STAMTYPE_COUNTER, "RenderLateWrites",
+                          STAMUNIT_OCCURENCES, "Register writes which arrived after their time was already played");
+    PDMDevHlpSTAMRegister(pDevIns, &pThis->StatPcmUnderruns, STAMTYPE_COUNTER, "PcmUnderruns",
+                          STAMUNIT_OCCURENCES, "PCM output underruns");
+    PDMDevHlpSTAMRegister(pDevIns, &pThis->StatPcmRecoveryTime, STAMTYPE_COUNTER, "PcmRecoveryTime",
+                          STAMUNIT_NS, "Time from PCM output underruns until back at the target latency");
+
     // Register saved state.
     rc = PDMDevHlpSSMRegister(pDevIns, ADLIB_SAVED_STATE_VERSION, sizeof(*pThis), adlibR3SaveExec, adlibR3LoadExec);
     AssertRCReturn(rc, rc);
 
-    LogRel(("adlib#%i: Configured on ports 0x%x-0x%x\n", iInstance, pThis->uPort, pThis->uPort + numPorts - 1));
-    if (pThis->uMirrorPort && pThis->hMirrorPorts) {
-        LogRel(("adlib#%i: Mirrored on ports 0x%x-0x%x\n", iInstance, pThis->uMirrorPort, pThis->uMirrorPort + numPorts - 1));
+    // Start the render thread parked, so that the first register write only has to wake it up.
+    rc = adlibCreateRenderThread(pDevIns);
+    AssertRCReturn(rc, rc);
+
+    LogRel(("adlib#%i: Configured on ports 0x%x-0x%x using the %s core\n", iInstance,
+            pThis->aChips[0].uPort, pThis->aChips[0].uPort + numPorts - 1, pThisCC->pCore->pszName));
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        PADLIBCHIP pChip = &pThis->aChips[i];
+        if (i > 0) {
+            LogRel(("adlib#%i: Chip %u configured on ports 0x%x-0x%x\n", iInstance, i, pChip->uPort, pChip->uPort + numPorts - 1));
+        }
+        if (pChip->uMirrorPort && pChip->hMirrorPorts) {
+            LogRel(("adlib#%i: Chip %u mirrored on ports 0x%x-0x%x\n", iInstance, i,
+                    pChip->uMirrorPort, pChip->uMirrorPort + numPorts - 1));
+        }
+    }
+    if (pThis->uIrq >= 0) {
+        LogRel(("adlib#%i: Using IRQ %d\n", iInstance, pThis->uIrq));
     }
 
     return VINF_SUCCESS;
@@ -669,18 +2037,29 @@ static DECLCALLBACK(int) adlibR3Construct(PPDMDEVINS pDevIns, int iInstance, PCF
 static DECLCALLBACK(int) adlibR3Destruct(PPDMDEVINS pDevIns)
 {
     PADLIBSTATE     pThis   = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+    PADLIBSTATER3   pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PADLIBSTATER3);
+
+    /* Terminate the render thread, which also closes the PCM output. */
+    adlibDestroyRenderThread(pDevIns);
 
-    /* Shutdown AND terminate the render thread. */
-    adlibStopRenderThread(pDevIns, true);
+    int rc = pThisCC->capture.close();
+    AssertLogRelRC(rc);
 
-    if (pThis->pbRenderBuf) {
-        PDMDevHlpMMHeapFree(pDevIns, pThis->pbRenderBuf);
-        pThis->pbRenderBuf = NULL;
+    if (pThisCC->pbRenderBuf) {
+        PDMDevHlpMMHeapFree(pDevIns, pThisCC->pbRenderBuf);
+        pThisCC->pbRenderBuf = NULL;
     }
 
-    if (pThis->pszOutDevice) {
-        PDMDevHlpMMHeapFree(pDevIns, pThis->pszOutDevice);
-        pThis->pszOutDevice = NULL;
+    if (pThisCC->pszOutDevice) {
+        PDMDevHlpMMHeapFree(pDevIns, pThisCC->pszOutDevice);
+        pThisCC->pszOutDevice = NULL;
+    }
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aChips); i++) {
+        if (pThisCC->aChips[i].pEventQueue) {
+            RTCircBufDestroy(pThisCC->aChips[i].pEventQueue);
+            pThisCC->aChips[i].pEventQueue = NULL;
+        }
     }
 
     PDMDevHlpCritSectDelete(pDevIns, &pThis->critSect);
@@ -688,6 +2067,33 @@ static DECLCALLBACK(int) adlibR3Destruct(PPDMDEVINS pDevIns)
     return VINF_SUCCESS;
 }
 
+# else  /* !IN_RING3 */
+
+/**
+ * @callback_method_impl{PDMDEVREGR0,pfnConstruct}
+ */
+static DECLCALLBACK(int) adlibRZConstruct(PPDMDEVINS pDevIns)
+{
+    PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
+    PADLIBSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PADLIBSTATE);
+
+    for (unsigned i = 0; i < pThis->cChips; i++) {
+        PADLIBCHIP pChip = &pThis->aChips[i];
+
+        int rc = PDMDevHlpIoPortSetUpContext(pDevIns, pChip->hIoPorts, adlibIoPortWrite, adlibIoPortRead,
+                                             (void *)(uintptr_t)i);
+        AssertRCReturn(rc, rc);
+
+        if (pChip->uMirrorPort) {
+            rc = PDMDevHlpIoPortSetUpContext(pDevIns, pChip->hMirrorPorts, adlibIoPortWrite, adlibIoPortRead,
+                                             (void *)(uintptr_t)i);
+            AssertRCReturn(rc, rc);
+        }
+    }
+
+    return VINF_SUCCESS;
+}
+
 # endif /* !IN_RING3 */
 
 
@@ -699,19 +2105,27 @@ static const PDMDEVREG g_DeviceAdlib =
     /* .u32Version = */             PDM_DEVREG_VERSION,
     /* .uReserved0 = */             0,
     /* .szName = */                 "adlib",
+# ifdef VMUSIC_WITH_R0
+    /* .fFlags = */                 PDM_DEVREG_FLAGS_DEFAULT_BITS | PDM_DEVREG_FLAGS_NEW_STYLE | PDM_DEVREG_FLAGS_R0,
+# else
     /* .fFlags = */                 PDM_DEVREG_FLAGS_DEFAULT_BITS | PDM_DEVREG_FLAGS_NEW_STYLE,
+# endif
     /* .fClass = */                 PDM_DEVREG_CLASS_AUDIO,
     /* .cMaxInstances = */          1,
     /* .uSharedVersion = */         42,
     /* .cbInstanceShared = */       sizeof(ADLIBSTATE),
-    /* .cbInstanceCC = */           0,
+    /* .cbInstanceCC = */           sizeof(ADLIBSTATECC),
     /* .cbInstanceRC = */           0,
     /* .cMaxPciDevices = */         0,
     /* .cMaxMsixVectors = */        0,
     /* .pszDescription = */         "Adlib.",
 # if defined(IN_RING3)
     /* .pszRCMod = */               "",
+#  ifdef VMUSIC_WITH_R0
+    /* .pszR0Mod = */               "AdlibR0.r0",
+#  else
     /* .pszR0Mod = */               "",
+#  endif
     /* .pfnConstruct = */           adlibR3Construct,
     /* .pfnDestruct = */            adlibR3Destruct,
     /* .pfnRelocate = */            NULL,
@@ -736,7 +2150,7 @@ static const PDMDEVREG g_DeviceAdlib =
     /* .pfnReserved7 = */           NULL,
 # elif defined(IN_RING0)
     /* .pfnEarlyConstruct = */      NULL,
-    /* .pfnConstruct = */           NULL,
+    /* .pfnConstruct = */           adlibRZConstruct,
     /* .pfnDestruct = */            NULL,
     /* .pfnFinalDestruct = */       NULL,
     /* .pfnRequest = */             NULL,
@@ -781,6 +2195,34 @@ extern "C" DECLEXPORT(int) VBoxDevicesRegister(PPDMDEVREGCB pCallbacks, uint32_t
     return pCallbacks->pfnRegister(pCallbacks, &g_DeviceAdlib);
 }
 
+# elif defined(VBOX_IN_EXTPACK_R0)
+
+/** The ring-0 device registrations of this module. */
+static PCPDMDEVREGR0 g_apDevRegs[] =
+{
+    &g_DeviceAdlib,
+};
+
+/** Module device registration record. */
+static PDMDEVMODREGR0 g_ModDevReg =
+{
+    /* .u32Version = */ PDM_DEVMODREGR0_VERSION,
+    /* .cDevRegs = */   RT_ELEMENTS(g_apDevRegs),
+    /* .papDevRegs = */ &g_apDevRegs[0],
+    /* .hMod = */       NULL,
+    /* .ListEntry = */  { NULL, NULL },
+};
+
+extern "C" DECLEXPORT(int) ModuleInit(void *hMod)
+{
+    return PDMR0DeviceRegisterModule(hMod, &g_ModDevReg);
+}
+
+extern "C" DECLEXPORT(void) ModuleTerm(void *hMod)
+{
+    PDMR0DeviceDeregisterModule(hMod, &g_ModDevReg);
+}
+
 # endif  /* !VBOX_IN_EXTPACK_R3 */
 
 #endif /* !VBOX_DEVICE_STRUCT_TESTCASE */
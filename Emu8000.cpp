@@ -54,15 +54,16 @@
 #include <VBox/vmm/pdmdev.h>
 #include <VBox/AssertGuest.h>
 #include <VBox/version.h>
+#include <iprt/asm-math.h>
 #include <iprt/assert.h>
 #include <iprt/file.h>
 #include <iprt/mem.h>
+#include <iprt/string.h>
 
 #include "emu8k.h"
 
-#ifndef IN_RING3
-#error "R3-only driver"
-#endif
+#ifdef IN_RING3
+#include "pcmresampler.h"
 
 #if RT_OPSYS == RT_OPSYS_LINUX
 #include "pcmalsa.h"
@@ -71,6 +72,7 @@ typedef PCMOutAlsa PCMOutBackend;
 #include "pcmwin.h"
 typedef PCMOutWin PCMOutBackend;
 #endif
+#endif /* IN_RING3 */
 
 /*********************************************************************************************************************************
 *   Defined Constants And Macros                                                                                                 *
@@ -84,6 +86,13 @@ typedef PCMOutWin PCMOutBackend;
 
 #define EMU_DEFAULT_RAM_SIZE        (8 * _1M)
 
+/** How often the envelopes and LFOs of each voice are run; 1 runs them on every sample, like the real chip. */
+#define EMU_DEFAULT_CONTROL_RATE    32 /* in samples */
+#define EMU_MAX_CONTROL_RATE        256 /* in samples */
+
+#define EMU_DEFAULT_INTERPOLATION   "cubic"
+#define EMU_DEFAULT_FILTER          "moog"
+
 enum {
     EMU_PORT_DATA0    = 0,
     EMU_PORT_DATA0_LO = EMU_PORT_DATA0,
@@ -102,11 +111,17 @@ enum {
 /** Maximum number of sound samples render in one batch by render thread. */
 #define EMU_RENDER_BLOCK_TIME       5 /* in millisec */
 
-/** The render thread will shutdown if this time passes since the last OPL register write. */
+/** How far rendering may drift from the virtual clock before resyncing, rather than resampling. */
+#define EMU_RENDER_MAX_DRIFT        20 /* in millisec */
+
+/** How long the resampler takes to absorb a difference between the virtual and host audio clocks. */
+#define EMU_RENDER_SETTLE_TIME      10000 /* in millisec */
+
+/** The render thread will park if this time passes since the last port write. */
 #define EMU_RENDER_SUSPEND_TIMEOUT  5000 /* in millisec */
 
-/** Device configuration & state. */
-typedef struct {
+/** Device configuration & state, shared between ring-0 and ring-3. */
+typedef struct EMUSTATE {
     /* Device configuration. */
     /** Base port. */
     RTIOPORT               uPort;
@@ -114,43 +129,85 @@ typedef struct {
     uint16_t               uSampleRate;
     /** Size of onboard RAM. */
     uint32_t               uRAMSize;
+    /** Samples between runs of the envelopes and LFOs. */
+    uint16_t               cControlRate;
+
+    /* Runtime state. */
+    /** The pointer register (voice and register index), latched here so it can be accessed in any context.
+     *  Ring-3 loads it into the emulator before every other register access. */
+    uint8_t                bPointer;
+    /** Changing upper bits of the pointer register as read back, which detection code checks for. */
+    uint8_t                bPointerReads;
+
+    /** To protect access to emu8k_t from the render thread and main thread. */
+    PDMCRITSECT            critSect;
+
+    IOMIOPORTHANDLE        hIoPorts[3];
+
+    /** Number of PCM output underruns. */
+    STAMCOUNTER            StatPcmUnderruns;
+    /** Time from PCM output underruns until the output was back at its target latency, in nanoseconds. */
+    STAMCOUNTER            StatPcmRecoveryTime;
+} EMUSTATE;
+typedef EMUSTATE *PEMUSTATE;
+
+#ifdef IN_RING3
+/** Device state for ring-3. */
+typedef struct EMUSTATER3 {
+    /* Device configuration. */
     /** Path to find ROM file. */
-    R3PTRTYPE(char *)      pszROMFile;
+    char                  *pszROMFile;
     /** Device for PCM output. */
-    R3PTRTYPE(char *)      pszOutDevice;
+    char                  *pszOutDevice;
 
     /* Runtime state. */
     /** Audio output device */
     PCMOutBackend          pcmOut;
     /** Thread that connects to PCM out, renders and pushes audio data. */
     RTTHREAD               hRenderThread;
+    /** Event the render thread parks on while the device is idle. */
+    RTSEMEVENT             hEvtRender;
     /** Buffer for the rendering thread to use, size defined by EMU_RENDER_BLOCK_TIME. */
-    R3PTRTYPE(uint8_t *)   pbRenderBuf;
-    /** Flag to signal render thread to shut down. */
+    uint8_t               *pbRenderBuf;
+    /** Flag to signal render thread to terminate. */
     bool volatile          fShutdown;
-    /** Flag from render thread indicated it has shutdown (e.g. due to error or timeout). */
+    /** Flag to ask the render thread to park now, e.g. when the VM is suspended. */
+    bool volatile          fIdle;
+    /** Whether the render thread is parked (or about to), and needs hEvtRender to be signalled to render. */
     bool volatile          fStopped;
     /** (System clock) timestamp of last port write. */
     uint64_t               tmLastWrite;
+    /** PCM device underruns, as last reported by the render thread. */
+    uint32_t               cXruns;
 
-    /** (Virtual clock) timestamp of last frame rendered. */
+    /** (Virtual clock) timestamp of the end of the last frame rendered; rendering is locked to the virtual clock. */
     uint64_t               tmLastRender;
 
-    /** To protect access to emu8k_t from the render thread and main thread. */
-    PDMCRITSECT            critSect;
     /** Handle to emu8k. */
-    R3PTRTYPE(emu8k_t*)    emu;
+    emu8k_t               *emu;
     /** Onboard RAM. */
-    R3PTRTYPE(void*)       ram;
+    void                  *ram;
     /** Contents of ROM file. */
-    R3PTRTYPE(void*)       rom;
+    void                  *rom;
+} EMUSTATER3;
+typedef EMUSTATER3 *PEMUSTATER3;
+#else
+/** Device state for ring-0, which only needs the shared state. */
+typedef struct EMUSTATER0 {
+    uint8_t                bDummy;
+} EMUSTATER0;
+typedef EMUSTATER0 *PEMUSTATER0;
+#endif
 
-    IOMIOPORTHANDLE        hIoPorts[3];
-} EMUSTATE;
-typedef EMUSTATE *PEMUSTATE;
+/** The device state for the current context. */
+typedef CTX_SUFF(EMUSTATE) EMUSTATECC;
+/** Pointer to the device state for the current context. */
+typedef CTX_SUFF(PEMUSTATE) PEMUSTATECC;
 
 #ifndef VBOX_DEVICE_STRUCT_TESTCASE
 
+# ifdef IN_RING3
+
 DECLINLINE(uint64_t) emuCalculateFramesFromMilli(PEMUSTATE pThis, uint64_t milli)
 {
     uint64_t rate = pThis->uSampleRate;
@@ -159,8 +216,12 @@ DECLINLINE(uint64_t) emuCalculateFramesFromMilli(PEMUSTATE pThis, uint64_t milli
 
 DECLINLINE(uint64_t) emuCalculateFramesFromNano(PEMUSTATE pThis, uint64_t nano)
 {
-    uint64_t rate = pThis->uSampleRate;
-    return (rate * nano) / 1000000000;
+    return ASMMultU64ByU32DivByU32(nano, pThis->uSampleRate, RT_NS_1SEC);
+}
+
+DECLINLINE(uint64_t) emuCalculateNanoFromFrames(PEMUSTATE pThis, uint64_t frames)
+{
+    return ASMMultU64ByU32DivByU32(frames, RT_NS_1SEC, pThis->uSampleRate);
 }
 
 DECLINLINE(size_t) emuCalculateBytesFromFrames(PEMUSTATE pThis, uint64_t frames)
@@ -169,12 +230,124 @@ DECLINLINE(size_t) emuCalculateBytesFromFrames(PEMUSTATE pThis, uint64_t frames)
     return frames * sizeof(uint16_t) * EMU_NUM_CHANNELS;
 }
 
+/**
+ * Reports the PCM output underruns since the last call, and once the output is realigned
+ * after them, how long that took: until the frames queued are back at the target latency,
+ * or the render position has been resynced to the virtual clock (fResynced).
+ */
+static void emuRenderCheckXruns(PPDMDEVINS pDevIns, PEMUSTATE pThis, PEMUSTATER3 pThisCC, bool fResynced)
+{
+    const uint32_t cXruns = pThisCC->pcmOut.xruns();
+    const bool fNewXruns = cXruns != pThisCC->cXruns;
+    if (fNewXruns) {
+        STAM_REL_COUNTER_ADD(&pThis->StatPcmUnderruns, cXruns - pThisCC->cXruns);
+        pThisCC->cXruns = cXruns;
+    }
+
+    // A block resynced before the write that underran does not realign the output
+    if (!pThisCC->pcmOut.xrunTime() || fNewXruns || (!fResynced && !pThisCC->pcmOut.atTargetLatency())) {
+        return;
+    }
+
+    const uint64_t cNsRecovery = pThisCC->pcmOut.realigned();
+    STAM_REL_COUNTER_ADD(&pThis->StatPcmRecoveryTime, cNsRecovery);
+    LogRelMax(10, ("emu%d: PCM output underrun, back to target latency in %RU64 ms\n", pDevIns->iInstance,
+                   cNsRecovery / RT_NS_1MS));
+}
+
+/**
+ * Renders blocks and pushes them to the started PCM output device, until asked to shutdown
+ * or idle, or EMU_RENDER_SUSPEND_TIMEOUT passes since the last port write.
+ *
+ * The emulator renders exactly as many frames as virtual time passes, so that its timeline
+ * matches the guest's one, and each block ends about when it is rendered. The PCM output
+ * runs on the host audio clock instead, so the frames are resampled to it, adapting the ratio
+ * to keep the rendered position from drifting. Larger jumps of the virtual clock (e.g. when
+ * the VM is starved of CPU time) are resynced to rather than resampled.
+ */
+static int emuRenderUntilIdle(PPDMDEVINS pDevIns, PEMUSTATE pThis, PEMUSTATER3 pThisCC, PCMResampler *pResampler)
+{
+    PCMOutBackend *pPcmOut = &pThisCC->pcmOut;
+    int16_t *buf = (int16_t*) pThisCC->pbRenderBuf;
+    uint64_t buf_frames = emuCalculateFramesFromMilli(pThis, EMU_RENDER_BLOCK_TIME);
+    const int64_t max_drift = emuCalculateFramesFromMilli(pThis, EMU_RENDER_MAX_DRIFT);
+
+    // Frames rendered since tmBase
+    uint64_t tmBase = 0;
+    uint64_t frames = 0;
+    bool fSynced = false;
+
+    while (!ASMAtomicReadBool(&pThisCC->fShutdown) && !ASMAtomicReadBool(&pThisCC->fIdle)
+           && ASMAtomicReadU64(&pThisCC->tmLastWrite) + EMU_RENDER_SUSPEND_TIMEOUT >= RTTimeSystemMilliTS()) {
+        int rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
+        PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
+
+        // How many frames rendering is behind the virtual clock, if this block is to end now
+        const uint64_t tmNow = PDMDevHlpTMTimeVirtGetNano(pDevIns);
+        int64_t error = fSynced ? (int64_t)emuCalculateFramesFromNano(pThis, tmNow - tmBase) - (int64_t)(frames + buf_frames) : 0;
+        const bool fResync = fSynced && (error > max_drift || error < -max_drift);
+        if (!fSynced || fResync) {
+            if (fResync) {
+                Log9(("resyncing render position by %lld frames\n", error));
+            }
+            tmBase = tmNow - RT_MIN(tmNow, emuCalculateNanoFromFrames(pThis, buf_frames));
+            frames = 0;
+            error = 0;
+            fSynced = true;
+            pResampler->reset();
+        }
+
+        pResampler->adapt(error, buf_frames);
+        const size_t in_frames = pResampler->inputFrames(buf_frames);
+
+        Log9(("rendering %zu frames\n", in_frames));
+
+        emu8k_render(pThisCC->emu, pResampler->inputBuffer(), in_frames);
+        frames += in_frames;
+        pThisCC->tmLastRender = tmBase + emuCalculateNanoFromFrames(pThis, frames);
+        PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
+
+        pResampler->process(in_frames, buf, buf_frames);
+
+        Log9(("writing %lld frames\n", buf_frames));
+
+        ssize_t written_frames = pPcmOut->write(buf, buf_frames);
+        if (written_frames < 0) {
+            AssertLogRelMsgFailedReturn(("emu: render thread write err=%Rrc\n", written_frames), written_frames);
+        }
+        emuRenderCheckXruns(pDevIns, pThis, pThisCC, fResync);
+
+        RTThreadYield();
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Goes idle after a period of rendering, unless asked to idle now by pfnSuspend.
+ * A port write made meanwhile may have seen us still running and not woken us;
+ * if so, and nobody has claimed the wake up since, keep going instead.
+ *
+ * @returns true if the thread should park, false to keep rendering.
+ */
+static bool emuRenderThreadGoIdle(PEMUSTATER3 pThisCC)
+{
+    const bool fIdleNow = ASMAtomicXchgBool(&pThisCC->fIdle, false);
+    ASMAtomicWriteBool(&pThisCC->fStopped, true);
+    return fIdleNow
+        || ASMAtomicReadU64(&pThisCC->tmLastWrite) + EMU_RENDER_SUSPEND_TIMEOUT < RTTimeSystemMilliTS()
+        || !ASMAtomicCmpXchgBool(&pThisCC->fStopped, false, true);
+}
+
 /**
  * The render thread calls into the emulator to render audio frames, and then pushes them
  * on the PCM output device.
  * We rely on the PCM output device's blocking writes behavior to avoid running continously.
  * A small block size (EMU_RENDER_BLOCK_TIME) is also used to give the main thread some
  * opportunities to run.
+ * The thread is created along with the device and lives as long as it does. While the
+ * device is idle it keeps the PCM output open but stopped, and parks on hEvtRender until
+ * the next port write.
  *
  * @callback_method_impl{FNRTTHREAD}
  */
@@ -183,119 +356,152 @@ static DECLCALLBACK(int) emuRenderThread(RTTHREAD ThreadSelf, void *pvUser)
     RT_NOREF(ThreadSelf);
     PPDMDEVINS pDevIns = (PPDMDEVINS)pvUser;
     PEMUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
-    PCMOutBackend *pPcmOut = &pThis->pcmOut;
-
-    // Compute the max number of frames we can store on our temporary buffer.
-    int16_t *buf = (int16_t*) pThis->pbRenderBuf;
-    uint64_t buf_frames = emuCalculateFramesFromMilli(pThis, EMU_RENDER_BLOCK_TIME);
+    PEMUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
+    PCMOutBackend *pPcmOut = &pThisCC->pcmOut;
+    const uint64_t buf_frames = emuCalculateFramesFromMilli(pThis, EMU_RENDER_BLOCK_TIME);
 
     Log(("emu: Starting render thread with buf_frames=%lld\n", buf_frames));
 
-    int rc = pPcmOut->open(pThis->pszOutDevice, pThis->uSampleRate, EMU_NUM_CHANNELS);
+    PCMResampler resampler;
+    int rc = resampler.init(EMU_NUM_CHANNELS, buf_frames, emuCalculateFramesFromMilli(pThis, EMU_RENDER_SETTLE_TIME));
     AssertLogRelRCReturn(rc, rc);
 
-    while (!ASMAtomicReadBool(&pThis->fShutdown)
-           && ASMAtomicReadU64(&pThis->tmLastWrite) + EMU_RENDER_SUSPEND_TIMEOUT >= RTTimeSystemMilliTS()) {
-        Log9(("rendering %lld frames\n", buf_frames));
-
-        rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
-        PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
-        emu8k_render(pThis->emu, buf, buf_frames);
-        pThis->tmLastRender = PDMDevHlpTMTimeVirtGetNano(pDevIns);
-        PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
-
-        Log9(("writing %lld frames\n", buf_frames));
+    bool fOpen = false;
 
-        ssize_t written_frames = pPcmOut->write(buf, buf_frames);
-        if (written_frames < 0) {
-            rc = written_frames;
-            AssertLogRelMsgFailedBreak(("emu: render thread write err=%Rrc\n", written_frames));
+    while (!ASMAtomicReadBool(&pThisCC->fShutdown)) {
+        // Park until a port write claims the wake up
+        rc = RTSemEventWait(pThisCC->hEvtRender, RT_INDEFINITE_WAIT);
+        if (rc == VERR_INTERRUPTED) {
+            continue;
+        }
+        AssertLogRelRCBreak(rc);
+        ASMAtomicWriteBool(&pThisCC->fIdle, false);
+
+        bool fPark = false;
+        while (!fPark && !ASMAtomicReadBool(&pThisCC->fShutdown)) {
+            // The PCM output is opened once and kept open; only reopened after an error.
+            if (!fOpen) {
+                rc = pPcmOut->open(pThisCC->pszOutDevice, pThis->uSampleRate, EMU_NUM_CHANNELS);
+                fOpen = RT_SUCCESS(rc);
+            }
+            if (fOpen) {
+                rc = pPcmOut->start();
+            }
+            if (RT_FAILURE(rc)) {
+                // Retried on the next wake up, as it will likely fail again now
+                LogRelMax(10, ("emu%d: cannot start PCM output (%Rrc)\n", pDevIns->iInstance, rc));
+                ASMAtomicWriteBool(&pThisCC->fStopped, true);
+                fPark = true;
+                continue;
+            }
+
+            rc = emuRenderUntilIdle(pDevIns, pThis, pThisCC, &resampler);
+
+            // Plays whatever is still buffered, but keeps the device open for the next wake up
+            int rcStop = RT_SUCCESS(rc) ? pPcmOut->stop() : rc;
+            if (RT_FAILURE(rcStop)) {
+                pPcmOut->close();
+                fOpen = false;
+            }
+
+            fPark = emuRenderThreadGoIdle(pThisCC);
         }
-
-        RTThreadYield();
     }
 
-    int rcClose = pPcmOut->close();
-    AssertLogRelRC(rcClose);
-    if (RT_SUCCESS(rc)) rc = rcClose;
+    if (fOpen) {
+        int rcClose = pPcmOut->close();
+        AssertLogRelRC(rcClose);
+    }
 
     Log(("emu: Stopping render thread with rc=%Rrc\n", rc));
 
-    ASMAtomicWriteBool(&pThis->fStopped, true);
+    return VINF_SUCCESS;
+}
+
+/** Creates the render thread, initially parked. */
+static int emuCreateRenderThread(PPDMDEVINS pDevIns)
+{
+    PEMUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
+
+    pThisCC->fShutdown = false;
+    pThisCC->fIdle = false;
+    pThisCC->fStopped = true;
+
+    int rc = RTSemEventCreate(&pThisCC->hEvtRender);
+    AssertRCReturn(rc, rc);
+
+    Log3(("Creating render thread\n"));
+
+    rc = RTThreadCreateF(&pThisCC->hRenderThread, emuRenderThread, pDevIns, 0,
+                         RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE,
+                         "emu%u_render", pDevIns->iInstance);
+    AssertRCReturn(rc, rc);
 
     return VINF_SUCCESS;
 }
 
-/** Waits for the render thread to finish and reaps it. */
-static int emuReapRenderThread(PPDMDEVINS pDevIns, RTMSINTERVAL millies = 100)
+/** Terminates the render thread and waits for it. */
+static int emuDestroyRenderThread(PPDMDEVINS pDevIns)
 {
-    PEMUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
+    PEMUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
+
+    if (pThisCC->hRenderThread != NIL_RTTHREAD) {
+        ASMAtomicWriteBool(&pThisCC->fShutdown, true);
+        RTSemEventSignal(pThisCC->hEvtRender);
 
-    if (pThis->hRenderThread != NIL_RTTHREAD) {
-        int rc = RTThreadWait(pThis->hRenderThread, millies, NULL);
+        int rc = RTThreadWait(pThisCC->hRenderThread, 30000, NULL);
         if (RT_SUCCESS(rc)) {
-            pThis->hRenderThread = NIL_RTTHREAD;
+            pThisCC->hRenderThread = NIL_RTTHREAD;
         } else {
             LogWarn(("emu%d: render thread did not terminate (%Rrc)\n", pDevIns->iInstance, rc));
             AssertRCReturn(rc, rc);
         }
     }
 
+    if (pThisCC->hEvtRender != NIL_RTSEMEVENT) {
+        RTSemEventDestroy(pThisCC->hEvtRender);
+        pThisCC->hEvtRender = NIL_RTSEMEVENT;
+    }
+
     return VINF_SUCCESS;
 }
 
-/** Raises signal for render thread to stop; potentially waits for it. */
-static int emuStopRenderThread(PPDMDEVINS pDevIns, bool wait = false)
+/** Asks the render thread to stop the PCM output and park now, rather than after EMU_RENDER_SUSPEND_TIMEOUT. */
+static void emuIdleRenderThread(PPDMDEVINS pDevIns)
 {
-    PEMUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
-
-    if (pThis->hRenderThread == NIL_RTTHREAD) {
-        // Already stopped & reaped
-        return VINF_SUCCESS;
-    }
-
-    // Raise the flag for the thread
-    ASMAtomicWriteBool(&pThis->fShutdown, true);
+    PEMUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
 
-    if (wait) {
-        int rc = emuReapRenderThread(pDevIns, 30000);
-        AssertRCReturn(rc, rc);
+    if (!ASMAtomicReadBool(&pThisCC->fStopped)) {
+        ASMAtomicWriteBool(&pThisCC->fIdle, true);
     }
-
-    return VINF_SUCCESS;
 }
 
 static void emuWakeRenderThread(PPDMDEVINS pDevIns)
 {
-    PEMUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
+    PEMUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
 
-    ASMAtomicWriteU64(&pThis->tmLastWrite, RTTimeSystemMilliTS());
+    ASMAtomicWriteU64(&pThisCC->tmLastWrite, RTTimeSystemMilliTS());
 
-    // Reap any existing render thread if it had stopped
-    if (ASMAtomicReadBool(&pThis->fStopped)) {
-        int rc = emuReapRenderThread(pDevIns);
-        AssertLogRelRCReturnVoid(rc);
-    } else if (ASMAtomicReadBool(&pThis->fShutdown)
-               && pThis->hRenderThread != NIL_RTTHREAD) {
-        AssertLogRelMsgFailedReturnVoid(("can't wake render thread -- it's shutting down!\n"));
+    // Unpark the render thread if it was parked, claiming its wake up
+    if (ASMAtomicCmpXchgBool(&pThisCC->fStopped, false, true)) {
+        Log3(("Waking render thread\n"));
+        int rc = RTSemEventSignal(pThisCC->hEvtRender);
+        AssertLogRelRC(rc);
     }
+}
 
-    // If there is no existing render thread, start a new one
-    if (pThis->hRenderThread == NIL_RTTHREAD) {
-        pThis->fShutdown = false;
-        pThis->fStopped = false;
-
-        Log3(("Creating render thread\n"));
+# endif /* IN_RING3 */
 
-        int rc = RTThreadCreateF(&pThis->hRenderThread, emuRenderThread, pDevIns, 0,
-                                 RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE,
-                                 "emu%u_render", pDevIns->iInstance);
-        AssertLogRelRCReturnVoid(rc);
-    }
+/** Whether the guest is accessing the pointer register by itself, which needs nothing but the shared state. */
+DECLINLINE(bool) emuIsPointerAccess(PEMUSTATE pThis, RTIOPORT port, unsigned cb)
+{
+    return port == pThis->uPort + EMU_PORT_POINTER && cb == sizeof(uint16_t);
 }
 
 /**
  * @callback_method_impl{FNIOMIOPORTNEWIN}
+ *
+ * Pointer register reads are served in any context; everything else needs the emulator, so goes to ring-3.
  */
 static DECLCALLBACK(VBOXSTRICTRC) emuIoPortRead(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT port, uint32_t *pu32, unsigned cb)
 {
@@ -303,20 +509,41 @@ static DECLCALLBACK(VBOXSTRICTRC) emuIoPortRead(PPDMDEVINS pDevIns, void *pvUser
 
     PEMUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
 
+    if (emuIsPointerAccess(pThis, port, cb)) {
+        // Like emu8k_inw: the LS byte reads back as written, but the MS byte keeps changing,
+        // which is what Impulse tracker and cubic player check for to detect a real AWE32.
+        pThis->bPointerReads = (pThis->bPointerReads + 1) & 0x1F;
+        *pu32 = ((0x80 | pThis->bPointerReads) << 8) | pThis->bPointer;
+
+        Log9Func(("read port 0x%X (%u): %#04x\n", port, cb, *pu32));
+
+        return VINF_SUCCESS;
+    }
+
+#ifndef IN_RING3
+    RT_NOREF(pu32);
+    return VINF_IOM_R3_IOPORT_READ;
+#else
+    PEMUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
+
     int rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
     PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
-    uint64_t frames_since_last_render = emuCalculateFramesFromNano(pThis, PDMDevHlpTMTimeVirtGetNano(pDevIns) - pThis->tmLastRender);
-    emu8k_update_virtual_sample_count(pThis->emu, frames_since_last_render);
+    // Rendering may be slightly ahead of the virtual clock, see emuRenderUntilIdle
+    const uint64_t tmNow = PDMDevHlpTMTimeVirtGetNano(pDevIns);
+    uint64_t frames_since_last_render = tmNow > pThisCC->tmLastRender
+                                      ? emuCalculateFramesFromNano(pThis, tmNow - pThisCC->tmLastRender) : 0;
+    emu8k_update_virtual_sample_count(pThisCC->emu, frames_since_last_render);
+    emu8k_set_pointer(pThisCC->emu, pThis->bPointer);
 
     switch (cb) {
         case sizeof(uint8_t):
-            *pu32 = emu8k_inb(pThis->emu, port);
+            *pu32 = emu8k_inb(pThisCC->emu, port);
             break;
         case sizeof(uint16_t):
-            *pu32 = emu8k_inw(pThis->emu, port);
+            *pu32 = emu8k_inw(pThisCC->emu, port);
             break;
         case sizeof(uint32_t):
-            *pu32 = RT_MAKE_U32(emu8k_inw(pThis->emu, port), emu8k_inw(pThis->emu, port + sizeof(uint16_t)));
+            *pu32 = RT_MAKE_U32(emu8k_inw(pThisCC->emu, port), emu8k_inw(pThisCC->emu, port + sizeof(uint16_t)));
             break;
         default:
             ASSERT_GUEST_MSG_FAILED(("port=0x%x cb=%u\n", port, cb));
@@ -329,10 +556,13 @@ static DECLCALLBACK(VBOXSTRICTRC) emuIoPortRead(PPDMDEVINS pDevIns, void *pvUser
     Log9Func(("read port 0x%X (%u): %#04x\n", port, cb, *pu32));
 
     return VINF_SUCCESS;
+#endif
 }
 
 /**
  * @callback_method_impl{FNIOMIOPORTNEWOUT}
+ *
+ * Pointer register writes are only latched, in any context; everything else needs the emulator, so goes to ring-3.
  */
 static DECLCALLBACK(VBOXSTRICTRC) emuIoPortWrite(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT port, uint32_t u32, unsigned cb)
 {
@@ -342,29 +572,46 @@ static DECLCALLBACK(VBOXSTRICTRC) emuIoPortWrite(PPDMDEVINS pDevIns, void *pvUse
 
     PEMUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
 
+    if (emuIsPointerAccess(pThis, port, cb)) {
+        // The MS byte is the read-only test register.
+        pThis->bPointer = (uint8_t)u32;
+        return VINF_SUCCESS;
+    }
+
+#ifndef IN_RING3
+    return VINF_IOM_R3_IOPORT_WRITE;
+#else
+    PEMUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
+
     int rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
     PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
+    emu8k_set_pointer(pThisCC->emu, pThis->bPointer);
 
     switch (cb) {
         case sizeof(uint8_t):
-            emu8k_outb(pThis->emu, port, u32);
+            emu8k_outb(pThisCC->emu, port, u32);
             break;
         case sizeof(uint16_t):
-            emu8k_outw(pThis->emu, port, u32);
+            emu8k_outw(pThisCC->emu, port, u32);
             break;
         case sizeof(uint32_t):
-            emu8k_outw(pThis->emu, port,                    RT_LO_U16(u32));
-            emu8k_outw(pThis->emu, port + sizeof(uint16_t), RT_HI_U16(u32));
+            emu8k_outw(pThisCC->emu, port,                    RT_LO_U16(u32));
+            emu8k_outw(pThisCC->emu, port + sizeof(uint16_t), RT_HI_U16(u32));
+            break;
         default:
             ASSERT_GUEST_MSG_FAILED(("port=0x%x cb=%u\n", port, cb));
             break;
     }
 
+    // Byte and doubleword writes may still reach the pointer register through the emulator.
+    pThis->bPointer = emu8k_get_pointer(pThisCC->emu);
+
     PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
 
     emuWakeRenderThread(pDevIns);
 
     return VINF_SUCCESS;
+#endif
 }
 
 # ifdef IN_RING3
@@ -374,13 +621,15 @@ static DECLCALLBACK(VBOXSTRICTRC) emuIoPortWrite(PPDMDEVINS pDevIns, void *pvUse
  */
 static DECLCALLBACK(int) emuR3SaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
 {
-    PEMUSTATE     pThis = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
-    PCPDMDEVHLPR3 pHlp  = pDevIns->pHlpR3;
+    PEMUSTATE     pThis   = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
+    PEMUSTATER3   pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
+    PCPDMDEVHLPR3 pHlp    = pDevIns->pHlpR3;
 
     pHlp->pfnSSMPutU32(pSSM, pThis->uRAMSize);
-    pHlp->pfnSSMPutMem(pSSM, pThis->ram, pThis->uRAMSize);
+    pHlp->pfnSSMPutMem(pSSM, pThisCC->ram, pThis->uRAMSize);
 
-    pHlp->pfnSSMPutStruct(pSSM, pThis->emu, g_emu8k_fields);
+    emu8k_set_pointer(pThisCC->emu, pThis->bPointer);
+    pHlp->pfnSSMPutStruct(pSSM, pThisCC->emu, g_emu8k_fields);
 
     return 0;
 }
@@ -390,8 +639,9 @@ static DECLCALLBACK(int) emuR3SaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
  */
 static DECLCALLBACK(int) emuR3LoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t uPass)
 {
-    PEMUSTATE     pThis = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
-    PCPDMDEVHLPR3 pHlp  = pDevIns->pHlpR3;
+    PEMUSTATE     pThis   = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
+    PEMUSTATER3   pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
+    PCPDMDEVHLPR3 pHlp    = pDevIns->pHlpR3;
 
     Assert(uPass == SSM_PASS_FINAL);
     NOREF(uPass);
@@ -400,15 +650,17 @@ static DECLCALLBACK(int) emuR3LoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint
     pHlp->pfnSSMGetU32(pSSM, &uRAMSize);
 
     if (uRAMSize == pThis->uRAMSize) {
-        pHlp->pfnSSMGetMem(pSSM, pThis->ram, uRAMSize);
+        pHlp->pfnSSMGetMem(pSSM, pThisCC->ram, uRAMSize);
     } else {
         LogWarn(("emu8000#%d: RAM size has changed, ignoring saved RAM contents\n", pDevIns->iInstance));
         pHlp->pfnSSMSkip(pSSM, uRAMSize);
     }
 
-    pHlp->pfnSSMGetStruct(pSSM, pThis->emu, g_emu8k_fields);
+    pHlp->pfnSSMGetStruct(pSSM, pThisCC->emu, g_emu8k_fields);
+    emu8k_wake_voices(pThisCC->emu);
+    pThis->bPointer = emu8k_get_pointer(pThisCC->emu);
 
-    pThis->tmLastWrite = RTTimeSystemMilliTS();
+    pThisCC->tmLastWrite = RTTimeSystemMilliTS();
 
     if (uVersion > EMU_SAVED_STATE_VERSION)
         return VERR_SSM_UNSUPPORTED_DATA_UNIT_VERSION;
@@ -425,11 +677,13 @@ static DECLCALLBACK(int) emuR3LoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint
 static DECLCALLBACK(void) emuR3Reset(PPDMDEVINS pDevIns)
 {
     PEMUSTATE   pThis   = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
+    PEMUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
     
     int rc = PDMDevHlpCritSectEnter(pDevIns, &pThis->critSect, VERR_SEM_BUSY);
     PDM_CRITSECT_RELEASE_ASSERT_RC_DEV(pDevIns, &pThis->critSect, rc);
-    emu8k_reset(pThis->emu);
-    pThis->tmLastRender = PDMDevHlpTMTimeVirtGetNano(pDevIns);
+    emu8k_reset(pThisCC->emu);
+    pThis->bPointer = emu8k_get_pointer(pThisCC->emu);
+    pThisCC->tmLastRender = PDMDevHlpTMTimeVirtGetNano(pDevIns);
     PDMDevHlpCritSectLeave(pDevIns, &pThis->critSect);
 }
 
@@ -438,7 +692,7 @@ static DECLCALLBACK(void) emuR3Reset(PPDMDEVINS pDevIns)
  */
 static DECLCALLBACK(void) emuR3Suspend(PPDMDEVINS pDevIns)
 {
-    emuStopRenderThread(pDevIns);
+    emuIdleRenderThread(pDevIns);
 }
 
 /**
@@ -446,7 +700,7 @@ static DECLCALLBACK(void) emuR3Suspend(PPDMDEVINS pDevIns)
  */
 static DECLCALLBACK(void) emuR3PowerOff(PPDMDEVINS pDevIns)
 {
-    emuStopRenderThread(pDevIns);
+    emuIdleRenderThread(pDevIns);
 }
 
 /**
@@ -455,14 +709,15 @@ static DECLCALLBACK(void) emuR3PowerOff(PPDMDEVINS pDevIns)
 static DECLCALLBACK(int) emuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGMNODE pCfg)
 {
     PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
-    PEMUSTATE     pThis   = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
+    PEMUSTATE       pThis   = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
+    PEMUSTATER3     pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
     PCPDMDEVHLPR3   pHlp    = pDevIns->pHlpR3;
     int             rc;
 
     Assert(iInstance == 0);
 
     // Validate and read the configuration
-    PDMDEV_VALIDATE_CONFIG_RETURN(pDevIns, "Port|RamSize|RomFile|OutDevice|SampleRate", "");
+    PDMDEV_VALIDATE_CONFIG_RETURN(pDevIns, "Port|RamSize|RomFile|OutDevice|SampleRate|ControlRate|Interpolation|Filter", "");
 
     rc = pHlp->pfnCFGMQueryPortDef(pCfg, "Port", &pThis->uPort, EMU_DEFAULT_IO_BASE);
     if (RT_FAILURE(rc))
@@ -472,11 +727,11 @@ static DECLCALLBACK(int) emuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"OnboardRAM\" from the config"));
 
-    rc = pHlp->pfnCFGMQueryStringAlloc(pCfg, "RomFile", &pThis->pszROMFile);
+    rc = pHlp->pfnCFGMQueryStringAlloc(pCfg, "RomFile", &pThisCC->pszROMFile);
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"RomFile\" from the config"));
 
-    rc = pHlp->pfnCFGMQueryStringAllocDef(pCfg, "OutDevice", &pThis->pszOutDevice, EMU_DEFAULT_OUT_DEVICE);
+    rc = pHlp->pfnCFGMQueryStringAllocDef(pCfg, "OutDevice", &pThisCC->pszOutDevice, EMU_DEFAULT_OUT_DEVICE);
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"OutDevice\" from the config"));
 
@@ -484,10 +739,52 @@ static DECLCALLBACK(int) emuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"SampleRate\" from the config"));
 
+    rc = pHlp->pfnCFGMQueryU16Def(pCfg, "ControlRate", &pThis->cControlRate, EMU_DEFAULT_CONTROL_RATE);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"ControlRate\" from the config"));
+    if (pThis->cControlRate < 1 || pThis->cControlRate > EMU_MAX_CONTROL_RATE)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("emu8000: \"ControlRate\" must be between 1 and %u samples"), EMU_MAX_CONTROL_RATE);
+
+    char szInterp[16];
+    emu8k_interp_t enmInterp;
+    rc = pHlp->pfnCFGMQueryStringDef(pCfg, "Interpolation", szInterp, sizeof(szInterp), EMU_DEFAULT_INTERPOLATION);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"Interpolation\" from the config"));
+
+    if (RTStrICmp(szInterp, "linear") == 0) {
+        enmInterp = EMU8K_INTERP_LINEAR;
+    } else if (RTStrICmp(szInterp, "cubic") == 0) {
+        enmInterp = EMU8K_INTERP_CUBIC;
+    } else {
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Invalid \"Interpolation\" value \"%s\", must be \"linear\" or \"cubic\""), szInterp);
+    }
+
+    char szFilter[16];
+    emu8k_filter_t enmFilter;
+    rc = pHlp->pfnCFGMQueryStringDef(pCfg, "Filter", szFilter, sizeof(szFilter), EMU_DEFAULT_FILTER);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to query \"Filter\" from the config"));
+
+    if (RTStrICmp(szFilter, "none") == 0) {
+        enmFilter = EMU8K_FILTER_NONE;
+    } else if (RTStrICmp(szFilter, "initial") == 0) {
+        enmFilter = EMU8K_FILTER_INITIAL;
+    } else if (RTStrICmp(szFilter, "moog") == 0) {
+        enmFilter = EMU8K_FILTER_MOOG;
+    } else if (RTStrICmp(szFilter, "constant") == 0) {
+        enmFilter = EMU8K_FILTER_CONSTANT;
+    } else {
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Invalid \"Filter\" value \"%s\", must be \"none\", \"initial\", \"moog\" or \"constant\""),
+                                   szFilter);
+    }
+
     // Validate and read the ROM file
     RTFILE fROM;
     uint64_t uROMSize;
-    rc = RTFileOpen(&fROM, pThis->pszROMFile, RTFILE_O_READ | RTFILE_O_OPEN | RTFILE_O_DENY_WRITE);
+    rc = RTFileOpen(&fROM, pThisCC->pszROMFile, RTFILE_O_READ | RTFILE_O_OPEN | RTFILE_O_DENY_WRITE);
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("emu8000: Failed to open ROMFile"));
 
@@ -495,31 +792,31 @@ static DECLCALLBACK(int) emuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
     if (RT_FAILURE(rc) || uROMSize != _1M)
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("emu8000: ROMFile is not of correct size (expecting 1MiB file)"));
 
-    pThis->rom = PDMDevHlpMMHeapAlloc(pDevIns, uROMSize);
-    AssertPtrReturn(pThis->rom, VERR_NO_MEMORY);
+    pThisCC->rom = PDMDevHlpMMHeapAlloc(pDevIns, uROMSize);
+    AssertPtrReturn(pThisCC->rom, VERR_NO_MEMORY);
 
-    rc = RTFileRead(fROM, pThis->rom, uROMSize, NULL);
+    rc = RTFileRead(fROM, pThisCC->rom, uROMSize, NULL);
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("emu8000: Failed to read ROMFile"));
 
     // Allocate RAM
-    pThis->ram = PDMDevHlpMMHeapAllocZ(pDevIns, pThis->uRAMSize);
-    AssertPtrReturn(pThis->ram, VERR_NO_MEMORY);
+    pThisCC->ram = PDMDevHlpMMHeapAllocZ(pDevIns, pThis->uRAMSize);
+    AssertPtrReturn(pThisCC->ram, VERR_NO_MEMORY);
 
     // Create the device
-    pThis->emu = emu8k_alloc(pThis->rom, pThis->ram, pThis->uRAMSize);
-    AssertPtrReturn(pThis->emu, VERR_NO_MEMORY);
+    pThisCC->emu = emu8k_alloc(pThisCC->rom, pThisCC->ram, pThis->uRAMSize);
+    AssertPtrReturn(pThisCC->emu, VERR_NO_MEMORY);
+    emu8k_set_control_rate(pThisCC->emu, pThis->cControlRate);
+    emu8k_set_kernels(pThisCC->emu, enmInterp, enmFilter);
 
     // Initialize now the buffer that will be used by the render thread.
     size_t renderBlockSize = emuCalculateBytesFromFrames(pThis, emuCalculateFramesFromMilli(pThis, EMU_RENDER_BLOCK_TIME));
-    pThis->pbRenderBuf = (uint8_t *) RTMemAlloc(renderBlockSize);
-    AssertPtrReturn(pThis->pbRenderBuf, VERR_NO_MEMORY);
-
-    // Prepare the render thread, but not create it yet.
-    pThis->fShutdown = false;
-    pThis->fStopped = false;
-    pThis->hRenderThread = NIL_RTTHREAD;
-    pThis->tmLastWrite = 0;
+    pThisCC->pbRenderBuf = (uint8_t *) RTMemAlloc(renderBlockSize);
+    AssertPtrReturn(pThisCC->pbRenderBuf, VERR_NO_MEMORY);
+
+    pThisCC->hRenderThread = NIL_RTTHREAD;
+    pThisCC->hEvtRender = NIL_RTSEMEVENT;
+    pThisCC->tmLastWrite = 0;
     rc = PDMDevHlpCritSectInit(pDevIns, &pThis->critSect, RT_SRC_POS, "emu8000#%d", iInstance);
     AssertRCReturn(rc, rc);
 
@@ -535,13 +832,22 @@ static DECLCALLBACK(int) emuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
                                           emuIoPortWrite, emuIoPortRead, "EMU8000 Data1/2", NULL, &pThis->hIoPorts[1]);
     AssertRCReturn(rc, rc);
     rc = PDMDevHlpIoPortCreateFlagsAndMap(pDevIns, pThis->uPort + EMU_PORT_DATA3, numPorts, IOM_IOPORT_F_ABS,
-                                          emuIoPortWrite, emuIoPortRead, "EMU8000 Data3/Ptr", NULL, &pThis->hIoPorts[3]);
+                                          emuIoPortWrite, emuIoPortRead, "EMU8000 Data3/Ptr", NULL, &pThis->hIoPorts[2]);
     AssertRCReturn(rc, rc);
 
+    PDMDevHlpSTAMRegister(pDevIns, &pThis->StatPcmUnderruns, STAMTYPE_COUNTER, "PcmUnderruns",
+                          STAMUNIT_OCCURENCES, "PCM output underruns");
+    PDMDevHlpSTAMRegister(pDevIns, &pThis->StatPcmRecoveryTime, STAMTYPE_COUNTER, "PcmRecoveryTime",
+                          STAMUNIT_NS, "Time from PCM output underruns until back at the target latency");
+
     // Register saved state.
     rc = PDMDevHlpSSMRegister(pDevIns, EMU_SAVED_STATE_VERSION, sizeof(*pThis), emuR3SaveExec, emuR3LoadExec);
     AssertRCReturn(rc, rc);
 
+    // Start the render thread parked, so that the first port write only has to wake it up.
+    rc = emuCreateRenderThread(pDevIns);
+    AssertRCReturn(rc, rc);
+
     LogRel(("emu8000#%i: Using %hu KiB of onboard RAM\n", iInstance, pThis->uRAMSize / _1K));
 
     LogRel(("emu8000#%i: Configured on ports 0x%X-0x%X, 0x%X-0x%X, 0x%X-0x%X\n", iInstance,
@@ -558,33 +864,34 @@ static DECLCALLBACK(int) emuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
 static DECLCALLBACK(int) emuR3Destruct(PPDMDEVINS pDevIns)
 {
     PEMUSTATE     pThis   = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
+    PEMUSTATER3   pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PEMUSTATER3);
 
-    /* Shutdown AND terminate the render thread. */
-    emuStopRenderThread(pDevIns, true);
+    /* Terminate the render thread, which also closes the PCM output. */
+    emuDestroyRenderThread(pDevIns);
 
-    if (pThis->pbRenderBuf) {
-        PDMDevHlpMMHeapFree(pDevIns, pThis->pbRenderBuf);
-        pThis->pbRenderBuf = NULL;
+    if (pThisCC->pbRenderBuf) {
+        PDMDevHlpMMHeapFree(pDevIns, pThisCC->pbRenderBuf);
+        pThisCC->pbRenderBuf = NULL;
     }
 
-    if (pThis->pszOutDevice) {
-        PDMDevHlpMMHeapFree(pDevIns, pThis->pszOutDevice);
-        pThis->pszOutDevice = NULL;
+    if (pThisCC->pszOutDevice) {
+        PDMDevHlpMMHeapFree(pDevIns, pThisCC->pszOutDevice);
+        pThisCC->pszOutDevice = NULL;
     }
 
-    if (pThis->emu) {
-        emu8k_free(pThis->emu);
-        pThis->emu = NULL;
+    if (pThisCC->emu) {
+        emu8k_free(pThisCC->emu);
+        pThisCC->emu = NULL;
     }
 
-    if (pThis->ram) {
-        PDMDevHlpMMHeapFree(pDevIns, pThis->ram);
-        pThis->ram = NULL;
+    if (pThisCC->ram) {
+        PDMDevHlpMMHeapFree(pDevIns, pThisCC->ram);
+        pThisCC->ram = NULL;
     }
 
-    if (pThis->rom) {
-        PDMDevHlpMMHeapFree(pDevIns, pThis->rom);
-        pThis->rom = NULL;
+    if (pThisCC->rom) {
+        PDMDevHlpMMHeapFree(pDevIns, pThisCC->rom);
+        pThisCC->rom = NULL;
     }
 
     PDMDevHlpCritSectDelete(pDevIns, &pThis->critSect);
@@ -592,6 +899,24 @@ static DECLCALLBACK(int) emuR3Destruct(PPDMDEVINS pDevIns)
     return VINF_SUCCESS;
 }
 
+# else  /* !IN_RING3 */
+
+/**
+ * @callback_method_impl{PDMDEVREGR0,pfnConstruct}
+ */
+static DECLCALLBACK(int) emuRZConstruct(PPDMDEVINS pDevIns)
+{
+    PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
+    PEMUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PEMUSTATE);
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->hIoPorts); i++) {
+        int rc = PDMDevHlpIoPortSetUpContext(pDevIns, pThis->hIoPorts[i], emuIoPortWrite, emuIoPortRead, NULL);
+        AssertRCReturn(rc, rc);
+    }
+
+    return VINF_SUCCESS;
+}
+
 # endif /* !IN_RING3 */
 
 
@@ -603,19 +928,27 @@ static const PDMDEVREG g_DeviceEmu =
     /* .u32Version = */             PDM_DEVREG_VERSION,
     /* .uReserved0 = */             0,
     /* .szName = */                 "emu8000",
+# ifdef VMUSIC_WITH_R0
+    /* .fFlags = */                 PDM_DEVREG_FLAGS_DEFAULT_BITS | PDM_DEVREG_FLAGS_NEW_STYLE | PDM_DEVREG_FLAGS_R0,
+# else
     /* .fFlags = */                 PDM_DEVREG_FLAGS_DEFAULT_BITS | PDM_DEVREG_FLAGS_NEW_STYLE,
+# endif
     /* .fClass = */                 PDM_DEVREG_CLASS_AUDIO,
     /* .cMaxInstances = */          1,
     /* .uSharedVersion = */         42,
     /* .cbInstanceShared = */       sizeof(EMUSTATE),
-    /* .cbInstanceCC = */           0,
+    /* .cbInstanceCC = */           sizeof(EMUSTATECC),
     /* .cbInstanceRC = */           0,
     /* .cMaxPciDevices = */         0,
     /* .cMaxMsixVectors = */        0,
     /* .pszDescription = */         "EMU8000.",
 # if defined(IN_RING3)
     /* .pszRCMod = */               "",
+#  ifdef VMUSIC_WITH_R0
+    /* .pszR0Mod = */               "Emu8000R0.r0",
+#  else
     /* .pszR0Mod = */               "",
+#  endif
     /* .pfnConstruct = */           emuR3Construct,
     /* .pfnDestruct = */            emuR3Destruct,
     /* .pfnRelocate = */            NULL,
@@ -640,7 +973,7 @@ static const PDMDEVREG g_DeviceEmu =
     /* .pfnReserved7 = */           NULL,
 # elif defined(IN_RING0)
     /* .pfnEarlyConstruct = */      NULL,
-    /* .pfnConstruct = */           NULL,
+    /* .pfnConstruct = */           emuRZConstruct,
     /* .pfnDestruct = */            NULL,
     /* .pfnFinalDestruct = */       NULL,
     /* .pfnRequest = */             NULL,
@@ -685,6 +1018,34 @@ extern "C" DECLEXPORT(int) VBoxDevicesRegister(PPDMDEVREGCB pCallbacks, uint32_t
     return pCallbacks->pfnRegister(pCallbacks, &g_DeviceEmu);
 }
 
+# elif defined(VBOX_IN_EXTPACK_R0)
+
+/** The ring-0 device registrations of this module. */
+static PCPDMDEVREGR0 g_apDevRegs[] =
+{
+    &g_DeviceEmu,
+};
+
+/** Module device registration record. */
+static PDMDEVMODREGR0 g_ModDevReg =
+{
+    /* .u32Version = */ PDM_DEVMODREGR0_VERSION,
+    /* .cDevRegs = */   RT_ELEMENTS(g_apDevRegs),
+    /* .papDevRegs = */ &g_apDevRegs[0],
+    /* .hMod = */       NULL,
+    /* .ListEntry = */  { NULL, NULL },
+};
+
+extern "C" DECLEXPORT(int) ModuleInit(void *hMod)
+{
+    return PDMR0DeviceRegisterModule(hMod, &g_ModDevReg);
+}
+
+extern "C" DECLEXPORT(void) ModuleTerm(void *hMod)
+{
+    PDMR0DeviceDeregisterModule(hMod, &g_ModDevReg);
+}
+
 # endif  /* !VBOX_IN_EXTPACK_R3 */
 
 #endif /* !VBOX_DEVICE_STRUCT_TESTCASE */
@@ -54,15 +54,13 @@
 #include <VBox/vmm/pdmdev.h>
 #include <VBox/AssertGuest.h>
 #include <VBox/version.h>
+#include <iprt/asm.h>
 #include <iprt/assert.h>
 #include <iprt/mem.h>
 #include <iprt/poll.h>
 #include <iprt/circbuf.h>
 
-#ifndef IN_RING3
-#error "R3-only driver"
-#endif
-
+#ifdef IN_RING3
 #if RT_OPSYS == RT_OPSYS_LINUX
 #include "midialsa.h"
 typedef MIDIAlsa MIDIBackend;
@@ -70,6 +68,7 @@ typedef MIDIAlsa MIDIBackend;
 #include "midiwin.h"
 typedef MIDIWin MIDIBackend;
 #endif
+#endif /* IN_RING3 */
 
 /*********************************************************************************************************************************
 *   Defined Constants And Macros                                                                                                 *
@@ -98,8 +97,8 @@ enum {
 /** The saved state version. */
 #define MPU_SAVED_STATE_VERSION     1
 
-/** Device configuration & state struct. */
-typedef struct {
+/** Device configuration & state struct, shared between ring-0 and ring-3. */
+typedef struct MPUSTATE {
     /* Device configuration. */
     /** Base port. */
     RTIOPORT               uPort;
@@ -107,17 +106,13 @@ typedef struct {
     int8_t                 uIrq;
 
     /* Current state. */
-    /** MIDI backend. */
-    MIDIBackend            midi;
     /** True if UART mode, false if regular/intelligent mode. */
     bool                   fModeUart;
-    /** Buffer used for sending UART data. */
-    R3PTRTYPE(PRTCIRCBUF)   pTxBuf;
-    /** Buffer used for receiving UART data / command responses. */
-    R3PTRTYPE(PRTCIRCBUF)   pRxBuf;
-
-    /** Thread which does actual RX/TX. */
-    PPDMTHREAD             pIoThread;
+    /** Number of bytes in the ring-3 TX and RX buffers, so that the status port can be read in any context.
+     *  Updated right after each change to the buffers, so they may lag behind the IO thread for a moment,
+     *  but never report TX room or RX data which is not there. Signed, as the consuming side may update
+     *  them before the producing one does and make them briefly negative. */
+    int32_t volatile       cTxUsed, cRxUsed;
 
     IOMIOPORTHANDLE        hIoPorts;
 
@@ -125,8 +120,74 @@ typedef struct {
 /** Pointer to the shared device state.  */
 typedef MPUSTATE *PMPUSTATE;
 
+#ifdef IN_RING3
+/** Device state for ring-3. */
+typedef struct MPUSTATER3 {
+    /** MIDI backend. */
+    MIDIBackend            midi;
+    /** Buffer used for sending UART data. */
+    PRTCIRCBUF             pTxBuf;
+    /** Buffer used for receiving UART data / command responses. */
+    PRTCIRCBUF             pRxBuf;
+
+    /** Thread which does actual RX/TX. */
+    PPDMTHREAD             pIoThread;
+} MPUSTATER3;
+typedef MPUSTATER3 *PMPUSTATER3;
+#else
+/** Device state for ring-0, which only needs the shared state. */
+typedef struct MPUSTATER0 {
+    uint8_t                bDummy;
+} MPUSTATER0;
+typedef MPUSTATER0 *PMPUSTATER0;
+#endif
+
+/** The device state for the current context. */
+typedef CTX_SUFF(MPUSTATE) MPUSTATECC;
+/** Pointer to the device state for the current context. */
+typedef CTX_SUFF(PMPUSTATE) PMPUSTATECC;
+
 #ifndef VBOX_DEVICE_STRUCT_TESTCASE
 
+static uint8_t mpuReadStatus(PPDMDEVINS pDevIns)
+{
+    PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+
+    /* This port indicates whether the interface is ready to
+       accept a data/command byte, or has in-bound data
+       available for reading.
+        Bit 6: Output Ready
+         0 - The interface is ready to receive a
+             data/command byte
+         1 - The interface is not ready to receive a
+             data/command byte
+        Bit 7: Input Ready
+         0 - Data is available for reading
+         1 - No data is available for reading */
+
+    uint8_t status = 0;
+
+    const int32_t cTxUsed = ASMAtomicReadS32(&pThis->cTxUsed);
+    const int32_t cRxUsed = ASMAtomicReadS32(&pThis->cRxUsed);
+
+    Log7Func(("tx buf=%d/%u rx buf=%d/%u\n", cTxUsed, MPU_CIRC_BUFFER_SIZE, cRxUsed, MPU_CIRC_BUFFER_SIZE));
+
+    if (cTxUsed >= MPU_CIRC_BUFFER_SIZE) {
+        status |= RT_BIT(6);
+    }
+
+    if (cRxUsed <= 0) {
+        status |= RT_BIT(7);
+    }
+
+    Log7(("mpu status: output=%RTbool input=%RTbool\n",
+          !(status & RT_BIT(6)), !(status & RT_BIT(7))));
+
+    return status;
+}
+
+# ifdef IN_RING3
+
 static void mpuLowerIrq(PPDMDEVINS pDevIns)
 {
     PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
@@ -140,11 +201,12 @@ static void mpuLowerIrq(PPDMDEVINS pDevIns)
 static void mpuUpdateIrq(PPDMDEVINS pDevIns)
 {
     PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
 
     // This function may be called from the IO thread, too.
 
     if (pThis->uIrq >= 0) {
-        bool raise = RTCircBufUsed(pThis->pRxBuf) > 0;
+        bool raise = RTCircBufUsed(pThisCC->pRxBuf) > 0;
         Log7Func(("irq=%RTbool\n", raise));
         PDMDevHlpISASetIrqNoWait(pDevIns, pThis->uIrq, raise ? PDM_IRQ_LEVEL_HIGH : PDM_IRQ_LEVEL_LOW);
     }
@@ -152,15 +214,16 @@ static void mpuUpdateIrq(PPDMDEVINS pDevIns)
 
 static void mpuWakeIoThread(PPDMDEVINS pDevIns)
 {
-    PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
     Log7(("wake io thread\n"));
-    int rc = pThis->midi.pollInterrupt();
+    int rc = pThisCC->midi.pollInterrupt();
     AssertLogRelRC(rc);
 }
 
 static void mpuReset(PPDMDEVINS pDevIns)
 {
     PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
 
     if (pThis->fModeUart) {
         Log(("Leaving UART mode\n"));
@@ -168,22 +231,24 @@ static void mpuReset(PPDMDEVINS pDevIns)
 
     pThis->fModeUart = false;
 
-    if (pThis->pIoThread) {
-        int rc = PDMDevHlpThreadSuspend(pDevIns, pThis->pIoThread);
+    if (pThisCC->pIoThread) {
+        int rc = PDMDevHlpThreadSuspend(pDevIns, pThisCC->pIoThread);
         AssertLogRelRC(rc);
     }
 
     mpuLowerIrq(pDevIns);
 
-    RTCircBufReset(pThis->pTxBuf);
-    RTCircBufReset(pThis->pRxBuf);
+    RTCircBufReset(pThisCC->pTxBuf);
+    RTCircBufReset(pThisCC->pRxBuf);
+    ASMAtomicWriteS32(&pThis->cTxUsed, 0);
+    ASMAtomicWriteS32(&pThis->cRxUsed, 0);
 
-    pThis->midi.reset();
+    pThisCC->midi.reset();
 
     mpuUpdateIrq(pDevIns);
 
-    if (pThis->pIoThread) {
-        int rc = PDMDevHlpThreadResume(pDevIns, pThis->pIoThread);
+    if (pThisCC->pIoThread) {
+        int rc = PDMDevHlpThreadResume(pDevIns, pThisCC->pIoThread);
         AssertLogRelRC(rc);
     }
 }
@@ -208,6 +273,7 @@ static void mpuEnterUart(PPDMDEVINS pDevIns)
 static void mpuRespondData(PPDMDEVINS pDevIns, uint8_t data)
 {
     PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
 
     // In UART mode we should not be generating system responses
     // which are going to corrupt the MIDI stream.
@@ -219,14 +285,15 @@ static void mpuRespondData(PPDMDEVINS pDevIns, uint8_t data)
 
     uint8_t *buf;
     size_t bufSize;
-    RTCircBufAcquireWriteBlock(pThis->pRxBuf, 1, (void**)&buf, &bufSize);
+    RTCircBufAcquireWriteBlock(pThisCC->pRxBuf, 1, (void**)&buf, &bufSize);
     if (bufSize < 1) {
         LogWarnFunc(("overflow in MIDI RX buffer\n"));
         return;
     }
 
     *buf = data;
-    RTCircBufReleaseWriteBlock(pThis->pRxBuf, 1);
+    RTCircBufReleaseWriteBlock(pThisCC->pRxBuf, 1);
+    ASMAtomicIncS32(&pThis->cRxUsed);
 
     mpuUpdateIrq(pDevIns);
 }
@@ -234,6 +301,7 @@ static void mpuRespondData(PPDMDEVINS pDevIns, uint8_t data)
 static uint8_t mpuReadData(PPDMDEVINS pDevIns)
 {
     PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
     uint8_t ret = 0xff;
 
     // Always lower IRQ after a port read, even if there is still more data left
@@ -241,10 +309,11 @@ static uint8_t mpuReadData(PPDMDEVINS pDevIns)
 
     uint8_t *buf;
     size_t bufSize;
-    RTCircBufAcquireReadBlock(pThis->pRxBuf, 1, (void**)&buf, &bufSize);
+    RTCircBufAcquireReadBlock(pThisCC->pRxBuf, 1, (void**)&buf, &bufSize);
     if (bufSize > 0) {
         ret = *buf;
-        RTCircBufReleaseReadBlock(pThis->pRxBuf, 1);
+        RTCircBufReleaseReadBlock(pThisCC->pRxBuf, 1);
+        ASMAtomicDecS32(&pThis->cRxUsed);
 
         Log5Func(("midi_in data=0x%x\n", ret));
 
@@ -265,14 +334,16 @@ static uint8_t mpuReadData(PPDMDEVINS pDevIns)
 static void mpuWriteData(PPDMDEVINS pDevIns, uint8_t data)
 {
     PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3 pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
 
     if (pThis->fModeUart) {
         uint8_t *buf;
         size_t bufSize;
-        RTCircBufAcquireWriteBlock(pThis->pTxBuf, 1, (void**)&buf, &bufSize);
+        RTCircBufAcquireWriteBlock(pThisCC->pTxBuf, 1, (void**)&buf, &bufSize);
         if (bufSize > 0) {
             *buf = data;
-            RTCircBufReleaseWriteBlock(pThis->pTxBuf, 1);
+            RTCircBufReleaseWriteBlock(pThisCC->pTxBuf, 1);
+            ASMAtomicIncS32(&pThis->cTxUsed);
 
             Log5Func(("midi_out data=0x%x\n", data));
 
@@ -285,42 +356,6 @@ static void mpuWriteData(PPDMDEVINS pDevIns, uint8_t data)
     }
 }
 
-static uint8_t mpuReadStatus(PPDMDEVINS pDevIns)
-{
-    PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
-
-    /* This port indicates whether the interface is ready to
-       accept a data/command byte, or has in-bound data
-       available for reading.
-        Bit 6: Output Ready
-         0 - The interface is ready to receive a
-             data/command byte
-         1 - The interface is not ready to receive a
-             data/command byte
-        Bit 7: Input Ready
-         0 - Data is available for reading
-         1 - No data is available for reading */
-
-    uint8_t status = 0;
-
-    Log7Func(("tx buf=%zu/%zu rx buf=%zu/%zu\n",
-              RTCircBufUsed(pThis->pTxBuf), RTCircBufFree(pThis->pTxBuf),
-              RTCircBufUsed(pThis->pRxBuf), RTCircBufFree(pThis->pRxBuf)));
-
-    if (RTCircBufFree(pThis->pTxBuf) == 0) {
-        status |= RT_BIT(6);
-    }
-
-    if (RTCircBufUsed(pThis->pRxBuf) == 0) {
-        status |= RT_BIT(7);
-    }
-
-    Log7(("mpu status: output=%RTbool input=%RTbool\n",
-          !(status & RT_BIT(6)), !(status & RT_BIT(7))));
-
-    return status;
-}
-
 static void mpuDoCommand(PPDMDEVINS pDevIns, uint8_t cmd)
 {
     PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
@@ -365,8 +400,8 @@ static void mpuDoCommand(PPDMDEVINS pDevIns, uint8_t cmd)
  */
 static DECLCALLBACK(int) mpuIoThreadLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
 {
-    RT_NOREF(pDevIns);
-    PMPUSTATE pThis = (PMPUSTATE)pThread->pvUser;
+    PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3 pThisCC = (PMPUSTATER3)pThread->pvUser;
 
     if (pThread->enmState == PDMTHREADSTATE_INITIALIZING)
         return VINF_SUCCESS;
@@ -378,10 +413,10 @@ static DECLCALLBACK(int) mpuIoThreadLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
         uint32_t events = 0, revents = 0;
 
         if (pThis->fModeUart) {
-            if (RTCircBufUsed(pThis->pTxBuf) > 0) {
+            if (RTCircBufUsed(pThisCC->pTxBuf) > 0) {
                 events |= RTPOLL_EVT_WRITE;
             }
-            if (RTCircBufFree(pThis->pRxBuf) > 0) {
+            if (RTCircBufFree(pThisCC->pRxBuf) > 0) {
                 events |= RTPOLL_EVT_READ;
             }
         }
@@ -389,42 +424,44 @@ static DECLCALLBACK(int) mpuIoThreadLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
         Log7Func(("polling for write=%RTbool read=%RTbool\n",
                   bool(events & RTPOLL_EVT_WRITE), bool(events & RTPOLL_EVT_READ)));
 
-        int rc = pThis->midi.poll(events, &revents, RT_INDEFINITE_WAIT);
+        int rc = pThisCC->midi.poll(events, &revents, RT_INDEFINITE_WAIT);
         if (RT_SUCCESS(rc)) {
             if (revents & RTPOLL_EVT_WRITE) {
                 // Write data from the Tx Buf
                 uint8_t *buf;
-                size_t bufSize = RTCircBufUsed(pThis->pTxBuf);
+                size_t bufSize = RTCircBufUsed(pThisCC->pTxBuf);
                 if (bufSize > 0) {
                     ssize_t written = 0;
-                    RTCircBufAcquireReadBlock(pThis->pTxBuf, bufSize, (void**)&buf, &bufSize);
+                    RTCircBufAcquireReadBlock(pThisCC->pTxBuf, bufSize, (void**)&buf, &bufSize);
                     if (bufSize > 0) {
                         Log7Func(("writing %zu bytes\n", bufSize));
-                        written = pThis->midi.write(buf, bufSize);
+                        written = pThisCC->midi.write(buf, bufSize);
                         if (written < 0) {
                             LogWarn(("write failed with %Rrc\n", written));
                             written = 0;
                         }
                     }
-                    RTCircBufReleaseReadBlock(pThis->pTxBuf, written);
+                    RTCircBufReleaseReadBlock(pThisCC->pTxBuf, written);
+                    ASMAtomicSubS32(&pThis->cTxUsed, (int32_t)written);
                 }
             }
             if (revents & RTPOLL_EVT_READ) {
                 // Read data into the Rx Buf
                 uint8_t *buf;
-                size_t bufSize = RTCircBufFree(pThis->pRxBuf);
+                size_t bufSize = RTCircBufFree(pThisCC->pRxBuf);
                 if (bufSize > 0) {
                     ssize_t read = 0;
-                    RTCircBufAcquireWriteBlock(pThis->pRxBuf, bufSize, (void**)&buf, &bufSize);
+                    RTCircBufAcquireWriteBlock(pThisCC->pRxBuf, bufSize, (void**)&buf, &bufSize);
                     if (bufSize > 0) {
                         Log7Func(("reading %zu bytes\n", bufSize));
-                        read = pThis->midi.read(buf, bufSize);
+                        read = pThisCC->midi.read(buf, bufSize);
                         if (read < 0) {
                             LogWarnFunc(("read failed with %Rrc\n", read));
                             read = 0;
                         }
                     }
-                    RTCircBufReleaseWriteBlock(pThis->pRxBuf, read);
+                    RTCircBufReleaseWriteBlock(pThisCC->pRxBuf, read);
+                    ASMAtomicAddS32(&pThis->cRxUsed, (int32_t)read);
                     if (read > 0) {
                         mpuUpdateIrq(pDevIns);
                     }
@@ -445,14 +482,18 @@ static DECLCALLBACK(int) mpuIoThreadLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
  */
 static DECLCALLBACK(int) mpuIoThreadWakeup(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
 {
-    PMPUSTATE pThis = (PMPUSTATE)pThread->pvUser;
+    PMPUSTATER3 pThisCC = (PMPUSTATER3)pThread->pvUser;
 
     RT_NOREF(pDevIns);
-    return pThis->midi.pollInterrupt();
+    return pThisCC->midi.pollInterrupt();
 }
 
+# endif /* IN_RING3 */
+
 /**
  * @callback_method_impl{FNIOMIOPORTNEWIN}
+ *
+ * Status reads are served from the shared state in any context; data reads go to ring-3.
  */
 static DECLCALLBACK(VBOXSTRICTRC) mpuIoPortRead(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT offPort, uint32_t *pu32, unsigned cb)
 {
@@ -464,8 +505,12 @@ static DECLCALLBACK(VBOXSTRICTRC) mpuIoPortRead(PPDMDEVINS pDevIns, void *pvUser
         switch (offPort)
         {
             case MPU_PORT_DATA:
+#ifdef IN_RING3
                 uValue = mpuReadData(pDevIns);
                 break;
+#else
+                return VINF_IOM_R3_IOPORT_READ;
+#endif
 
             case MPU_PORT_STATUS:
                 uValue = mpuReadStatus(pDevIns);
@@ -488,10 +533,16 @@ static DECLCALLBACK(VBOXSTRICTRC) mpuIoPortRead(PPDMDEVINS pDevIns, void *pvUser
 
 /**
  * @callback_method_impl{FNIOMIOPORTNEWOUT}
+ *
+ * Both data and commands need the MIDI backend, so in ring-0 this only defers to ring-3.
  */
 static DECLCALLBACK(VBOXSTRICTRC) mpuIoPortWrite(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT offPort, uint32_t u32, unsigned cb)
 {
     RT_NOREF(pvUser);
+#ifndef IN_RING3
+    RT_NOREF(pDevIns, offPort, u32, cb);
+    return VINF_IOM_R3_IOPORT_WRITE;
+#else
     if (cb == 1)
     {
         Log7Func(("write port %u: %#04x\n", offPort, u32));
@@ -514,6 +565,7 @@ static DECLCALLBACK(VBOXSTRICTRC) mpuIoPortWrite(PPDMDEVINS pDevIns, void *pvUse
     else
         ASSERT_GUEST_MSG_FAILED(("offPort=%#x cb=%d\n", offPort, cb));
     return VINF_SUCCESS;
+#endif
 }
 
 # ifdef IN_RING3
@@ -523,10 +575,11 @@ static DECLCALLBACK(VBOXSTRICTRC) mpuIoPortWrite(PPDMDEVINS pDevIns, void *pvUse
  */
 static DECLCALLBACK(int) mpuR3SaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
 {
-    PMPUSTATE       pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATE       pThis   = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3     pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
     PCPDMDEVHLPR3   pHlp  = pDevIns->pHlpR3;
 
-    AssertLogRel(pThis->pIoThread->enmState != PDMTHREADSTATE_RUNNING);
+    AssertLogRel(pThisCC->pIoThread->enmState != PDMTHREADSTATE_RUNNING);
 
     pHlp->pfnSSMPutBool(pSSM, pThis->fModeUart);
 
@@ -538,13 +591,14 @@ static DECLCALLBACK(int) mpuR3SaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
  */
 static DECLCALLBACK(int) mpuR3LoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t uPass)
 {
-    PMPUSTATE       pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATE       pThis   = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3     pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
     PCPDMDEVHLPR3   pHlp  = pDevIns->pHlpR3;
 
     Assert(uPass == SSM_PASS_FINAL);
     NOREF(uPass);
 
-    AssertLogRel(pThis->pIoThread->enmState != PDMTHREADSTATE_RUNNING);
+    AssertLogRel(pThisCC->pIoThread->enmState != PDMTHREADSTATE_RUNNING);
 
     pHlp->pfnSSMGetBool(pSSM, &pThis->fModeUart);
 
@@ -561,6 +615,7 @@ static DECLCALLBACK(int) mpuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
 {
     PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
     PMPUSTATE       pThis   = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3     pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
     PCPDMDEVHLPR3   pHlp    = pDevIns->pHlpR3;
     int             rc;
 
@@ -580,9 +635,9 @@ static DECLCALLBACK(int) mpuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
     LogFlowFunc(("mpu401#%i: port 0x%x irq %d\n", iInstance, pThis->uPort, pThis->uIrq));
 
     // Create buffers
-    rc = RTCircBufCreate(&pThis->pTxBuf, MPU_CIRC_BUFFER_SIZE);
+    rc = RTCircBufCreate(&pThisCC->pTxBuf, MPU_CIRC_BUFFER_SIZE);
     AssertRCReturn(rc, rc);
-    rc = RTCircBufCreate(&pThis->pRxBuf, MPU_CIRC_BUFFER_SIZE);
+    rc = RTCircBufCreate(&pThisCC->pRxBuf, MPU_CIRC_BUFFER_SIZE);
     AssertRCReturn(rc, rc);
 
     // Initialize the device state.
@@ -604,11 +659,11 @@ static DECLCALLBACK(int) mpuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
     AssertRCReturn(rc, rc);
 
     // Open the MIDI device now, before we create the IO thread which may poll it.
-    rc = pThis->midi.open("default");
+    rc = pThisCC->midi.open("default");
     AssertRCReturn(rc, rc);
 
     // Create the IO thread; note that this starts it...
-    rc = PDMDevHlpThreadCreate(pDevIns, &pThis->pIoThread, pThis, mpuIoThreadLoop,
+    rc = PDMDevHlpThreadCreate(pDevIns, &pThisCC->pIoThread, pThisCC, mpuIoThreadLoop,
                                mpuIoThreadWakeup, 0, RTTHREADTYPE_IO, "MpuIo");
     AssertRCReturn(rc, rc);
 
@@ -625,20 +680,20 @@ static DECLCALLBACK(int) mpuR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
  */
 static DECLCALLBACK(int) mpuR3Destruct(PPDMDEVINS pDevIns)
 {
-    PMPUSTATE     pThis   = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+    PMPUSTATER3   pThisCC = PDMDEVINS_2_DATA_CC(pDevIns, PMPUSTATER3);
 
-    if (pThis->pIoThread) {
+    if (pThisCC->pIoThread) {
         int rc, rcThread;
-        rc = PDMDevHlpThreadDestroy(pDevIns, pThis->pIoThread, &rcThread);
+        rc = PDMDevHlpThreadDestroy(pDevIns, pThisCC->pIoThread, &rcThread);
         AssertLogRelRC(rc);
-        pThis->pIoThread = NULL;
+        pThisCC->pIoThread = NULL;
     }
 
-    int rc = pThis->midi.close();
+    int rc = pThisCC->midi.close();
     AssertLogRelRC(rc);
 
-    RTCircBufDestroy(pThis->pTxBuf);
-    RTCircBufDestroy(pThis->pRxBuf);
+    RTCircBufDestroy(pThisCC->pTxBuf);
+    RTCircBufDestroy(pThisCC->pRxBuf);
 
 
     return VINF_SUCCESS;
@@ -655,6 +710,22 @@ static DECLCALLBACK(void) mpuR3Reset(PPDMDEVINS pDevIns)
     mpuReset(pDevIns);
 }
 
+# else  /* !IN_RING3 */
+
+/**
+ * @callback_method_impl{PDMDEVREGR0,pfnConstruct}
+ */
+static DECLCALLBACK(int) mpuRZConstruct(PPDMDEVINS pDevIns)
+{
+    PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
+    PMPUSTATE pThis = PDMDEVINS_2_DATA(pDevIns, PMPUSTATE);
+
+    int rc = PDMDevHlpIoPortSetUpContext(pDevIns, pThis->hIoPorts, mpuIoPortWrite, mpuIoPortRead, NULL);
+    AssertRCReturn(rc, rc);
+
+    return VINF_SUCCESS;
+}
+
 # endif /* !IN_RING3 */
 
 
@@ -666,19 +737,27 @@ static const PDMDEVREG g_DeviceMpu =
     /* .u32Version = */             PDM_DEVREG_VERSION,
     /* .uReserved0 = */             0,
     /* .szName = */                 "mpu401",
+# ifdef VMUSIC_WITH_R0
+    /* .fFlags = */                 PDM_DEVREG_FLAGS_DEFAULT_BITS | PDM_DEVREG_FLAGS_NEW_STYLE | PDM_DEVREG_FLAGS_R0,
+# else
     /* .fFlags = */                 PDM_DEVREG_FLAGS_DEFAULT_BITS | PDM_DEVREG_FLAGS_NEW_STYLE,
+# endif
     /* .fClass = */                 PDM_DEVREG_CLASS_AUDIO,
     /* .cMaxInstances = */          1,
     /* .uSharedVersion = */         42,
     /* .cbInstanceShared = */       sizeof(MPUSTATE),
-    /* .cbInstanceCC = */           0,
+    /* .cbInstanceCC = */           sizeof(MPUSTATECC),
     /* .cbInstanceRC = */           0,
     /* .cMaxPciDevices = */         0,
     /* .cMaxMsixVectors = */        0,
     /* .pszDescription = */         "MPU-401.",
 # if defined(IN_RING3)
     /* .pszRCMod = */               "",
+#  ifdef VMUSIC_WITH_R0
+    /* .pszR0Mod = */               "Mpu401R0.r0",
+#  else
     /* .pszR0Mod = */               "",
+#  endif
     /* .pfnConstruct = */           mpuR3Construct,
     /* .pfnDestruct = */            mpuR3Destruct,
     /* .pfnRelocate = */            NULL,
@@ -703,7 +782,7 @@ static const PDMDEVREG g_DeviceMpu =
     /* .pfnReserved7 = */           NULL,
 # elif defined(IN_RING0)
     /* .pfnEarlyConstruct = */      NULL,
-    /* .pfnConstruct = */           NULL,
+    /* .pfnConstruct = */           mpuRZConstruct,
     /* .pfnDestruct = */            NULL,
     /* .pfnFinalDestruct = */       NULL,
     /* .pfnRequest = */             NULL,
@@ -748,6 +827,34 @@ extern "C" DECLEXPORT(int) VBoxDevicesRegister(PPDMDEVREGCB pCallbacks, uint32_t
     return pCallbacks->pfnRegister(pCallbacks, &g_DeviceMpu);
 }
 
+# elif defined(VBOX_IN_EXTPACK_R0)
+
+/** The ring-0 device registrations of this module. */
+static PCPDMDEVREGR0 g_apDevRegs[] =
+{
+    &g_DeviceMpu,
+};
+
+/** Module device registration record. */
+static PDMDEVMODREGR0 g_ModDevReg =
+{
+    /* .u32Version = */ PDM_DEVMODREGR0_VERSION,
+    /* .cDevRegs = */   RT_ELEMENTS(g_apDevRegs),
+    /* .papDevRegs = */ &g_apDevRegs[0],
+    /* .hMod = */       NULL,
+    /* .ListEntry = */  { NULL, NULL },
+};
+
+extern "C" DECLEXPORT(int) ModuleInit(void *hMod)
+{
+    return PDMR0DeviceRegisterModule(hMod, &g_ModDevReg);
+}
+
+extern "C" DECLEXPORT(void) ModuleTerm(void *hMod)
+{
+    PDMR0DeviceDeregisterModule(hMod, &g_ModDevReg);
+}
+
 # endif  /* !VBOX_IN_EXTPACK_R3 */
 
 #endif /* !VBOX_DEVICE_STRUCT_TESTCASE */
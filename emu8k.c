@@ -39,27 +39,19 @@
 #include <math.h>
 
 #define LOG_GROUP LOG_GROUP_DEV_SB16
+#include <VBox/err.h>
 #include <VBox/log.h>
+#include <iprt/asm.h>
 #include <iprt/assert.h>
 #include <iprt/string.h>
 #include <iprt/mem.h>
+#include <iprt/once.h>
 
 #include "emu8k.h"
 #include "emu8k_internal.h"
 
 #define pclog(...) LogFlow((__VA_ARGS__))
 
-#if !defined FILTER_INITIAL && !defined FILTER_MOOG && !defined FILTER_CONSTANT
-//#define FILTER_INITIAL
-#define FILTER_MOOG
-//#define FILTER_CONSTANT
-#endif
-
-#if !defined RESAMPLER_LINEAR && !defined RESAMPLER_CUBIC
-//#define RESAMPLER_LINEAR
-#define RESAMPLER_CUBIC
-#endif
-
 //#define EMU8K_DEBUG_REGISTERS
 
 char* PORT_NAMES[][8] =
@@ -146,19 +138,30 @@ static int dmawritebit = 0;
 /* cubic_table coefficients. */
 static float cubic_table[CUBIC_RESOLUTION * 4];
 
-/* conversion from current pitch to linear frequency change (in 32.32 fixed point). */
-static int64_t freqtable[65536];
-/* Conversion from initial attenuation to 16 bit unsigned lineal amplitude (currently only a way to update volume target register) */
-static int32_t attentable[256];
+/* exp2(c/4096) for c = 0 to 4096 in 2.30 fixed point. Both the pitch and the envelope "dbs" have 4096 steps per octave,
+ * so this covers their fraction and the whole octaves are applied with a shift. Being small, it stays in the cache
+ * while rendering the voices. */
+static uint32_t exp2_frac_table[4097];
+/* log2(1 + c/1024) for c = 0 to 1024 in 16.16 fixed point. Interpolated linearly, which is within 0.02 of a 16.16 unit. */
+static int32_t log2_frac_table[1025];
+/* The conversions made by emu8k_voice_modulate, precomputed for every input. With ControlRate 1
+ * it runs on every sample, which is faster reading these than computing them from the small tables above, so they are
+ * filled (by emu8k_init_sample_tables) and read only then. */
+/* Conversion from current pitch to the pitch target register (see emu8k_pitch_to_speed). */
+static uint16_t freqtable[65536];
 /* Conversion from envelope dbs (once rigth shifted) (0 = 0dBFS, 65535 = -96dbFS and silence ) to 16 bit unsigned lineal amplitude,
  * to convert to current volume. (0 to 65536) */
 static int32_t env_vol_db_to_vol_target[65537];
-/* Same as above, but to convert amplitude (once rigth shifted) (0 to 65536) to db (0 = 0dBFS, 65535 = -96dbFS and silence ). 
+/* Same as above, but to convert amplitude (once rigth shifted) (0 to 65536) to db (0 = 0dBFS, 65535 = -96dbFS and silence ).
  * it is needed so that the delay, attack and hold phase can be added to initial attenuation and tremolo */
 static int32_t env_vol_amplitude_to_db[65537];
 /* Conversion from envelope herts (once right shifted) to octave . it is needed so that the delay, attack and hold phase can be
  * added to initial pitch ,lfos pitch , initial filter and lfo filter */
 static int32_t env_mod_hertz_to_octave[65537];
+/* Table represeting the LFO waveform (see emu8k_lfo_triangle). */
+static int32_t lfotable[65536];
+/* Conversion from initial attenuation to 16 bit unsigned lineal amplitude (currently only a way to update volume target register) */
+static int32_t attentable[256];
 /* Conversion from envelope amount to time in samples. */
 static int32_t env_attack_to_samples[128];
 /* This table has been generated using the following formula:
@@ -168,7 +171,7 @@ static int32_t env_attack_to_samples[128];
  *      int result = round(d*21845);
  * The multiplication by 21845 gives a minimum value of 1, and a maximum accumulated value of 1<<21
  * The accumulated value has to be converted to amplitude, and that can be done with the 
- * env_vol_db_to_vol_target and shifting by 8
+ * emu8k_env_vol_db_to_vol_target and shifting by 8
  * In other words, the unit of the table is the 1/21845th of a dB per sample frame, to be added or
  * substracted to the accumulating value_db of the envelope. */
 static int32_t env_decay_to_dbs_or_oct[128] =
@@ -199,12 +202,11 @@ static int32_t env_decay_to_millis[128] = {
 };
 */
 
-/* Table represeting the LFO waveform (signed 16bits with 32768 max int. >> 15 to move back to +/-1 range). */
-static int32_t lfotable[65536];
 /* Table to transform the speed parameter to emu8k_mem_internal_t range. */
 static int64_t lfofreqtospeed[256];
 
-/* LFO used for the chorus. a sine wave.(signed 16bits with 32768 max int. >> 15 to move back to +/-1 range). */
+/* LFO used for the chorus. a sine wave.(signed 16bits with 32768 max int. >> 15 to move back to +/-1 range).
+ * It is read on every sample, so it is kept whole rather than interpolated. */
 static double chortable[65536];
 
 static const int REV_BUFSIZE_STEP = 242;
@@ -246,8 +248,82 @@ static int32_t filter_atten[16] =
                 26392, 24630, 22463, 20487, 18470
         };
 
-/*Coefficients for the filters for a defined Q and cutoff.*/
-static int32_t filt_coeffs[16][256][3];
+/*Coefficients for the filters for a defined Q and cutoff, for each filter type (minus EMU8K_FILTER_NONE).*/
+static int32_t filt_coeffs[EMU8K_FILTER_COUNT - 1][16][256][3];
+
+/* log2(65535) in 16.16 fixed point. */
+#define ENV_LOG2_MAX_AMPLITUDE 1048575
+/* 680.32142884264 * 20 * log10(2) in 16.16 fixed point, to scale a log2 to envelope dbs. */
+#define ENV_LOG2_TO_DB 268431729
+
+/* log2 of value (1 to 0x1FFFF) in 16.16 fixed point. */
+static inline int32_t emu8k_log2(uint32_t value)
+{
+        int octave = ASMBitLastSetU32(value) - 1;
+        uint32_t fract = (value << (16 - octave)) & 0xFFFF;
+        const int32_t* entry = &log2_frac_table[fract >> 6];
+
+        return (octave << 16) + entry[0] + (((entry[1] - entry[0]) * (int32_t)(fract & 0x3F)) >> 6);
+}
+
+/* Conversion from current pitch to linear frequency change, for the pitch target register.
+ * The input is encoded such as 0xe000 is center note (no pitch shift) and changing up or down 0x1000 (4096)
+ * increments/decrements an octave, so it is exp2((pitch - 0xe000) / 4096) in 2.14 fixed point.
+ * Note that this is in reference to the 44.1Khz clock that the channels play at. */
+static inline uint16_t emu8k_pitch_to_speed(uint16_t pitch)
+{
+        /* Shortcut: minimum pitch equals stopped. I don't really know if this is true, but it's better
+         * since some programs set the pitch to 0 for unused channels. */
+        if (pitch == 0)
+                return 0;
+        return exp2_frac_table[pitch & 0xFFF] >> (30 - (pitch >> 12));
+}
+
+/* Conversion from envelope dbs (once rigth shifted) (0 = 0dBFS, 65535 = -96dbFS and silence ) to 16 bit unsigned lineal amplitude,
+ * to convert to current volume. (0 to 65536). Each 4096 dbs halve the amplitude (the 65536th root of 65536 per db). */
+static inline int32_t emu8k_env_vol_db_to_vol_target(int32_t db)
+{
+        /* Shortcut: max attenuation is silent, not -96dB. */
+        if (db >= 0xFFFF)
+                return 0;
+        /* Important: Using 65535 as max output value because this is intended to be used with the volume target register! */
+        return (int32_t)(((uint64_t)65535 * exp2_frac_table[0x1000 - (db & 0xFFF)]) >> (31 + (db >> 12)));
+}
+
+/* Same as above, but to convert amplitude (once rigth shifted) (0 to 65536) to db (0 = 0dBFS, 65535 = -96dbFS and silence ).
+ * it is needed so that the delay, attack and hold phase can be added to initial attenuation and tremolo */
+static inline int32_t emu8k_env_vol_amplitude_to_db(int32_t amplitude)
+{
+        /*Shortcut: max attenuation is silent, not -96dB.*/
+        if (amplitude <= 0)
+                return 65535;
+        if (amplitude >= 65535)
+                return 0;
+        return (int32_t)(((int64_t)(ENV_LOG2_MAX_AMPLITUDE - emu8k_log2(amplitude)) * ENV_LOG2_TO_DB) >> 32);
+}
+
+/* Conversion from envelope herts (once right shifted) (0 to 65536) to octave . it is needed so that the delay, attack and hold
+ * phase can be added to initial pitch ,lfos pitch , initial filter and lfo filter */
+static inline int32_t emu8k_env_mod_hertz_to_octave(int32_t hertz)
+{
+        /* The maximum would be one octave more than the range of emu8k_log2. */
+        if (hertz >= 0x10000)
+                return 0x10000;
+        return emu8k_log2(0x10000 + hertz) - (16 << 16);
+}
+
+/* The LFOs use a triangular waveform starting at zero and going 1/-1/1/-1, with a period of 65536 samples.
+ * The result is in signed 16bits with 32768 max int. >> 15 to move back to +/-1 range. */
+static inline int32_t emu8k_lfo_triangle(uint32_t count)
+{
+        int32_t d = (count + 16384) & 65535;
+        if (d >= 32768)
+                return 32768 + ((32768 - d) * 2);
+        return (d * 2) - 32768;
+}
+
+/* One of the conversions in emu8k_voice_modulate, from its precomputed table if sample_tables, else computed. */
+#define EMU8K_MOD_CONVERT(sample_tables, table, func, value) ((sample_tables) ? table[value] : func(value))
 
 #define READ16_SWITCH(addr, var)       switch ((addr) & 2)                              \
                                 {                                                       \
@@ -853,6 +929,15 @@ void emu8k_outw(emu8k_t *emu8k, uint16_t addr, uint16_t val)
         }
 #endif //EMU8K_DEBUG_REGISTERS
 
+        /* Any data write may start the current voice (or change what it does), so let the renderer look at it again.
+         * Also stop its slides, so that they do not override the written values until the next control step. */
+        if ((addr & 0xF02) != 0xE02)
+        {
+                emu8k->active_voices |= 1u << emu8k->cur_voice;
+                emu8k->ramp[emu8k->cur_voice].pitch_step = 0;
+                emu8k->ramp[emu8k->cur_voice].vol_step = 0;
+        }
+
         switch (addr & 0xF02)
         {
         case 0x600:
@@ -1122,7 +1207,7 @@ void emu8k_outw(emu8k_t *emu8k, uint16_t addr, uint16_t val)
                         {
                                 if (vol_env->state == ENV_DELAY || vol_env->state == ENV_ATTACK || vol_env->state == ENV_HOLD)
                                 {
-                                        vol_env->value_db_oct = env_vol_amplitude_to_db[vol_env->value_amp_hz >> 5] << 5;
+                                        vol_env->value_db_oct = emu8k_env_vol_amplitude_to_db(vol_env->value_amp_hz >> 5) << 5;
                                         if (vol_env->value_db_oct > (1 << 21))
                                                 vol_env->value_db_oct = 1 << 21;
                                 }
@@ -1149,7 +1234,7 @@ void emu8k_outw(emu8k_t *emu8k, uint16_t addr, uint16_t val)
                         {
                                 if (mod_env->state == ENV_DELAY || mod_env->state == ENV_ATTACK || mod_env->state == ENV_HOLD)
                                 {
-                                        mod_env->value_db_oct = env_mod_hertz_to_octave[mod_env->value_amp_hz >> 9] << 9;
+                                        mod_env->value_db_oct = emu8k_env_mod_hertz_to_octave(mod_env->value_amp_hz >> 9) << 9;
                                         if (mod_env->value_db_oct >= (1 << 21))
                                                 mod_env->value_db_oct = (1 << 21) - 1;
                                 }
@@ -1198,10 +1283,10 @@ void emu8k_outw(emu8k_t *emu8k, uint16_t addr, uint16_t val)
                                          * Another interpretation could be periods. (and so, Hz = 1/period)*/
                                         double osc_speed = emu8k->hwcf5;//*1.316;
 #if 1 // milliHz
-                                        /*milliHz to lfotable samples.*/
+                                        /*milliHz to LFO samples.*/
                                         osc_speed *= 65.536 / 44100.0;
 #elif 0 //periods
-                                        /* 44.1Khz ticks to lfotable samples.*/
+                                        /* 44.1Khz ticks to LFO samples.*/
                                         osc_speed = 65.536/osc_speed;
 #endif
                                         /*left shift 32bits for 32.32 fixed.point*/
@@ -1438,7 +1523,7 @@ void emu8k_outw(emu8k_t *emu8k, uint16_t addr, uint16_t val)
                 {
                 case 0:
                         emu8k->voice[emu8k->cur_voice].ip = val;
-                        emu8k->voice[emu8k->cur_voice].ptrx_pit_target = freqtable[val] >> 18;
+                        emu8k->voice[emu8k->cur_voice].ptrx_pit_target = emu8k_pitch_to_speed(val);
                         return;
 
                 case 1:
@@ -1531,6 +1616,17 @@ void emu8k_outw(emu8k_t *emu8k, uint16_t addr, uint16_t val)
 
 }
 
+uint8_t emu8k_get_pointer(emu8k_t *emu8k)
+{
+        return (emu8k->cur_reg << 5) | emu8k->cur_voice;
+}
+
+void emu8k_set_pointer(emu8k_t *emu8k, uint8_t val)
+{
+        emu8k->cur_voice = (val & 31);
+        emu8k->cur_reg = ((val >> 5) & 7);
+}
+
 uint8_t emu8k_inb(emu8k_t *emu8k, uint16_t addr)
 {
         /* Reading a single byte is a feature that at least Impulse tracker uses,
@@ -1741,355 +1837,447 @@ int32_t emu8k_vol_slide(emu8k_slide_t* slide, int32_t target)
         return slide->last;
 }
 
-//int32_t old_pitch[32]={0};
-//int32_t old_cut[32]={0};
-//int32_t old_vol[32]={0};
-void emu8k_update(emu8k_t* emu8k, int new_pos)
+/* Runs the envelopes and LFOs of a voice for the given number of samples, and sets its targets from them.
+ * sample_tables is a constant in each of the instances below, see freqtable. */
+DECL_FORCE_INLINE(void) emu8k_voice_modulate(emu8k_voice_t* emu_voice, int samples, const bool sample_tables)
 {
-        if (emu8k->pos >= new_pos)
-                return;
+        int32_t attenuation = emu_voice->initial_att;
+        int32_t filtercut = emu_voice->initial_filter;
+        int32_t currentpitch = emu_voice->ip;
+        /* run envelopes */
+        emu8k_envelope_t* volenv = &emu_voice->vol_envelope;
+        switch (volenv->state)
+        {
+        case ENV_DELAY:
+                volenv->delay_samples -= samples;
+                if (volenv->delay_samples <= 0)
+                {
+                        volenv->state = ENV_ATTACK;
+                        volenv->delay_samples = 0;
+                }
+                attenuation = 0x1FFFFF;
+                break;
 
-        AssertLogRelReturnVoid(new_pos <= MAXSOUNDBUFLEN);
+        case ENV_ATTACK:
+                /* Attack amount is in linear amplitude */
+                volenv->value_amp_hz += volenv->attack_amount_amp_hz * samples;
+                if (volenv->value_amp_hz >= (1 << 21))
+                {
+                        volenv->value_amp_hz = 1 << 21;
+                        volenv->value_db_oct = 0;
+                        if (volenv->hold_samples)
+                        {
+                                volenv->state = ENV_HOLD;
+                        }
+                        else
+                        {
+                                /* RAMP_UP since db value is inverted and it is 0 at this point. */
+                                volenv->state = ENV_RAMP_UP;
+                        }
+                }
+                attenuation += EMU8K_MOD_CONVERT(sample_tables, env_vol_amplitude_to_db, emu8k_env_vol_amplitude_to_db,
+                                                 volenv->value_amp_hz >> 5) << 5;
+                break;
 
-        int32_t* buf;
-        emu8k_voice_t* emu_voice;
-        int pos;
-        int c;
+        case ENV_HOLD:
+                volenv->hold_samples -= samples;
+                if (volenv->hold_samples <= 0)
+                {
+                        volenv->state = ENV_RAMP_UP;
+                }
+                attenuation += volenv->value_db_oct;
+                break;
 
-        /* Clean the buffers since we will accumulate into them. */
-        buf = &emu8k->buffer[emu8k->pos * 2];
-        memset(buf, 0, 2 * (new_pos - emu8k->pos) * sizeof(emu8k->buffer[0]));
-        memset(&emu8k->chorus_in_buffer[emu8k->pos], 0, (new_pos - emu8k->pos) * sizeof(emu8k->chorus_in_buffer[0]));
-        memset(&emu8k->reverb_in_buffer[emu8k->pos], 0, (new_pos - emu8k->pos) * sizeof(emu8k->reverb_in_buffer[0]));
+        case ENV_RAMP_DOWN:
+                /* Decay/release amount is in fraction of dBs and is always positive */
+                volenv->value_db_oct -= volenv->ramp_amount_db_oct * samples;
+                if (volenv->value_db_oct <= volenv->sustain_value_db_oct)
+                {
+                        volenv->value_db_oct = volenv->sustain_value_db_oct;
+                        volenv->state = ENV_SUSTAIN;
+                }
+                attenuation += volenv->value_db_oct;
+                break;
 
-        /* Voices section  */
-        for (c = 0; c < 32; c++)
-        {
-                emu_voice = &emu8k->voice[c];
-                buf = &emu8k->buffer[emu8k->pos * 2];
+        case ENV_RAMP_UP:
+                /* Decay/release amount is in fraction of dBs and is always positive */
+                volenv->value_db_oct += volenv->ramp_amount_db_oct * samples;
+                if (volenv->value_db_oct >= volenv->sustain_value_db_oct)
+                {
+                        volenv->value_db_oct = volenv->sustain_value_db_oct;
+                        volenv->state = ENV_SUSTAIN;
+                }
+                attenuation += volenv->value_db_oct;
+                break;
+
+        case ENV_SUSTAIN:
+                attenuation += volenv->value_db_oct;
+                break;
 
-                for (pos = emu8k->pos; pos < new_pos; pos++)
+        case ENV_STOPPED:
+                attenuation = 0x1FFFFF;
+                break;
+        }
+
+        emu8k_envelope_t* modenv = &emu_voice->mod_envelope;
+        switch (modenv->state)
+        {
+        case ENV_DELAY:
+                modenv->delay_samples -= samples;
+                if (modenv->delay_samples <= 0)
                 {
-                        int32_t dat;
+                        modenv->state = ENV_ATTACK;
+                        modenv->delay_samples = 0;
+                }
+                break;
 
-                        if (emu_voice->cvcf_curr_volume)
+        case ENV_ATTACK:
+                /* Attack amount is in linear amplitude */
+                modenv->value_amp_hz += modenv->attack_amount_amp_hz * samples;
+                if (modenv->value_amp_hz >= (1 << 21))
+                {
+                        modenv->value_amp_hz = 1 << 21;
+                        modenv->value_db_oct = 1 << 21;
+                        if (modenv->hold_samples)
                         {
-                                /* Waveform oscillator */
-#ifdef RESAMPLER_LINEAR
-                                dat = EMU8K_READ_INTERP_LINEAR(emu8k, emu_voice->addr.int_address,
-                                                        emu_voice->addr.fract_address);
+                                modenv->state = ENV_HOLD;
+                        }
+                        else
+                        {
+                                modenv->state = ENV_RAMP_DOWN;
+                        }
+                }
+                else
+                {
+                        modenv->value_db_oct = EMU8K_MOD_CONVERT(sample_tables, env_mod_hertz_to_octave, emu8k_env_mod_hertz_to_octave,
+                                                                 modenv->value_amp_hz >> 5) << 5;
+                }
+                break;
 
-#elif defined RESAMPLER_CUBIC
-                                dat = EMU8K_READ_INTERP_CUBIC(emu8k, emu_voice->addr.int_address,
-                                        emu_voice->addr.fract_address);
-#endif
+        case ENV_HOLD:
+                modenv->hold_samples -= samples;
+                if (modenv->hold_samples <= 0)
+                {
+                        modenv->state = ENV_RAMP_UP;
+                }
+                break;
 
-                                /* Filter section */
-                                if (emu_voice->filterq_idx || emu_voice->cvcf_curr_filt_ctoff != 0xFFFF)
-                                {
-                                        int cutoff = emu_voice->cvcf_curr_filt_ctoff >> 8;
-                                        const int64_t coef0 = filt_coeffs[emu_voice->filterq_idx][cutoff][0];
-                                        const int64_t coef1 = filt_coeffs[emu_voice->filterq_idx][cutoff][1];
-                                        const int64_t coef2 = filt_coeffs[emu_voice->filterq_idx][cutoff][2];
-                                        /* clip at twice the range */
-#define ClipBuffer(buf) (buf < -16777216) ? -16777216 : (buf > 16777216) ? 16777216 : buf
+        case ENV_RAMP_DOWN:
+                /* Decay/release amount is in fraction of octave and is always positive */
+                modenv->value_db_oct -= modenv->ramp_amount_db_oct * samples;
+                if (modenv->value_db_oct <= modenv->sustain_value_db_oct)
+                {
+                        modenv->value_db_oct = modenv->sustain_value_db_oct;
+                        modenv->state = ENV_SUSTAIN;
+                }
+                break;
 
-#ifdef FILTER_INITIAL
-#define NOOP(x) (void)x;
-                                        NOOP(coef1)
-                                        /* Apply expected attenuation. (FILTER_MOOG does it implicitly, but this one doesn't).
-                                         * Work in 24bits. */
-                                        dat = (dat * emu_voice->filt_att) >> 8;
-                                
-                                        int64_t vhp = ((-emu_voice->filt_buffer[0] * coef2) >> 24) - emu_voice->filt_buffer[1] - dat;
-                                        emu_voice->filt_buffer[1] += (emu_voice->filt_buffer[0] * coef0) >> 24;
-                                        emu_voice->filt_buffer[0] += (vhp * coef0) >> 24;
-                                        dat = (int32_t)(emu_voice->filt_buffer[1] >> 8);
-                                        if (dat > 32767) { dat = 32767; }
-                                        else if (dat < -32768) { dat = -32768; }
-
-#elif defined FILTER_MOOG
-
-                                        /*move to 24bits*/
-                                        dat <<= 8;
-
-                                        dat -= (coef2 * emu_voice->filt_buffer[4]) >> 24; /*feedback*/
-                                        int64_t t1 = emu_voice->filt_buffer[1];
-                                        emu_voice->filt_buffer[1] = ((dat + emu_voice->filt_buffer[0]) * coef0 - emu_voice->filt_buffer[1] * coef1) >> 24;
-                                        emu_voice->filt_buffer[1] = ClipBuffer(emu_voice->filt_buffer[1]);
-
-                                        int64_t t2 = emu_voice->filt_buffer[2];
-                                        emu_voice->filt_buffer[2] = ((emu_voice->filt_buffer[1] + t1) * coef0 - emu_voice->filt_buffer[2] * coef1) >> 24;
-                                        emu_voice->filt_buffer[2] = ClipBuffer(emu_voice->filt_buffer[2]);
-
-                                        int64_t t3 = emu_voice->filt_buffer[3];
-                                        emu_voice->filt_buffer[3] = ((emu_voice->filt_buffer[2] + t2) * coef0 - emu_voice->filt_buffer[3] * coef1) >> 24;
-                                        emu_voice->filt_buffer[3] = ClipBuffer(emu_voice->filt_buffer[3]);
-
-                                        emu_voice->filt_buffer[4] = ((emu_voice->filt_buffer[3] + t3) * coef0 - emu_voice->filt_buffer[4] * coef1) >> 24;
-                                        emu_voice->filt_buffer[4] = ClipBuffer(emu_voice->filt_buffer[4]);
-
-                                        emu_voice->filt_buffer[0] = ClipBuffer(dat);
-
-                                        dat = (int32_t)(emu_voice->filt_buffer[4] >> 8);
-                                        if (dat > 32767)
-                                        { dat = 32767; }
-                                        else if (dat < -32768)
-                                        { dat = -32768; }
-
-#elif defined FILTER_CONSTANT
-
-                                        /* Apply expected attenuation. (FILTER_MOOG does it implicitly, but this one is constant gain).
-                                         * Also stay at 24bits.*/
-                                        dat = (dat * emu_voice->filt_att) >> 8;
-
-                                        emu_voice->filt_buffer[0] = (coef1 * emu_voice->filt_buffer[0]
-                                                + coef0 * (dat +
-                                                    ((coef2 * (emu_voice->filt_buffer[0] - emu_voice->filt_buffer[1]))>>24))
-                                                ) >> 24;
-                                        emu_voice->filt_buffer[1] = (coef1 * emu_voice->filt_buffer[1]
-                                                + coef0 * emu_voice->filt_buffer[0]) >> 24;
-
-                                        emu_voice->filt_buffer[0] = ClipBuffer(emu_voice->filt_buffer[0]);
-                                        emu_voice->filt_buffer[1] = ClipBuffer(emu_voice->filt_buffer[1]);
-
-                                        dat = (int32_t)(emu_voice->filt_buffer[1] >> 8);
-                                        if (dat > 32767) { dat = 32767; }
-                                        else if (dat < -32768) { dat = -32768; }
+        case ENV_RAMP_UP:
+                /* Decay/release amount is in fraction of octave and is always positive */
+                modenv->value_db_oct += modenv->ramp_amount_db_oct * samples;
+                if (modenv->value_db_oct >= modenv->sustain_value_db_oct)
+                {
+                        modenv->value_db_oct = modenv->sustain_value_db_oct;
+                        modenv->state = ENV_SUSTAIN;
+                }
+                break;
+        }
 
-#endif
+        /* run lfos */
+        if (emu_voice->lfo1_delay_samples >= samples)
+        {
+                emu_voice->lfo1_delay_samples -= samples;
+        }
+        else
+        {
+                emu_voice->lfo1_count.addr += emu_voice->lfo1_speed * (samples - emu_voice->lfo1_delay_samples);
+                emu_voice->lfo1_count.int_address &= 0xFFFF;
+                emu_voice->lfo1_delay_samples = 0;
+        }
+        if (emu_voice->lfo2_delay_samples >= samples)
+        {
+                emu_voice->lfo2_delay_samples -= samples;
+        }
+        else
+        {
+                emu_voice->lfo2_count.addr += emu_voice->lfo2_speed * (samples - emu_voice->lfo2_delay_samples);
+                emu_voice->lfo2_count.int_address &= 0xFFFF;
+                emu_voice->lfo2_delay_samples = 0;
+        }
 
-                                }
-                                if ((emu8k->hwcf3 & 0x04) && !CCCA_DMA_ACTIVE(emu_voice->ccca))
-                                {
-                                        /*volume and pan*/
-                                        dat = (dat * emu_voice->cvcf_curr_volume) >> 16;
+        if (emu_voice->fixed_modenv_pitch_height)
+        {
+                /* modenv range 1<<21, pitch height range 1<<14 desired range 0x1000 (+/-one octave) */
+                currentpitch += ((modenv->value_db_oct >> 9) * emu_voice->fixed_modenv_pitch_height) >> 14;
+        }
 
-                                        (*buf++) += (dat * emu_voice->vol_l) >> 8;
-                                        (*buf++) += (dat * emu_voice->vol_r) >> 8;
+        if (emu_voice->fixed_lfo1_vibrato)
+        {
+                /* table range 1<<15, pitch mod range 1<<14 desired range 0x1000 (+/-one octave) */
+                int32_t lfo1_vibrato = (EMU8K_MOD_CONVERT(sample_tables, lfotable, emu8k_lfo_triangle, emu_voice->lfo1_count.int_address)
+                                        * emu_voice->fixed_lfo1_vibrato) >> 17;
+                currentpitch += lfo1_vibrato;
+        }
+        if (emu_voice->fixed_lfo2_vibrato)
+        {
+                /* table range 1<<15, pitch mod range 1<<14 desired range 0x1000 (+/-one octave) */
+                int32_t lfo2_vibrato = (EMU8K_MOD_CONVERT(sample_tables, lfotable, emu8k_lfo_triangle, emu_voice->lfo2_count.int_address)
+                                        * emu_voice->fixed_lfo2_vibrato) >> 17;
+                currentpitch += lfo2_vibrato;
+        }
 
-                                        /* Effects section */
-                                        if (emu_voice->ptrx_revb_send > 0)
-                                        {
-                                                emu8k->reverb_in_buffer[pos] += (dat * emu_voice->ptrx_revb_send) >> 8;
-                                        }
-                                        if (emu_voice->csl_chor_send > 0)
-                                        {
-                                                emu8k->chorus_in_buffer[pos] += (dat * emu_voice->csl_chor_send) >> 8;
-                                        }
-                                }
-                        }
+        if (emu_voice->fixed_modenv_filter_height)
+        {
+                /* modenv range 1<<21, pitch height range 1<<14 desired range 0x200000 (+/-full filter range) */
+                filtercut += ((modenv->value_db_oct >> 9) * emu_voice->fixed_modenv_filter_height) >> 5;
+        }
 
-                        if (emu_voice->env_engine_on)
-                        {
-                                int32_t attenuation = emu_voice->initial_att;
-                                int32_t filtercut = emu_voice->initial_filter;
-                                int32_t currentpitch = emu_voice->ip;
-                                /* run envelopes */
-                                emu8k_envelope_t* volenv = &emu_voice->vol_envelope;
-                                switch (volenv->state)
-                                {
-                                case ENV_DELAY:
-                                        volenv->delay_samples--;
-                                        if (volenv->delay_samples <= 0)
-                                        {
-                                                volenv->state = ENV_ATTACK;
-                                                volenv->delay_samples = 0;
-                                        }
-                                        attenuation = 0x1FFFFF;
-                                        break;
+        if (emu_voice->fixed_lfo1_filt_mod)
+        {
+                /* table range 1<<15, pitch mod range 1<<14 desired range 0x100000 (+/-three octaves) */
+                int32_t lfo1_filtmod = (EMU8K_MOD_CONVERT(sample_tables, lfotable, emu8k_lfo_triangle, emu_voice->lfo1_count.int_address)
+                                        * emu_voice->fixed_lfo1_filt_mod) >> 9;
+                filtercut += lfo1_filtmod;
+        }
 
-                                case ENV_ATTACK:
-                                        /* Attack amount is in linear amplitude */
-                                        volenv->value_amp_hz += volenv->attack_amount_amp_hz;
-                                        if (volenv->value_amp_hz >= (1 << 21))
-                                        {
-                                                volenv->value_amp_hz = 1 << 21;
-                                                volenv->value_db_oct = 0;
-                                                if (volenv->hold_samples)
-                                                {
-                                                        volenv->state = ENV_HOLD;
-                                                }
-                                                else
-                                                {
-                                                        /* RAMP_UP since db value is inverted and it is 0 at this point. */
-                                                        volenv->state = ENV_RAMP_UP;
-                                                }
-                                        }
-                                        attenuation += env_vol_amplitude_to_db[volenv->value_amp_hz >> 5] << 5;
-                                        break;
+        if (emu_voice->fixed_lfo1_tremolo)
+        {
+                /* table range 1<<15, pitch mod range 1<<14 desired range 0x40000 (+/-12dBs). */
+                int32_t lfo1_tremolo = (EMU8K_MOD_CONVERT(sample_tables, lfotable, emu8k_lfo_triangle, emu_voice->lfo1_count.int_address)
+                                        * emu_voice->fixed_lfo1_tremolo) >> 11;
+                attenuation += lfo1_tremolo;
+        }
 
-                                case ENV_HOLD:
-                                        volenv->hold_samples--;
-                                        if (volenv->hold_samples <= 0)
-                                        {
-                                                volenv->state = ENV_RAMP_UP;
-                                        }
-                                        attenuation += volenv->value_db_oct;
-                                        break;
+        if (currentpitch > 0xFFFF) currentpitch = 0xFFFF;
+        if (currentpitch < 0) currentpitch = 0;
+        if (attenuation > 0x1FFFFF) attenuation = 0x1FFFFF;
+        if (attenuation < 0) attenuation = 0;
+        if (filtercut > 0x1FFFFF) filtercut = 0x1FFFFF;
+        if (filtercut < 0) filtercut = 0;
+
+        emu_voice->vtft_vol_target = EMU8K_MOD_CONVERT(sample_tables, env_vol_db_to_vol_target, emu8k_env_vol_db_to_vol_target,
+                                                       attenuation >> 5);
+        emu_voice->vtft_filter_target = filtercut >> 5;
+        emu_voice->ptrx_pit_target = EMU8K_MOD_CONVERT(sample_tables, freqtable, emu8k_pitch_to_speed, currentpitch);
+}
 
-                                case ENV_RAMP_DOWN:
-                                        /* Decay/release amount is in fraction of dBs and is always positive */
-                                        volenv->value_db_oct -= volenv->ramp_amount_db_oct;
-                                        if (volenv->value_db_oct <= volenv->sustain_value_db_oct)
-                                        {
-                                                volenv->value_db_oct = volenv->sustain_value_db_oct;
-                                                volenv->state = ENV_SUSTAIN;
-                                        }
-                                        attenuation += volenv->value_db_oct;
-                                        break;
+static void emu8k_voice_modulate_sample_tables(emu8k_voice_t* emu_voice, int samples)
+{
+        emu8k_voice_modulate(emu_voice, samples, true);
+}
 
-                                case ENV_RAMP_UP:
-                                        /* Decay/release amount is in fraction of dBs and is always positive */
-                                        volenv->value_db_oct += volenv->ramp_amount_db_oct;
-                                        if (volenv->value_db_oct >= volenv->sustain_value_db_oct)
-                                        {
-                                                volenv->value_db_oct = volenv->sustain_value_db_oct;
-                                                volenv->state = ENV_SUSTAIN;
-                                        }
-                                        attenuation += volenv->value_db_oct;
-                                        break;
+static void emu8k_voice_modulate_compact(emu8k_voice_t* emu_voice, int samples)
+{
+        emu8k_voice_modulate(emu_voice, samples, false);
+}
 
-                                case ENV_SUSTAIN:
-                                        attenuation += volenv->value_db_oct;
-                                        break;
+/* Step to go from value to target in the given number of samples, rounded away from zero so that it gets there. */
+static int32_t emu8k_ramp_step(int32_t value, int32_t target, int samples)
+{
+        int32_t diff = target - value;
+        if (diff > 0)
+                return (diff + samples - 1) / samples;
+        else
+                return (diff - samples + 1) / samples;
+}
 
-                                case ENV_STOPPED:
-                                        attenuation = 0x1FFFFF;
-                                        break;
-                                }
+/* Advances a slide by one sample, stopping at the target. Returns the new value in whole units. */
+static inline int32_t emu8k_ramp_next(int32_t* value, int32_t* step, int32_t target)
+{
+        *value += *step;
+        if (*step > 0 ? *value >= target : *value <= target)
+        {
+                *value = target;
+                *step = 0;
+        }
+        return *value >> EMU8K_RAMP_SHIFT;
+}
 
-                                emu8k_envelope_t* modenv = &emu_voice->mod_envelope;
-                                switch (modenv->state)
-                                {
-                                case ENV_DELAY:
-                                        modenv->delay_samples--;
-                                        if (modenv->delay_samples <= 0)
-                                        {
-                                                modenv->state = ENV_ATTACK;
-                                                modenv->delay_samples = 0;
-                                        }
-                                        break;
+/* Starts sliding pitch and volume towards the targets over the next control period; the filter cutoff just follows. */
+static void emu8k_voice_ramp(emu8k_voice_t* emu_voice, emu8k_ramp_t* ramp, int samples)
+{
+        ramp->pitch = emu_voice->cpf_curr_pitch << EMU8K_RAMP_SHIFT;
+        ramp->pitch_step = emu8k_ramp_step(ramp->pitch, emu_voice->ptrx_pit_target << EMU8K_RAMP_SHIFT, samples);
 
-                                case ENV_ATTACK:
-                                        /* Attack amount is in linear amplitude */
-                                        modenv->value_amp_hz += modenv->attack_amount_amp_hz;
-                                        modenv->value_db_oct = env_mod_hertz_to_octave[modenv->value_amp_hz >> 5] << 5;
-                                        if (modenv->value_amp_hz >= (1 << 21))
-                                        {
-                                                modenv->value_amp_hz = 1 << 21;
-                                                modenv->value_db_oct = 1 << 21;
-                                                if (modenv->hold_samples)
-                                                {
-                                                        modenv->state = ENV_HOLD;
-                                                }
-                                                else
-                                                {
-                                                        modenv->state = ENV_RAMP_DOWN;
-                                                }
-                                        }
-                                        break;
+        /* Same maximum slope as emu8k_vol_slide */
+        ramp->vol = emu_voice->volumeslide.last << EMU8K_RAMP_SHIFT;
+        ramp->vol_step = emu8k_ramp_step(ramp->vol, emu_voice->vtft_vol_target << EMU8K_RAMP_SHIFT, samples);
+        if (ramp->vol_step > (0x400 << EMU8K_RAMP_SHIFT)) ramp->vol_step = 0x400 << EMU8K_RAMP_SHIFT;
+        else if (ramp->vol_step < -(0x400 << EMU8K_RAMP_SHIFT)) ramp->vol_step = -(0x400 << EMU8K_RAMP_SHIFT);
 
-                                case ENV_HOLD:
-                                        modenv->hold_samples--;
-                                        if (modenv->hold_samples <= 0)
-                                        {
-                                                modenv->state = ENV_RAMP_UP;
-                                        }
-                                        break;
+        emu_voice->cvcf_curr_filt_ctoff = emu_voice->vtft_filter_target;
+}
 
-                                case ENV_RAMP_DOWN:
-                                        /* Decay/release amount is in fraction of octave and is always positive */
-                                        modenv->value_db_oct -= modenv->ramp_amount_db_oct;
-                                        if (modenv->value_db_oct <= modenv->sustain_value_db_oct)
-                                        {
-                                                modenv->value_db_oct = modenv->sustain_value_db_oct;
-                                                modenv->state = ENV_SUSTAIN;
-                                        }
-                                        break;
+/* clip at twice the range */
+#define ClipBuffer(buf) (buf < -16777216) ? -16777216 : (buf > 16777216) ? 16777216 : buf
 
-                                case ENV_RAMP_UP:
-                                        /* Decay/release amount is in fraction of octave and is always positive */
-                                        modenv->value_db_oct += modenv->ramp_amount_db_oct;
-                                        if (modenv->value_db_oct >= modenv->sustain_value_db_oct)
-                                        {
-                                                modenv->value_db_oct = modenv->sustain_value_db_oct;
-                                                modenv->state = ENV_SUSTAIN;
-                                        }
-                                        break;
-                                }
+/* State variable filter. */
+static inline int32_t emu8k_filter_initial(emu8k_voice_t* emu_voice, int32_t dat, const int32_t* coefs)
+{
+        const int64_t coef0 = coefs[0];
+        const int64_t coef1 = coefs[1];
+        const int64_t coef2 = coefs[2];
+        NOREF(coef1);
+
+        /* Apply expected attenuation. (emu8k_filter_moog does it implicitly, but this one doesn't).
+         * Work in 24bits. */
+        dat = (dat * emu_voice->filt_att) >> 8;
+
+        int64_t vhp = ((-emu_voice->filt_buffer[0] * coef2) >> 24) - emu_voice->filt_buffer[1] - dat;
+        emu_voice->filt_buffer[1] += (emu_voice->filt_buffer[0] * coef0) >> 24;
+        emu_voice->filt_buffer[0] += (vhp * coef0) >> 24;
+        dat = (int32_t)(emu_voice->filt_buffer[1] >> 8);
+        if (dat > 32767) { dat = 32767; }
+        else if (dat < -32768) { dat = -32768; }
+        return dat;
+}
 
-                                /* run lfos */
-                                if (emu_voice->lfo1_delay_samples)
-                                {
-                                        emu_voice->lfo1_delay_samples--;
-                                }
-                                else
-                                {
-                                        emu_voice->lfo1_count.addr += emu_voice->lfo1_speed;
-                                        emu_voice->lfo1_count.int_address &= 0xFFFF;
-                                }
-                                if (emu_voice->lfo2_delay_samples)
-                                {
-                                        emu_voice->lfo2_delay_samples--;
-                                }
-                                else
-                                {
-                                        emu_voice->lfo2_count.addr += emu_voice->lfo2_speed;
-                                        emu_voice->lfo2_count.int_address &= 0xFFFF;
-                                }
+/* Four pole ladder filter, with resonance. */
+static inline int32_t emu8k_filter_moog(emu8k_voice_t* emu_voice, int32_t dat, const int32_t* coefs)
+{
+        const int64_t coef0 = coefs[0];
+        const int64_t coef1 = coefs[1];
+        const int64_t coef2 = coefs[2];
 
-                                if (emu_voice->fixed_modenv_pitch_height)
-                                {
-                                        /* modenv range 1<<21, pitch height range 1<<14 desired range 0x1000 (+/-one octave) */
-                                        currentpitch += ((modenv->value_db_oct >> 9) * emu_voice->fixed_modenv_pitch_height) >> 14;
-                                }
+        /*move to 24bits*/
+        dat <<= 8;
 
-                                if (emu_voice->fixed_lfo1_vibrato)
-                                {
-                                        /* table range 1<<15, pitch mod range 1<<14 desired range 0x1000 (+/-one octave) */
-                                        int32_t lfo1_vibrato = (lfotable[emu_voice->lfo1_count.int_address] * emu_voice->fixed_lfo1_vibrato) >> 17;
-                                        currentpitch += lfo1_vibrato;
-                                }
-                                if (emu_voice->fixed_lfo2_vibrato)
-                                {
-                                        /* table range 1<<15, pitch mod range 1<<14 desired range 0x1000 (+/-one octave) */
-                                        int32_t lfo2_vibrato = (lfotable[emu_voice->lfo2_count.int_address] * emu_voice->fixed_lfo2_vibrato) >> 17;
-                                        currentpitch += lfo2_vibrato;
-                                }
+        dat -= (coef2 * emu_voice->filt_buffer[4]) >> 24; /*feedback*/
+        int64_t t1 = emu_voice->filt_buffer[1];
+        emu_voice->filt_buffer[1] = ((dat + emu_voice->filt_buffer[0]) * coef0 - emu_voice->filt_buffer[1] * coef1) >> 24;
+        emu_voice->filt_buffer[1] = ClipBuffer(emu_voice->filt_buffer[1]);
+
+        int64_t t2 = emu_voice->filt_buffer[2];
+        emu_voice->filt_buffer[2] = ((emu_voice->filt_buffer[1] + t1) * coef0 - emu_voice->filt_buffer[2] * coef1) >> 24;
+        emu_voice->filt_buffer[2] = ClipBuffer(emu_voice->filt_buffer[2]);
+
+        int64_t t3 = emu_voice->filt_buffer[3];
+        emu_voice->filt_buffer[3] = ((emu_voice->filt_buffer[2] + t2) * coef0 - emu_voice->filt_buffer[3] * coef1) >> 24;
+        emu_voice->filt_buffer[3] = ClipBuffer(emu_voice->filt_buffer[3]);
+
+        emu_voice->filt_buffer[4] = ((emu_voice->filt_buffer[3] + t3) * coef0 - emu_voice->filt_buffer[4] * coef1) >> 24;
+        emu_voice->filt_buffer[4] = ClipBuffer(emu_voice->filt_buffer[4]);
+
+        emu_voice->filt_buffer[0] = ClipBuffer(dat);
 
-                                if (emu_voice->fixed_modenv_filter_height)
+        dat = (int32_t)(emu_voice->filt_buffer[4] >> 8);
+        if (dat > 32767)
+        { dat = 32767; }
+        else if (dat < -32768)
+        { dat = -32768; }
+        return dat;
+}
+
+/* Two pole filter with constant gain. */
+static inline int32_t emu8k_filter_constant(emu8k_voice_t* emu_voice, int32_t dat, const int32_t* coefs)
+{
+        const int64_t coef0 = coefs[0];
+        const int64_t coef1 = coefs[1];
+        const int64_t coef2 = coefs[2];
+
+        /* Apply expected attenuation. (emu8k_filter_moog does it implicitly, but this one is constant gain).
+         * Also stay at 24bits.*/
+        dat = (dat * emu_voice->filt_att) >> 8;
+
+        emu_voice->filt_buffer[0] = (coef1 * emu_voice->filt_buffer[0]
+                + coef0 * (dat +
+                    ((coef2 * (emu_voice->filt_buffer[0] - emu_voice->filt_buffer[1]))>>24))
+                ) >> 24;
+        emu_voice->filt_buffer[1] = (coef1 * emu_voice->filt_buffer[1]
+                + coef0 * emu_voice->filt_buffer[0]) >> 24;
+
+        emu_voice->filt_buffer[0] = ClipBuffer(emu_voice->filt_buffer[0]);
+        emu_voice->filt_buffer[1] = ClipBuffer(emu_voice->filt_buffer[1]);
+
+        dat = (int32_t)(emu_voice->filt_buffer[1] >> 8);
+        if (dat > 32767) { dat = 32767; }
+        else if (dat < -32768) { dat = -32768; }
+        return dat;
+}
+
+/* Renders a voice up to new_pos. The interpolation and filter are constants in each of the instances below,
+ * so that the compiler specializes them; the filter is skipped anyway while it is wide open. */
+DECL_FORCE_INLINE(void) emu8k_voice_render(emu8k_t* emu8k, emu8k_voice_t* emu_voice, emu8k_ramp_t* ramp, int new_pos,
+                                           const emu8k_interp_t interp, const emu8k_filter_t filter)
+{
+        int32_t* buf = &emu8k->buffer[emu8k->pos * 2];
+        int control_left = emu8k->control_left;
+        int pos;
+
+        for (pos = emu8k->pos; pos < new_pos; pos++, buf += 2)
+        {
+                int32_t dat;
+
+                if (emu_voice->cvcf_curr_volume)
+                {
+                        /* Waveform oscillator */
+                        if (interp == EMU8K_INTERP_LINEAR)
+                        {
+                                dat = EMU8K_READ_INTERP_LINEAR(emu8k, emu_voice->addr.int_address,
+                                                        emu_voice->addr.fract_address);
+                        }
+                        else
+                        {
+                                dat = EMU8K_READ_INTERP_CUBIC(emu8k, emu_voice->addr.int_address,
+                                        emu_voice->addr.fract_address);
+                        }
+
+                        /* Filter section */
+                        if (filter != EMU8K_FILTER_NONE
+                            && (emu_voice->filterq_idx || emu_voice->cvcf_curr_filt_ctoff != 0xFFFF))
+                        {
+                                const int32_t* coefs = filt_coeffs[filter - 1][emu_voice->filterq_idx][emu_voice->cvcf_curr_filt_ctoff >> 8];
+                                switch (filter)
                                 {
-                                        /* modenv range 1<<21, pitch height range 1<<14 desired range 0x200000 (+/-full filter range) */
-                                        filtercut += ((modenv->value_db_oct >> 9) * emu_voice->fixed_modenv_filter_height) >> 5;
+                                case EMU8K_FILTER_INITIAL:
+                                        dat = emu8k_filter_initial(emu_voice, dat, coefs);
+                                        break;
+                                case EMU8K_FILTER_MOOG:
+                                        dat = emu8k_filter_moog(emu_voice, dat, coefs);
+                                        break;
+                                case EMU8K_FILTER_CONSTANT:
+                                        dat = emu8k_filter_constant(emu_voice, dat, coefs);
+                                        break;
+                                default:
+                                        break;
                                 }
+                        }
+                        if ((emu8k->hwcf3 & 0x04) && !CCCA_DMA_ACTIVE(emu_voice->ccca))
+                        {
+                                /*volume and pan*/
+                                dat = (dat * emu_voice->cvcf_curr_volume) >> 16;
 
-                                if (emu_voice->fixed_lfo1_filt_mod)
+                                buf[0] += (dat * emu_voice->vol_l) >> 8;
+                                buf[1] += (dat * emu_voice->vol_r) >> 8;
+
+                                /* Effects section */
+                                if (emu_voice->ptrx_revb_send > 0)
                                 {
-                                        /* table range 1<<15, pitch mod range 1<<14 desired range 0x100000 (+/-three octaves) */
-                                        int32_t lfo1_filtmod = (lfotable[emu_voice->lfo1_count.int_address] * emu_voice->fixed_lfo1_filt_mod) >> 9;
-                                        filtercut += lfo1_filtmod;
+                                        emu8k->reverb_in_buffer[pos] += (dat * emu_voice->ptrx_revb_send) >> 8;
                                 }
-
-                                if (emu_voice->fixed_lfo1_tremolo)
+                                if (emu_voice->csl_chor_send > 0)
                                 {
-                                        /* table range 1<<15, pitch mod range 1<<14 desired range 0x40000 (+/-12dBs). */
-                                        int32_t lfo1_tremolo = (lfotable[emu_voice->lfo1_count.int_address] * emu_voice->fixed_lfo1_tremolo) >> 11;
-                                        attenuation += lfo1_tremolo;
+                                        emu8k->chorus_in_buffer[pos] += (dat * emu_voice->csl_chor_send) >> 8;
                                 }
+                        }
+                }
 
-                                if (currentpitch > 0xFFFF) currentpitch = 0xFFFF;
-                                if (currentpitch < 0) currentpitch = 0;
-                                if (attenuation > 0x1FFFFF) attenuation = 0x1FFFFF;
-                                if (attenuation < 0) attenuation = 0;
-                                if (filtercut > 0x1FFFFF) filtercut = 0x1FFFFF;
-                                if (filtercut < 0) filtercut = 0;
-
-                                emu_voice->vtft_vol_target = env_vol_db_to_vol_target[attenuation >> 5];
-                                emu_voice->vtft_filter_target = filtercut >> 5;
-                                emu_voice->ptrx_pit_target = freqtable[currentpitch] >> 18;
-
+                /* Modulation, on every sample or once per control period */
+                if (--control_left == 0)
+                {
+                        control_left = emu8k->control_rate;
+                        if (emu_voice->env_engine_on)
+                        {
+                                if (emu8k->sample_tables)
+                                        emu8k_voice_modulate_sample_tables(emu_voice, control_left);
+                                else
+                                        emu8k_voice_modulate_compact(emu_voice, control_left);
+                        }
+                        if (control_left > 1)
+                        {
+                                emu8k_voice_ramp(emu_voice, ramp, control_left);
                         }
+                }
 /*
 I've recopilated these sentences to get an idea of how to loop
 
@@ -2105,23 +2293,121 @@ I've recopilated these sentences to get an idea of how to loop
 -In programs that use the awe, they generally set the loop address as "loopaddress -1" to compensate for the above.
 (Note: I am already using address+1 in the interpolators so these things are already as they should.)
 */
-                        emu_voice->addr.addr += ((uint64_t)emu_voice->cpf_curr_pitch) << 18;
-                        if (emu_voice->addr.addr >= emu_voice->loop_end.addr)
-                        {
-                                emu_voice->addr.int_address -= (emu_voice->loop_end.int_address - emu_voice->loop_start.int_address);
-                                emu_voice->addr.int_address &= EMU8K_MEM_ADDRESS_MASK;
-                        }
+                emu_voice->addr.addr += ((uint64_t)emu_voice->cpf_curr_pitch) << 18;
+                if (emu_voice->addr.addr >= emu_voice->loop_end.addr)
+                {
+                        emu_voice->addr.int_address -= (emu_voice->loop_end.int_address - emu_voice->loop_start.int_address);
+                        emu_voice->addr.int_address &= EMU8K_MEM_ADDRESS_MASK;
+                }
 
+                if (emu8k->control_rate == 1)
+                {
                         /* TODO: How and when are the target and current values updated */
                         emu_voice->cpf_curr_pitch = emu_voice->ptrx_pit_target;
                         emu_voice->cvcf_curr_volume = emu8k_vol_slide(&emu_voice->volumeslide, emu_voice->vtft_vol_target);
                         emu_voice->cvcf_curr_filt_ctoff = emu_voice->vtft_filter_target;
                 }
+                else
+                {
+                        if (ramp->pitch_step)
+                        {
+                                emu_voice->cpf_curr_pitch = emu8k_ramp_next(&ramp->pitch, &ramp->pitch_step,
+                                        emu_voice->ptrx_pit_target << EMU8K_RAMP_SHIFT);
+                        }
+                        if (ramp->vol_step)
+                        {
+                                emu_voice->volumeslide.last = emu8k_ramp_next(&ramp->vol, &ramp->vol_step,
+                                        emu_voice->vtft_vol_target << EMU8K_RAMP_SHIFT);
+                                emu_voice->cvcf_curr_volume = emu_voice->volumeslide.last;
+                        }
+                }
+        }
+}
+
+typedef void (*emu8k_voice_kernel_t)(emu8k_t* emu8k, emu8k_voice_t* emu_voice, emu8k_ramp_t* ramp, int new_pos);
+
+#define EMU8K_VOICE_KERNEL(interp, filter) \
+        static void emu8k_voice_render_##interp##_##filter(emu8k_t* emu8k, emu8k_voice_t* emu_voice, emu8k_ramp_t* ramp, int new_pos) \
+        { \
+                emu8k_voice_render(emu8k, emu_voice, ramp, new_pos, EMU8K_INTERP_##interp, EMU8K_FILTER_##filter); \
+        }
+
+EMU8K_VOICE_KERNEL(LINEAR, NONE)
+EMU8K_VOICE_KERNEL(LINEAR, INITIAL)
+EMU8K_VOICE_KERNEL(LINEAR, MOOG)
+EMU8K_VOICE_KERNEL(LINEAR, CONSTANT)
+EMU8K_VOICE_KERNEL(CUBIC, NONE)
+EMU8K_VOICE_KERNEL(CUBIC, INITIAL)
+EMU8K_VOICE_KERNEL(CUBIC, MOOG)
+EMU8K_VOICE_KERNEL(CUBIC, CONSTANT)
+
+static const emu8k_voice_kernel_t emu8k_voice_kernels[EMU8K_INTERP_COUNT][EMU8K_FILTER_COUNT] =
+{
+        { emu8k_voice_render_LINEAR_NONE, emu8k_voice_render_LINEAR_INITIAL, emu8k_voice_render_LINEAR_MOOG, emu8k_voice_render_LINEAR_CONSTANT },
+        { emu8k_voice_render_CUBIC_NONE, emu8k_voice_render_CUBIC_INITIAL, emu8k_voice_render_CUBIC_MOOG, emu8k_voice_render_CUBIC_CONSTANT },
+};
+
+
+/* Whether the filter of a voice stays wide open, and so does nothing, until its registers are written to. */
+static int emu8k_voice_filter_open(const emu8k_voice_t* emu_voice)
+{
+        if (emu_voice->filterq_idx || emu_voice->cvcf_curr_filt_ctoff != 0xFFFF || emu_voice->vtft_filter_target != 0xFFFF)
+                return 0;
+        /* Otherwise the envelope engine could move the target */
+        return !emu_voice->env_engine_on
+               || (!emu_voice->fixed_modenv_filter_height && !emu_voice->fixed_lfo1_filt_mod
+                   && (emu_voice->initial_filter >> 5) >= 0xFFFF);
+}
+//int32_t old_pitch[32]={0};
+//int32_t old_cut[32]={0};
+//int32_t old_vol[32]={0};
+void emu8k_update(emu8k_t* emu8k, int new_pos)
+{
+        if (emu8k->pos >= new_pos)
+                return;
+
+        AssertLogRelReturnVoid(new_pos <= MAXSOUNDBUFLEN);
+
+        int32_t* buf;
+        emu8k_voice_t* emu_voice;
+        uint32_t voices;
+        int pos;
+        int c;
+
+        /* Clean the buffers since we will accumulate into them. */
+        buf = &emu8k->buffer[emu8k->pos * 2];
+        memset(buf, 0, 2 * (new_pos - emu8k->pos) * sizeof(emu8k->buffer[0]));
+        memset(&emu8k->chorus_in_buffer[emu8k->pos], 0, (new_pos - emu8k->pos) * sizeof(emu8k->chorus_in_buffer[0]));
+        memset(&emu8k->reverb_in_buffer[emu8k->pos], 0, (new_pos - emu8k->pos) * sizeof(emu8k->reverb_in_buffer[0]));
+
+        /* Voices section. Only the voices that can still produce sound or change state. */
+        voices = emu8k->active_voices;
+        while (voices)
+        {
+                c = ASMBitFirstSetU32(voices) - 1;
+                voices &= voices - 1;
+                emu_voice = &emu8k->voice[c];
+
+                emu8k_voice_kernels[emu8k->interp][emu8k_voice_filter_open(emu_voice) ? EMU8K_FILTER_NONE : emu8k->filter]
+                        (emu8k, emu_voice, &emu8k->ramp[c], new_pos);
 
                 /* Update EMU voice registers. */
                 emu_voice->ccca = (((uint32_t)emu_voice->ccca_qcontrol) << 24) | emu_voice->addr.int_address;
                 emu_voice->cpf_curr_frac_addr = emu_voice->addr.fract_address;
 
+                /* A stopped voice which has faded out and has no envelope to run will render silence until
+                 * it is written to again, and none of its registers change meanwhile.
+                 * (Past the loop end it would still wrap around, unless the loop is empty, e.g. never set up.) */
+                if (!emu_voice->env_engine_on
+                    && !emu_voice->cvcf_curr_volume && !emu_voice->vtft_vol_target && !emu_voice->volumeslide.last
+                    && !emu_voice->cpf_curr_pitch && !emu_voice->ptrx_pit_target
+                    && emu_voice->cvcf_curr_filt_ctoff == emu_voice->vtft_filter_target
+                    && (emu_voice->addr.addr < emu_voice->loop_end.addr
+                        || emu_voice->loop_end.int_address == emu_voice->loop_start.int_address))
+                {
+                        emu8k->active_voices &= ~(1u << c);
+                }
+
                 //if ( emu_voice->cvcf_curr_volume != old_vol[c]) {
                 //    pclog("EMUVOL (%d):%d\n", c, emu_voice->cvcf_curr_volume);
                 //    old_vol[c]=emu_voice->cvcf_curr_volume;
@@ -2129,6 +2415,12 @@ I've recopilated these sentences to get an idea of how to loop
                 //pclog("EMUFILT :%d\n", emu_voice->cvcf_curr_filt_ctoff);
         }
 
+        /* All voices share the control period, including those which were skipped. */
+        emu8k->control_left = (emu8k->control_left - 1 - (new_pos - emu8k->pos)) % emu8k->control_rate;
+        if (emu8k->control_left < 0)
+                emu8k->control_left += emu8k->control_rate;
+        emu8k->control_left++;
+
         buf = &emu8k->buffer[emu8k->pos * 2];
         emu8k_work_reverb(&emu8k->reverb_in_buffer[emu8k->pos], buf, &emu8k->reverb_engine, new_pos - emu8k->pos);
         emu8k_work_chorus(&emu8k->chorus_in_buffer[emu8k->pos], buf, &emu8k->chorus_engine, new_pos - emu8k->pos);
@@ -2157,24 +2449,23 @@ I've recopilated these sentences to get an idea of how to loop
         emu8k->pos = new_pos;
 }
 
-static void emu8k_init_globals()
+/* The tables above only depend on constants, so they are computed once and then shared by all instances. */
+static RTONCE g_emu8k_tables_once = RTONCE_INITIALIZER;
+
+static DECLCALLBACK(int) emu8k_init_globals(void *pvUser)
 {
     int c;
     double out;
 
-    /*Create frequency table. (Convert initial pitch register value to a linear speed change)
-     * The input is encoded such as 0xe000 is center note (no pitch shift)
-     * and from then on , changing up or down 0x1000 (4096) increments/decrements an octave.
-     * Note that this is in reference to the 44.1Khz clock that the channels play at.
-     * The 65536 * 65536 is in order to left-shift the 32bit value to a 64bit value as a 32.32 fixed point.
-     */
-    for (c = 0; c < 0x10000; c++)
+    /* Fraction tables for the pitch and envelope conversions. (see emu8k_pitch_to_speed and the emu8k_env_* functions) */
+    for (c = 0; c <= 4096; c++)
     {
-            freqtable[c] = (uint64_t)(exp2((double)(c - 0xe000) / 4096.0) * 65536.0 * 65536.0);
+            exp2_frac_table[c] = (uint32_t)(exp2(c / 4096.0) * 1073741824.0);
+    }
+    for (c = 0; c <= 1024; c++)
+    {
+            log2_frac_table[c] = (int32_t)(log2(1.0 + c / 1024.0) * 65536.0 + 0.5);
     }
-    /* Shortcut: minimum pitch equals stopped. I don't really know if this is true, but it's better
-     * since some programs set the pitch to 0 for unused channels. */
-    freqtable[0] = 0;
 
     /* starting at 65535 because it is used for "volume target" register conversion. */
     out = 65535.0;
@@ -2186,43 +2477,6 @@ static void emu8k_init_globals()
     /* Shortcut: max attenuation is silent, not -96dB. */
     attentable[255] = 0;
 
-    /* Note: these two tables have "db" inverted: 0 dB is max volume, 65535 "db" (-96.32dBFS) is silence.
-     * Important: Using 65535 as max output value because this is intended to be used with the volume target register! */
-    out = 65535.0;
-    for (c = 0; c < 0x10000; c++)
-    {
-            //double db = -(c*6.0205999/65535.0)*16.0;
-            //out = powf(10.f,db/20.f) * 65536.0;
-            env_vol_db_to_vol_target[c] = (int32_t)out;
-            /* calculated from the 65536th root of 65536 */
-            out /= 1.00016923970;
-    }
-    /* Shortcut: max attenuation is silent, not -96dB. */
-    env_vol_db_to_vol_target[0x10000 - 1] = 0;
-    /* One more position to accept max value being 65536. */
-    env_vol_db_to_vol_target[0x10000] = 0;
-
-    for (c = 1; c < 0x10000; c++)
-    {
-            out = -680.32142884264 * 20.0 * log10(((double)c) / 65535.0);
-            env_vol_amplitude_to_db[c] = (int32_t)out;
-    }
-    /*Shortcut: max attenuation is silent, not -96dB.*/
-    env_vol_amplitude_to_db[0] = 65535;
-    /* One more position to acceMpt max value being 65536. */
-    env_vol_amplitude_to_db[0x10000] = 0;
-
-    for (c = 1; c < 0x10000; c++)
-    {
-            out = log2((((double)c) / 0x10000) + 1.0) * 65536.0;
-            env_mod_hertz_to_octave[c] = (int32_t)out;
-    }
-    /*No hertz change, no octave change. */
-    env_mod_hertz_to_octave[0] = 0;
-    /* One more position to accept max value being 65536. */
-    env_mod_hertz_to_octave[0x10000] = 65536;
-
-
     /* This formula comes from vince vu/judge dredd's awe32p10 and corresponds to what the freebsd/linux AWE32 driver has. */
     float millis;
     for (c = 0; c < 128; c++)
@@ -2239,16 +2493,6 @@ static void emu8k_init_globals()
              * millis = (256+4096*(0x7F-c)) */
     }
 
-    /* The LFOs use a triangular waveform starting at zero and going 1/-1/1/-1.
-     * This table is stored in signed 16bits precision, with a period of 65536 samples */
-    for (c = 0; c < 65536; c++)
-    {
-            int d = (c + 16384) & 65535;
-            if (d >= 32768)
-                    lfotable[c] = 32768 + ((32768 - d) * 2);
-            else
-                    lfotable[c] = (d * 2) - 32768;
-    }
     /* The 65536 * 65536 is in order to left-shift the 32bit value to a 64bit value as a 32.32 fixed point. */
     out = 0.01;
     for (c = 0; c < 256; c++)
@@ -2270,34 +2514,39 @@ static void emu8k_init_globals()
             out = 125.0; /* Start at 125Hz */
             for (c = 0; c < 256; c++)
             {
-#ifdef FILTER_INITIAL
-                    float w0 = sin(2.0*M_PI*out / 44100.0);
-                    /* The value 102.5f has been selected a bit randomly. Pretends to reach 0.2929 at w0 = 1.0 */
-                    float q = (qidx / 102.5f) * (1.0 + 1.0 / w0);
-                    /* Limit max value. Else it would be 470. */
-                    if (q > 200) q=200;
-                    filt_coeffs[qidx][c][0] = (int32_t)(w0 * 16777216.0);
-                    filt_coeffs[qidx][c][1] = 16777216.0;
-                    filt_coeffs[qidx][c][2] = (int32_t)((1.0f / (0.7071f + q)) * 16777216.0);
-#elif defined FILTER_MOOG
-                    float w0 = sin(2.0 * M_PI * out / 44100.0);
-                    float q_factor = 1.0f - w0;
-                    float p = w0 + 0.8f * w0 * q_factor;
-                    float f = p + p - 1.0f;
-                    float resonance = (1.0 - pow(2.0, -qidx * 24.0 / 90.0)) * 0.8;
-                    float q = resonance * (1.0f + 0.5f * q_factor * (w0 + 5.6f * q_factor * q_factor));
-                    filt_coeffs[qidx][c][0] = (int32_t)(p * 16777216.0);
-                    filt_coeffs[qidx][c][1] = (int32_t)(f * 16777216.0);
-                    filt_coeffs[qidx][c][2] = (int32_t)(q * 16777216.0);
-#elif defined FILTER_CONSTANT
-                    float q = (1.0-pow(2.0,-qidx*24.0/90.0))*0.8;
-                    float coef0 = sin(2.0*M_PI*out / 44100.0);
-                    float coef1 = 1.0 - coef0;
-                    float coef2 = q * (1.0 + 1.0 / coef1);
-                    filt_coeffs[qidx][c][0] = (int32_t)(coef0 * 16777216.0);
-                    filt_coeffs[qidx][c][1] = (int32_t)(coef1 * 16777216.0);
-                    filt_coeffs[qidx][c][2] = (int32_t)(coef2 * 16777216.0);
-#endif //FILTER_TYPE
+                    {
+                            float w0 = sin(2.0*M_PI*out / 44100.0);
+                            /* The value 102.5f has been selected a bit randomly. Pretends to reach 0.2929 at w0 = 1.0 */
+                            float q = (qidx / 102.5f) * (1.0 + 1.0 / w0);
+                            /* Limit max value. Else it would be 470. */
+                            if (q > 200) q=200;
+                            int32_t* coefs = filt_coeffs[EMU8K_FILTER_INITIAL - 1][qidx][c];
+                            coefs[0] = (int32_t)(w0 * 16777216.0);
+                            coefs[1] = 16777216.0;
+                            coefs[2] = (int32_t)((1.0f / (0.7071f + q)) * 16777216.0);
+                    }
+                    {
+                            float w0 = sin(2.0 * M_PI * out / 44100.0);
+                            float q_factor = 1.0f - w0;
+                            float p = w0 + 0.8f * w0 * q_factor;
+                            float f = p + p - 1.0f;
+                            float resonance = (1.0 - pow(2.0, -qidx * 24.0 / 90.0)) * 0.8;
+                            float q = resonance * (1.0f + 0.5f * q_factor * (w0 + 5.6f * q_factor * q_factor));
+                            int32_t* coefs = filt_coeffs[EMU8K_FILTER_MOOG - 1][qidx][c];
+                            coefs[0] = (int32_t)(p * 16777216.0);
+                            coefs[1] = (int32_t)(f * 16777216.0);
+                            coefs[2] = (int32_t)(q * 16777216.0);
+                    }
+                    {
+                            float q = (1.0-pow(2.0,-qidx*24.0/90.0))*0.8;
+                            float coef0 = sin(2.0*M_PI*out / 44100.0);
+                            float coef1 = 1.0 - coef0;
+                            float coef2 = q * (1.0 + 1.0 / coef1);
+                            int32_t* coefs = filt_coeffs[EMU8K_FILTER_CONSTANT - 1][qidx][c];
+                            coefs[0] = (int32_t)(coef0 * 16777216.0);
+                            coefs[1] = (int32_t)(coef1 * 16777216.0);
+                            coefs[2] = (int32_t)(coef2 * 16777216.0);
+                    }
                     /* 42.66 divisions per octave (the doc says quarter seminotes which is 48, but then it would be almost an octave less) */
                     out *= 1.016378315;
                     /* 42 divisions. This moves the max frequency to 8.5Khz.*/
@@ -2318,17 +2567,82 @@ static void emu8k_init_globals()
             cubic_table[c * 4 + 2] = (-1.5 * x * x * x + 2.0 * x * x + 0.5 * x);
             cubic_table[c * 4 + 3] = (0.5 * x * x * x - 0.5 * x * x);
     }
+
+    NOREF(pvUser);
+    return VINF_SUCCESS;
+}
+
+/* The tables for modulating on every sample, filled the first time emu8k_set_control_rate asks for them. */
+static RTONCE g_emu8k_sample_tables_once = RTONCE_INITIALIZER;
+
+static DECLCALLBACK(int) emu8k_init_sample_tables(void *pvUser)
+{
+    int c;
+    double out;
+
+    for (c = 0; c < 0x10000; c++)
+    {
+            freqtable[c] = emu8k_pitch_to_speed(c);
+    }
+
+    /* Note: these two tables have "db" inverted: 0 dB is max volume, 65535 "db" (-96.32dBFS) is silence.
+     * Important: Using 65535 as max output value because this is intended to be used with the volume target register! */
+    out = 65535.0;
+    for (c = 0; c < 0x10000; c++)
+    {
+            env_vol_db_to_vol_target[c] = (int32_t)out;
+            /* calculated from the 65536th root of 65536 */
+            out /= 1.00016923970;
+    }
+    /* Shortcut: max attenuation is silent, not -96dB. */
+    env_vol_db_to_vol_target[0x10000 - 1] = 0;
+    /* One more position to accept max value being 65536. */
+    env_vol_db_to_vol_target[0x10000] = 0;
+
+    for (c = 1; c < 0x10000; c++)
+    {
+            out = -680.32142884264 * 20.0 * log10(((double)c) / 65535.0);
+            env_vol_amplitude_to_db[c] = (int32_t)out;
+    }
+    /*Shortcut: max attenuation is silent, not -96dB.*/
+    env_vol_amplitude_to_db[0] = 65535;
+    /* One more position to accept max value being 65536. */
+    env_vol_amplitude_to_db[0x10000] = 0;
+
+    for (c = 1; c < 0x10000; c++)
+    {
+            out = log2((((double)c) / 0x10000) + 1.0) * 65536.0;
+            env_mod_hertz_to_octave[c] = (int32_t)out;
+    }
+    /*No hertz change, no octave change. */
+    env_mod_hertz_to_octave[0] = 0;
+    /* One more position to accept max value being 65536. */
+    env_mod_hertz_to_octave[0x10000] = 65536;
+
+    for (c = 0; c < 0x10000; c++)
+    {
+            lfotable[c] = emu8k_lfo_triangle(c);
+    }
+
+    NOREF(pvUser);
+    return VINF_SUCCESS;
 }
 
 emu8k_t* emu8k_alloc(void *rom, void *ram, size_t ram_size)
 {
+    int rc = RTOnce(&g_emu8k_tables_once, emu8k_init_globals, NULL);
+    AssertRCReturn(rc, NULL);
+
     emu8k_t *emu8k = RTMemAlloc(sizeof(emu8k_t));
     AssertPtrReturn(emu8k, NULL);
 
-    emu8k_init_globals();
-
     emu8k->rom = rom;
     emu8k->ram = ram;
+    emu8k->control_rate = 1;
+    emu8k->sample_tables = false;
+    emu8k->interp = EMU8K_INTERP_CUBIC;
+    emu8k->filter = EMU8K_FILTER_MOOG;
+    emu8k_wake_voices(emu8k);
 
     /*AWE-DUMP creates ROM images offset by 2 bytes, so if we detect this
       then correct it*/
@@ -2413,6 +2727,33 @@ void emu8k_reset(emu8k_t* emu8k)
 
     emu8k->sample_count = 0;
     emu8k->sample_count_virtual = 0;
+
+    emu8k_wake_voices(emu8k);
+}
+
+void emu8k_wake_voices(emu8k_t* emu8k)
+{
+    emu8k->active_voices = UINT32_MAX;
+
+    /* Run a control step right away, so that no voice keeps sliding from where it was */
+    emu8k->control_left = 1;
+    memset(emu8k->ramp, 0, sizeof(emu8k->ramp));
+}
+
+void emu8k_set_control_rate(emu8k_t* emu8k, int samples)
+{
+    Assert(samples >= 1);
+    emu8k->control_rate = samples;
+    emu8k->sample_tables = samples == 1 && RT_SUCCESS(RTOnce(&g_emu8k_sample_tables_once, emu8k_init_sample_tables, NULL));
+    emu8k_wake_voices(emu8k);
+}
+
+void emu8k_set_kernels(emu8k_t* emu8k, emu8k_interp_t interp, emu8k_filter_t filter)
+{
+    AssertReturnVoid(interp >= 0 && interp < EMU8K_INTERP_COUNT);
+    AssertReturnVoid(filter >= 0 && filter < EMU8K_FILTER_COUNT);
+    emu8k->interp = interp;
+    emu8k->filter = filter;
 }
 
 void emu8k_render(emu8k_t *emu8k, int16_t *buf, size_t frames)
@@ -49,10 +49,36 @@ extern "C" {
 
 typedef struct emu8k_t emu8k_t;
 
+/** How samples are interpolated, from cheapest to best. */
+typedef enum emu8k_interp_t
+{
+    EMU8K_INTERP_LINEAR,
+    EMU8K_INTERP_CUBIC,
+    EMU8K_INTERP_COUNT
+} emu8k_interp_t;
+
+/** Implementations of the voice low-pass filter. */
+typedef enum emu8k_filter_t
+{
+    /** No filtering at all, the cheapest. */
+    EMU8K_FILTER_NONE,
+    EMU8K_FILTER_INITIAL,
+    /** The default. */
+    EMU8K_FILTER_MOOG,
+    EMU8K_FILTER_CONSTANT,
+    EMU8K_FILTER_COUNT
+} emu8k_filter_t;
+
 emu8k_t* emu8k_alloc(void *rom, void *ram, size_t ram_size);
 void emu8k_free(emu8k_t *emu8k);
 
 void emu8k_reset(emu8k_t *emu8k);
+/** Makes the renderer reconsider all voices, e.g. after their registers were restored behind its back. */
+void emu8k_wake_voices(emu8k_t *emu8k);
+/** Runs the envelopes and LFOs only every given number of samples, interpolating pitch and volume in between (1 = every sample). */
+void emu8k_set_control_rate(emu8k_t *emu8k, int samples);
+/** Selects the interpolation and filter used to render all voices. */
+void emu8k_set_kernels(emu8k_t *emu8k, emu8k_interp_t interp, emu8k_filter_t filter);
 
 uint16_t emu8k_inw(emu8k_t *emu8k, uint16_t addr);
 void emu8k_outw(emu8k_t *emu8k, uint16_t addr, uint16_t val);
@@ -62,6 +88,10 @@ void emu8k_outb(emu8k_t *emu8k, uint16_t addr, uint8_t val);
 
 void emu8k_render(emu8k_t *emu8k, int16_t *buf, size_t frames);
 
+/** The pointer register (voice and register index), for callers that latch it themselves. */
+uint8_t emu8k_get_pointer(emu8k_t *emu8k);
+void emu8k_set_pointer(emu8k_t *emu8k, uint8_t val);
+
 /** Between calls to emu8k_render, the virtual sample count is used to keep the "sample count" register ticking at a reasonable pace. */
 void emu8k_update_virtual_sample_count(emu8k_t *emu8k, uint16_t sample_count);
 /*  Many programs seem to rely in this counter incrementing frequently, and may hang/error out if it doesn't.
@@ -388,6 +388,14 @@ typedef struct emu8k_voice_t
 
 } emu8k_voice_t;
 
+/* Linear slide of a voice's pitch and volume between two control steps, in 20.12 fixed point.
+ * Kept out of emu8k_voice_t since that one is saved as is, and this is recalculated on every control step. */
+typedef struct emu8k_ramp_t {
+        int32_t pitch, pitch_step;
+        int32_t vol, vol_step;
+} emu8k_ramp_t;
+#define EMU8K_RAMP_SHIFT 12
+
 typedef struct emu8k_t
 {
         emu8k_voice_t voice[32];
@@ -413,6 +421,20 @@ typedef struct emu8k_t
         uint32_t ram_end_addr;
 
         int cur_reg, cur_voice;
+
+        /* Bitmap of the voices that may produce sound or whose state is still changing.
+         * Voices drop out of it once silent and idle, and are added back by any register write to them. */
+        uint32_t active_voices;
+
+        /* Envelopes and LFOs run once every control_rate samples (1 = on every sample like the chip),
+         * with pitch and volume sliding linearly in between. control_left counts down to the next step. */
+        int control_rate, control_left;
+        /* Whether the envelopes and LFOs use the large precomputed tables, which only pays off at control_rate 1. */
+        bool sample_tables;
+        emu8k_ramp_t ramp[32];
+
+        emu8k_interp_t interp;
+        emu8k_filter_t filter;
         
         emu8k_chorus_eng_t chorus_engine;
         int32_t chorus_in_buffer[MAXSOUNDBUFLEN];
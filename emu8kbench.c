@@ -0,0 +1,342 @@
+/*
+ * VMusic - a VirtualBox extension pack with various music devices
+ * Copyright (C) 2022 Javier S. Pedro
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * vmusic-emu8kbench: renders a fixed set of looping EMU8000 voices with the same
+ * emulation as the Emu8000 device, as fast as possible, and reports how long the
+ * voice loop took and how many cache misses it caused.
+ *
+ * The voices play a synthetic wave from the sound ROM area, are retriggered once
+ * per second (so that the attack and release phases are measured too), and have
+ * their vibrato, tremolo and filter modulation enabled. Optionally, a buffer is
+ * walked between blocks to evict the caches, like other VMs on the host would.
+ * Cache misses are counted with perf events, for the rendering only.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+#endif
+
+#include <iprt/err.h>
+#include <iprt/initterm.h>
+
+#include "emu8k.h"
+
+#define EMUB_RATE               44100
+#define EMUB_DEFAULT_VOICES     32
+#define EMUB_DEFAULT_SECS       20
+#define EMUB_DEFAULT_RATE       32      /* samples, as the device ControlRate default */
+#define EMUB_BLOCK_FRAMES       441     /* 10 ms, about what the device renders at once */
+#define EMUB_MAX_VOICES         32
+#define EMUB_ROM_SIZE           (1024 * 1024)
+#define EMUB_RAM_SIZE           (512 * 1024)
+#define EMUB_WAVE_PERIOD        64      /* samples, so that it loops cleanly */
+#define EMUB_LOOP_START         0x1000
+#define EMUB_LOOP_END           0x2000
+
+/* Emu8000 ports, at their Sound Blaster offsets. */
+#define EMUB_DATA0              0x600
+#define EMUB_DATA1              0xA00
+#define EMUB_DATA2              0xA02
+#define EMUB_DATA3              0xE00
+#define EMUB_POINTER            0xE02
+
+/* A counted hardware event. */
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+    uint64_t count;
+} emub_counter;
+
+static emub_counter g_counters[] = {
+#ifdef __linux__
+    { "cache references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, -1, 0 },
+    { "cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1, 0 },
+    { "L1D read misses", PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1, 0 },
+#endif
+    { NULL, 0, 0, -1, 0 }
+};
+
+static emu8k_t *g_emu;
+
+static double wall_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void counters_open(void)
+{
+#ifdef __linux__
+    for (emub_counter *c = g_counters; c->name; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = c->type;
+        attr.config = c->config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        c->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (c->fd < 0) {
+            fprintf(stderr, "cannot count %s: %s\n", c->name, strerror(errno));
+        }
+    }
+#endif
+}
+
+static void counters_enable(int enable)
+{
+#ifdef __linux__
+    for (emub_counter *c = g_counters; c->name; c++) {
+        if (c->fd >= 0) {
+            ioctl(c->fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#else
+    (void)enable;
+#endif
+}
+
+static void counters_close(void)
+{
+    for (emub_counter *c = g_counters; c->name; c++) {
+        if (c->fd >= 0) {
+            if (read(c->fd, &c->count, sizeof(c->count)) != sizeof(c->count)) {
+                c->count = 0;
+            }
+            close(c->fd);
+        }
+    }
+}
+
+static void write_reg(int reg, int voice, uint16_t port, uint16_t value)
+{
+    emu8k_outw(g_emu, EMUB_POINTER, (reg << 5) | voice);
+    emu8k_outw(g_emu, port, value);
+}
+
+static void write_reg32(int reg, int voice, uint16_t port, uint32_t value)
+{
+    write_reg(reg, voice, port, value & 0xFFFF);
+    write_reg(reg, voice, port + 2, value >> 16);
+}
+
+/* Starts a note on a voice, following the sequence in the EMU8000 programmer's manual. */
+static void note_on(int voice)
+{
+    /* DCYSUSV: release the envelope while the voice is set up. */
+    write_reg(5, voice, EMUB_DATA1, 0x0080);
+    /* ENVVOL, ENVVAL, DCYSUS: no delay, sustain the modulation envelope. */
+    write_reg(4, voice, EMUB_DATA1, 0x8000);
+    write_reg(6, voice, EMUB_DATA1, 0x8000);
+    write_reg(7, voice, EMUB_DATA1, 0x7F40);
+    /* ATKHLDV, LFO1VAL, ATKHLD, LFO2VAL: short attacks, no LFO delays. */
+    write_reg(4, voice, EMUB_DATA2, 0x7F70);
+    write_reg(5, voice, EMUB_DATA2, 0x8000);
+    write_reg(6, voice, EMUB_DATA2, 0x7F70);
+    write_reg(7, voice, EMUB_DATA2, 0x8000);
+    /* IP, IFATN: a different pitch per voice, filter half open. */
+    write_reg(0, voice, EMUB_DATA3, 0xE000 + voice * 0x80);
+    write_reg(1, voice, EMUB_DATA3, 0x8010);
+    /* PEFE, FMMOD, TREMFRQ, FM2FRQ2: pitch and filter modulation, tremolo and vibrato. */
+    write_reg(2, voice, EMUB_DATA3, 0x1020);
+    write_reg(3, voice, EMUB_DATA3, 0x1020);
+    write_reg(4, voice, EMUB_DATA3, 0x2018);
+    write_reg(5, voice, EMUB_DATA3, 0x1010);
+    /* PSST, CSL, CCCA: pan and loop start, chorus send and loop end, start address. */
+    write_reg32(6, voice, EMUB_DATA0, ((uint32_t)(voice * 8) << 24) | EMUB_LOOP_START);
+    write_reg32(7, voice, EMUB_DATA0, 0x40000000 | EMUB_LOOP_END);
+    write_reg32(0, voice, EMUB_DATA1, EMUB_LOOP_START);
+    /* VTFT, CVCF, PTRX, CPF */
+    write_reg32(3, voice, EMUB_DATA0, 0x0000FFFF);
+    write_reg32(2, voice, EMUB_DATA0, 0x0000FFFF);
+    write_reg32(1, voice, EMUB_DATA0, 0x40000000);
+    write_reg32(0, voice, EMUB_DATA0, 0x40000000);
+    /* DCYSUSV: start the volume envelope. */
+    write_reg(5, voice, EMUB_DATA1, 0x7F50);
+}
+
+static void note_off(int voice)
+{
+    write_reg(5, voice, EMUB_DATA1, 0x8000 | 0x7F20);
+}
+
+static int find_name(const char *const *names, int count, const char *name)
+{
+    for (int i = 0; i < count; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Renders looping EMU8000 voices, reporting the render time and cache misses.\n"
+            "  -v N      number of voices (default %d, max %d)\n"
+            "  -s SECS   length of audio to render (default %d)\n"
+            "  -c N      samples between envelope/LFO updates, as ControlRate (default %d)\n"
+            "  -i INTERP interpolation, linear or cubic (default)\n"
+            "  -f FILTER filter, none, initial, moog (default) or constant\n"
+            "  -t MIB    walk a buffer of this size between blocks to evict the caches (default 0)\n",
+            argv0, EMUB_DEFAULT_VOICES, EMUB_MAX_VOICES, EMUB_DEFAULT_SECS, EMUB_DEFAULT_RATE);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const interps[EMU8K_INTERP_COUNT] = { "linear", "cubic" };
+    static const char *const filters[EMU8K_FILTER_COUNT] = { "none", "initial", "moog", "constant" };
+    int voices = EMUB_DEFAULT_VOICES;
+    int secs = EMUB_DEFAULT_SECS;
+    int control_rate = EMUB_DEFAULT_RATE;
+    int interp = EMU8K_INTERP_CUBIC;
+    int filter = EMU8K_FILTER_MOOG;
+    size_t thrash_size = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "v:s:c:i:f:t:h")) != -1) {
+        switch (opt) {
+            case 'v':
+                voices = atoi(optarg);
+                break;
+            case 's':
+                secs = atoi(optarg);
+                break;
+            case 'c':
+                control_rate = atoi(optarg);
+                break;
+            case 'i':
+                interp = find_name(interps, EMU8K_INTERP_COUNT, optarg);
+                break;
+            case 'f':
+                filter = find_name(filters, EMU8K_FILTER_COUNT, optarg);
+                break;
+            case 't':
+                thrash_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc || voices < 1 || voices > EMUB_MAX_VOICES || secs < 1 || control_rate < 1
+        || interp < 0 || filter < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int rc = RTR3InitExe(argc, &argv, 0);
+    if (RT_FAILURE(rc)) {
+        fprintf(stderr, "cannot initialize the runtime (%d)\n", rc);
+        return 1;
+    }
+
+    int16_t *rom = malloc(EMUB_ROM_SIZE);
+    uint8_t *ram = calloc(1, EMUB_RAM_SIZE);
+    volatile uint8_t *thrash = thrash_size ? calloc(1, thrash_size) : NULL;
+    if (!rom || !ram || (thrash_size && !thrash)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < EMUB_ROM_SIZE / sizeof(int16_t); i++) {
+        rom[i] = (int16_t)(8000 * sin(i * 2 * M_PI / EMUB_WAVE_PERIOD));
+    }
+
+    g_emu = emu8k_alloc(rom, ram, EMUB_RAM_SIZE);
+    if (!g_emu) {
+        fprintf(stderr, "cannot allocate the emulation\n");
+        return 1;
+    }
+    emu8k_reset(g_emu);
+    emu8k_set_control_rate(g_emu, control_rate);
+    emu8k_set_kernels(g_emu, (emu8k_interp_t)interp, (emu8k_filter_t)filter);
+
+    /* HWCF4, HWCF5, HWCF6: chorus feedback, LFO speed and depth, so that the chorus runs too. */
+    write_reg(1, 29, EMUB_DATA1, 0x0059);
+    write_reg(1, 30, EMUB_DATA1, 0x0020);
+    write_reg(1, 31, EMUB_DATA1, 0x0004);
+
+    counters_open();
+
+    const int blocks_per_sec = EMUB_RATE / EMUB_BLOCK_FRAMES;
+    const int blocks = secs * blocks_per_sec;
+    int16_t buf[EMUB_BLOCK_FRAMES * 2];
+    double render_secs = 0;
+
+    for (int block = 0; block < blocks; block++) {
+        /* Each voice plays for 0.8 seconds out of every second, starting at a different block. */
+        for (int voice = 0; voice < voices; voice++) {
+            const int phase = (block + voice * blocks_per_sec / voices) % blocks_per_sec;
+            if (phase == 0) {
+                note_on(voice);
+            } else if (phase == blocks_per_sec * 4 / 5) {
+                note_off(voice);
+            }
+        }
+
+        for (size_t i = 0; i < thrash_size; i += 64) {
+            thrash[i]++;
+        }
+
+        const double start = wall_secs();
+        counters_enable(1);
+        emu8k_render(g_emu, buf, EMUB_BLOCK_FRAMES);
+        counters_enable(0);
+        render_secs += wall_secs() - start;
+    }
+
+    counters_close();
+
+    const double frames = (double)blocks * EMUB_BLOCK_FRAMES;
+    printf("%d voices, %d s of audio, ControlRate %d, %s interpolation, %s filter, %zu MiB evicted per block\n",
+           voices, secs, control_rate, interps[interp], filters[filter], thrash_size / (1024 * 1024));
+    printf("render time: %.3f s (%.1fx realtime, %.1f ns per voice sample)\n",
+           render_secs, secs / render_secs, render_secs * 1e9 / (frames * voices));
+    for (emub_counter *c = g_counters; c->name; c++) {
+        if (c->fd >= 0) {
+            printf("%s: %llu (%.3f per voice sample)\n", c->name, (unsigned long long)c->count,
+                   c->count / (frames * voices));
+        }
+    }
+
+    emu8k_free(g_emu);
+    free((void *)thrash);
+    free(ram);
+    free(rom);
+
+    return 0;
+}
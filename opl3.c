@@ -29,9 +29,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "opl3.h"
 
 #define RSM_FRAC    10
+#define RSM_RECIP_RATIO_BITS    11
+#define RSM_RECIP_SHIFT         (15 + RSM_RECIP_RATIO_BITS + RSM_RECIP_RATIO_BITS)
 
 // Channel types
 
@@ -327,6 +334,24 @@ static Bit16s OPL3_EnvelopeCalcSin7(Bit16u phase, Bit16u envelope)
     return OPL3_EnvelopeCalcExp(out + (envelope << 3)) ^ neg;
 }
 
+//
+// Output of a slot with a fully attenuated envelope: only the sign remains,
+// indexed by waveform and bits 8-9 of the phase
+//
+
+#if !defined(__SSE2__)
+static const Bit16s envelope_sin_off[8][4] = {
+    { 0, 0, -1, -1 },
+    { 0, 0, 0, 0 },
+    { 0, 0, 0, 0 },
+    { 0, 0, 0, 0 },
+    { 0, -1, 0, 0 },
+    { 0, 0, 0, 0 },
+    { 0, 0, -1, -1 },
+    { 0, 0, -1, -1 }
+};
+#endif
+
 static const envelope_sinfunc envelope_sin[8] = {
     OPL3_EnvelopeCalcSin0,
     OPL3_EnvelopeCalcSin1,
@@ -357,29 +382,23 @@ static void OPL3_EnvelopeUpdateKSL(opl3_slot *slot)
     slot->eg_ksl = (Bit8u)ksl;
 }
 
-static void OPL3_EnvelopeCalc(opl3_slot *slot)
+//
+// Advances the envelope state by one sample, returns non-zero on a phase reset
+//
+
+static Bit8u OPL3_EnvelopeRegRate(opl3_slot *slot, Bit8u gen, Bit8u *reset)
 {
-    Bit8u nonzero;
-    Bit8u rate;
-    Bit8u rate_hi;
-    Bit8u rate_lo;
     Bit8u reg_rate = 0;
-    Bit8u ks;
-    Bit8u eg_shift, shift;
-    Bit16u eg_rout;
-    Bit16s eg_inc;
-    Bit8u eg_off;
-    Bit8u reset = 0;
-    slot->eg_out = slot->eg_rout + (slot->reg_tl << 2)
-                 + (slot->eg_ksl >> kslshift[slot->reg_ksl]) + *slot->trem;
-    if (slot->key && slot->eg_gen == envelope_gen_num_release)
+
+    *reset = 0;
+    if (slot->key && gen == envelope_gen_num_release)
     {
-        reset = 1;
+        *reset = 1;
         reg_rate = slot->reg_ar;
     }
     else
     {
-        switch (slot->eg_gen)
+        switch (gen)
         {
         case envelope_gen_num_attack:
             reg_rate = slot->reg_ar;
@@ -398,16 +417,41 @@ static void OPL3_EnvelopeCalc(opl3_slot *slot)
             break;
         }
     }
-    slot->pg_reset = reset;
+    return reg_rate;
+}
+
+// Effective rate as (rate_hi << 2) | rate_lo
+static Bit8u OPL3_EnvelopeRate(opl3_slot *slot, Bit8u reg_rate)
+{
+    Bit8u ks;
+    Bit8u rate;
+
     ks = slot->channel->ksv >> ((slot->reg_ksr ^ 1) << 1);
-    nonzero = (reg_rate != 0);
     rate = ks + (reg_rate << 2);
-    rate_hi = rate >> 2;
-    rate_lo = rate & 0x03;
-    if (rate_hi & 0x10)
+    if ((rate >> 2) & 0x10)
     {
-        rate_hi = 0x0f;
+        rate = 0x3c | (rate & 0x03);
     }
+    return rate;
+}
+
+static Bit8u OPL3_EnvelopeAdvance(opl3_slot *slot, Bit16s *rout, Bit8u *gen)
+{
+    Bit8u nonzero;
+    Bit8u rate;
+    Bit8u rate_hi;
+    Bit8u rate_lo;
+    Bit8u reg_rate;
+    Bit8u eg_shift, shift;
+    Bit16u eg_rout;
+    Bit16s eg_inc;
+    Bit8u eg_off;
+    Bit8u reset;
+    reg_rate = OPL3_EnvelopeRegRate(slot, *gen, &reset);
+    nonzero = (reg_rate != 0);
+    rate = OPL3_EnvelopeRate(slot, reg_rate);
+    rate_hi = rate >> 2;
+    rate_lo = rate & 0x03;
     eg_shift = rate_hi + slot->chip->eg_add;
     shift = 0;
     if (nonzero)
@@ -445,7 +489,7 @@ static void OPL3_EnvelopeCalc(opl3_slot *slot)
             }
         }
     }
-    eg_rout = slot->eg_rout;
+    eg_rout = *rout;
     eg_inc = 0;
     eg_off = 0;
     // Instant attack
@@ -454,30 +498,30 @@ static void OPL3_EnvelopeCalc(opl3_slot *slot)
         eg_rout = 0x00;
     }
     // Envelope off
-    if ((slot->eg_rout & 0x1f8) == 0x1f8)
+    if ((*rout & 0x1f8) == 0x1f8)
     {
         eg_off = 1;
     }
-    if (slot->eg_gen != envelope_gen_num_attack && !reset && eg_off)
+    if (*gen != envelope_gen_num_attack && !reset && eg_off)
     {
         eg_rout = 0x1ff;
     }
-    switch (slot->eg_gen)
+    switch (*gen)
     {
     case envelope_gen_num_attack:
-        if (!slot->eg_rout)
+        if (!*rout)
         {
-            slot->eg_gen = envelope_gen_num_decay;
+            *gen = envelope_gen_num_decay;
         }
         else if (slot->key && shift > 0 && rate_hi != 0x0f)
         {
-            eg_inc = ((~slot->eg_rout) << shift) >> 4;
+            eg_inc = ((~*rout) << shift) >> 4;
         }
         break;
     case envelope_gen_num_decay:
-        if ((slot->eg_rout >> 4) == slot->reg_sl)
+        if ((*rout >> 4) == slot->reg_sl)
         {
-            slot->eg_gen = envelope_gen_num_sustain;
+            *gen = envelope_gen_num_sustain;
         }
         else if (!eg_off && !reset && shift > 0)
         {
@@ -492,16 +536,24 @@ static void OPL3_EnvelopeCalc(opl3_slot *slot)
         }
         break;
     }
-    slot->eg_rout = (eg_rout + eg_inc) & 0x1ff;
+    *rout = (eg_rout + eg_inc) & 0x1ff;
     // Key off
     if (reset)
     {
-        slot->eg_gen = envelope_gen_num_attack;
+        *gen = envelope_gen_num_attack;
     }
     if (!slot->key)
     {
-        slot->eg_gen = envelope_gen_num_release;
+        *gen = envelope_gen_num_release;
     }
+    return reset;
+}
+
+static void OPL3_EnvelopeCalc(opl3_slot *slot)
+{
+    slot->eg_out = slot->eg_rout + (slot->reg_tl << 2)
+                 + (slot->eg_ksl >> kslshift[slot->reg_ksl]) + *slot->trem;
+    slot->pg_reset = OPL3_EnvelopeAdvance(slot, &slot->eg_rout, &slot->eg_gen);
 }
 
 static void OPL3_EnvelopeKeyOn(opl3_slot *slot, Bit8u type)
@@ -518,48 +570,87 @@ static void OPL3_EnvelopeKeyOff(opl3_slot *slot, Bit8u type)
 // Phase Generator
 //
 
-static void OPL3_PhaseGenerate(opl3_slot *slot)
+static Bit32u OPL3_PhaseCalcIncrement(opl3_slot *slot, Bit16u f_num)
 {
-    opl3_chip *chip;
-    Bit16u f_num;
     Bit32u basefreq;
-    Bit8u rm_xor, n_bit;
-    Bit32u noise;
-    Bit16u phase;
 
-    chip = slot->chip;
+    basefreq = (f_num << slot->channel->block) >> 1;
+    return (basefreq * mt[slot->reg_mult]) >> 1;
+}
+
+//
+// The phase increment only depends on f_num, block and mult, and on vibpos and
+// vibshift for vibrato slots, so it is cached per slot: pg_inc without vibrato
+// and pg_vibinc as the vibrato offset from it.
+//
+
+static void OPL3_PhaseUpdateVibrato(opl3_slot *slot)
+{
+    Bit16u f_num;
+    Bit8s range;
+    Bit8u vibpos;
+
+    slot->pg_vibinc = 0;
+    if (!slot->reg_vib)
+    {
+        return;
+    }
+
     f_num = slot->channel->f_num;
-    if (slot->reg_vib)
+    range = (f_num >> 7) & 7;
+    vibpos = slot->chip->vibpos;
+
+    if (!(vibpos & 3))
+    {
+        range = 0;
+    }
+    else if (vibpos & 1)
     {
-        Bit8s range;
-        Bit8u vibpos;
+        range >>= 1;
+    }
+    range >>= slot->chip->vibshift;
 
-        range = (f_num >> 7) & 7;
-        vibpos = slot->chip->vibpos;
+    if (vibpos & 4)
+    {
+        range = -range;
+    }
+    f_num += range;
+    slot->pg_vibinc = OPL3_PhaseCalcIncrement(slot, f_num) - slot->pg_inc;
+}
 
-        if (!(vibpos & 3))
-        {
-            range = 0;
-        }
-        else if (vibpos & 1)
-        {
-            range >>= 1;
-        }
-        range >>= slot->chip->vibshift;
+static void OPL3_PhaseUpdateIncrement(opl3_slot *slot)
+{
+    slot->pg_inc = OPL3_PhaseCalcIncrement(slot, slot->channel->f_num);
+    OPL3_PhaseUpdateVibrato(slot);
+}
 
-        if (vibpos & 4)
+static void OPL3_PhaseUpdateVibratoAll(opl3_chip *chip)
+{
+    Bit8u ii;
+
+    for (ii = 0; ii < 36; ii++)
+    {
+        if (chip->slot[ii].reg_vib)
         {
-            range = -range;
+            OPL3_PhaseUpdateVibrato(&chip->slot[ii]);
         }
-        f_num += range;
     }
-    basefreq = (f_num << slot->channel->block) >> 1;
+}
+
+static void OPL3_PhaseGenerate(opl3_slot *slot)
+{
+    opl3_chip *chip;
+    Bit8u rm_xor, n_bit;
+    Bit32u noise;
+    Bit16u phase;
+
+    chip = slot->chip;
     phase = (Bit16u)(slot->pg_phase >> 9);
     if (slot->pg_reset)
     {
         slot->pg_phase = 0;
     }
-    slot->pg_phase += (basefreq * mt[slot->reg_mult]) >> 1;
+    slot->pg_phase += slot->pg_inc + slot->pg_vibinc;
     // Rhythm mode
     noise = chip->noise;
     slot->pg_phase_out = phase;
@@ -626,6 +717,7 @@ static void OPL3_SlotWrite20(opl3_slot *slot, Bit8u data)
     slot->reg_type = (data >> 5) & 0x01;
     slot->reg_ksr = (data >> 4) & 0x01;
     slot->reg_mult = data & 0x0f;
+    OPL3_PhaseUpdateIncrement(slot);
 }
 
 static void OPL3_SlotWrite40(opl3_slot *slot, Bit8u data)
@@ -787,12 +879,16 @@ static void OPL3_ChannelWriteA0(opl3_channel *channel, Bit8u data)
                  | ((channel->f_num >> (0x09 - channel->chip->nts)) & 0x01);
     OPL3_EnvelopeUpdateKSL(channel->slots[0]);
     OPL3_EnvelopeUpdateKSL(channel->slots[1]);
+    OPL3_PhaseUpdateIncrement(channel->slots[0]);
+    OPL3_PhaseUpdateIncrement(channel->slots[1]);
     if (channel->chip->newm && channel->chtype == ch_4op)
     {
         channel->pair->f_num = channel->f_num;
         channel->pair->ksv = channel->ksv;
         OPL3_EnvelopeUpdateKSL(channel->pair->slots[0]);
         OPL3_EnvelopeUpdateKSL(channel->pair->slots[1]);
+        OPL3_PhaseUpdateIncrement(channel->pair->slots[0]);
+        OPL3_PhaseUpdateIncrement(channel->pair->slots[1]);
     }
 }
 
@@ -808,6 +904,8 @@ static void OPL3_ChannelWriteB0(opl3_channel *channel, Bit8u data)
                  | ((channel->f_num >> (0x09 - channel->chip->nts)) & 0x01);
     OPL3_EnvelopeUpdateKSL(channel->slots[0]);
     OPL3_EnvelopeUpdateKSL(channel->slots[1]);
+    OPL3_PhaseUpdateIncrement(channel->slots[0]);
+    OPL3_PhaseUpdateIncrement(channel->slots[1]);
     if (channel->chip->newm && channel->chtype == ch_4op)
     {
         channel->pair->f_num = channel->f_num;
@@ -815,6 +913,8 @@ static void OPL3_ChannelWriteB0(opl3_channel *channel, Bit8u data)
         channel->pair->ksv = channel->ksv;
         OPL3_EnvelopeUpdateKSL(channel->pair->slots[0]);
         OPL3_EnvelopeUpdateKSL(channel->pair->slots[1]);
+        OPL3_PhaseUpdateIncrement(channel->pair->slots[0]);
+        OPL3_PhaseUpdateIncrement(channel->pair->slots[1]);
     }
 }
 
@@ -1043,21 +1143,25 @@ static Bit16s OPL3_ClipSample(Bit32s sample)
     return (Bit16s)sample;
 }
 
-void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
+static void OPL3_ProcessSlot(opl3_slot *slot)
+{
+    OPL3_SlotCalcFB(slot);
+    OPL3_EnvelopeCalc(slot);
+    OPL3_PhaseGenerate(slot);
+    OPL3_SlotGenerate(slot);
+}
+
+static void OPL3_GenerateSlots(opl3_chip *chip, Bit16s *buf)
 {
     Bit8u ii;
     Bit8u jj;
     Bit16s accm;
-    Bit8u shift = 0;
 
     buf[1] = OPL3_ClipSample(chip->mixbuff[1]);
 
     for (ii = 0; ii < 15; ii++)
     {
-        OPL3_SlotCalcFB(&chip->slot[ii]);
-        OPL3_EnvelopeCalc(&chip->slot[ii]);
-        OPL3_PhaseGenerate(&chip->slot[ii]);
-        OPL3_SlotGenerate(&chip->slot[ii]);
+        OPL3_ProcessSlot(&chip->slot[ii]);
     }
 
     chip->mixbuff[0] = 0;
@@ -1073,20 +1177,14 @@ void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
 
     for (ii = 15; ii < 18; ii++)
     {
-        OPL3_SlotCalcFB(&chip->slot[ii]);
-        OPL3_EnvelopeCalc(&chip->slot[ii]);
-        OPL3_PhaseGenerate(&chip->slot[ii]);
-        OPL3_SlotGenerate(&chip->slot[ii]);
+        OPL3_ProcessSlot(&chip->slot[ii]);
     }
 
     buf[0] = OPL3_ClipSample(chip->mixbuff[0]);
 
     for (ii = 18; ii < 33; ii++)
     {
-        OPL3_SlotCalcFB(&chip->slot[ii]);
-        OPL3_EnvelopeCalc(&chip->slot[ii]);
-        OPL3_PhaseGenerate(&chip->slot[ii]);
-        OPL3_SlotGenerate(&chip->slot[ii]);
+        OPL3_ProcessSlot(&chip->slot[ii]);
     }
 
     chip->mixbuff[1] = 0;
@@ -1102,16 +1200,12 @@ void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
 
     for (ii = 33; ii < 36; ii++)
     {
-        OPL3_SlotCalcFB(&chip->slot[ii]);
-        OPL3_EnvelopeCalc(&chip->slot[ii]);
-        OPL3_PhaseGenerate(&chip->slot[ii]);
-        OPL3_SlotGenerate(&chip->slot[ii]);
+        OPL3_ProcessSlot(&chip->slot[ii]);
     }
+}
 
-    if ((chip->timer & 0x3f) == 0x3f)
-    {
-        chip->tremolopos = (chip->tremolopos + 1) % 210;
-    }
+static void OPL3_UpdateTremolo(opl3_chip *chip)
+{
     if (chip->tremolopos < 105)
     {
         chip->tremolo = chip->tremolopos >> chip->tremoloshift;
@@ -1120,13 +1214,11 @@ void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
     {
         chip->tremolo = (210 - chip->tremolopos) >> chip->tremoloshift;
     }
+}
 
-    if ((chip->timer & 0x3ff) == 0x3ff)
-    {
-        chip->vibpos = (chip->vibpos + 1) & 7;
-    }
-
-    chip->timer++;
+static void OPL3_EnvelopeUpdateAdd(opl3_chip *chip)
+{
+    Bit8u shift = 0;
 
     chip->eg_add = 0;
     if (chip->eg_timer)
@@ -1144,6 +1236,12 @@ void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
             chip->eg_add = shift + 1;
         }
     }
+}
+
+// Returns non-zero if eg_timer has changed
+static Bit8u OPL3_EnvelopeTimerTick(opl3_chip *chip)
+{
+    Bit8u ticked = 0;
 
     if (chip->eg_timerrem || chip->eg_state)
     {
@@ -1157,10 +1255,15 @@ void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
             chip->eg_timer++;
             chip->eg_timerrem = 0;
         }
+        ticked = 1;
     }
 
     chip->eg_state ^= 1;
+    return ticked;
+}
 
+static void OPL3_ProcessWriteBuf(opl3_chip *chip)
+{
     while (chip->writebuf[chip->writebuf_cur].time <= chip->writebuf_samplecnt)
     {
         if (!(chip->writebuf[chip->writebuf_cur].reg & 0x200))
@@ -1172,6 +1275,40 @@ void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
                       chip->writebuf[chip->writebuf_cur].data);
         chip->writebuf_cur = (chip->writebuf_cur + 1) % OPL_WRITEBUF_SIZE;
     }
+}
+
+// Time of the next pending buffered write, ~0 if there is none
+static Bit64u OPL3_NextWriteTime(opl3_chip *chip)
+{
+    if (chip->writebuf[chip->writebuf_cur].reg & 0x200)
+    {
+        return chip->writebuf[chip->writebuf_cur].time;
+    }
+    return ~(Bit64u)0;
+}
+
+void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
+{
+    OPL3_GenerateSlots(chip, buf);
+
+    if ((chip->timer & 0x3f) == 0x3f)
+    {
+        chip->tremolopos = (chip->tremolopos + 1) % 210;
+    }
+    OPL3_UpdateTremolo(chip);
+
+    if ((chip->timer & 0x3ff) == 0x3ff)
+    {
+        chip->vibpos = (chip->vibpos + 1) & 7;
+        OPL3_PhaseUpdateVibratoAll(chip);
+    }
+
+    chip->timer++;
+
+    OPL3_EnvelopeUpdateAdd(chip);
+    OPL3_EnvelopeTimerTick(chip);
+
+    OPL3_ProcessWriteBuf(chip);
     chip->writebuf_samplecnt++;
 }
 
@@ -1191,6 +1328,831 @@ void OPL3_GenerateResampled(opl3_chip *chip, Bit16s *buf)
     chip->samplecnt += 1 << RSM_FRAC;
 }
 
+//
+// Structure-of-arrays kernel
+//
+// While a block is rendered, the per-slot state that changes on every sample
+// lives in chip->soa so that the envelope attenuation and the phase
+// accumulators can be computed for many slots at once. Register writes only
+// touch the opl3_slot/opl3_channel parameters, after which the derived SoA
+// parameters are refreshed. OPL3_Generate remains the scalar reference.
+//
+// The SoA arrays hold the first slot of every channel in lanes 0-17 and the
+// second slot in lanes 18-35, bank by bank, so that the modulators and the
+// slots they modulate each fill as few vectors as possible.
+//
+
+static const Bit8u soa_lane[36] = {
+    0, 1, 2, 18, 19, 20, 3, 4, 5, 21, 22, 23, 6, 7, 8, 24, 25, 26,
+    9, 10, 11, 27, 28, 29, 12, 13, 14, 30, 31, 32, 15, 16, 17, 33, 34, 35
+};
+
+static const Bit8u soa_slot[36] = {
+    0, 1, 2, 6, 7, 8, 12, 13, 14, 18, 19, 20, 24, 25, 26, 30, 31, 32,
+    3, 4, 5, 9, 10, 11, 15, 16, 17, 21, 22, 23, 27, 28, 29, 33, 34, 35
+};
+
+static void OPL3_SoaUpdateVibrato(opl3_chip *chip)
+{
+    opl3_slot *slot;
+    Bit8u ii;
+
+    for (ii = 0; ii < 36; ii++)
+    {
+        slot = &chip->slot[ii];
+        if (slot->reg_vib)
+        {
+            OPL3_PhaseUpdateVibrato(slot);
+            chip->soa.pg_inc[soa_lane[ii]] = slot->pg_inc + slot->pg_vibinc;
+        }
+    }
+}
+
+//
+// Slot kernels: a slot is modulated either by nothing, by its own feedback
+// or by the slot three positions before it (2-op FM, 4-op chains and the
+// bass drum). Together with the waveform this selects one case of the
+// switch in the scalar OPL3_SoaSlotGenerate; the vector one only uses the
+// modulation source.
+//
+
+enum {
+    soa_mod_none = 0,
+    soa_mod_fb = 1,
+    soa_mod_prev = 2
+};
+
+#define OPL3_SOA_KERNEL(mod, wf) (((mod) << 3) | (wf))
+
+static Bit8u OPL3_SoaSelectKernel(opl3_chip *chip, opl3_slot *slot)
+{
+    Bit8u mod = soa_mod_prev;
+
+    if (slot->mod == &chip->zeromod)
+    {
+        mod = soa_mod_none;
+    }
+    else if (slot->mod == &slot->fbmod)
+    {
+        mod = slot->channel->fb ? soa_mod_fb : soa_mod_none;
+    }
+    return OPL3_SOA_KERNEL(mod, slot->reg_wf);
+}
+
+//
+// The vector slot output evaluates all waveforms with the same operations,
+// using per-slot masks derived from the waveform:
+//   dbl:     phase is doubled (waveforms 4 and 5)
+//   mirror:  log-sin index xor for the falling quarter of the wave
+//   zero:    phase bits where the output is silenced (out = 0x1000)
+//   sin/lin: log-sin lookup or the linear ramp of waveform 7
+//   neg:     the output is negated when (phase & negmask) == negval
+//
+
+typedef struct {
+    Bit16s dbl;
+    Bit16s mirror;
+    Bit16s zero;
+    Bit16s sin;
+    Bit16s lin;
+    Bit16s negmask;
+    Bit16s negval;
+} opl3_soawave;
+
+static const opl3_soawave soa_wave[8] = {
+    { 0x000, 0xff, 0x000, -1, 0, 0x200, 0x200 },
+    { 0x000, 0xff, 0x200, -1, 0, 0x000, 0x001 },
+    { 0x000, 0xff, 0x000, -1, 0, 0x000, 0x001 },
+    { 0x000, 0xff, 0x100, -1, 0, 0x000, 0x001 },
+    { 0x3ff, 0xfe, 0x200, -1, 0, 0x300, 0x100 },
+    { 0x3ff, 0xfe, 0x200, -1, 0, 0x000, 0x001 },
+    { 0x000, 0x00, 0x000, 0, 0, 0x200, 0x200 },
+    { 0x000, 0x00, 0x000, 0, -1, 0x200, 0x200 }
+};
+
+// A slot that is keyed off and fully released stays that way until key-on
+static Bit8u OPL3_SoaSlotIdle(opl3_chip *chip, Bit8u lane)
+{
+    return !chip->slot[soa_slot[lane]].key && chip->soa.eg_rout[lane] == 0x1ff
+        && chip->soa.eg_gen[lane] == envelope_gen_num_release;
+}
+
+//
+// Envelope scheduling: outside of stage transitions, a slot envelope only
+// moves on samples where the shift computed in OPL3_EnvelopeAdvance is
+// non-zero. Which rates get a shift depends on eg_add/eg_state only.
+//
+
+enum {
+    eg_sched_eval = 0,  // evaluate on every sample
+    eg_sched_rate = 1,  // evaluate when the rate in eg_rate steps
+    eg_sched_hold = 2   // constant until the next register write
+};
+
+// Bit n is set if rate n can step on the current sample
+static Bit64u OPL3_EnvelopeTickMask(opl3_chip *chip)
+{
+    Bit64u mask = 0xffff000000000000ULL; // rate_hi >= 12 may step on any sample
+    Bit8s rate_hi;
+
+    if (chip->eg_state)
+    {
+        rate_hi = 12 - chip->eg_add;
+        if (rate_hi >= 0 && rate_hi < 12)
+        {
+            mask |= (Bit64u)0x0f << (rate_hi << 2);
+        }
+        rate_hi = 13 - chip->eg_add;
+        if (rate_hi >= 0 && rate_hi < 12)
+        {
+            mask |= (Bit64u)0x0c << (rate_hi << 2);
+        }
+        rate_hi = 14 - chip->eg_add;
+        if (rate_hi >= 0 && rate_hi < 12)
+        {
+            mask |= (Bit64u)0x0a << (rate_hi << 2);
+        }
+    }
+    return mask;
+}
+
+static void OPL3_SoaEnvelopeSchedule(opl3_chip *chip, Bit8u lane)
+{
+    opl3_slotsoa *soa = &chip->soa;
+    opl3_slot *slot = &chip->slot[soa_slot[lane]];
+    Bit16s rout = soa->eg_rout[lane];
+    Bit8u gen = soa->eg_gen[lane];
+    Bit8u reg_rate;
+    Bit8u reset;
+
+    reg_rate = OPL3_EnvelopeRegRate(slot, gen, &reset);
+    soa->eg_sched[lane] = eg_sched_eval;
+    if (reset
+        || (!slot->key && gen != envelope_gen_num_release)
+        || (gen == envelope_gen_num_attack && !rout)
+        || (gen == envelope_gen_num_decay && (rout >> 4) == slot->reg_sl)
+        || (gen != envelope_gen_num_attack && (rout & 0x1f8) == 0x1f8 && rout != 0x1ff))
+    {
+        return;
+    }
+    if (!reg_rate || (gen != envelope_gen_num_attack && rout == 0x1ff))
+    {
+        soa->eg_sched[lane] = eg_sched_hold;
+        return;
+    }
+    soa->eg_rate[lane] = OPL3_EnvelopeRate(slot, reg_rate);
+    soa->eg_sched[lane] = eg_sched_rate;
+}
+
+static void OPL3_SoaLoadParams(opl3_chip *chip)
+{
+    opl3_slotsoa *soa = &chip->soa;
+    opl3_slot *slot;
+    const opl3_soawave *wave;
+    Bit16s depth;
+    size_t idx;
+    Bit8u lane;
+    Bit8u ii;
+    Bit8u jj;
+
+    // Until bank 1 is programmed its slots stay silent at their reset state,
+    // so an OPL2 program only needs the first bank
+    soa->nslots = chip->highbank ? 36 : 18;
+    soa->nchan = chip->highbank ? 18 : 9;
+    soa->active = 0;
+    soa->ngroups = 0;
+    soa->ndepth = 1;
+    memset(soa->depth_groups, 0, sizeof(soa->depth_groups));
+    for (ii = 0; ii < 36; ii++)
+    {
+        slot = &chip->slot[ii];
+        lane = soa_lane[ii];
+        soa->eg_base[lane] = (slot->reg_tl << 2) + (slot->eg_ksl >> kslshift[slot->reg_ksl]);
+        soa->trem_mask[lane] = (slot->trem == &chip->tremolo) ? ~0 : 0;
+        soa->pg_inc[lane] = slot->pg_inc + slot->pg_vibinc;
+        soa->fb[lane] = slot->channel->fb;
+        soa->wf[lane] = slot->reg_wf;
+        soa->kernel[lane] = OPL3_SoaSelectKernel(chip, slot);
+        wave = &soa_wave[slot->reg_wf];
+        soa->wf_dbl[lane] = wave->dbl;
+        soa->wf_mirror[lane] = wave->mirror;
+        soa->wf_zero[lane] = wave->zero;
+        soa->wf_sin[lane] = wave->sin;
+        soa->wf_lin[lane] = wave->lin;
+        soa->wf_negmask[lane] = wave->negmask;
+        soa->wf_negval[lane] = wave->negval;
+        soa->fb_mul[lane] = 0;
+        depth = 0;
+        switch (soa->kernel[lane] >> 3)
+        {
+        case soa_mod_fb:
+            soa->fb_mul[lane] = 1 << (7 + soa->fb[lane]);
+            break;
+        case soa_mod_prev:
+            // At most 3, for the last slot of a 4-op chain
+            depth = soa->mod_depth[soa_lane[ii - 3]] + 1;
+            break;
+        }
+        soa->mod_depth[lane] = depth;
+        if (ii < soa->nslots)
+        {
+            soa->depth_groups[depth] |= 1 << (lane >> 3);
+            if ((lane >> 3) >= soa->ngroups)
+            {
+                soa->ngroups = (lane >> 3) + 1;
+            }
+            if (depth >= soa->ndepth)
+            {
+                soa->ndepth = depth + 1;
+            }
+        }
+        if (!OPL3_SoaSlotIdle(chip, lane))
+        {
+            soa->active |= (Bit64u)1 << lane;
+        }
+        OPL3_SoaEnvelopeSchedule(chip, lane);
+    }
+    // Mix weights: how many outputs of a channel playing on that side are
+    // wired to a slot. The left mix is taken after slot 14 and the right one
+    // after slot 32, so the later slots contribute their previous output,
+    // which prout holds at that point
+    memset(soa->mix_out, 0, sizeof(soa->mix_out));
+    memset(soa->mix_prout, 0, sizeof(soa->mix_prout));
+    for (ii = 0; ii < soa->nchan; ii++)
+    {
+        for (jj = 0; jj < 4; jj++)
+        {
+            if (chip->channel[ii].out[jj] == &chip->zeromod)
+            {
+                continue;
+            }
+            idx = (size_t)((char *)chip->channel[ii].out[jj] - (char *)chip->slot) / sizeof(opl3_slot);
+            lane = soa_lane[idx];
+            if (chip->channel[ii].cha && idx < 15)
+            {
+                soa->mix_out[0][lane]++;
+            }
+            else if (chip->channel[ii].cha)
+            {
+                soa->mix_prout[0][lane]++;
+            }
+            if (chip->channel[ii].chb && idx < 33)
+            {
+                soa->mix_out[1][lane]++;
+            }
+            else if (chip->channel[ii].chb)
+            {
+                soa->mix_prout[1][lane]++;
+            }
+        }
+    }
+}
+
+static void OPL3_SoaLoad(opl3_chip *chip)
+{
+    opl3_slotsoa *soa = &chip->soa;
+    opl3_slot *slot;
+    Bit8u lane;
+    Bit8u ii;
+
+    for (ii = 0; ii < 36; ii++)
+    {
+        slot = &chip->slot[ii];
+        lane = soa_lane[ii];
+        soa->out[lane] = slot->out;
+        soa->prout[lane] = slot->prout;
+        soa->fbmod[lane] = slot->fbmod;
+        soa->eg_rout[lane] = slot->eg_rout;
+        soa->eg_gen[lane] = slot->eg_gen;
+        soa->pg_phase[lane] = slot->pg_phase;
+    }
+    OPL3_SoaLoadParams(chip);
+}
+
+static void OPL3_SoaStore(opl3_chip *chip)
+{
+    opl3_slotsoa *soa = &chip->soa;
+    opl3_slot *slot;
+    Bit8u lane;
+    Bit8u ii;
+
+    for (ii = 0; ii < 36; ii++)
+    {
+        slot = &chip->slot[ii];
+        lane = soa_lane[ii];
+        slot->out = soa->out[lane];
+        slot->prout = soa->prout[lane];
+        slot->fbmod = soa->fbmod[lane];
+        slot->eg_rout = soa->eg_rout[lane];
+        slot->eg_out = soa->eg_out[lane];
+        slot->eg_gen = soa->eg_gen[lane];
+        slot->pg_reset = soa->pg_reset[lane] & 1;
+        slot->pg_phase = soa->pg_phase[lane];
+        slot->pg_phase_out = (Bit16u)soa->pg_phase_out[lane];
+    }
+}
+
+// eg_out = eg_rout + eg_base + tremolo, for all slots
+static void OPL3_SoaEnvelopeOut(opl3_slotsoa *soa, Bit8u tremolo)
+{
+    Bit32u ii = 0;
+#if defined(__AVX2__)
+    __m256i trem16 = _mm256_set1_epi16(tremolo);
+    for (; ii + 16 <= OPL_SOA_SLOTS; ii += 16)
+    {
+        __m256i v = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *)&soa->eg_rout[ii]),
+                                     _mm256_loadu_si256((const __m256i *)&soa->eg_base[ii]));
+        v = _mm256_add_epi16(v, _mm256_and_si256(trem16,
+                             _mm256_loadu_si256((const __m256i *)&soa->trem_mask[ii])));
+        _mm256_storeu_si256((__m256i *)&soa->eg_out[ii], v);
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i trem8 = _mm_set1_epi16(tremolo);
+    for (; ii + 8 <= OPL_SOA_SLOTS; ii += 8)
+    {
+        __m128i v = _mm_add_epi16(_mm_loadu_si128((const __m128i *)&soa->eg_rout[ii]),
+                                  _mm_loadu_si128((const __m128i *)&soa->eg_base[ii]));
+        v = _mm_add_epi16(v, _mm_and_si128(trem8,
+                          _mm_loadu_si128((const __m128i *)&soa->trem_mask[ii])));
+        _mm_storeu_si128((__m128i *)&soa->eg_out[ii], v);
+    }
+#endif
+    for (; ii < OPL_SOA_SLOTS; ii++)
+    {
+        soa->eg_out[ii] = soa->eg_rout[ii] + soa->eg_base[ii] + (tremolo & soa->trem_mask[ii]);
+    }
+}
+
+// pg_phase_out = pg_phase >> 9, then pg_phase is reset and advanced, for all slots
+static void OPL3_SoaPhase(opl3_slotsoa *soa)
+{
+    Bit32u ii = 0;
+#if defined(__AVX2__)
+    for (; ii + 8 <= OPL_SOA_SLOTS; ii += 8)
+    {
+        __m256i phase = _mm256_loadu_si256((const __m256i *)&soa->pg_phase[ii]);
+        _mm256_storeu_si256((__m256i *)&soa->pg_phase_out[ii], _mm256_srli_epi32(phase, 9));
+        phase = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)&soa->pg_reset[ii]), phase);
+        phase = _mm256_add_epi32(phase, _mm256_loadu_si256((const __m256i *)&soa->pg_inc[ii]));
+        _mm256_storeu_si256((__m256i *)&soa->pg_phase[ii], phase);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; ii + 4 <= OPL_SOA_SLOTS; ii += 4)
+    {
+        __m128i phase = _mm_loadu_si128((const __m128i *)&soa->pg_phase[ii]);
+        _mm_storeu_si128((__m128i *)&soa->pg_phase_out[ii], _mm_srli_epi32(phase, 9));
+        phase = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)&soa->pg_reset[ii]), phase);
+        phase = _mm_add_epi32(phase, _mm_loadu_si128((const __m128i *)&soa->pg_inc[ii]));
+        _mm_storeu_si128((__m128i *)&soa->pg_phase[ii], phase);
+    }
+#endif
+    for (; ii < OPL_SOA_SLOTS; ii++)
+    {
+        soa->pg_phase_out[ii] = soa->pg_phase[ii] >> 9;
+        soa->pg_phase[ii] = (soa->pg_phase[ii] & ~soa->pg_reset[ii]) + soa->pg_inc[ii];
+    }
+}
+
+// Rhythm phase overrides and the noise generator, see OPL3_PhaseGenerate
+static void OPL3_SoaRhythm(opl3_chip *chip)
+{
+    opl3_slotsoa *soa = &chip->soa;
+    Bit32u noise = chip->noise;
+    Bit16u phase;
+    Bit8u rm_xor;
+    Bit8u ii;
+
+    phase = (Bit16u)soa->pg_phase_out[soa_lane[13]];
+    chip->rm_hh_bit2 = (phase >> 2) & 1;
+    chip->rm_hh_bit3 = (phase >> 3) & 1;
+    chip->rm_hh_bit7 = (phase >> 7) & 1;
+    chip->rm_hh_bit8 = (phase >> 8) & 1;
+    if (chip->rhy & 0x20)
+    {
+        // Slot n sees the noise register after n steps
+        rm_xor = (chip->rm_hh_bit2 ^ chip->rm_hh_bit7)
+               | (chip->rm_hh_bit3 ^ chip->rm_tc_bit5)
+               | (chip->rm_tc_bit3 ^ chip->rm_tc_bit5);
+        soa->pg_phase_out[soa_lane[13]] = rm_xor << 9;
+        if (rm_xor ^ ((noise >> 13) & 1))
+        {
+            soa->pg_phase_out[soa_lane[13]] |= 0xd0;
+        }
+        else
+        {
+            soa->pg_phase_out[soa_lane[13]] |= 0x34;
+        }
+        soa->pg_phase_out[soa_lane[16]] = (chip->rm_hh_bit8 << 9)
+                              | ((chip->rm_hh_bit8 ^ ((noise >> 16) & 1)) << 8);
+        phase = (Bit16u)soa->pg_phase_out[soa_lane[17]];
+        chip->rm_tc_bit3 = (phase >> 3) & 1;
+        chip->rm_tc_bit5 = (phase >> 5) & 1;
+        rm_xor = (chip->rm_hh_bit2 ^ chip->rm_hh_bit7)
+               | (chip->rm_hh_bit3 ^ chip->rm_tc_bit5)
+               | (chip->rm_tc_bit3 ^ chip->rm_tc_bit5);
+        soa->pg_phase_out[soa_lane[17]] = (rm_xor << 9) | 0x80;
+    }
+    // One LFSR step per slot, 9 steps at a time
+    for (ii = 0; ii < 4; ii++)
+    {
+        noise = (noise >> 9) | (((noise ^ (noise >> 14)) & 0x1ff) << 14);
+    }
+    chip->noise = noise;
+}
+
+#if defined(__SSE2__)
+
+//
+// Vector slot output
+//
+// Slot n+3 takes its modulation from the output of slot n in the same
+// sample, so the slots are evaluated in passes by their depth in the
+// modulation chain: the modulators first, then the slots they modulate.
+// Feedback only depends on the slot itself and is computed up front. All
+// waveforms go through the same operations, see opl3_soawave.
+//
+
+#define OPL3_SOA_LOAD(name, ii) _mm_loadu_si128((const __m128i *)&soa->name[ii])
+#define OPL3_SOA_STORE(name, ii, v) _mm_storeu_si128((__m128i *)&soa->name[ii], v)
+#define OPL3_SOA_SELECT(mask, a, b) _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
+
+// table[idx] for each 16-bit lane
+static __m128i OPL3_SoaLookup(const Bit16u *table, __m128i idx)
+{
+    __m128i v = _mm_cvtsi32_si128(table[_mm_extract_epi16(idx, 0)]);
+
+    v = _mm_insert_epi16(v, table[_mm_extract_epi16(idx, 1)], 1);
+    v = _mm_insert_epi16(v, table[_mm_extract_epi16(idx, 2)], 2);
+    v = _mm_insert_epi16(v, table[_mm_extract_epi16(idx, 3)], 3);
+    v = _mm_insert_epi16(v, table[_mm_extract_epi16(idx, 4)], 4);
+    v = _mm_insert_epi16(v, table[_mm_extract_epi16(idx, 5)], 5);
+    v = _mm_insert_epi16(v, table[_mm_extract_epi16(idx, 6)], 6);
+    v = _mm_insert_epi16(v, table[_mm_extract_epi16(idx, 7)], 7);
+    return v;
+}
+
+// Waveform output of lanes ii to ii + 7, see OPL3_EnvelopeCalcSin0-7
+static __m128i OPL3_SoaSlotOut(opl3_slotsoa *soa, Bit32u ii, __m128i mod)
+{
+    const __m128i c0ff = _mm_set1_epi16(0xff);
+    const __m128i c100 = _mm_set1_epi16(0x100);
+    const __m128i c1ff = _mm_set1_epi16(0x1ff);
+    const __m128i c200 = _mm_set1_epi16(0x200);
+    const __m128i c3ff = _mm_set1_epi16(0x3ff);
+    __m128i phase, wphase, out, level, shift, mask;
+
+    // Only the low 10 bits of the phase are used
+    mask = _mm_set1_epi32(0x3ff);
+    phase = _mm_packs_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)&soa->pg_phase_out[ii]), mask),
+                            _mm_and_si128(_mm_loadu_si128((const __m128i *)&soa->pg_phase_out[ii + 4]), mask));
+    phase = _mm_and_si128(_mm_add_epi16(phase, mod), c3ff);
+
+    // Log-sin lookup, or the ramp of waveform 7
+    wphase = _mm_add_epi16(phase, _mm_and_si128(phase, OPL3_SOA_LOAD(wf_dbl, ii)));
+    mask = _mm_cmpeq_epi16(_mm_and_si128(wphase, c100), c100);
+    out = _mm_xor_si128(_mm_and_si128(wphase, c0ff), _mm_and_si128(mask, OPL3_SOA_LOAD(wf_mirror, ii)));
+    out = _mm_and_si128(OPL3_SoaLookup(logsinrom, out), OPL3_SOA_LOAD(wf_sin, ii));
+    mask = _mm_cmpeq_epi16(_mm_and_si128(phase, c200), c200);
+    level = _mm_slli_epi16(_mm_xor_si128(_mm_and_si128(phase, c1ff), _mm_and_si128(mask, c1ff)), 3);
+    out = _mm_or_si128(out, _mm_and_si128(level, OPL3_SOA_LOAD(wf_lin, ii)));
+    mask = _mm_cmpeq_epi16(_mm_and_si128(phase, OPL3_SOA_LOAD(wf_zero, ii)), _mm_setzero_si128());
+    out = OPL3_SOA_SELECT(mask, out, _mm_set1_epi16(0x1000));
+
+    // OPL3_EnvelopeCalcExp. The shift by level >> 8 is a multiply by
+    // 2^(13 - shift), built in the exponent of a float, which truncates to 0
+    // for shifts that leave nothing of the 12-bit value
+    level = _mm_add_epi16(out, _mm_slli_epi16(OPL3_SOA_LOAD(eg_out, ii), 3));
+    level = _mm_min_epi16(level, _mm_set1_epi16(0x1fff));
+    out = _mm_slli_epi16(OPL3_SoaLookup(exprom, _mm_and_si128(level, c0ff)), 4);
+    shift = _mm_srli_epi16(level, 8);
+    mask = _mm_set1_epi32(127 + 13);
+    shift = _mm_packs_epi32(
+        _mm_cvttps_epi32(_mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(mask, _mm_unpacklo_epi16(shift, _mm_setzero_si128())), 23))),
+        _mm_cvttps_epi32(_mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(mask, _mm_unpackhi_epi16(shift, _mm_setzero_si128())), 23))));
+    out = _mm_mulhi_epu16(out, shift);
+
+    mask = _mm_cmpeq_epi16(_mm_and_si128(phase, OPL3_SOA_LOAD(wf_negmask, ii)), OPL3_SOA_LOAD(wf_negval, ii));
+    return _mm_xor_si128(out, mask);
+}
+
+static void OPL3_SoaSlotGenerate(opl3_chip *chip)
+{
+    opl3_slotsoa *soa = &chip->soa;
+    Bit32u ii;
+    Bit8u depth;
+    __m128i out, fbmod, mod, mask;
+
+    // fbmod = (prout + out) >> (9 - fb) as a multiply by 2^(7 + fb)
+    for (ii = 0; ii < (Bit32u)soa->ngroups << 3; ii += 8)
+    {
+        out = OPL3_SOA_LOAD(out, ii);
+        mask = _mm_cmpgt_epi16(OPL3_SOA_LOAD(fb_mul, ii), _mm_setzero_si128());
+        fbmod = _mm_mulhi_epi16(_mm_add_epi16(OPL3_SOA_LOAD(prout, ii), out), OPL3_SOA_LOAD(fb_mul, ii));
+        OPL3_SOA_STORE(fbmod, ii, OPL3_SOA_SELECT(mask, fbmod, OPL3_SOA_LOAD(fbmod, ii)));
+        OPL3_SOA_STORE(prout, ii, out);
+    }
+    for (depth = 0; depth < soa->ndepth; depth++)
+    {
+        for (ii = 0; ii < soa->ngroups; ii++)
+        {
+            if (!(soa->depth_groups[depth] & (1 << ii)))
+            {
+                continue;
+            }
+            // A second slot takes its modulation from the first slot of the
+            // channel, 18 lanes before it. In a 4-op chain the first slot of
+            // the second channel (lanes 3-5 and 12-14) takes it from the
+            // second slot of the first one, 15 lanes after it.
+            if (!depth)
+            {
+                mask = _mm_cmpgt_epi16(OPL3_SOA_LOAD(fb_mul, ii << 3), _mm_setzero_si128());
+                mod = _mm_and_si128(mask, OPL3_SOA_LOAD(fbmod, ii << 3));
+            }
+            else if (ii < 2)
+            {
+                mod = OPL3_SOA_LOAD(out, (ii << 3) + 15);
+            }
+            else if (ii == 2)
+            {
+                mod = _mm_slli_si128(OPL3_SOA_LOAD(out, 0), 4);
+            }
+            else
+            {
+                mod = OPL3_SOA_LOAD(out, (ii << 3) - 18);
+            }
+            out = OPL3_SoaSlotOut(soa, ii << 3, mod);
+            mask = _mm_cmpeq_epi16(OPL3_SOA_LOAD(mod_depth, ii << 3), _mm_set1_epi16(depth));
+            OPL3_SOA_STORE(out, ii << 3, OPL3_SOA_SELECT(mask, out, OPL3_SOA_LOAD(out, ii << 3)));
+        }
+    }
+}
+
+// Sum of the channel outputs, weighted by the mix_out/mix_prout counts
+static Bit32s OPL3_SoaMix(opl3_slotsoa *soa, Bit8u right)
+{
+    __m128i sum = _mm_setzero_si128();
+    Bit32u ii;
+
+    for (ii = 0; ii < (Bit32u)soa->ngroups << 3; ii += 8)
+    {
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(OPL3_SOA_LOAD(out, ii), OPL3_SOA_LOAD(mix_out[right], ii)));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(OPL3_SOA_LOAD(prout, ii), OPL3_SOA_LOAD(mix_prout[right], ii)));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
+}
+
+#undef OPL3_SOA_LOAD
+#undef OPL3_SOA_STORE
+#undef OPL3_SOA_SELECT
+
+#else
+
+#define OPL3_SOA_CASES(wf) \
+    case OPL3_SOA_KERNEL(soa_mod_none, wf): \
+        soa->out[lane] = OPL3_EnvelopeCalcSin##wf(phase, soa->eg_out[lane]); \
+        break; \
+    case OPL3_SOA_KERNEL(soa_mod_fb, wf): \
+        soa->fbmod[lane] = fbsum >> (0x09 - soa->fb[lane]); \
+        soa->out[lane] = OPL3_EnvelopeCalcSin##wf(phase + soa->fbmod[lane], soa->eg_out[lane]); \
+        break; \
+    case OPL3_SOA_KERNEL(soa_mod_prev, wf): \
+        soa->out[lane] = OPL3_EnvelopeCalcSin##wf(phase + soa->out[soa_lane[ii - 3]], soa->eg_out[lane]); \
+        break;
+
+//
+// Feedback is only computed for slots that use it; the other slots only keep
+// prout up to date, and fbmod is recomputed before use after a CON or FB write.
+//
+
+static void OPL3_SoaSlotGenerate(opl3_chip *chip)
+{
+    opl3_slotsoa *soa = &chip->soa;
+    Bit16u phase;
+    Bit32s fbsum;
+    Bit8u lane;
+    Bit8u ii;
+
+    // In slot order, so that slot n + 3 sees the output of slot n
+    for (ii = 0; ii < soa->nslots; ii++)
+    {
+        lane = soa_lane[ii];
+        fbsum = soa->prout[lane] + soa->out[lane];
+        soa->prout[lane] = soa->out[lane];
+        phase = (Bit16u)soa->pg_phase_out[lane];
+        if (!(soa->active & ((Bit64u)1 << lane)))
+        {
+            switch (soa->kernel[lane] >> 3)
+            {
+            case soa_mod_fb:
+                soa->fbmod[lane] = fbsum >> (0x09 - soa->fb[lane]);
+                phase += soa->fbmod[lane];
+                break;
+            case soa_mod_prev:
+                phase += soa->out[soa_lane[ii - 3]];
+                break;
+            }
+            soa->out[lane] = envelope_sin_off[soa->wf[lane]][(phase >> 8) & 0x03];
+            continue;
+        }
+        switch (soa->kernel[lane])
+        {
+        OPL3_SOA_CASES(0)
+        OPL3_SOA_CASES(1)
+        OPL3_SOA_CASES(2)
+        OPL3_SOA_CASES(3)
+        OPL3_SOA_CASES(4)
+        OPL3_SOA_CASES(5)
+        OPL3_SOA_CASES(6)
+        OPL3_SOA_CASES(7)
+        }
+    }
+}
+
+#undef OPL3_SOA_CASES
+
+static Bit32s OPL3_SoaMix(opl3_slotsoa *soa, Bit8u right)
+{
+    Bit32s mix = 0;
+    Bit8u ii;
+
+    for (ii = 0; ii < 36; ii++)
+    {
+        mix += soa->out[ii] * soa->mix_out[right][ii] + soa->prout[ii] * soa->mix_prout[right][ii];
+    }
+    return mix;
+}
+
+#endif
+
+static void OPL3_SoaGenerate(opl3_chip *chip, Bit16s *buf)
+{
+    opl3_slotsoa *soa = &chip->soa;
+    Bit64u tick;
+    Bit8u ii;
+
+    buf[1] = OPL3_ClipSample(chip->mixbuff[1]);
+
+    // Idle slots keep a constant envelope and never reset their phase
+    OPL3_SoaEnvelopeOut(soa, chip->tremolo);
+    tick = OPL3_EnvelopeTickMask(chip);
+    for (ii = 0; ii < 36 && (soa->active >> ii); ii++)
+    {
+        if (!(soa->active & ((Bit64u)1 << ii)))
+        {
+            continue;
+        }
+        if (soa->eg_sched[ii] == eg_sched_hold
+            || (soa->eg_sched[ii] == eg_sched_rate && !((tick >> soa->eg_rate[ii]) & 1)))
+        {
+            soa->pg_reset[ii] = 0;
+            continue;
+        }
+        soa->pg_reset[ii] = OPL3_EnvelopeAdvance(&chip->slot[soa_slot[ii]], &soa->eg_rout[ii],
+                                                 &soa->eg_gen[ii]) ? ~0U : 0;
+        OPL3_SoaEnvelopeSchedule(chip, ii);
+        // A slot that finished its release only has its sign left in the output
+        if (OPL3_SoaSlotIdle(chip, ii))
+        {
+            soa->active &= ~((Bit64u)1 << ii);
+        }
+    }
+    OPL3_SoaPhase(soa);
+    OPL3_SoaRhythm(chip);
+
+    OPL3_SoaSlotGenerate(chip);
+    chip->mixbuff[0] = OPL3_SoaMix(soa, 0);
+    buf[0] = OPL3_ClipSample(chip->mixbuff[0]);
+    chip->mixbuff[1] = OPL3_SoaMix(soa, 1);
+}
+
+//
+// Block generation
+//
+// Same output as calling OPL3_Generate numsamples times. The LFO and envelope
+// timer state only changes at known points, so it is refreshed on those
+// instead of on every sample. Slots are processed by the SoA kernel.
+//
+
+void OPL3_GenerateBlock(opl3_chip *chip, Bit16s *sndptr, Bit32u numsamples)
+{
+    Bit64u writetime;
+    Bit8u lfo_update = 1;
+    Bit8u eg_update = 1;
+
+    OPL3_SoaLoad(chip);
+    writetime = OPL3_NextWriteTime(chip);
+    while (numsamples--)
+    {
+        OPL3_SoaGenerate(chip, sndptr);
+        sndptr += 2;
+
+        if ((chip->timer & 0x3f) == 0x3f)
+        {
+            chip->tremolopos = (chip->tremolopos + 1) % 210;
+            if ((chip->timer & 0x3ff) == 0x3ff)
+            {
+                chip->vibpos = (chip->vibpos + 1) & 7;
+                OPL3_SoaUpdateVibrato(chip);
+            }
+            lfo_update = 1;
+        }
+        if (lfo_update)
+        {
+            OPL3_UpdateTremolo(chip);
+            lfo_update = 0;
+        }
+
+        chip->timer++;
+
+        if (eg_update)
+        {
+            OPL3_EnvelopeUpdateAdd(chip);
+        }
+        eg_update = OPL3_EnvelopeTimerTick(chip);
+
+        if (writetime <= chip->writebuf_samplecnt)
+        {
+            OPL3_ProcessWriteBuf(chip);
+            OPL3_SoaLoadParams(chip);
+            writetime = OPL3_NextWriteTime(chip);
+            // BD writes change the tremolo depth
+            lfo_update = 1;
+        }
+        chip->writebuf_samplecnt++;
+    }
+    OPL3_SoaStore(chip);
+}
+
+//
+// Bulk linear resampler, matches OPL3_GenerateResampled
+//
+
+static Bit16s OPL3_ResampleDiv(opl3_chip *chip, Bit32s sample)
+{
+    if (!chip->rateratio_recip)
+    {
+        return (Bit16s)(sample / chip->rateratio);
+    }
+    if (sample < 0)
+    {
+        return (Bit16s)-(Bit32s)(((Bit64u)-sample * chip->rateratio_recip) >> RSM_RECIP_SHIFT);
+    }
+    return (Bit16s)(((Bit64u)sample * chip->rateratio_recip) >> RSM_RECIP_SHIFT);
+}
+
+static void OPL3_ResampleBlock(opl3_chip *chip, const Bit16s *src, Bit16s *sndptr,
+                               Bit32u numsamples)
+{
+    Bit32s rateratio = chip->rateratio;
+    Bit32s samplecnt = chip->samplecnt;
+
+    while (numsamples--)
+    {
+        while (samplecnt >= rateratio)
+        {
+            chip->oldsamples[0] = chip->samples[0];
+            chip->oldsamples[1] = chip->samples[1];
+            chip->samples[0] = src[0];
+            chip->samples[1] = src[1];
+            src += 2;
+            samplecnt -= rateratio;
+        }
+        sndptr[0] = OPL3_ResampleDiv(chip, chip->oldsamples[0] * (rateratio - samplecnt)
+                                         + chip->samples[0] * samplecnt);
+        sndptr[1] = OPL3_ResampleDiv(chip, chip->oldsamples[1] * (rateratio - samplecnt)
+                                         + chip->samples[1] * samplecnt);
+        sndptr += 2;
+        samplecnt += 1 << RSM_FRAC;
+    }
+    chip->samplecnt = samplecnt;
+}
+
+// Whether the chip outputs silence until the next register write:
+// every slot is keyed off and fully released, and no buffered write is pending
+Bit8u OPL3_IsSilent(opl3_chip *chip)
+{
+    opl3_slot *slot;
+    Bit8u ii;
+
+    if (chip->writebuf[chip->writebuf_cur].reg & 0x200)
+    {
+        return 0;
+    }
+    for (ii = 0; ii < 36; ii++)
+    {
+        slot = &chip->slot[ii];
+        if (slot->key || slot->eg_rout != 0x1ff || slot->eg_gen != envelope_gen_num_release)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 void OPL3_Reset(opl3_chip *chip, Bit32u samplerate)
 {
     Bit8u slotnum;
@@ -1234,6 +2196,12 @@ void OPL3_Reset(opl3_chip *chip, Bit32u samplerate)
     }
     chip->noise = 1;
     chip->rateratio = (samplerate << RSM_FRAC) / 49716;
+    // Exact reciprocal for |sample * rateratio| < 2^26, see OPL3_ResampleDiv
+    if (chip->rateratio > 0 && chip->rateratio < (1 << RSM_RECIP_RATIO_BITS))
+    {
+        chip->rateratio_recip = ((1ULL << RSM_RECIP_SHIFT) + chip->rateratio - 1)
+                              / chip->rateratio;
+    }
     chip->tremoloshift = 4;
     chip->vibshift = 1;
 }
@@ -1242,6 +2210,10 @@ void OPL3_WriteReg(opl3_chip *chip, Bit16u reg, Bit8u v)
 {
     Bit8u high = (reg >> 8) & 0x01;
     Bit8u regm = reg & 0xff;
+    if (high && regm >= 0x20)
+    {
+        chip->highbank = 1;
+    }
     switch (regm & 0xf0)
     {
     case 0x00:
@@ -1313,6 +2285,7 @@ void OPL3_WriteReg(opl3_chip *chip, Bit16u reg, Bit8u v)
         {
             chip->tremoloshift = (((v >> 7) ^ 1) << 1) + 2;
             chip->vibshift = ((v >> 6) & 0x01) ^ 1;
+            OPL3_PhaseUpdateVibratoAll(chip);
             OPL3_ChannelUpdateRhythm(chip, v);
         }
         else if ((regm & 0x0f) < 9)
@@ -1367,11 +2340,27 @@ void OPL3_WriteRegBuffered(opl3_chip *chip, Bit16u reg, Bit8u v)
 
 void OPL3_GenerateStream(opl3_chip *chip, Bit16s *sndptr, Bit32u numsamples)
 {
-    Bit32u i;
+    Bit32u count;
+    Bit32u native;
 
-    for(i = 0; i < numsamples; i++)
+    if (chip->rateratio == 1 << RSM_FRAC)
     {
-        OPL3_GenerateResampled(chip, sndptr);
-        sndptr += 2;
+        OPL3_GenerateBlock(chip, sndptr, numsamples);
+        return;
+    }
+
+    while (numsamples > 0)
+    {
+        // Output frames whose source samples still fit into rsmbuf
+        count = (((OPL_RSMBUF_SIZE + 1) * chip->rateratio - chip->samplecnt - 1) >> RSM_FRAC) + 1;
+        if (count > numsamples)
+        {
+            count = numsamples;
+        }
+        native = (chip->samplecnt + ((count - 1) << RSM_FRAC)) / chip->rateratio;
+        OPL3_GenerateBlock(chip, chip->rsmbuf, native);
+        OPL3_ResampleBlock(chip, chip->rsmbuf, sndptr, count);
+        sndptr += count * 2;
+        numsamples -= count;
     }
 }
@@ -37,6 +37,8 @@ extern "C" {
 
 #define OPL_WRITEBUF_SIZE   1024
 #define OPL_WRITEBUF_DELAY  2
+#define OPL_RSMBUF_SIZE     512
+#define OPL_SOA_SLOTS       40 // 36 slots, padded for SIMD
 
 typedef uintptr_t       Bitu;
 typedef intptr_t        Bits;
@@ -82,6 +84,8 @@ struct _opl3_slot {
     Bit32u pg_reset;
     Bit32u pg_phase;
     Bit16u pg_phase_out;
+    Bit32u pg_inc;
+    Bit32s pg_vibinc;
     Bit8u slot_num;
 };
 
@@ -101,6 +105,45 @@ struct _opl3_channel {
     Bit8u ch_num;
 };
 
+// Per-slot state used while rendering a block, see OPL3_GenerateBlock
+typedef struct _opl3_slotsoa {
+    Bit16s eg_rout[OPL_SOA_SLOTS];
+    Bit16s eg_out[OPL_SOA_SLOTS];
+    Bit16s eg_base[OPL_SOA_SLOTS];
+    Bit16s trem_mask[OPL_SOA_SLOTS];
+    Bit16s out[OPL_SOA_SLOTS];
+    Bit16s prout[OPL_SOA_SLOTS];
+    Bit16s fbmod[OPL_SOA_SLOTS];
+    Bit32u pg_phase[OPL_SOA_SLOTS];
+    Bit32u pg_phase_out[OPL_SOA_SLOTS];
+    Bit32u pg_reset[OPL_SOA_SLOTS];
+    Bit32u pg_inc[OPL_SOA_SLOTS];
+    Bit8u eg_gen[OPL_SOA_SLOTS];
+    Bit8u eg_sched[OPL_SOA_SLOTS];
+    Bit8u eg_rate[OPL_SOA_SLOTS];
+    Bit8u fb[OPL_SOA_SLOTS];
+    Bit8u wf[OPL_SOA_SLOTS];
+    Bit8u kernel[OPL_SOA_SLOTS];
+    // Vector slot output, see OPL3_SoaSlotGenerate
+    Bit16s fb_mul[OPL_SOA_SLOTS];
+    Bit16s mod_depth[OPL_SOA_SLOTS];
+    Bit16s wf_dbl[OPL_SOA_SLOTS];
+    Bit16s wf_mirror[OPL_SOA_SLOTS];
+    Bit16s wf_zero[OPL_SOA_SLOTS];
+    Bit16s wf_sin[OPL_SOA_SLOTS];
+    Bit16s wf_lin[OPL_SOA_SLOTS];
+    Bit16s wf_negmask[OPL_SOA_SLOTS];
+    Bit16s wf_negval[OPL_SOA_SLOTS];
+    Bit8u depth_groups[4];
+    Bit8u ndepth;
+    Bit8u ngroups;
+    Bit16s mix_out[2][OPL_SOA_SLOTS];
+    Bit16s mix_prout[2][OPL_SOA_SLOTS];
+    Bit64u active;
+    Bit8u nslots;
+    Bit8u nchan;
+} opl3_slotsoa;
+
 typedef struct _opl3_writebuf {
     Bit64u time;
     Bit16u reg;
@@ -137,6 +180,11 @@ struct _opl3_chip {
     Bit32s samplecnt;
     Bit16s oldsamples[2];
     Bit16s samples[2];
+    Bit64u rateratio_recip;
+    Bit16s rsmbuf[OPL_RSMBUF_SIZE * 2];
+    Bit8u highbank;
+
+    opl3_slotsoa soa;
 
     Bit64u writebuf_samplecnt;
     Bit32u writebuf_cur;
@@ -147,10 +195,12 @@ struct _opl3_chip {
 
 void OPL3_Generate(opl3_chip *chip, Bit16s *buf);
 void OPL3_GenerateResampled(opl3_chip *chip, Bit16s *buf);
+void OPL3_GenerateBlock(opl3_chip *chip, Bit16s *sndptr, Bit32u numsamples);
 void OPL3_Reset(opl3_chip *chip, Bit32u samplerate);
 void OPL3_WriteReg(opl3_chip *chip, Bit16u reg, Bit8u v);
 void OPL3_WriteRegBuffered(opl3_chip *chip, Bit16u reg, Bit8u v);
 void OPL3_GenerateStream(opl3_chip *chip, Bit16s *sndptr, Bit32u numsamples);
+Bit8u OPL3_IsSilent(opl3_chip *chip);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2022 Javier S. Pedro
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define LOG_GROUP LOG_GROUP_DEV_SB16
+
+#include <VBox/err.h>
+#include <VBox/log.h>
+#include <iprt/asm.h>
+#include <iprt/asm-math.h>
+#include <iprt/string.h>
+#include "oplcapture.h"
+
+/** Number of register writes that can be queued for the writer thread. */
+#define OPLCAPTURE_QUEUE_SIZE       65536
+/** How often the writer thread wakes up to write queued register writes. */
+#define OPLCAPTURE_FLUSH_INTERVAL   100 /* millisec */
+
+#define VGM_HEADER_SIZE             0x80
+#define VGM_SAMPLE_RATE             44100
+#define VGM_YM3812_CLOCK            3579545
+#define VGM_YMF262_CLOCK            14318180
+#define VGM_DUAL_CHIP               RT_BIT_32(30)
+
+#define DRO_HEADER_SIZE             0x1A
+#define DRO_HW_OPL2                 0
+#define DRO_HW_DUAL_OPL2            1
+#define DRO_HW_OPL3                 2
+
+static inline void putLE16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static inline void putLE32(uint8_t *p, uint32_t v)
+{
+    putLE16(p, v & 0xffff);
+    putLE16(p + 2, v >> 16);
+}
+
+OPLCapture::OPLCapture() : _open(false)
+{
+
+}
+
+OPLCapture::~OPLCapture()
+{
+}
+
+int OPLCapture::open(const char *path, Format format, bool opl3, unsigned int chips, uint64_t ticksPerSec)
+{
+    _format = format;
+    _opl3 = opl3;
+    _ticksPerSec = ticksPerSec;
+    _rc = VINF_SUCCESS;
+    _shutdown = false;
+    _dropped = 0;
+    _started = false;
+    _startTicks = 0;
+    _pos = 0;
+    _pairs = 0;
+    _fileSize = 0;
+    _bufUsed = 0;
+
+    // VGM can hold two of each chip, DRO either one OPL3 or two OPL2.
+    const unsigned int maxChips = format == FORMAT_DRO && opl3 ? 1 : 2;
+    if (chips > maxChips) {
+        LogRel(("OPL capture: only the first %u chips will be captured\n", maxChips));
+    }
+    _chips = RT_MIN(chips, maxChips);
+
+    if (format == FORMAT_DRO) {
+        // Fixed code map with every register that exists on one bank, like DOSBox.
+        static const uint8_t s_abOpOffsets[18] = { 0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, 16, 17, 18, 19, 20, 21 };
+        _droRegCount = 0;
+        _droRegs[_droRegCount++] = 0x01;
+        _droRegs[_droRegCount++] = 0x02;
+        _droRegs[_droRegCount++] = 0x03;
+        _droRegs[_droRegCount++] = 0x04;
+        _droRegs[_droRegCount++] = 0x05;
+        _droRegs[_droRegCount++] = 0x08;
+        for (uint8_t base = 0x20; base <= 0x80; base += 0x20) {
+            for (unsigned i = 0; i < RT_ELEMENTS(s_abOpOffsets); i++) {
+                _droRegs[_droRegCount++] = base + s_abOpOffsets[i];
+            }
+        }
+        for (uint8_t base = 0xA0; base <= 0xC0; base += 0x10) {
+            for (uint8_t i = 0; i < 9; i++) {
+                _droRegs[_droRegCount++] = base + i;
+            }
+        }
+        _droRegs[_droRegCount++] = 0xBD;
+        for (unsigned i = 0; i < RT_ELEMENTS(s_abOpOffsets); i++) {
+            _droRegs[_droRegCount++] = 0xE0 + s_abOpOffsets[i];
+        }
+
+        memset(_droCodes, 0xff, sizeof(_droCodes));
+        for (uint8_t i = 0; i < _droRegCount; i++) {
+            _droCodes[_droRegs[i]] = i;
+        }
+    }
+
+    int rc = RTFileOpen(&_file, path, RTFILE_O_WRITE | RTFILE_O_CREATE_REPLACE | RTFILE_O_DENY_WRITE);
+    if (RT_FAILURE(rc)) {
+        LogWarn(("OPL capture: cannot open '%s': %Rrc\n", path, rc));
+        return rc;
+    }
+
+    rc = writeHeader();
+    if (RT_SUCCESS(rc)) {
+        rc = RTCircBufCreate(&_queue, OPLCAPTURE_QUEUE_SIZE * sizeof(Event));
+    }
+    if (RT_SUCCESS(rc)) {
+        rc = RTSemEventCreate(&_wakeup);
+        if (RT_SUCCESS(rc)) {
+            rc = RTThreadCreate(&_thread, writerThread, this, 0, RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "oplcapture");
+            if (RT_FAILURE(rc)) {
+                RTSemEventDestroy(_wakeup);
+            }
+        }
+        if (RT_FAILURE(rc)) {
+            RTCircBufDestroy(_queue);
+        }
+    }
+    if (RT_FAILURE(rc)) {
+        LogWarn(("OPL capture: cannot start capturing to '%s': %Rrc\n", path, rc));
+        RTFileClose(_file);
+        return rc;
+    }
+
+    _open = true;
+    return VINF_SUCCESS;
+}
+
+int OPLCapture::close()
+{
+    if (!_open) {
+        return VINF_SUCCESS;
+    }
+
+    ASMAtomicWriteBool(&_shutdown, true);
+    RTSemEventSignal(_wakeup);
+    int rc = RTThreadWait(_thread, RT_INDEFINITE_WAIT, NULL);
+    AssertRC(rc);
+
+    if (RT_SUCCESS(_rc)) {
+        _rc = writeTrailer();
+    }
+    if (_dropped) {
+        LogRel(("OPL capture: %u register writes were dropped as the writer could not keep up\n", _dropped));
+    }
+
+    rc = RTFileClose(_file);
+    if (RT_SUCCESS(_rc)) {
+        _rc = rc;
+    }
+
+    RTSemEventDestroy(_wakeup);
+    RTCircBufDestroy(_queue);
+    _open = false;
+
+    return _rc;
+}
+
+/**
+ * Queues a register write, timestamped in ticks of the clock given to open().
+ * Never blocks; if the writer thread is too far behind, the write is dropped and counted.
+ */
+void OPLCapture::write(uint64_t ticks, unsigned int chip, uint16_t reg, uint8_t value)
+{
+    Event *event;
+    size_t size;
+
+    RTCircBufAcquireWriteBlock(_queue, sizeof(*event), (void **)&event, &size);
+    if (size < sizeof(*event)) {
+        RTCircBufReleaseWriteBlock(_queue, 0);
+        ASMAtomicIncU32(&_dropped);
+        return;
+    }
+    event->ticks = ticks;
+    event->reg = reg;
+    event->value = value;
+    event->chip = chip;
+    RTCircBufReleaseWriteBlock(_queue, sizeof(*event));
+
+    // Only wake the writer early when the queue is filling up.
+    if (RTCircBufUsed(_queue) >= RTCircBufSize(_queue) / 2) {
+        RTSemEventSignal(_wakeup);
+    }
+}
+
+DECLCALLBACK(int) OPLCapture::writerThread(RTTHREAD thread, void *user)
+{
+    RT_NOREF(thread);
+    OPLCapture *self = static_cast<OPLCapture *>(user);
+
+    bool shutdown;
+    do {
+        shutdown = ASMAtomicReadBool(&self->_shutdown);
+        RTSemEventWait(self->_wakeup, OPLCAPTURE_FLUSH_INTERVAL);
+        self->drain();
+        self->flush();
+    } while (!shutdown);
+
+    return VINF_SUCCESS;
+}
+
+int OPLCapture::writeHeader()
+{
+    uint8_t header[RT_MAX(VGM_HEADER_SIZE, DRO_HEADER_SIZE + sizeof(_droRegs))];
+    size_t size;
+    RT_ZERO(header);
+
+    // Counts and sizes are filled in by writeTrailer().
+    if (_format == FORMAT_VGM) {
+        memcpy(header, "Vgm ", 4);
+        putLE32(header + 0x08, 0x151); // version
+        putLE32(header + 0x34, VGM_HEADER_SIZE - 0x34); // data offset
+        const uint32_t dual = _chips > 1 ? VGM_DUAL_CHIP : 0;
+        if (_opl3) {
+            putLE32(header + 0x5C, VGM_YMF262_CLOCK | dual);
+        } else {
+            putLE32(header + 0x50, VGM_YM3812_CLOCK | dual);
+        }
+        size = VGM_HEADER_SIZE;
+    } else {
+        memcpy(header, "DBRAWOPL", 8);
+        putLE16(header + 0x08, 2); // version major
+        putLE16(header + 0x0A, 0); // version minor
+        header[0x14] = _opl3 ? DRO_HW_OPL3 : _chips > 1 ? DRO_HW_DUAL_OPL2 : DRO_HW_OPL2;
+        header[0x15] = 0; // interleaved
+        header[0x16] = 0; // uncompressed
+        header[0x17] = _droRegCount;     // short delay code
+        header[0x18] = _droRegCount + 1; // long delay code
+        header[0x19] = _droRegCount;
+        memcpy(header + DRO_HEADER_SIZE, _droRegs, _droRegCount);
+        size = DRO_HEADER_SIZE + _droRegCount;
+    }
+
+    _fileSize = size;
+    return RTFileWrite(_file, header, size, NULL);
+}
+
+int OPLCapture::writeTrailer()
+{
+    uint8_t field[8];
+
+    if (_format == FORMAT_VGM) {
+        put(0x66); // end of sound data
+        flush();
+        if (RT_FAILURE(_rc)) {
+            return _rc;
+        }
+
+        putLE32(field, _fileSize - 4);
+        putLE32(field + 4, _pos);
+        int rc = RTFileWriteAt(_file, 0x04, field, 4, NULL);
+        if (RT_SUCCESS(rc)) {
+            rc = RTFileWriteAt(_file, 0x18, field + 4, 4, NULL);
+        }
+        return rc;
+    } else {
+        putLE32(field, _pairs);
+        putLE32(field + 4, _pos);
+        return RTFileWriteAt(_file, 0x0C, field, 8, NULL);
+    }
+}
+
+/** Converts all queued register writes into the file buffer. */
+void OPLCapture::drain()
+{
+    Event *event;
+    size_t size;
+
+    for (;;) {
+        RTCircBufAcquireReadBlock(_queue, sizeof(*event), (void **)&event, &size);
+        if (size < sizeof(*event)) {
+            RTCircBufReleaseReadBlock(_queue, 0);
+            break;
+        }
+        convert(event);
+        RTCircBufReleaseReadBlock(_queue, sizeof(*event));
+    }
+}
+
+void OPLCapture::convert(const Event *event)
+{
+    if (event->chip >= _chips) {
+        return;
+    }
+
+    // Time starts at the first write, so the capture does not begin with a long silence.
+    if (!_started) {
+        _started = true;
+        _startTicks = event->ticks;
+    }
+    const uint64_t ticks = event->ticks > _startTicks ? event->ticks - _startTicks : 0;
+
+    if (_format == FORMAT_VGM) {
+        convertVGM(event, ticks);
+    } else {
+        convertDRO(event, ticks);
+    }
+}
+
+void OPLCapture::convertVGM(const Event *event, uint64_t ticks)
+{
+    // Positions are derived from the absolute time so rounding errors do not accumulate.
+    const uint64_t pos = ASMMultU64ByU32DivByU32(ticks, VGM_SAMPLE_RATE, (uint32_t)_ticksPerSec);
+    while (pos > _pos) {
+        const uint64_t wait = RT_MIN(pos - _pos, UINT16_MAX);
+        if (wait <= 16) {
+            put(0x70 + (wait - 1));
+        } else {
+            put(0x61, wait & 0xff, wait >> 8);
+        }
+        _pos += wait;
+    }
+
+    uint8_t cmd;
+    if (_opl3) {
+        cmd = event->reg & 0x100 ? 0x5F : 0x5E;
+        if (event->chip) {
+            cmd += 0xAE - 0x5E;
+        }
+    } else {
+        cmd = event->chip ? 0xAA : 0x5A;
+    }
+    put(cmd, event->reg & 0xff, event->value);
+}
+
+void OPLCapture::convertDRO(const Event *event, uint64_t ticks)
+{
+    const uint8_t code = _droCodes[event->reg & 0xff];
+    if (code == 0xff) {
+        return; // Register that does not exist, nothing to replay
+    }
+
+    const uint64_t pos = ASMMultU64ByU32DivByU32(ticks, 1000, (uint32_t)_ticksPerSec);
+    while (pos > _pos) {
+        const uint64_t delay = pos - _pos;
+        if (delay <= 256) {
+            put(_droRegCount, delay - 1);
+            _pos += delay;
+        } else {
+            const uint64_t blocks = RT_MIN(delay / 256, 256);
+            put(_droRegCount + 1, blocks - 1);
+            _pos += blocks * 256;
+        }
+        _pairs++;
+    }
+
+    // Both the OPL3 high bank and the second OPL2 use the high bit.
+    const bool high = _opl3 ? event->reg & 0x100 : event->chip;
+    put(code | (high ? 0x80 : 0), event->value);
+    _pairs++;
+}
+
+void OPLCapture::put(uint8_t b0)
+{
+    if (_bufUsed + 1 > sizeof(_buf)) {
+        flush();
+    }
+    _buf[_bufUsed++] = b0;
+}
+
+void OPLCapture::put(uint8_t b0, uint8_t b1)
+{
+    if (_bufUsed + 2 > sizeof(_buf)) {
+        flush();
+    }
+    _buf[_bufUsed++] = b0;
+    _buf[_bufUsed++] = b1;
+}
+
+void OPLCapture::put(uint8_t b0, uint8_t b1, uint8_t b2)
+{
+    if (_bufUsed + 3 > sizeof(_buf)) {
+        flush();
+    }
+    _buf[_bufUsed++] = b0;
+    _buf[_bufUsed++] = b1;
+    _buf[_bufUsed++] = b2;
+}
+
+/** Writes the file buffer out. After an error, the rest of the capture is discarded. */
+void OPLCapture::flush()
+{
+    if (_bufUsed && RT_SUCCESS(_rc)) {
+        _rc = RTFileWrite(_file, _buf, _bufUsed, NULL);
+        if (RT_FAILURE(_rc)) {
+            LogRel(("OPL capture: write error %Rrc, stopping capture\n", _rc));
+        }
+        _fileSize += _bufUsed;
+    }
+    _bufUsed = 0;
+}
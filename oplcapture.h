@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2022 Javier S. Pedro
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef VMUSIC_OPLCAPTURE_H
+#define VMUSIC_OPLCAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <iprt/circbuf.h>
+#include <iprt/file.h>
+#include <iprt/semaphore.h>
+#include <iprt/thread.h>
+
+/**
+ * Captures OPL register writes into a VGM or DOSBox DRO file.
+ *
+ * write() only queues the register write, and may be called from a single producer thread
+ * without locking; a background thread converts the writes and writes them to the file.
+ * Like the other backends, a zero-filled object is a valid closed one.
+ */
+class OPLCapture
+{
+public:
+    enum Format {
+        FORMAT_VGM = 0,
+        FORMAT_DRO
+    };
+
+    OPLCapture();
+    ~OPLCapture();
+
+    int open(const char *path, Format format, bool opl3, unsigned int chips, uint64_t ticksPerSec);
+    int close();
+
+    bool isOpen() const { return _open; }
+
+    void write(uint64_t ticks, unsigned int chip, uint16_t reg, uint8_t value);
+
+private:
+    struct Event {
+        uint64_t ticks;
+        uint16_t reg;
+        uint8_t value;
+        uint8_t chip;
+    };
+
+    static DECLCALLBACK(int) writerThread(RTTHREAD thread, void *user);
+
+    int writeHeader();
+    int writeTrailer();
+    void drain();
+    void convert(const Event *event);
+    void convertVGM(const Event *event, uint64_t ticks);
+    void convertDRO(const Event *event, uint64_t ticks);
+    void put(uint8_t b0);
+    void put(uint8_t b0, uint8_t b1);
+    void put(uint8_t b0, uint8_t b1, uint8_t b2);
+    void flush();
+
+private:
+    bool _open;
+    Format _format;
+    bool _opl3;
+    unsigned int _chips;
+    uint64_t _ticksPerSec;
+
+    RTFILE _file;
+    int _rc;
+    RTTHREAD _thread;
+    RTSEMEVENT _wakeup;
+    bool volatile _shutdown;
+    PRTCIRCBUF _queue;
+    uint32_t volatile _dropped;
+
+    bool _started;
+    uint64_t _startTicks;
+    /** Position of the last written command, in VGM samples or DRO milliseconds. */
+    uint64_t _pos;
+    /** Number of DRO register/value pairs written, delays included. */
+    uint32_t _pairs;
+    /** DRO code of each register, or 0xff if it is not in the code map. */
+    uint8_t _droCodes[256];
+    uint8_t _droRegs[128];
+    uint8_t _droRegCount;
+    uint64_t _fileSize;
+
+    uint8_t _buf[4096];
+    size_t _bufUsed;
+};
+
+#endif
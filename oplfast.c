@@ -0,0 +1,1053 @@
+//
+// VMusic - a VirtualBox extension pack with various music devices
+// Copyright (C) 2022 Javier S. Pedro
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+//
+//  Table-driven OPL2/OPL3 emulator, see oplfast.h.
+//
+//  Register decoding, operator routing, key scaling, vibrato, tremolo and
+//  rhythm follow Nuked OPL3 (opl3.c) so that both cores react to the same
+//  register programs in the same way.
+//
+
+#include <math.h>
+#include <string.h>
+#include "oplfast.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define OPLF_NATIVE_RATE    49716
+
+// Envelope attenuation in 9.16 fixed point
+#define OPLF_ENV_ONE        0x10000
+#define OPLF_ENV_OFF        (0x1f8 << 16)
+#define OPLF_ENV_MAX        (0x1ff << 16)
+
+enum {
+    oplf_eg_attack = 0,
+    oplf_eg_decay = 1,
+    oplf_eg_sustain = 2,
+    oplf_eg_release = 3
+};
+
+enum {
+    oplf_key_norm = 0x01,
+    oplf_key_drum = 0x02
+};
+
+// What a channel renders, derived from NEW, CONNECTION SEL and the rhythm bit
+enum {
+    oplf_mode_2op = 0,
+    oplf_mode_4op = 1,      // first channel of a pair, renders all four slots
+    oplf_mode_4op2 = 2,     // second channel of a pair, rendered by the first
+    oplf_mode_bd = 3,
+    oplf_mode_hhsd = 4,
+    oplf_mode_tttc = 5
+};
+
+//
+// Tables, built on first reset. The logsin and exp formulas reproduce the
+// ROMs used by Nuked OPL3 exactly.
+//
+
+static uint16_t oplf_wave[8][1024]; // log attenuation, bit 15 is the sign
+static int16_t oplf_exp[0x2000];    // indexed by log attenuation
+static uint8_t oplf_tables_ready;
+
+static const uint8_t mt[16] = {
+    1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30
+};
+
+static const uint8_t kslrom[16] = {
+    0, 32, 40, 45, 48, 51, 53, 55, 56, 58, 59, 60, 61, 62, 63, 64
+};
+
+static const uint8_t kslshift[4] = {
+    8, 1, 2, 0
+};
+
+static const int8_t ad_slot[0x20] = {
+    0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1,
+    12, 13, 14, 15, 16, 17, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static const uint8_t ch_slot[18] = {
+    0, 1, 2, 6, 7, 8, 12, 13, 14, 18, 19, 20, 24, 25, 26, 30, 31, 32
+};
+
+static void OPLF_InitTables(void)
+{
+    uint16_t logsin[256];
+    uint16_t exprom[256];
+    uint16_t phase;
+    uint16_t out;
+    uint16_t neg;
+    uint8_t wf;
+    int ii;
+
+    if (oplf_tables_ready)
+    {
+        return;
+    }
+    for (ii = 0; ii < 256; ii++)
+    {
+        logsin[ii] = (uint16_t)lround(-log2(sin((ii + 0.5) * M_PI / 512.0)) * 256.0);
+        exprom[ii] = (uint16_t)lround(exp2((255 - ii) / 256.0) * 1024.0);
+    }
+    for (ii = 0; ii < 0x2000; ii++)
+    {
+        oplf_exp[ii] = (exprom[ii & 0xff] << 1) >> (ii >> 8);
+    }
+    // Same shapes as OPL3_EnvelopeCalcSin0..7
+    for (wf = 0; wf < 8; wf++)
+    {
+        for (phase = 0; phase < 1024; phase++)
+        {
+            out = 0;
+            neg = 0;
+            switch (wf)
+            {
+            case 0:
+                neg = (phase & 0x200) ? 0x8000 : 0;
+                out = logsin[(phase & 0x100) ? (phase & 0xff) ^ 0xff : phase & 0xff];
+                break;
+            case 1:
+                out = (phase & 0x200) ? 0x1000
+                    : logsin[(phase & 0x100) ? (phase & 0xff) ^ 0xff : phase & 0xff];
+                break;
+            case 2:
+                out = logsin[(phase & 0x100) ? (phase & 0xff) ^ 0xff : phase & 0xff];
+                break;
+            case 3:
+                out = (phase & 0x100) ? 0x1000 : logsin[phase & 0xff];
+                break;
+            case 4:
+                neg = ((phase & 0x300) == 0x100) ? 0x8000 : 0;
+                out = (phase & 0x200) ? 0x1000
+                    : logsin[(phase & 0x80) ? ((phase ^ 0xff) << 1) & 0xff : (phase << 1) & 0xff];
+                break;
+            case 5:
+                out = (phase & 0x200) ? 0x1000
+                    : logsin[(phase & 0x80) ? ((phase ^ 0xff) << 1) & 0xff : (phase << 1) & 0xff];
+                break;
+            case 6:
+                neg = (phase & 0x200) ? 0x8000 : 0;
+                break;
+            case 7:
+                neg = (phase & 0x200) ? 0x8000 : 0;
+                out = ((phase & 0x200) ? (phase & 0x1ff) ^ 0x1ff : phase) << 3;
+                break;
+            }
+            oplf_wave[wf][phase] = out | neg;
+        }
+    }
+    oplf_tables_ready = 1;
+}
+
+//
+// Envelope generator
+//
+// On the chip an envelope moves by 2^(rate_hi - 13) * (4 + rate_lo) / 4 steps
+// per sample on average (capped at 4), and the attack multiplies the
+// attenuation by 1 - steps / 8. Both are scaled to the output rate in
+// OPLF_Reset, so an envelope advances with one add or multiply per sample.
+//
+
+static uint8_t OPLF_EnvelopeRate(oplf_chip *chip, oplf_slot *slot, uint8_t reg_rate)
+{
+    oplf_channel *channel = &chip->channel[slot->ch_num];
+    uint8_t rate;
+
+    rate = (reg_rate << 2) + (channel->ksv >> ((slot->reg_ksr ^ 1) << 1));
+    if (rate > 0x3f)
+    {
+        rate = 0x3c | (rate & 0x03);
+    }
+    return rate;
+}
+
+static void OPLF_EnvelopeUpdateRate(oplf_chip *chip, oplf_slot *slot)
+{
+    uint8_t reg_rate = 0;
+    uint8_t rate;
+
+    switch (slot->eg_stage)
+    {
+    case oplf_eg_attack:
+        reg_rate = slot->reg_ar;
+        break;
+    case oplf_eg_decay:
+        reg_rate = slot->reg_dr;
+        break;
+    case oplf_eg_sustain:
+        if (!slot->reg_type)
+        {
+            reg_rate = slot->reg_rr;
+        }
+        break;
+    case oplf_eg_release:
+        reg_rate = slot->reg_rr;
+        break;
+    }
+    if (!reg_rate)
+    {
+        slot->eg_step = (slot->eg_stage == oplf_eg_attack) ? 1 << 30 : 0;
+        return;
+    }
+    rate = OPLF_EnvelopeRate(chip, slot, reg_rate);
+    slot->eg_step = (slot->eg_stage == oplf_eg_attack) ? chip->eg_att[rate] : chip->eg_dec[rate];
+}
+
+static void OPLF_EnvelopeSetStage(oplf_chip *chip, oplf_slot *slot, uint8_t stage)
+{
+    slot->eg_stage = stage;
+    OPLF_EnvelopeUpdateRate(chip, slot);
+}
+
+static int OPLF_SlotSilent(const oplf_slot *slot)
+{
+    return slot->eg_stage == oplf_eg_release && slot->env == OPLF_ENV_MAX;
+}
+
+// Returns zero once the slot has been fully released
+static int OPLF_EnvelopeStep(oplf_chip *chip, oplf_slot *slot)
+{
+    switch (slot->eg_stage)
+    {
+    case oplf_eg_attack:
+        slot->env = (int32_t)(((int64_t)(slot->env + OPLF_ENV_ONE) * slot->eg_step) >> 30)
+                  - OPLF_ENV_ONE;
+        if (slot->env <= 0)
+        {
+            slot->env = 0;
+            OPLF_EnvelopeSetStage(chip, slot, oplf_eg_decay);
+        }
+        return 1;
+    case oplf_eg_decay:
+        slot->env += slot->eg_step;
+        if (slot->env >= (slot->reg_sl << 20))
+        {
+            OPLF_EnvelopeSetStage(chip, slot, oplf_eg_sustain);
+        }
+        break;
+    default:
+        slot->env += slot->eg_step;
+        break;
+    }
+    if (slot->env >= OPLF_ENV_OFF)
+    {
+        slot->env = OPLF_ENV_MAX;
+        if (slot->eg_stage == oplf_eg_release)
+        {
+            slot->out = 0;
+            slot->prout = 0;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void OPLF_SlotKeyOn(oplf_chip *chip, oplf_slot *slot, uint8_t type)
+{
+    if (!slot->key)
+    {
+        chip->active |= (uint64_t)1 << slot->slot_num;
+        slot->phase = 0;
+        OPLF_EnvelopeSetStage(chip, slot, oplf_eg_attack);
+        // Instant attack; rate 15 does not attack otherwise
+        if (slot->reg_ar && (OPLF_EnvelopeRate(chip, slot, slot->reg_ar) >> 2) == 0x0f)
+        {
+            slot->env = 0;
+        }
+    }
+    slot->key |= type;
+}
+
+static void OPLF_SlotKeyOff(oplf_chip *chip, oplf_slot *slot, uint8_t type)
+{
+    if (!slot->key)
+    {
+        return;
+    }
+    slot->key &= ~type;
+    if (!slot->key)
+    {
+        OPLF_EnvelopeSetStage(chip, slot, oplf_eg_release);
+    }
+}
+
+//
+// Phase generator
+//
+
+static void OPLF_SlotUpdateInc(oplf_chip *chip, oplf_slot *slot)
+{
+    oplf_channel *channel = &chip->channel[slot->ch_num];
+    uint16_t f_num = channel->f_num;
+    uint64_t inc;
+    int8_t range;
+
+    if (slot->reg_vib)
+    {
+        range = (f_num >> 7) & 7;
+        if (!(chip->vibpos & 3))
+        {
+            range = 0;
+        }
+        else if (chip->vibpos & 1)
+        {
+            range >>= 1;
+        }
+        range >>= chip->vibshift;
+        if (chip->vibpos & 4)
+        {
+            range = -range;
+        }
+        f_num += range;
+    }
+    inc = ((((uint32_t)f_num << channel->block) >> 1) * mt[slot->reg_mult]) >> 1;
+    slot->inc = (uint32_t)((inc * chip->phase_scale) >> 16);
+}
+
+static void OPLF_SlotUpdateBase(oplf_chip *chip, oplf_slot *slot)
+{
+    oplf_channel *channel = &chip->channel[slot->ch_num];
+    int16_t ksl = (kslrom[channel->f_num >> 6] << 2) - ((0x08 - channel->block) << 5);
+
+    if (ksl < 0)
+    {
+        ksl = 0;
+    }
+    slot->eg_base = (slot->reg_tl << 2) + (ksl >> kslshift[slot->reg_ksl]);
+}
+
+static void OPLF_UpdateVibrato(oplf_chip *chip)
+{
+    uint8_t ii;
+
+    for (ii = 0; ii < 36; ii++)
+    {
+        if (chip->slot[ii].reg_vib)
+        {
+            OPLF_SlotUpdateInc(chip, &chip->slot[ii]);
+        }
+    }
+}
+
+static void OPLF_UpdateTremolo(oplf_chip *chip)
+{
+    uint8_t pos = (uint8_t)((chip->timer >> 22) % 210);
+
+    if (pos < 105)
+    {
+        chip->tremolo = pos >> chip->tremoloshift;
+    }
+    else
+    {
+        chip->tremolo = (210 - pos) >> chip->tremoloshift;
+    }
+}
+
+//
+// Channels
+//
+
+static int OPLF_Is4Op(oplf_chip *chip, uint8_t ch_num)
+{
+    uint8_t bit;
+
+    if (!chip->newm || (ch_num % 9) >= 3)
+    {
+        return 0;
+    }
+    bit = (ch_num < 9) ? ch_num : ch_num - 6;
+    return (chip->fourop >> bit) & 1;
+}
+
+static int OPLF_Is4Op2(oplf_chip *chip, uint8_t ch_num)
+{
+    return (ch_num % 9) >= 3 && (ch_num % 9) < 6 && OPLF_Is4Op(chip, ch_num - 3);
+}
+
+static void OPLF_UpdateModes(oplf_chip *chip)
+{
+    uint8_t ii;
+
+    for (ii = 0; ii < 18; ii++)
+    {
+        chip->channel[ii].mode = OPLF_Is4Op(chip, ii) ? oplf_mode_4op
+                               : OPLF_Is4Op2(chip, ii) ? oplf_mode_4op2
+                               : oplf_mode_2op;
+    }
+    if (chip->rhy & 0x20)
+    {
+        chip->channel[6].mode = oplf_mode_bd;
+        chip->channel[7].mode = oplf_mode_hhsd;
+        chip->channel[8].mode = oplf_mode_tttc;
+    }
+}
+
+static void OPLF_ChannelUpdateFreq(oplf_chip *chip, uint8_t ch_num)
+{
+    oplf_channel *channel = &chip->channel[ch_num];
+    oplf_slot *slot;
+    uint8_t ii;
+
+    channel->ksv = (channel->block << 1) | ((channel->f_num >> (0x09 - chip->nts)) & 0x01);
+    for (ii = 0; ii < 2; ii++)
+    {
+        slot = &chip->slot[ch_slot[ch_num] + 3 * ii];
+        OPLF_SlotUpdateBase(chip, slot);
+        OPLF_SlotUpdateInc(chip, slot);
+        OPLF_EnvelopeUpdateRate(chip, slot);
+    }
+}
+
+static void OPLF_ChannelWriteFreq(oplf_chip *chip, uint8_t ch_num, uint16_t f_num, uint8_t block)
+{
+    if (OPLF_Is4Op2(chip, ch_num))
+    {
+        return;
+    }
+    chip->channel[ch_num].f_num = f_num;
+    chip->channel[ch_num].block = block;
+    OPLF_ChannelUpdateFreq(chip, ch_num);
+    if (OPLF_Is4Op(chip, ch_num))
+    {
+        chip->channel[ch_num + 3].f_num = f_num;
+        chip->channel[ch_num + 3].block = block;
+        OPLF_ChannelUpdateFreq(chip, ch_num + 3);
+    }
+}
+
+static void OPLF_ChannelKey(oplf_chip *chip, uint8_t ch_num, uint8_t on)
+{
+    uint8_t base = ch_slot[ch_num];
+    uint8_t ii;
+
+    if (OPLF_Is4Op2(chip, ch_num))
+    {
+        return;
+    }
+    for (ii = 0; ii < (OPLF_Is4Op(chip, ch_num) ? 4 : 2); ii++)
+    {
+        // The pair's slots are 3 slots after this channel's
+        oplf_slot *slot = &chip->slot[base + 3 * ii];
+        if (on)
+        {
+            OPLF_SlotKeyOn(chip, slot, oplf_key_norm);
+        }
+        else
+        {
+            OPLF_SlotKeyOff(chip, slot, oplf_key_norm);
+        }
+    }
+}
+
+static void OPLF_UpdateRhythm(oplf_chip *chip, uint8_t data)
+{
+    // hh, tc, tom, sd, bd (both slots)
+    static const uint8_t drum_slot[5][2] = {
+        { 13, 13 }, { 17, 17 }, { 14, 14 }, { 16, 16 }, { 12, 15 }
+    };
+    uint8_t ii;
+
+    chip->rhy = data & 0x3f;
+    for (ii = 0; ii < 5; ii++)
+    {
+        if ((chip->rhy & 0x20) && (chip->rhy & (1 << ii)))
+        {
+            OPLF_SlotKeyOn(chip, &chip->slot[drum_slot[ii][0]], oplf_key_drum);
+            OPLF_SlotKeyOn(chip, &chip->slot[drum_slot[ii][1]], oplf_key_drum);
+        }
+        else
+        {
+            OPLF_SlotKeyOff(chip, &chip->slot[drum_slot[ii][0]], oplf_key_drum);
+            OPLF_SlotKeyOff(chip, &chip->slot[drum_slot[ii][1]], oplf_key_drum);
+        }
+    }
+    OPLF_UpdateModes(chip);
+}
+
+//
+// Rendering
+//
+// Register writes only happen between calls to OPLF_GenerateStream, so each
+// channel renders a whole block at a time into a stereo mix buffer. Blocks end
+// where the vibrato position changes, as that changes phase increments.
+//
+
+#define OPLF_BLOCK_SIZE     64
+
+static uint32_t OPLF_SlotPhase(oplf_slot *slot)
+{
+    uint32_t phase = slot->phase >> 22;
+
+    slot->phase += slot->inc;
+    return phase;
+}
+
+static int16_t OPLF_SlotCalc(oplf_slot *slot, uint32_t phase, uint8_t tremolo)
+{
+    uint32_t level;
+    uint16_t wave;
+    int16_t out;
+
+    level = (slot->env >> 16) + slot->eg_base + (tremolo & slot->trem_mask);
+    wave = slot->wave[phase & 0x3ff];
+    level = (wave & 0x7fff) + (level << 3);
+    if (level > 0x1fff)
+    {
+        level = 0x1fff;
+    }
+    out = oplf_exp[level];
+    slot->out = (wave & 0x8000) ? ~out : out;
+    return slot->out;
+}
+
+static int32_t OPLF_SlotFeedback(oplf_channel *channel, oplf_slot *slot)
+{
+    int32_t fbmod = 0;
+
+    if (channel->fb)
+    {
+        fbmod = (slot->prout + slot->out) >> (0x09 - channel->fb);
+    }
+    slot->prout = slot->out;
+    return fbmod;
+}
+
+static void OPLF_Render2Op(oplf_chip *chip, oplf_channel *channel, oplf_slot *s0,
+                           const uint8_t *trem, int32_t *mix, uint32_t count)
+{
+    oplf_slot *s1 = s0 + 3;
+    int32_t cha = (int16_t)channel->cha;
+    int32_t chb = (int16_t)channel->chb;
+    int32_t accm;
+    int32_t out;
+    uint32_t n;
+
+    for (n = 0; n < count; n++)
+    {
+        OPLF_EnvelopeStep(chip, s0);
+        OPLF_EnvelopeStep(chip, s1);
+        out = OPLF_SlotFeedback(channel, s0);
+        out = OPLF_SlotCalc(s0, OPLF_SlotPhase(s0) + out, trem[n]);
+        if (channel->con)
+        {
+            accm = out + OPLF_SlotCalc(s1, OPLF_SlotPhase(s1), trem[n]);
+        }
+        else
+        {
+            accm = OPLF_SlotCalc(s1, OPLF_SlotPhase(s1) + out, trem[n]);
+        }
+        mix[2 * n] += accm & cha;
+        mix[2 * n + 1] += accm & chb;
+    }
+}
+
+static void OPLF_Render4Op(oplf_chip *chip, oplf_channel *channel, oplf_slot *sa,
+                           const uint8_t *trem, int32_t *mix, uint32_t count)
+{
+    oplf_slot *sb = sa + 3;
+    oplf_slot *sc = sa + 6;
+    oplf_slot *sd = sa + 9;
+    // Nuked OPL3 outputs 4-op channels through the second channel
+    int32_t cha = (int16_t)channel[3].cha;
+    int32_t chb = (int16_t)channel[3].chb;
+    uint8_t alg = (channel->con << 1) | channel[3].con;
+    int32_t accm;
+    int32_t a, b, c;
+    uint32_t n;
+
+    for (n = 0; n < count; n++)
+    {
+        OPLF_EnvelopeStep(chip, sa);
+        OPLF_EnvelopeStep(chip, sb);
+        OPLF_EnvelopeStep(chip, sc);
+        OPLF_EnvelopeStep(chip, sd);
+        a = OPLF_SlotFeedback(channel, sa);
+        a = OPLF_SlotCalc(sa, OPLF_SlotPhase(sa) + a, trem[n]);
+        switch (alg)
+        {
+        case 0x00:
+            b = OPLF_SlotCalc(sb, OPLF_SlotPhase(sb) + a, trem[n]);
+            c = OPLF_SlotCalc(sc, OPLF_SlotPhase(sc) + b, trem[n]);
+            accm = OPLF_SlotCalc(sd, OPLF_SlotPhase(sd) + c, trem[n]);
+            break;
+        case 0x01:
+            b = OPLF_SlotCalc(sb, OPLF_SlotPhase(sb) + a, trem[n]);
+            c = OPLF_SlotCalc(sc, OPLF_SlotPhase(sc), trem[n]);
+            accm = b + OPLF_SlotCalc(sd, OPLF_SlotPhase(sd) + c, trem[n]);
+            break;
+        case 0x02:
+            b = OPLF_SlotCalc(sb, OPLF_SlotPhase(sb), trem[n]);
+            c = OPLF_SlotCalc(sc, OPLF_SlotPhase(sc) + b, trem[n]);
+            accm = a + OPLF_SlotCalc(sd, OPLF_SlotPhase(sd) + c, trem[n]);
+            break;
+        default:
+            b = OPLF_SlotCalc(sb, OPLF_SlotPhase(sb), trem[n]);
+            c = OPLF_SlotCalc(sc, OPLF_SlotPhase(sc) + b, trem[n]);
+            accm = a + c + OPLF_SlotCalc(sd, OPLF_SlotPhase(sd), trem[n]);
+            break;
+        }
+        mix[2 * n] += accm & cha;
+        mix[2 * n + 1] += accm & chb;
+    }
+}
+
+static void OPLF_RenderBassDrum(oplf_chip *chip, oplf_channel *channel, oplf_slot *s0,
+                                const uint8_t *trem, int32_t *mix, uint32_t count)
+{
+    oplf_slot *s1 = s0 + 3;
+    int32_t cha = (int16_t)channel->cha;
+    int32_t chb = (int16_t)channel->chb;
+    int32_t accm;
+    int32_t out;
+    uint32_t n;
+
+    for (n = 0; n < count; n++)
+    {
+        OPLF_EnvelopeStep(chip, s0);
+        OPLF_EnvelopeStep(chip, s1);
+        out = OPLF_SlotFeedback(channel, s0);
+        out = OPLF_SlotCalc(s0, OPLF_SlotPhase(s0) + out, trem[n]);
+        accm = OPLF_SlotCalc(s1, OPLF_SlotPhase(s1) + (channel->con ? 0 : out), trem[n]) * 2;
+        mix[2 * n] += accm & cha;
+        mix[2 * n + 1] += accm & chb;
+    }
+}
+
+// Hi-hat and snare drum on channel 7, tom-tom and top cymbal on channel 8
+static void OPLF_RenderRhythm(oplf_chip *chip, const uint8_t *trem, int32_t *mix, uint32_t count)
+{
+    oplf_slot *hh = &chip->slot[13];
+    oplf_slot *tt = &chip->slot[14];
+    oplf_slot *sd = &chip->slot[16];
+    oplf_slot *tc = &chip->slot[17];
+    int32_t cha7 = (int16_t)chip->channel[7].cha;
+    int32_t chb7 = (int16_t)chip->channel[7].chb;
+    int32_t cha8 = (int16_t)chip->channel[8].cha;
+    int32_t chb8 = (int16_t)chip->channel[8].chb;
+    uint32_t noise = chip->noise;
+    uint32_t ph_hh, ph_tc;
+    uint32_t rm_xor;
+    uint32_t n_bit;
+    int32_t accm;
+    uint32_t n;
+    uint8_t ii;
+
+    for (n = 0; n < count; n++)
+    {
+        OPLF_EnvelopeStep(chip, hh);
+        OPLF_EnvelopeStep(chip, tt);
+        OPLF_EnvelopeStep(chip, sd);
+        OPLF_EnvelopeStep(chip, tc);
+        ph_hh = OPLF_SlotPhase(hh);
+        ph_tc = OPLF_SlotPhase(tc);
+        OPLF_SlotPhase(sd);
+        for (ii = 0; ii < 4; ii++)
+        {
+            noise = (noise >> 9) | (((noise ^ (noise >> 14)) & 0x1ff) << 14);
+        }
+        n_bit = noise & 1;
+        rm_xor = (((ph_hh >> 2) ^ (ph_hh >> 7)) | ((ph_hh >> 3) ^ (ph_tc >> 5))
+               | ((ph_tc >> 3) ^ (ph_tc >> 5))) & 1;
+        accm = (OPLF_SlotCalc(hh, (rm_xor << 9) | ((rm_xor ^ n_bit) ? 0xd0 : 0x34), trem[n])
+             + OPLF_SlotCalc(sd, (((ph_hh >> 8) & 1) << 9) | ((((ph_hh >> 8) ^ n_bit) & 1) << 8),
+                             trem[n])) * 2;
+        mix[2 * n] += accm & cha7;
+        mix[2 * n + 1] += accm & chb7;
+        accm = (OPLF_SlotCalc(tt, OPLF_SlotPhase(tt), trem[n])
+             + OPLF_SlotCalc(tc, (rm_xor << 9) | 0x80, trem[n])) * 2;
+        mix[2 * n] += accm & cha8;
+        mix[2 * n + 1] += accm & chb8;
+    }
+    chip->noise = noise;
+}
+
+// Advances the LFOs over up to count samples, returns how many share the vibrato position
+static uint32_t OPLF_UpdateLFO(oplf_chip *chip, uint8_t *trem, uint32_t count)
+{
+    uint64_t timer = chip->timer;
+    uint64_t next;
+    uint32_t n;
+
+    for (n = 0; n < count; n++)
+    {
+        next = timer + chip->timer_step;
+        if ((next ^ timer) >> 22)
+        {
+            if (((next >> 26) & 7) != chip->vibpos)
+            {
+                if (n)
+                {
+                    break;
+                }
+                chip->vibpos = (next >> 26) & 7;
+                OPLF_UpdateVibrato(chip);
+            }
+            chip->timer = next;
+            OPLF_UpdateTremolo(chip);
+        }
+        timer = next;
+        trem[n] = chip->tremolo;
+    }
+    chip->timer = timer;
+    return n;
+}
+
+static uint8_t OPLF_LowestBit(uint64_t mask)
+{
+#if defined(__GNUC__)
+    return (uint8_t)__builtin_ctzll(mask);
+#else
+    uint8_t bit = 0;
+
+    while (!(mask & 1))
+    {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static int16_t OPLF_ClipSample(int32_t sample)
+{
+    if (sample > 32767)
+    {
+        sample = 32767;
+    }
+    else if (sample < -32768)
+    {
+        sample = -32768;
+    }
+    return (int16_t)sample;
+}
+
+static void OPLF_GenerateBlock(oplf_chip *chip, int16_t *sndptr, uint32_t count,
+                               const uint8_t *trem)
+{
+    int32_t mix[OPLF_BLOCK_SIZE * 2];
+    oplf_channel *channel;
+    oplf_slot *slot;
+    uint64_t active;
+    uint32_t n;
+    uint8_t ii;
+
+    memset(mix, 0, sizeof(mix[0]) * 2 * count);
+    for (ii = 0; ii < 18; ii++)
+    {
+        channel = &chip->channel[ii];
+        slot = &chip->slot[ch_slot[ii]];
+        // Slots of a channel are 3 apart, a 4-op channel also has the pair's
+        active = chip->active >> ch_slot[ii];
+        switch (channel->mode)
+        {
+        case oplf_mode_2op:
+            if (active & 0x09)
+            {
+                OPLF_Render2Op(chip, channel, slot, trem, mix, count);
+            }
+            break;
+        case oplf_mode_4op:
+            if (active & 0x249)
+            {
+                OPLF_Render4Op(chip, channel, slot, trem, mix, count);
+            }
+            break;
+        case oplf_mode_bd:
+            if (active & 0x09)
+            {
+                OPLF_RenderBassDrum(chip, channel, slot, trem, mix, count);
+            }
+            break;
+        case oplf_mode_hhsd:
+            // Slots 13, 14, 16 and 17
+            if (active & 0x1b)
+            {
+                OPLF_RenderRhythm(chip, trem, mix, count);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (active = chip->active; active; active &= active - 1)
+    {
+        ii = OPLF_LowestBit(active);
+        if (OPLF_SlotSilent(&chip->slot[ii]))
+        {
+            chip->active &= ~((uint64_t)1 << ii);
+        }
+    }
+
+    for (n = 0; n < 2 * count; n++)
+    {
+        sndptr[n] = OPLF_ClipSample(mix[n]);
+    }
+}
+
+//
+// Slot registers
+//
+
+static void OPLF_SlotWrite20(oplf_chip *chip, oplf_slot *slot, uint8_t data)
+{
+    slot->trem_mask = ((data >> 7) & 0x01) ? 0xff : 0x00;
+    slot->reg_vib = (data >> 6) & 0x01;
+    slot->reg_type = (data >> 5) & 0x01;
+    slot->reg_ksr = (data >> 4) & 0x01;
+    slot->reg_mult = data & 0x0f;
+    OPLF_SlotUpdateInc(chip, slot);
+    OPLF_EnvelopeUpdateRate(chip, slot);
+}
+
+static void OPLF_SlotWrite40(oplf_chip *chip, oplf_slot *slot, uint8_t data)
+{
+    slot->reg_ksl = (data >> 6) & 0x03;
+    slot->reg_tl = data & 0x3f;
+    OPLF_SlotUpdateBase(chip, slot);
+}
+
+static void OPLF_SlotWrite60(oplf_chip *chip, oplf_slot *slot, uint8_t data)
+{
+    slot->reg_ar = (data >> 4) & 0x0f;
+    slot->reg_dr = data & 0x0f;
+    OPLF_EnvelopeUpdateRate(chip, slot);
+}
+
+static void OPLF_SlotWrite80(oplf_chip *chip, oplf_slot *slot, uint8_t data)
+{
+    slot->reg_sl = (data >> 4) & 0x0f;
+    if (slot->reg_sl == 0x0f)
+    {
+        slot->reg_sl = 0x1f;
+    }
+    slot->reg_rr = data & 0x0f;
+    OPLF_EnvelopeUpdateRate(chip, slot);
+}
+
+static void OPLF_SlotWriteE0(oplf_chip *chip, oplf_slot *slot, uint8_t data)
+{
+    slot->reg_wf = data & 0x07;
+    if (!chip->newm)
+    {
+        slot->reg_wf &= 0x03;
+    }
+    slot->wave = oplf_wave[slot->reg_wf];
+}
+
+//
+// Interface
+//
+
+void OPLF_Reset(oplf_chip *chip, uint32_t samplerate)
+{
+    double ratio;
+    double steps;
+    uint8_t rate;
+    uint8_t ii;
+
+    OPLF_InitTables();
+    if (!samplerate)
+    {
+        samplerate = OPLF_NATIVE_RATE;
+    }
+    ratio = (double)OPLF_NATIVE_RATE / samplerate;
+
+    memset(chip, 0, sizeof(oplf_chip));
+    for (rate = 4; rate < 64; rate++)
+    {
+        if ((rate >> 2) == 0x0f)
+        {
+            steps = 4.0;
+        }
+        else
+        {
+            steps = ldexp(4 + (rate & 0x03), (rate >> 2) - 15);
+        }
+        chip->eg_dec[rate] = (int32_t)lround(steps * ratio * OPLF_ENV_ONE);
+        chip->eg_att[rate] = ((rate >> 2) == 0x0f) ? 1 << 30
+                           : (int32_t)lround(pow(1.0 - steps / 8.0, ratio) * (1 << 30));
+    }
+    chip->timer_step = (uint32_t)lround(ratio * 65536.0);
+    chip->phase_scale = (uint64_t)llround(ratio * (1 << 29));
+
+    for (ii = 0; ii < 36; ii++)
+    {
+        chip->slot[ii].env = OPLF_ENV_MAX;
+        chip->slot[ii].eg_stage = oplf_eg_release;
+        chip->slot[ii].wave = oplf_wave[0];
+        chip->slot[ii].slot_num = ii;
+    }
+    for (ii = 0; ii < 18; ii++)
+    {
+        chip->slot[ch_slot[ii]].ch_num = ii;
+        chip->slot[ch_slot[ii] + 3].ch_num = ii;
+        chip->channel[ii].cha = 0xffff;
+        chip->channel[ii].chb = 0xffff;
+    }
+    for (ii = 0; ii < 36; ii++)
+    {
+        OPLF_SlotUpdateBase(chip, &chip->slot[ii]);
+    }
+    chip->noise = 1;
+    chip->tremoloshift = 4;
+    chip->vibshift = 1;
+}
+
+void OPLF_WriteReg(oplf_chip *chip, uint16_t reg, uint8_t v)
+{
+    uint8_t high = (reg >> 8) & 0x01;
+    uint8_t regm = reg & 0xff;
+    uint8_t ch_num = 9 * high + (regm & 0x0f);
+    oplf_channel *channel;
+    oplf_slot *slot = NULL;
+
+    if (ad_slot[regm & 0x1f] >= 0)
+    {
+        slot = &chip->slot[18 * high + ad_slot[regm & 0x1f]];
+    }
+    switch (regm & 0xf0)
+    {
+    case 0x00:
+        if (high)
+        {
+            switch (regm & 0x0f)
+            {
+            case 0x04:
+                chip->fourop = v & 0x3f;
+                OPLF_UpdateModes(chip);
+                break;
+            case 0x05:
+                chip->newm = v & 0x01;
+                OPLF_UpdateModes(chip);
+                break;
+            }
+        }
+        else if ((regm & 0x0f) == 0x08)
+        {
+            chip->nts = (v >> 6) & 0x01;
+        }
+        break;
+    case 0x20:
+    case 0x30:
+        if (slot)
+        {
+            OPLF_SlotWrite20(chip, slot, v);
+        }
+        break;
+    case 0x40:
+    case 0x50:
+        if (slot)
+        {
+            OPLF_SlotWrite40(chip, slot, v);
+        }
+        break;
+    case 0x60:
+    case 0x70:
+        if (slot)
+        {
+            OPLF_SlotWrite60(chip, slot, v);
+        }
+        break;
+    case 0x80:
+    case 0x90:
+        if (slot)
+        {
+            OPLF_SlotWrite80(chip, slot, v);
+        }
+        break;
+    case 0xe0:
+    case 0xf0:
+        if (slot)
+        {
+            OPLF_SlotWriteE0(chip, slot, v);
+        }
+        break;
+    case 0xa0:
+        if ((regm & 0x0f) < 9)
+        {
+            channel = &chip->channel[ch_num];
+            OPLF_ChannelWriteFreq(chip, ch_num, (channel->f_num & 0x300) | v, channel->block);
+        }
+        break;
+    case 0xb0:
+        if (regm == 0xbd && !high)
+        {
+            chip->tremoloshift = (((v >> 7) ^ 1) << 1) + 2;
+            chip->vibshift = ((v >> 6) & 0x01) ^ 1;
+            OPLF_UpdateTremolo(chip);
+            OPLF_UpdateVibrato(chip);
+            OPLF_UpdateRhythm(chip, v);
+        }
+        else if ((regm & 0x0f) < 9)
+        {
+            channel = &chip->channel[ch_num];
+            OPLF_ChannelWriteFreq(chip, ch_num, (channel->f_num & 0xff) | ((v & 0x03) << 8),
+                                  (v >> 2) & 0x07);
+            OPLF_ChannelKey(chip, ch_num, v & 0x20);
+        }
+        break;
+    case 0xc0:
+        if ((regm & 0x0f) < 9)
+        {
+            channel = &chip->channel[ch_num];
+            channel->fb = (v & 0x0e) >> 1;
+            channel->con = v & 0x01;
+            if (chip->newm)
+            {
+                channel->cha = ((v >> 4) & 0x01) ? 0xffff : 0;
+                channel->chb = ((v >> 5) & 0x01) ? 0xffff : 0;
+            }
+            else
+            {
+                channel->cha = channel->chb = 0xffff;
+            }
+        }
+        break;
+    }
+}
+
+// Writes take effect immediately; there is no point in emulating the chip's
+// write latency when rendering is not sample-accurate anyway
+void OPLF_WriteRegBuffered(oplf_chip *chip, uint16_t reg, uint8_t v)
+{
+    OPLF_WriteReg(chip, reg, v);
+}
+
+// Whether every slot is keyed off and fully released
+int OPLF_IsSilent(const oplf_chip *chip)
+{
+    return chip->active == 0;
+}
+
+void OPLF_GenerateStream(oplf_chip *chip, int16_t *sndptr, uint32_t numsamples)
+{
+    uint8_t trem[OPLF_BLOCK_SIZE];
+    uint32_t count;
+
+    while (numsamples > 0)
+    {
+        count = numsamples < OPLF_BLOCK_SIZE ? numsamples : OPLF_BLOCK_SIZE;
+        count = OPLF_UpdateLFO(chip, trem, count);
+        OPLF_GenerateBlock(chip, sndptr, count, trem);
+        sndptr += count * 2;
+        numsamples -= count;
+    }
+}
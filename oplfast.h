@@ -0,0 +1,107 @@
+//
+// VMusic - a VirtualBox extension pack with various music devices
+// Copyright (C) 2022 Javier S. Pedro
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+//
+//  Table-driven OPL2/OPL3 emulator.
+//
+//  A cheaper alternative to the Nuked OPL3 core with the same interface.
+//  It uses the same register model, sine/exp ROMs and operator routing,
+//  but renders directly at the output sample rate: phase increments,
+//  envelope rates and LFO steps are scaled once per register write instead
+//  of running the chip at 49716 Hz and resampling, and envelopes advance
+//  by precomputed per-sample steps instead of the chip's envelope timer.
+//  Output is close to, but not bit-identical with, Nuked OPL3.
+//
+
+#ifndef OPL_OPLFAST_H
+#define OPL_OPLFAST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <inttypes.h>
+
+typedef struct _oplf_slot oplf_slot;
+typedef struct _oplf_channel oplf_channel;
+typedef struct _oplf_chip oplf_chip;
+
+struct _oplf_slot {
+    uint32_t phase;      // 10.22 fixed point, upper 10 bits index the waveform
+    uint32_t inc;        // per output sample, vibrato included
+    int32_t env;         // attenuation, 9.16 fixed point
+    int32_t eg_step;     // attack: 2.30 multiplier, other stages: 9.16 increment
+    uint16_t eg_base;    // total level + key scale level
+    uint8_t eg_stage;
+    uint8_t key;
+    int16_t out;
+    int16_t prout;
+    const uint16_t *wave;
+    uint8_t trem_mask;
+    uint8_t reg_vib;
+    uint8_t reg_type;
+    uint8_t reg_ksr;
+    uint8_t reg_mult;
+    uint8_t reg_ksl;
+    uint8_t reg_tl;
+    uint8_t reg_ar;
+    uint8_t reg_dr;
+    uint8_t reg_sl;
+    uint8_t reg_rr;
+    uint8_t reg_wf;
+    uint8_t ch_num;
+    uint8_t slot_num;
+};
+
+struct _oplf_channel {
+    uint16_t f_num;
+    uint8_t block;
+    uint8_t ksv;
+    uint8_t fb;
+    uint8_t con;
+    uint8_t mode;
+    uint16_t cha, chb;
+};
+
+struct _oplf_chip {
+    oplf_channel channel[18];
+    oplf_slot slot[36];
+    uint8_t newm;
+    uint8_t nts;
+    uint8_t rhy;
+    uint8_t fourop;
+    uint8_t vibpos;
+    uint8_t vibshift;
+    uint8_t tremolo;
+    uint8_t tremoloshift;
+    uint32_t noise;
+    uint64_t active;         // slots that are not fully released
+    uint64_t timer;          // native samples, 16.16 fixed point
+    uint32_t timer_step;     // native samples per output sample, 16.16 fixed point
+    uint64_t phase_scale;    // native phase increment to output increment, 16.16 fixed point
+    int32_t eg_dec[64];      // decay increment per rate, 9.16 fixed point
+    int32_t eg_att[64];      // attack multiplier per rate, 2.30 fixed point
+};
+
+void OPLF_Reset(oplf_chip *chip, uint32_t samplerate);
+void OPLF_WriteReg(oplf_chip *chip, uint16_t reg, uint8_t v);
+void OPLF_WriteRegBuffered(oplf_chip *chip, uint16_t reg, uint8_t v);
+void OPLF_GenerateStream(oplf_chip *chip, int16_t *sndptr, uint32_t numsamples);
+int OPLF_IsSilent(const oplf_chip *chip);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
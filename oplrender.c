@@ -0,0 +1,899 @@
+/*
+ * VMusic - a VirtualBox extension pack with various music devices
+ * Copyright (C) 2022 Javier S. Pedro
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * vmusic-oplrender: renders VGM and DOSBox DRO captures offline with the same
+ * OPL emulation cores as the Adlib device, as fast as possible, for batch
+ * verification and benchmarking of the cores.
+ *
+ * Files are rendered in parallel by a pool of threads. Long files are also
+ * split into segments at points where all keys have been off for a while, and
+ * those segments are rendered in parallel too: each one starts from a fresh
+ * chip with all earlier register writes replayed. If the chip was silent at the
+ * split point, this only changes the phase of the envelope, LFO and noise
+ * generators; -s 0 disables splitting for bit-exact sequential renders.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "opl3.h"
+#include "oplfast.h"
+
+#define OPLR_DEFAULT_RATE       49716   /* Hz, the native OPL3 rate */
+#define OPLR_DEFAULT_SEGMENT    30      /* seconds, minimum length of a split segment */
+#define OPLR_SPLIT_SILENCE      3       /* seconds all keys must be off before a split point */
+#define OPLR_MAX_CHIPS          2
+#define OPLR_CHUNK_FRAMES       4096
+#define OPLR_VGM_RATE           44100
+#define OPLR_WAV_HEADER_SIZE    44
+
+/* An OPL emulation core, as in the Adlib device. */
+typedef struct {
+    const char *name;
+    size_t size;
+    void (*reset)(void *chip, uint32_t rate);
+    void (*write)(void *chip, uint16_t reg, uint8_t value);
+    void (*generate)(void *chip, int16_t *buf, uint32_t frames);
+    int (*silent)(void *chip);
+} oplr_core;
+
+/* A register write, at the output frame it happens before. */
+typedef struct {
+    uint64_t pos;
+    uint16_t reg;
+    uint8_t value;
+    uint8_t chip;
+} oplr_event;
+
+typedef struct oplr_song oplr_song;
+
+/* A part of a song which can be rendered independently. */
+typedef struct {
+    oplr_song *song;
+    uint64_t start, end;        /* output frames */
+    size_t first_event;         /* first write at or after start */
+} oplr_segment;
+
+struct oplr_song {
+    const char *path;
+    oplr_event *events;
+    size_t nevents;
+    unsigned nchips;
+    uint64_t frames;
+    int fd;                     /* output, or -1 */
+
+    oplr_segment *segs;
+    unsigned nsegs;
+    unsigned next_seg;          /* protected by the job lock */
+    unsigned segs_done;         /* protected by the job lock */
+    double cpu_secs;            /* protected by the job lock */
+    unsigned unclean_splits;    /* protected by the job lock */
+    int failed;                 /* protected by the job lock */
+
+    oplr_song *next;
+};
+
+/* Options. */
+static const oplr_core *g_core;
+static uint32_t g_rate = OPLR_DEFAULT_RATE;
+static unsigned g_segment_secs = OPLR_DEFAULT_SEGMENT;
+static const char *g_outdir;
+static int g_raw;
+
+/* Jobs, protected by g_lock. */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **g_files;
+static int g_nfiles;
+static int g_next_file;
+static oplr_song *g_songs;      /* songs with segments still to render */
+static double g_total_audio, g_total_cpu;
+static int g_errors;
+
+static void nuked_reset(void *chip, uint32_t rate)
+{
+    OPL3_Reset((opl3_chip *)chip, rate);
+}
+
+static void nuked_write(void *chip, uint16_t reg, uint8_t value)
+{
+    OPL3_WriteReg((opl3_chip *)chip, reg, value);
+}
+
+static void nuked_generate(void *chip, int16_t *buf, uint32_t frames)
+{
+    OPL3_GenerateStream((opl3_chip *)chip, buf, frames);
+}
+
+static int nuked_silent(void *chip)
+{
+    return OPL3_IsSilent((opl3_chip *)chip);
+}
+
+static void fast_reset(void *chip, uint32_t rate)
+{
+    OPLF_Reset((oplf_chip *)chip, rate);
+}
+
+static void fast_write(void *chip, uint16_t reg, uint8_t value)
+{
+    OPLF_WriteReg((oplf_chip *)chip, reg, value);
+}
+
+static void fast_generate(void *chip, int16_t *buf, uint32_t frames)
+{
+    OPLF_GenerateStream((oplf_chip *)chip, buf, frames);
+}
+
+static int fast_silent(void *chip)
+{
+    return OPLF_IsSilent((oplf_chip *)chip);
+}
+
+static const oplr_core g_cores[] = {
+    { "nuked", sizeof(opl3_chip), nuked_reset, nuked_write, nuked_generate, nuked_silent },
+    { "fast",  sizeof(oplf_chip), fast_reset,  fast_write,  fast_generate,  fast_silent },
+};
+
+static double thread_cpu_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double wall_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v & 0xffff);
+    put16(p + 2, v >> 16);
+}
+
+static int add_event(oplr_song *song, size_t *cap, uint64_t pos, unsigned chip, uint16_t reg, uint8_t value)
+{
+    if (song->nevents == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 4096;
+        oplr_event *events = realloc(song->events, ncap * sizeof(*events));
+        if (!events) {
+            return -1;
+        }
+        song->events = events;
+        *cap = ncap;
+    }
+    oplr_event *e = &song->events[song->nevents++];
+    e->pos = pos;
+    e->reg = reg;
+    e->value = value;
+    e->chip = chip;
+    return 0;
+}
+
+/* Number of bytes taken by a VGM command, including the command byte. */
+static size_t vgm_cmd_size(const uint8_t *p)
+{
+    uint8_t cmd = p[0];
+
+    if (cmd == 0x67) {
+        return 7 + get32(p + 3); /* data block */
+    } else if (cmd == 0x68) {
+        return 12;
+    } else if (cmd >= 0x70 && cmd <= 0x8f) {
+        return 1;
+    } else if (cmd >= 0x30 && cmd <= 0x3f) {
+        return 2;
+    } else if (cmd == 0x4f || cmd == 0x50) {
+        return 2;
+    } else if ((cmd >= 0x40 && cmd <= 0x5f) || (cmd >= 0xa0 && cmd <= 0xbf)) {
+        return 3;
+    } else if (cmd == 0x61) {
+        return 3;
+    } else if (cmd == 0x90 || cmd == 0x91 || cmd == 0x95) {
+        return 5;
+    } else if (cmd == 0x92) {
+        return 6;
+    } else if (cmd == 0x93) {
+        return 11;
+    } else if (cmd == 0x94) {
+        return 2;
+    } else if (cmd >= 0xc0 && cmd <= 0xdf) {
+        return 4;
+    } else if (cmd >= 0xe0) {
+        return 5;
+    }
+    return 1;
+}
+
+static int parse_vgm(oplr_song *song, const uint8_t *data, size_t size)
+{
+    size_t cap = 0;
+
+    if (size < 0x40) {
+        return -1;
+    }
+
+    uint32_t version = get32(data + 0x08);
+    size_t off = 0x40;
+    if (version >= 0x150 && get32(data + 0x34)) {
+        off = 0x34 + get32(data + 0x34);
+    }
+
+    uint32_t clock_opl2 = size >= 0x54 && version >= 0x151 ? get32(data + 0x50) : 0;
+    uint32_t clock_opl = size >= 0x58 && version >= 0x151 ? get32(data + 0x54) : 0;
+    uint32_t clock_opl3 = size >= 0x60 && version >= 0x151 ? get32(data + 0x5c) : 0;
+    if (!clock_opl2 && !clock_opl && !clock_opl3) {
+        fprintf(stderr, "%s: no OPL2/OPL3 in this VGM file\n", song->path);
+        return -1;
+    }
+    song->nchips = ((clock_opl2 | clock_opl | clock_opl3) & (1u << 30)) ? 2 : 1;
+
+    uint64_t samples = 0;
+    while (off < size) {
+        const uint8_t *p = data + off;
+        uint8_t cmd = p[0];
+        if (cmd == 0x67 && off + 7 > size) {
+            break;
+        }
+        size_t len = vgm_cmd_size(p);
+        if (off + len > size) {
+            break;
+        }
+
+        uint64_t pos = samples * g_rate / OPLR_VGM_RATE;
+        int chip = -1;
+        uint16_t bank = 0;
+
+        switch (cmd) {
+            case 0x5a: case 0x5b: case 0x5e:
+                chip = 0;
+                break;
+            case 0x5f:
+                chip = 0;
+                bank = 0x100;
+                break;
+            case 0xaa: case 0xab: case 0xae:
+                chip = 1;
+                break;
+            case 0xaf:
+                chip = 1;
+                bank = 0x100;
+                break;
+            case 0x61:
+                samples += get16(p + 1);
+                break;
+            case 0x62:
+                samples += 735;
+                break;
+            case 0x63:
+                samples += 882;
+                break;
+            case 0x66:
+                off = size; /* end of sound data */
+                continue;
+            default:
+                if (cmd >= 0x70 && cmd <= 0x7f) {
+                    samples += (cmd & 0xf) + 1;
+                } else if (cmd >= 0x80 && cmd <= 0x8f) {
+                    samples += cmd & 0xf;
+                }
+                break;
+        }
+
+        if (chip >= 0 && (unsigned)chip < song->nchips) {
+            if (add_event(song, &cap, pos, chip, bank | p[1], p[2]) < 0) {
+                return -1;
+            }
+        }
+
+        off += len;
+    }
+
+    song->frames = samples * g_rate / OPLR_VGM_RATE;
+    return 0;
+}
+
+static int parse_dro(oplr_song *song, const uint8_t *data, size_t size)
+{
+    size_t cap = 0;
+    uint64_t ms = 0;
+
+    if (size < 0x1a) {
+        return -1;
+    }
+
+    if (get16(data + 0x08) == 2) {
+        /* Version 2: register/value pairs through a code map. */
+        uint32_t pairs = get32(data + 0x0c);
+        uint8_t hw = data[0x14];
+        uint8_t short_delay = data[0x17], long_delay = data[0x18];
+        uint8_t codemap_len = data[0x19];
+        const uint8_t *codemap = data + 0x1a;
+        size_t off = 0x1a + codemap_len;
+
+        if (data[0x15] != 0 || data[0x16] != 0) {
+            fprintf(stderr, "%s: unsupported DRO format or compression\n", song->path);
+            return -1;
+        }
+        song->nchips = hw == 1 ? 2 : 1;
+
+        for (uint32_t i = 0; i < pairs && off + 2 <= size; i++, off += 2) {
+            uint8_t code = data[off], value = data[off + 1];
+            if (code == short_delay) {
+                ms += value + 1;
+            } else if (code == long_delay) {
+                ms += (value + 1) << 8;
+            } else if ((code & 0x7f) < codemap_len) {
+                unsigned chip = hw == 1 && (code & 0x80) ? 1 : 0;
+                uint16_t bank = hw == 2 && (code & 0x80) ? 0x100 : 0;
+                if (add_event(song, &cap, ms * g_rate / 1000, chip, bank | codemap[code & 0x7f], value) < 0) {
+                    return -1;
+                }
+            }
+        }
+    } else if (get32(data + 0x08) == 0x10000) {
+        /* Version 1: a byte stream with inline delay and bank commands. */
+        uint8_t hw = data[0x14];
+        size_t off = 0x15;
+        /* Most writers stored the hardware type as 32 bits, despite the format documentation. */
+        if (size >= 0x18 && data[0x15] == 0 && data[0x16] == 0 && data[0x17] == 0) {
+            off = 0x18;
+        }
+        size_t end = off + get32(data + 0x10);
+        if (end > size) {
+            end = size;
+        }
+        song->nchips = hw == 2 ? 2 : 1;
+
+        unsigned bank = 0;
+        while (off < end) {
+            uint8_t cmd = data[off++];
+            uint8_t reg = cmd;
+            switch (cmd) {
+                case 0x00:
+                    if (off < end) {
+                        ms += data[off++] + 1;
+                    }
+                    continue;
+                case 0x01:
+                    if (off + 2 <= end) {
+                        ms += get16(data + off) + 1;
+                        off += 2;
+                    }
+                    continue;
+                case 0x02:
+                case 0x03:
+                    bank = cmd - 0x02;
+                    continue;
+                case 0x04:
+                    if (off < end) {
+                        reg = data[off++];
+                    }
+                    break;
+            }
+            if (off >= end) {
+                break;
+            }
+            unsigned chip = hw == 2 ? bank : 0;
+            uint16_t high = hw == 1 && bank ? 0x100 : 0;
+            if (add_event(song, &cap, ms * g_rate / 1000, chip, high | reg, data[off++]) < 0) {
+                return -1;
+            }
+        }
+    } else {
+        fprintf(stderr, "%s: unsupported DRO version\n", song->path);
+        return -1;
+    }
+
+    song->frames = ms * g_rate / 1000;
+    return 0;
+}
+
+/*
+ * Splits the song where all keys have been off for OPLR_SPLIT_SILENCE seconds,
+ * into segments of at least g_segment_secs.
+ */
+static int split_song(oplr_song *song)
+{
+    const uint64_t min_frames = (uint64_t)g_segment_secs * g_rate;
+    const uint64_t silence_frames = (uint64_t)OPLR_SPLIT_SILENCE * g_rate;
+    uint32_t keys[OPLR_MAX_CHIPS][2] = { { 0 } }; /* per chip: channel key bits, rhythm key bits */
+    uint64_t silent_since = 0;
+    uint64_t last_split = 0;
+    unsigned cap = 16;
+
+    song->segs = malloc(cap * sizeof(*song->segs));
+    if (!song->segs) {
+        return -1;
+    }
+    song->nsegs = 0;
+
+    for (size_t i = 0; g_segment_secs && i < song->nevents; i++) {
+        const oplr_event *e = &song->events[i];
+        int any_key = 0;
+        for (unsigned c = 0; c < song->nchips; c++) {
+            any_key |= keys[c][0] || keys[c][1];
+        }
+
+        if (!any_key && e->pos - silent_since >= silence_frames
+            && e->pos - last_split >= min_frames && song->frames - e->pos >= min_frames) {
+            if (song->nsegs + 1 == cap) {
+                oplr_segment *segs = realloc(song->segs, cap * 2 * sizeof(*segs));
+                if (!segs) {
+                    return -1;
+                }
+                song->segs = segs;
+                cap *= 2;
+            }
+            song->segs[song->nsegs].start = last_split;
+            song->segs[song->nsegs].end = e->pos;
+            song->nsegs++;
+            last_split = e->pos;
+        }
+
+        uint8_t regm = e->reg & 0xff;
+        unsigned ch = (regm & 0xf) + (e->reg & 0x100 ? 9 : 0);
+        if (regm >= 0xb0 && regm <= 0xb8) {
+            if (e->value & 0x20) {
+                keys[e->chip][0] |= 1u << ch;
+            } else {
+                keys[e->chip][0] &= ~(1u << ch);
+            }
+        } else if (e->reg == 0xbd) {
+            keys[e->chip][1] = e->value & 0x20 ? e->value & 0x1f : 0;
+        }
+
+        int any_key_after = 0;
+        for (unsigned c = 0; c < song->nchips; c++) {
+            any_key_after |= keys[c][0] || keys[c][1];
+        }
+        if (any_key_after) {
+            silent_since = UINT64_MAX; /* not silent */
+        } else if (any_key) {
+            silent_since = e->pos;
+        }
+    }
+
+    song->segs[song->nsegs].start = last_split;
+    song->segs[song->nsegs].end = song->frames;
+    song->nsegs++;
+
+    size_t ev = 0;
+    for (unsigned s = 0; s < song->nsegs; s++) {
+        song->segs[s].song = song;
+        while (ev < song->nevents && song->events[ev].pos < song->segs[s].start) {
+            ev++;
+        }
+        song->segs[s].first_event = ev;
+    }
+
+    return 0;
+}
+
+/* Output file name: the input file name with .wav or .raw appended, so that song.vgm and song.dro do not clash. */
+static char *output_path(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    size_t len = strlen(g_outdir) + 1 + strlen(base) + 5;
+    char *out = malloc(len);
+    if (out) {
+        snprintf(out, len, "%s/%s.%s", g_outdir, base, g_raw ? "raw" : "wav");
+    }
+    return out;
+}
+
+static int open_output(oplr_song *song)
+{
+    song->fd = -1;
+    if (!g_outdir) {
+        return 0;
+    }
+
+    char *out = output_path(song->path);
+    if (!out) {
+        return -1;
+    }
+    song->fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (song->fd < 0) {
+        fprintf(stderr, "%s: %s\n", out, strerror(errno));
+        free(out);
+        return -1;
+    }
+    free(out);
+
+    if (!g_raw) {
+        uint8_t hdr[OPLR_WAV_HEADER_SIZE];
+        uint32_t data_size = (uint32_t)(song->frames * 4);
+        memcpy(hdr, "RIFF", 4);
+        put32(hdr + 4, 36 + data_size);
+        memcpy(hdr + 8, "WAVEfmt ", 8);
+        put32(hdr + 16, 16);
+        put16(hdr + 20, 1);             /* PCM */
+        put16(hdr + 22, 2);             /* channels */
+        put32(hdr + 24, g_rate);
+        put32(hdr + 28, g_rate * 4);    /* byte rate */
+        put16(hdr + 32, 4);             /* block align */
+        put16(hdr + 34, 16);            /* bits per sample */
+        memcpy(hdr + 36, "data", 4);
+        put32(hdr + 40, data_size);
+        if (pwrite(song->fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_song(oplr_song *song)
+{
+    if (song->fd >= 0) {
+        close(song->fd);
+    }
+    free(song->events);
+    free(song->segs);
+    free(song);
+}
+
+static oplr_song *load_song(const char *path)
+{
+    oplr_song *song = calloc(1, sizeof(*song));
+    if (!song) {
+        return NULL;
+    }
+    song->path = path;
+    song->fd = -1;
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        free_song(song);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    if (!data || fread(data, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "%s: cannot read\n", path);
+        fclose(f);
+        free(data);
+        free_song(song);
+        return NULL;
+    }
+    fclose(f);
+
+    int rc;
+    if (size >= 4 && memcmp(data, "Vgm ", 4) == 0) {
+        rc = parse_vgm(song, data, size);
+    } else if (size >= 8 && memcmp(data, "DBRAWOPL", 8) == 0) {
+        rc = parse_dro(song, data, size);
+    } else if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+        fprintf(stderr, "%s: compressed (VGZ) files are not supported, gunzip them first\n", path);
+        rc = -1;
+    } else {
+        fprintf(stderr, "%s: not a VGM or DRO file\n", path);
+        rc = -1;
+    }
+    free(data);
+
+    if (rc == 0) {
+        rc = split_song(song);
+    }
+    if (rc == 0) {
+        rc = open_output(song);
+    }
+    if (rc != 0) {
+        free_song(song);
+        return NULL;
+    }
+    return song;
+}
+
+static void mix_chips(int16_t *out, int16_t *const *in, unsigned nchips, uint32_t frames)
+{
+    for (uint32_t i = 0; i < frames * 2; i++) {
+        int32_t sample = 0;
+        for (unsigned c = 0; c < nchips; c++) {
+            sample += in[c][i];
+        }
+        out[i] = sample > INT16_MAX ? INT16_MAX : sample < INT16_MIN ? INT16_MIN : sample;
+    }
+}
+
+/* Renders a segment, writing it at its place in the output. Returns whether the chips were silent at its end. */
+static int render_segment(const oplr_segment *seg, int *failed)
+{
+    const oplr_song *song = seg->song;
+    void *chips[OPLR_MAX_CHIPS];
+    int16_t *bufs[OPLR_MAX_CHIPS];
+    int16_t *out = malloc(OPLR_CHUNK_FRAMES * 4);
+    int silent = 1;
+
+    for (unsigned c = 0; c < song->nchips; c++) {
+        chips[c] = aligned_alloc(64, (g_core->size + 63) & ~(size_t)63);
+        bufs[c] = song->nchips > 1 ? malloc(OPLR_CHUNK_FRAMES * 4) : out;
+        if (!chips[c] || !bufs[c] || !out) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        g_core->reset(chips[c], g_rate);
+    }
+
+    /* Bring the chips to the state at the start of the segment. */
+    for (size_t i = 0; i < seg->first_event; i++) {
+        const oplr_event *e = &song->events[i];
+        g_core->write(chips[e->chip], e->reg, e->value);
+    }
+
+    size_t ev = seg->first_event;
+    for (uint64_t pos = seg->start; pos < seg->end; ) {
+        uint32_t frames = seg->end - pos < OPLR_CHUNK_FRAMES ? (uint32_t)(seg->end - pos) : OPLR_CHUNK_FRAMES;
+        uint32_t done = 0;
+
+        while (done < frames) {
+            while (ev < song->nevents && song->events[ev].pos <= pos + done) {
+                const oplr_event *e = &song->events[ev++];
+                g_core->write(chips[e->chip], e->reg, e->value);
+            }
+            uint32_t n = frames - done;
+            if (ev < song->nevents && song->events[ev].pos < pos + frames) {
+                n = (uint32_t)(song->events[ev].pos - pos) - done;
+            }
+            for (unsigned c = 0; c < song->nchips; c++) {
+                g_core->generate(chips[c], bufs[c] + done * 2, n);
+            }
+            done += n;
+        }
+
+        if (song->nchips > 1) {
+            mix_chips(out, bufs, song->nchips, frames);
+        }
+        if (song->fd >= 0) {
+            off_t off = (g_raw ? 0 : OPLR_WAV_HEADER_SIZE) + (off_t)pos * 4;
+            if (pwrite(song->fd, out, frames * 4, off) != (ssize_t)(frames * 4)) {
+                *failed = 1;
+            }
+        }
+        pos += frames;
+    }
+
+    for (unsigned c = 0; c < song->nchips; c++) {
+        silent &= g_core->silent(chips[c]) != 0;
+        free(chips[c]);
+        if (bufs[c] != out) {
+            free(bufs[c]);
+        }
+    }
+    free(out);
+
+    return silent;
+}
+
+/* Takes the next segment to render, loading the next file if needed. Called with g_lock held. */
+static oplr_segment *take_segment(void)
+{
+    for (;;) {
+        for (oplr_song *song = g_songs; song; song = song->next) {
+            if (song->next_seg < song->nsegs) {
+                return &song->segs[song->next_seg++];
+            }
+        }
+        if (g_next_file >= g_nfiles) {
+            return NULL;
+        }
+
+        const char *path = g_files[g_next_file++];
+        pthread_mutex_unlock(&g_lock);
+        oplr_song *song = load_song(path);
+        pthread_mutex_lock(&g_lock);
+        if (!song) {
+            g_errors++;
+            continue;
+        }
+        song->next = g_songs;
+        g_songs = song;
+    }
+}
+
+static void finish_song(oplr_song *song)
+{
+    oplr_song **pp = &g_songs;
+    while (*pp != song) {
+        pp = &(*pp)->next;
+    }
+    *pp = song->next;
+
+    double audio = (double)song->frames / g_rate;
+    if (song->failed) {
+        fprintf(stderr, "%s: write error\n", song->path);
+        g_errors++;
+    }
+    printf("%s: %.1f s in %.3f s, %.1fx realtime", song->path, audio, song->cpu_secs,
+           song->cpu_secs > 0 ? audio / song->cpu_secs : 0.0);
+    if (song->nsegs > 1) {
+        printf(", %u segments", song->nsegs);
+    }
+    if (song->unclean_splits) {
+        printf(", %u split while not silent", song->unclean_splits);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    g_total_audio += audio;
+    g_total_cpu += song->cpu_secs;
+    free_song(song);
+}
+
+static void *worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&g_lock);
+    for (;;) {
+        oplr_segment *seg = take_segment();
+        if (!seg) {
+            break;
+        }
+        oplr_song *song = seg->song;
+        pthread_mutex_unlock(&g_lock);
+
+        int failed = 0;
+        double start = thread_cpu_secs();
+        int silent = render_segment(seg, &failed);
+        double secs = thread_cpu_secs() - start;
+
+        pthread_mutex_lock(&g_lock);
+        song->cpu_secs += secs;
+        song->failed |= failed;
+        if (!silent && seg != &song->segs[song->nsegs - 1]) {
+            song->unclean_splits++;
+        }
+        if (++song->segs_done == song->nsegs) {
+            finish_song(song);
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+
+    return NULL;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] file.vgm|file.dro...\n"
+            "Renders OPL2/OPL3 VGM or DOSBox DRO captures, reporting how much faster than realtime each one is.\n"
+            "  -o DIR    write the output into DIR (default: only render, for benchmarking)\n"
+            "  -f FMT    output format, wav or raw (16-bit signed stereo, native endian)\n"
+            "  -c CORE   emulation core, nuked (default) or fast\n"
+            "  -r RATE   output sample rate (default %u)\n"
+            "  -j N      number of threads (default: number of CPUs)\n"
+            "  -s SECS   minimum segment length when splitting long files at silence (default %u, 0 disables)\n",
+            argv0, OPLR_DEFAULT_RATE, OPLR_DEFAULT_SEGMENT);
+}
+
+int main(int argc, char **argv)
+{
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    g_core = &g_cores[0];
+
+    while ((opt = getopt(argc, argv, "o:f:c:r:j:s:h")) != -1) {
+        switch (opt) {
+            case 'o':
+                g_outdir = optarg;
+                break;
+            case 'f':
+                if (strcmp(optarg, "raw") == 0) {
+                    g_raw = 1;
+                } else if (strcmp(optarg, "wav") != 0) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'c':
+                g_core = NULL;
+                for (size_t i = 0; i < sizeof(g_cores) / sizeof(g_cores[0]); i++) {
+                    if (strcmp(optarg, g_cores[i].name) == 0) {
+                        g_core = &g_cores[i];
+                    }
+                }
+                if (!g_core) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'r':
+                g_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                nthreads = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                g_segment_secs = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc || g_rate == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    g_files = argv + optind;
+    g_nfiles = argc - optind;
+
+    pthread_t *threads = malloc(nthreads * sizeof(*threads));
+    if (!threads) {
+        return 1;
+    }
+
+    double start = wall_secs();
+    for (long i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+            fprintf(stderr, "cannot create thread\n");
+            return 1;
+        }
+    }
+    for (long i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double wall = wall_secs() - start;
+    free(threads);
+
+    printf("total: %d files, %.1f s of audio in %.3f s of CPU (%.1fx realtime per thread), "
+           "%.3f s elapsed (%.1fx realtime) with %ld threads using the %s core\n",
+           g_nfiles - g_errors, g_total_audio, g_total_cpu, g_total_cpu > 0 ? g_total_audio / g_total_cpu : 0.0,
+           wall, wall > 0 ? g_total_audio / wall : 0.0, nthreads, g_core->name);
+
+    return g_errors ? 1 : 0;
+}
@@ -20,10 +20,15 @@
 
 #include <VBox/err.h>
 #include <VBox/log.h>
+#include <iprt/time.h>
 #include <alsa/asoundlib.h>
 #include "pcmalsa.h"
 
-PCMOutAlsa::PCMOutAlsa() : _pcm(NULL)
+/** Length of the fade in after an underrun, so that resuming playback does not click. */
+#define PCM_FADE_IN_TIME 5 /* msec */
+
+PCMOutAlsa::PCMOutAlsa() : _pcm(NULL), _bufferSize(0), _periodSize(0), _channels(0),
+                           _fadeLength(0), _fadeLeft(0), _xruns(0), _xrunTime(0)
 {
 
 }
@@ -55,6 +60,10 @@ int PCMOutAlsa::open(const char *dev, unsigned int sampleRate, unsigned int chan
         return VERR_AUDIO_STREAM_COULD_NOT_CREATE;
     }
 
+    _channels = channels;
+    _fadeLength = sampleRate * PCM_FADE_IN_TIME / 1000;
+    _fadeLeft = 0;
+
     return VINF_SUCCESS;
 }
 
@@ -63,6 +72,147 @@ int PCMOutAlsa::close()
     if (_pcm) {
         snd_pcm_drain(_pcm);
         snd_pcm_close(_pcm);
+        _pcm = NULL;
+    }
+    return VINF_SUCCESS;
+}
+
+/**
+ * Gets ready to play again, after open() or stop(), by pre-filling half a period of silence.
+ * Playback starts once another half period of audio follows, so the first frames
+ * written are heard within a few milliseconds, with the silence as a margin against underruns.
+ * An underrun not yet realigned() from when playback stopped no longer matters.
+ */
+int PCMOutAlsa::start()
+{
+    _xrunTime = 0;
+
+    if (snd_pcm_state(_pcm) != SND_PCM_STATE_PREPARED) {
+        int err = snd_pcm_prepare(_pcm);
+        if (err < 0) {
+            LogWarn(("ALSA prepare error: %s\n", snd_strerror(err)));
+            return VERR_AUDIO_STREAM_NOT_READY;
+        }
+    }
+
+    return prefill();
+}
+
+/** Writes the half period of silence start() begins with, on a prepared device. */
+int PCMOutAlsa::prefill()
+{
+    static const int16_t silence[256] = { 0 };
+
+    size_t frames = _periodSize / 2;
+    while (frames > 0) {
+        size_t n = RT_MIN(frames, RT_ELEMENTS(silence) / _channels);
+        snd_pcm_sframes_t written = snd_pcm_writei(_pcm, silence, n);
+        if (written < 0) {
+            LogWarn(("ALSA prefill error: %s\n", snd_strerror(written)));
+            return VERR_AUDIO_STREAM_NOT_READY;
+        }
+        frames -= written;
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Recovers from an underrun (or a suspend), and gets back to the usual latency.
+ * Whatever is still queued beyond our own buffer (e.g. in a sound server) is dropped,
+ * as everything that follows would otherwise be heard that much later for good.
+ * Then playback restarts like in start(), fading in the next frames written.
+ *
+ * @returns 0 if recovered, or a negative ALSA error.
+ */
+int PCMOutAlsa::recover(int err)
+{
+    if (err != -EPIPE && err != -ESTRPIPE) {
+        return snd_pcm_recover(_pcm, err, 0);
+    }
+
+    _xruns++;
+    if (!_xrunTime) {
+        _xrunTime = RTTimeNanoTS();
+    }
+
+    err = snd_pcm_recover(_pcm, err, 0);
+    if (err < 0) {
+        return err;
+    }
+
+    snd_pcm_sframes_t frames;
+    if (snd_pcm_delay(_pcm, &frames) == 0 && frames > (snd_pcm_sframes_t)_bufferSize) {
+        LogFlow(("ALSA dropping %ld frames of backlog\n", frames));
+        snd_pcm_drop(_pcm);
+        err = snd_pcm_prepare(_pcm);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    if (snd_pcm_state(_pcm) == SND_PCM_STATE_PREPARED && RT_FAILURE(prefill())) {
+        return -EIO;
+    }
+    _fadeLeft = _fadeLength;
+
+    return 0;
+}
+
+/**
+ * Whether the frames queued are back at the latency the blocking writes keep them at,
+ * a full buffer but for the period they wait for, give or take a period.
+ * After an underrun playback restarts with only half a period queued, or with a sound server
+ * backlog on top, and takes a while to get back there.
+ */
+bool PCMOutAlsa::atTargetLatency()
+{
+    const ssize_t frames = delay();
+    return frames >= 0
+        && (size_t)frames + 2 * _periodSize >= _bufferSize
+        && (size_t)frames <= _bufferSize;
+}
+
+/**
+ * Marks the output as back at its target latency after underruns.
+ *
+ * @returns the nanoseconds since the first of them, or 0 if there was none.
+ */
+uint64_t PCMOutAlsa::realigned()
+{
+    if (!_xrunTime) {
+        return 0;
+    }
+    const uint64_t elapsed = RTTimeNanoTS() - _xrunTime;
+    _xrunTime = 0;
+    return elapsed;
+}
+
+/** Applies what is left of the fade in after an underrun to the frames about to be written. */
+void PCMOutAlsa::fadeIn(int16_t *buf, size_t n)
+{
+    for (size_t i = 0; i < n && _fadeLeft > 0; i++, _fadeLeft--) {
+        const int32_t gain = (int32_t)(((_fadeLength - _fadeLeft) << 16) / _fadeLength);
+        for (unsigned int c = 0; c < _channels; c++) {
+            buf[i * _channels + c] = (int16_t)((buf[i * _channels + c] * gain) >> 16);
+        }
+    }
+}
+
+/**
+ * Stops playing once the already written frames have been played, but keeps the device
+ * open and configured, so that start() can quickly resume playback.
+ */
+int PCMOutAlsa::stop()
+{
+    int err = snd_pcm_drain(_pcm);
+    if (err < 0) {
+        LogFlow(("ALSA drain error: %s\n", snd_strerror(err)));
+    }
+    err = snd_pcm_prepare(_pcm);
+    if (err < 0) {
+        LogWarn(("ALSA prepare error: %s\n", snd_strerror(err)));
+        return VERR_AUDIO_STREAM_NOT_READY;
     }
     return VINF_SUCCESS;
 }
@@ -72,7 +222,7 @@ ssize_t PCMOutAlsa::avail()
     snd_pcm_sframes_t frames = snd_pcm_avail(_pcm);
     if (frames < 0) {
         LogWarn(("ALSA trying to recover from avail error: %s\n", snd_strerror(frames)));
-        frames = snd_pcm_recover(_pcm, frames, 0);
+        frames = recover(frames);
         if (frames == 0) {
             frames = snd_pcm_avail(_pcm);
         }
@@ -90,7 +240,7 @@ int PCMOutAlsa::wait()
     int err = snd_pcm_wait(_pcm, -1);
     if (err < 0) {
         LogWarn(("ALSA trying to recover from wait error: %s\n", snd_strerror(err)));
-        err = snd_pcm_recover(_pcm, err, 0);
+        err = recover(err);
     }
     if (err < 0) {
         LogWarn(("ALSA wait error: %s\n", snd_strerror(err)));
@@ -100,12 +250,31 @@ int PCMOutAlsa::wait()
 }
 
 
+/**
+ * Writes n frames, blocking until they fit.
+ * After an underrun, the frames written are faded in, in place in buf.
+ */
 ssize_t PCMOutAlsa::write(int16_t *buf, size_t n)
 {
+    const bool faded = _fadeLeft > 0;
+    if (faded) {
+        fadeIn(buf, n);
+    }
+    const size_t fadeLeft = _fadeLeft;
     snd_pcm_sframes_t frames = snd_pcm_writei(_pcm, buf, n);
     if (frames < 0) {
         LogFlow(("ALSA trying to recover from error: %s\n", snd_strerror(frames)));
-        frames = snd_pcm_recover(_pcm, frames, 0);
+        frames = recover(frames);
+        if (frames == 0) {
+            // Write them again now that playback has restarted, rather than losing them.
+            // Frames already faded in keep that fade, which then carries on, rather than being faded twice.
+            if (faded) {
+                _fadeLeft = fadeLeft;
+            } else {
+                fadeIn(buf, n);
+            }
+            frames = snd_pcm_writei(_pcm, buf, n);
+        }
     }
     if (frames < 0) {
         LogWarn(("ALSA write error: %s\n", snd_strerror(frames)));
@@ -114,6 +283,46 @@ ssize_t PCMOutAlsa::write(int16_t *buf, size_t n)
     return frames;
 }
 
+/** Returns the number of frames written but not yet played. */
+ssize_t PCMOutAlsa::delay()
+{
+    snd_pcm_sframes_t frames;
+    int err = snd_pcm_delay(_pcm, &frames);
+    if (err < 0) {
+        LogFlow(("ALSA delay error: %s\n", snd_strerror(err)));
+        return VERR_AUDIO_STREAM_NOT_READY;
+    }
+    return frames < 0 ? 0 : frames;
+}
+
+/** Returns the number of written frames that can still be taken back with rewind(). */
+ssize_t PCMOutAlsa::rewindable()
+{
+    snd_pcm_sframes_t frames = snd_pcm_rewindable(_pcm);
+    if (frames < 0) {
+        LogFlow(("ALSA rewindable error: %s\n", snd_strerror(frames)));
+        return VERR_AUDIO_STREAM_NOT_READY;
+    }
+    return frames;
+}
+
+/** Takes back exactly the last n written frames, so that they can be written again. */
+int PCMOutAlsa::rewind(size_t n)
+{
+    snd_pcm_sframes_t frames = snd_pcm_rewind(_pcm, n);
+    if (frames < 0) {
+        LogWarn(("ALSA rewind error: %s\n", snd_strerror(frames)));
+        return VERR_AUDIO_STREAM_NOT_READY;
+    }
+    if ((size_t)frames != n) {
+        // Partial rewinds are of no use to us, so undo it.
+        LogFlow(("ALSA could only rewind %ld of %zu frames\n", frames, n));
+        snd_pcm_forward(_pcm, frames);
+        return VERR_AUDIO_STREAM_NOT_READY;
+    }
+    return VINF_SUCCESS;
+}
+
 int PCMOutAlsa::setParams(unsigned int sampleRate, unsigned int channels, unsigned int bufferTime, unsigned int periodTime)
 {
     snd_pcm_hw_params_t *hwparams;
@@ -204,9 +413,8 @@ int PCMOutAlsa::setParams(unsigned int sampleRate, unsigned int channels, unsign
         LogWarnFunc(("Unable to determine current swparams: %s\n", snd_strerror(err)));
         return err;
     }
-    /* start the transfer when the buffer is almost full: */
-    /* (buffer_size / avail_min) * avail_min */
-    err = snd_pcm_sw_params_set_start_threshold(_pcm, swparams, (_bufferSize / _periodSize) * _periodSize);
+    /* start the transfer as soon as there is one period to play, see start() */
+    err = snd_pcm_sw_params_set_start_threshold(_pcm, swparams, _periodSize);
     if (err < 0) {
         LogWarnFunc(("Unable to set start threshold mode: %s\n", snd_strerror(err)));
         return err;
@@ -33,18 +33,41 @@ public:
     int open(const char *dev, unsigned int sampleRate, unsigned int channels);
     int close();
 
+    int start();
+    int stop();
+
     ssize_t avail();
     int wait();
 
     ssize_t write(int16_t *buf, size_t n);
 
+    /** Number of underruns (or suspends) recovered from since the object was created. */
+    uint32_t xruns() const { return _xruns; }
+    /** When (RTTimeNanoTS) the first underrun not yet got over with realigned() happened, or 0 if none. */
+    uint64_t xrunTime() const { return _xrunTime; }
+    bool atTargetLatency();
+    uint64_t realigned();
+
+    ssize_t delay();
+    ssize_t rewindable();
+    int rewind(size_t n);
+
 private:
     int setParams(unsigned int sampleRate, unsigned int channels, unsigned int bufferTime, unsigned int periodTime);
+    int prefill();
+    int recover(int err);
+    void fadeIn(int16_t *buf, size_t n);
 
 private:
     snd_pcm_t * _pcm;
     size_t _bufferSize;
     size_t _periodSize;
+    unsigned int _channels;
+    /** Length of the fade in after an underrun, and frames of it still to be written. */
+    size_t _fadeLength;
+    size_t _fadeLeft;
+    uint32_t _xruns;
+    uint64_t _xrunTime;
 };
 
 #endif
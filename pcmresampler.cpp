@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2022 Javier S. Pedro
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define LOG_GROUP LOG_GROUP_DEV_SB16
+
+#include <VBox/err.h>
+#include <VBox/log.h>
+#include <iprt/assert.h>
+#include <iprt/mem.h>
+#include <iprt/string.h>
+#include "pcmresampler.h"
+
+/** How far the ratio may be adapted from 1:1. Clock drift is usually well below 0.1%. */
+#define RESAMPLER_MAX_DEVIATION 0.005
+
+PCMResampler::PCMResampler()
+    : _channels(0), _maxOutFrames(0), _maxInFrames(0), _buf(NULL),
+      _pos(0), _step(UINT64_C(1) << 32), _kp(0), _ki(0), _integral(0)
+{
+}
+
+PCMResampler::~PCMResampler()
+{
+    destroy();
+}
+
+/**
+ * Allocates the input buffer for blocks of up to maxOutFrames output frames.
+ * settleFrames is roughly how many output frames it takes to correct a position error;
+ * the control loop is critically damped, so it does not overshoot.
+ */
+int PCMResampler::init(unsigned int channels, size_t maxOutFrames, size_t settleFrames)
+{
+    AssertReturn(channels > 0 && channels <= MAX_CHANNELS, VERR_INVALID_PARAMETER);
+    AssertReturn(maxOutFrames > 0 && settleFrames > 0, VERR_INVALID_PARAMETER);
+
+    destroy();
+
+    _channels = channels;
+    _maxOutFrames = maxOutFrames;
+    _maxInFrames = (size_t)(maxOutFrames * (1.0 + RESAMPLER_MAX_DEVIATION)) + HISTORY_FRAMES + 1;
+    _buf = (int16_t *) RTMemAlloc((HISTORY_FRAMES + _maxInFrames) * _channels * sizeof(int16_t));
+    if (!_buf) {
+        return VERR_NO_MEMORY;
+    }
+
+    _kp = 2.0 / settleFrames;
+    _ki = _kp * _kp / 4.0;
+
+    memset(_buf, 0, HISTORY_FRAMES * _channels * sizeof(int16_t));
+    reset();
+
+    return VINF_SUCCESS;
+}
+
+void PCMResampler::destroy()
+{
+    RTMemFree(_buf);
+    _buf = NULL;
+}
+
+/**
+ * Starts again at 1:1, e.g. after the caller resynced its position.
+ * The last frames of the previous block are still interpolated from, to avoid a click.
+ */
+void PCMResampler::reset()
+{
+    _pos = 0;
+    _step = UINT64_C(1) << 32;
+    _integral = 0;
+}
+
+/**
+ * Adapts the ratio after a block of outFrames output frames.
+ * error is how many input frames the caller is behind where it should be,
+ * i.e. positive when the input clock runs faster than the output clock.
+ */
+void PCMResampler::adapt(double error, size_t outFrames)
+{
+    double deviation = _kp * error + _ki * (_integral + error * outFrames);
+    if (deviation > RESAMPLER_MAX_DEVIATION) {
+        deviation = RESAMPLER_MAX_DEVIATION;
+    } else if (deviation < -RESAMPLER_MAX_DEVIATION) {
+        deviation = -RESAMPLER_MAX_DEVIATION;
+    } else {
+        // Only integrate while not saturated, so that it does not wind up during large errors
+        _integral += error * outFrames;
+    }
+
+    _step = (uint64_t)((1.0 + deviation) * (double)(UINT64_C(1) << 32));
+}
+
+/** Current ratio of input to output frames. */
+double PCMResampler::ratio() const
+{
+    return (double)_step / (double)(UINT64_C(1) << 32);
+}
+
+/** Returns how many input frames process() needs to produce outFrames output frames. */
+size_t PCMResampler::inputFrames(size_t outFrames) const
+{
+    Assert(outFrames > 0 && outFrames <= _maxOutFrames);
+    const int64_t last = _pos + (int64_t)((outFrames - 1) * _step);
+    // Interpolating the last output frame needs the input frame after its position
+    return (size_t)((last >> 32) + 2);
+}
+
+/**
+ * Resamples the inFrames frames rendered into inputBuffer() into outFrames frames,
+ * where inFrames must be what inputFrames() returned for outFrames.
+ */
+void PCMResampler::process(size_t inFrames, int16_t *out, size_t outFrames)
+{
+    const int16_t *in = inputBuffer();
+    const unsigned int channels = _channels;
+    int64_t pos = _pos;
+
+    Assert(inFrames == inputFrames(outFrames) && inFrames <= _maxInFrames);
+
+    for (size_t i = 0; i < outFrames; i++, pos += _step) {
+        // Positions before the block (down to -HISTORY_FRAMES) interpolate from the previous block
+        const int16_t *a = in + (pos >> 32) * (int64_t)channels;
+        const int16_t *b = a + channels;
+        const int32_t frac = (int32_t)((uint32_t)pos >> 17);
+        for (unsigned int c = 0; c < channels; c++) {
+            *out++ = (int16_t)(a[c] + (((b[c] - a[c]) * frac) >> 15));
+        }
+    }
+
+    _pos = pos - ((int64_t)inFrames << 32);
+    Assert(_pos >= -((int64_t)HISTORY_FRAMES << 32));
+
+    memmove(_buf, in + ((int64_t)inFrames - HISTORY_FRAMES) * channels, HISTORY_FRAMES * channels * sizeof(int16_t));
+}
+
+void PCMResampler::saveState(State *state) const
+{
+    state->pos = _pos;
+    state->step = _step;
+    state->integral = _integral;
+    memcpy(state->history, _buf, HISTORY_FRAMES * _channels * sizeof(int16_t));
+}
+
+void PCMResampler::loadState(const State *state)
+{
+    _pos = state->pos;
+    _step = state->step;
+    _integral = state->integral;
+    memcpy(_buf, state->history, HISTORY_FRAMES * _channels * sizeof(int16_t));
+}
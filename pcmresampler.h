@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2022 Javier S. Pedro
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef VMUSIC_PCMRESAMPLER_H
+#define VMUSIC_PCMRESAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Converts audio rendered against the VM virtual clock to the host audio clock.
+ *
+ * Both run at the same nominal sample rate, but drift apart, so the ratio is slowly
+ * adapted from the position error the caller measures (see adapt()), within a fraction
+ * of a percent. Uses linear interpolation, which is inaudible at such ratios.
+ *
+ * For each block: ask inputFrames() how many frames are needed for the output block,
+ * render them into inputBuffer(), then call process().
+ * Like the PCM backends, a zero-filled object is a valid uninitialized one.
+ */
+class PCMResampler
+{
+public:
+    /** Number of previous input frames kept for interpolating across blocks. */
+    enum { HISTORY_FRAMES = 2, MAX_CHANNELS = 2 };
+
+    /** Everything needed to resample a block again exactly the same way. */
+    struct State {
+        int64_t pos;
+        uint64_t step;
+        double integral;
+        int16_t history[HISTORY_FRAMES * MAX_CHANNELS];
+    };
+
+    PCMResampler();
+    ~PCMResampler();
+
+    int init(unsigned int channels, size_t maxOutFrames, size_t settleFrames);
+    void destroy();
+    void reset();
+
+    void adapt(double error, size_t outFrames);
+    double ratio() const;
+
+    size_t inputFrames(size_t outFrames) const;
+    size_t maxInputFrames() const { return _maxInFrames; }
+    int16_t *inputBuffer() const { return _buf + HISTORY_FRAMES * _channels; }
+    void process(size_t inFrames, int16_t *out, size_t outFrames);
+
+    void saveState(State *state) const;
+    void loadState(const State *state);
+
+private:
+    unsigned int _channels;
+    size_t _maxOutFrames, _maxInFrames;
+    /** Previous input frames followed by the input frames of the current block. */
+    int16_t *_buf;
+    /** Position of the next output frame relative to the first input frame of the block, as 32.32 fixed point. */
+    int64_t _pos;
+    /** Input frames per output frame, as 32.32 fixed point. */
+    uint64_t _step;
+    /** Proportional and integral gains of the ratio control loop. */
+    double _kp, _ki;
+    double _integral;
+};
+
+#endif